@@ -1,58 +1,156 @@
 #include <kdpoint.hpp>
 #include <kdtree.hpp>
+#include <kdtreefile.hpp>
+#include <kdcsvreader.hpp>
+#include <kdsplitstorages.hpp>
+#include <kdexternalbuilder.hpp>
+
+#include "kdarguments.hpp"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 
 #include <fstream>
-#include <sstream>
 #include <iostream>
+#include <limits>
+#include <map>
 
-BOOST_CLASS_EXPORT(KDTreeIntermediateNode<float>)
-BOOST_CLASS_EXPORT(KDTreeIntermediateNode<double>)
+/// build the tree of T coordinates from the CSV file and save it
+template <typename T>
+int buildTree(std::string const & csvFilename,
+              std::string const & treeFilename,
+              std::string const & format,
+              KDSplitStrategy split,
+              KDQuantization quantization,
+              size_t memoryLimit,
+              KDThreadPool & pool)
+{
+    /// points which do not fit in the memory limit are built out of core by buckets
+    if (memoryLimit > 0) {
+        KDExternalBuilder<T> builder(memoryLimit, split, KDPointsLayout::SoA, 2, &pool);
+        builder.build(csvFilename, treeFilename);
+        return 0;
+    }
 
-int main(int argc, char** argv) {
-    if (argc != 3) {
-        std::cout << "This software accepts two arguments exactly. They are: \n"
-                     "1) input CSV file with points to build the k-d tree from them\n"
-                     "2) ouput file to save the built tree" << std::endl;
+    /// coordinates are parsed right into the buffer which is moved to the storage then
+    KDCsvReader<T> reader(csvFilename);
+    std::vector<T> coordinates;
+    if (reader.read(coordinates, 0, &pool) == 0) {
+        std::cout << "there are no values for points in the file: " << csvFilename << std::endl;
         return 1;
     }
 
-    std::string csvFilename(argv[1]);
-    std::string treeFilename(argv[2]);
+    auto storage = makeKDPointStorage<T>(
+                split, std::move(coordinates), reader.getK(), KDPointsLayout::SoA);
+    KDTree<T> tree(storage, 2, pool.size() == 1 ? nullptr : &pool);
+    tree.quantize(quantization);
 
-    std::ifstream infile(csvFilename);
-    if (!infile) {
-        std::cout << csvFilename + " file is not found" << std::endl;
-        return 1;
+    if (format == "binary") {
+        KDTreeFile::save(tree, treeFilename);
+    } else {
+        std::ofstream outfile(treeFilename);
+        boost::archive::text_oarchive oa{outfile};
+        oa << tree;
     }
+    return 0;
+}
 
-    std::vector<KDPoint<double>> points;
-    std::string line;
-    while (std::getline(infile, line))
-    {
-        std::vector<double> coords;
-        std::istringstream iss(line);
-        std::string item;
-        while (std::getline(iss, item, ',')) {
-            coords.push_back(std::stod(item));
+int main(int argc, char** argv) {
+    std::vector<std::string> arguments;
+    size_t threadsNumber = 1;
+    std::string format("binary");
+    std::string split("median");
+    std::string precision("double");
+    std::string quantization("none");
+    size_t memoryLimit = 0;
+    /// false if a number of an option is not valid
+    bool areNumbersValid = true;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument(argv[i]);
+        if (argument == "--threads" && i + 1 < argc) {
+            areNumbersValid &= parseKDArgument(argv[++i], threadsNumber);
+        } else if (argument == "--format" && i + 1 < argc) {
+            format = argv[++i];
+        } else if (argument == "--split" && i + 1 < argc) {
+            split = argv[++i];
+        } else if (argument == "--precision" && i + 1 < argc) {
+            precision = argv[++i];
+        } else if (argument == "--quantize" && i + 1 < argc) {
+            quantization = argv[++i];
+        } else if (argument == "--memory-limit" && i + 1 < argc) {
+            /// 0 would mean the build in memory, and the limit in bytes must fit in size_t
+            size_t megabytesNumber = 0;
+            areNumbersValid &= parseKDArgument(argv[++i], megabytesNumber) &&
+                    megabytesNumber > 0 &&
+                    megabytesNumber <= (std::numeric_limits<size_t>::max() >> 20);
+            memoryLimit = megabytesNumber << 20;
+        } else {
+            arguments.push_back(argument);
         }
-        KDPoint<double> point(coords);
-        points.push_back(point);
     }
 
-    if (points.empty()) {
-        std::cout << "there are no values for points in the file: " << csvFilename << std::endl;
+    std::map<std::string, KDSplitStrategy> splitStrategies = {
+        {"median", KDSplitStrategy::Median},
+        {"max-spread", KDSplitStrategy::MaxSpread},
+        {"sliding-midpoint", KDSplitStrategy::SlidingMidpoint},
+        {"cost-model", KDSplitStrategy::CostModel}
+    };
+    std::map<std::string, KDQuantization> quantizations = {
+        {"none", KDQuantization::None},
+        {"int16", KDQuantization::Int16},
+        {"uint8", KDQuantization::UInt8}
+    };
+    /// text files are always read as double trees and can not keep quantized coordinates
+    bool isDefaultPrecision = precision == "double" && quantization == "none";
+
+    if (arguments.size() != 2 || !areNumbersValid || (format != "binary" && format != "text") ||
+            splitStrategies.count(split) == 0 ||
+            (precision != "double" && precision != "float") ||
+            quantizations.count(quantization) == 0 ||
+            (format == "text" && !isDefaultPrecision) ||
+            (memoryLimit > 0 && (format != "binary" || quantization != "none"))) {
+        std::cout << "This software accepts two arguments exactly. They are: \n"
+                     "1) input CSV file with points to build the k-d tree from them\n"
+                     "2) ouput file to save the built tree\n"
+                     "Options:\n"
+                     "--threads N: number of threads to build the tree, "
+                     "0 means all hardware threads, 1 by default\n"
+                     "--format binary|text: format of the tree file, binary by default. "
+                     "Binary files are mapped to memory by query_kdtree without parsing, "
+                     "text files are Boost text archives\n"
+                     "--split median|max-spread|sliding-midpoint|cost-model: algorithm to split "
+                     "points, median by default. median cycles through dimensions and splits "
+                     "at the median, max-spread splits the dimension with the largest spread "
+                     "at the median, sliding-midpoint splits it at the middle, cost-model "
+                     "chooses the split by the surface area heuristic\n"
+                     "--precision double|float: type of the coordinates, double by default. "
+                     "float trees take about half of the memory\n"
+                     "--quantize none|int16|uint8: keep the coordinates as 16-bit or 8-bit "
+                     "integers scaled to the range of the points, none by default. Queries are "
+                     "approximate then, use the --rerank option of query_kdtree with "
+                     "the not quantized tree to find the exact points. "
+                     "Both options need the binary format\n"
+                     "--memory-limit MB: build the tree of the points which do not fit in "
+                     "memory, only about MB megabytes are used, MB is a positive integer "
+                     "without units. Points are split into "
+                     "temporary files next to the tree file, which are built one by one. "
+                     "It needs the binary format and no quantization" << std::endl;
         return 1;
     }
 
-    auto storage = new KDPointStorage<double>(points, points[0].size());
-    KDTree<double> tree(storage, 2);
-
-    std::ofstream outfile(treeFilename);
-    boost::archive::text_oarchive oa{outfile};
-    oa << tree;
+    std::string csvFilename(arguments[0]);
+    std::string treeFilename(arguments[1]);
 
-    return 0;
+    KDThreadPool pool(threadsNumber);
+    try {
+        if (precision == "float") {
+            return buildTree<float>(csvFilename, treeFilename, format, splitStrategies[split],
+                                    quantizations[quantization], memoryLimit, pool);
+        }
+        return buildTree<double>(csvFilename, treeFilename, format, splitStrategies[split],
+                                 quantizations[quantization], memoryLimit, pool);
+    } catch (std::exception const & e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
 }
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <charconv>
+#include <cstring>
+#include <system_error>
+
+/// Parse the whole command line argument as a number of type T. Returns false if it is
+/// not a number, if it has other characters after the number or if it does not fit in T,
+/// so a wrong option value is reported instead of being read as 0 or as its prefix.
+template <typename T>
+bool parseKDArgument(char const * argument, T & value)
+{
+    char const * end = argument + std::strlen(argument);
+    auto result = std::from_chars(argument, end, value);
+    return result.ec == std::errc() && result.ptr == end;
+}
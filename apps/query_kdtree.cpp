@@ -1,64 +1,196 @@
 #include <kdpoint.hpp>
 #include <kdtree.hpp>
+#include <kdtreefile.hpp>
+#include <kdcsvreader.hpp>
+
+#include "kdarguments.hpp"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 
 #include <fstream>
-#include <sstream>
 #include <iostream>
+#include <cmath>
 
-BOOST_CLASS_EXPORT(KDTreeIntermediateNode<float>)
-BOOST_CLASS_EXPORT(KDTreeIntermediateNode<double>)
-
-int main(int argc, char** argv) {
-    if (argc != 4) {
-        std::cout << "This software accepts three arguments exactly. They are: \n"
-                     "1) input file having valid built k-d tree\n"
-                     "2) input CSV file with points to search in the tree\n"
-                     "3) ouput file to save the indices and the distances of the closest "
-                     "points from the tree" << std::endl;
-        return 1;
-    }
+/// queries are read and answered by batches, so the memory does not depend on the file size
+const size_t queriesBatchSize = 1 << 16;
+/// maximum number of query points in a leaf of the query tree of --join
+const size_t joinLeafSize = 8;
 
-    std::string csvFilename(argv[2]);
-    std::string treeFilename(argv[1]);
-    std::string outputFilename(argv[3]);
+struct QueryOptions {
+    size_t threadsNumber = 1;
+    KDApproximateSearch search;
+    std::string statsFilename;
+    /// the not quantized tree to rerank the points found in the quantized one
+    std::string rerankFilename;
+    size_t candidatesNumber = 8;
+    /// all the queries are read to a tree and joined with the tree, see KDTree::joinClosestPoints
+    bool isJoin = false;
+    /// the whole binary tree file is checked when it is mapped, see KDTreeFile::map
+    bool isVerified = false;
+};
 
-    /// read tree from file
+/// search the closest points of the CSV file in the tree of T coordinates
+template <typename T>
+int queryTree(std::string const & treeFilename,
+              std::string const & csvFilename,
+              std::string const & outputFilename,
+              QueryOptions const & options)
+{
+    /// read tree from file: binary files are mapped, text ones are Boost text archives
     std::ifstream treeFile(treeFilename);
     if (!treeFile) {
         std::cout << treeFilename + " file is not found" << std::endl;
         return 1;
     }
-    KDTree<double> tree;
-    boost::archive::text_iarchive ia{treeFile};
-    ia >> tree;
-
-    /// read points from file
-    std::ifstream infile(csvFilename);
-    if (!infile) {
-        std::cout << csvFilename + " file is not found" << std::endl;
-        return 1;
+    KDTree<T> tree;
+    if (KDTreeFile::isTreeFile(treeFilename)) {
+        KDTreeFile::map(treeFilename, tree, options.isVerified);
+    } else {
+        boost::archive::text_iarchive ia{treeFile};
+        ia >> tree;
+    }
+    KDTree<T> exactTree;
+    if (!options.rerankFilename.empty()) {
+        KDTreeFile::map(options.rerankFilename, exactTree);
     }
 
+    KDThreadPool pool(options.threadsNumber);
+    /// coordinates of a batch are queried as they are read, without copying them to points,
+    /// and all the buffers are reused by the next batches
+    std::vector<T> coordinates;
+    std::vector<KDQueryResult<T>> results;
+    /// queries are measured only if the stats are saved
+    KDQueryHistograms histograms;
+    KDQueryHistograms * queryHistograms = options.statsFilename.empty() ? nullptr : &histograms;
+    auto const & search = options.search;
+
+    /// read points from file by batches
+    KDCsvReader<T> reader(csvFilename);
+    if (reader.getK() != tree.getK()) {
+        throw std::length_error("size of points are not the same");
+    }
     std::ofstream outfile(outputFilename);
+    size_t joinedPointsNumber = options.isJoin ? reader.read(coordinates, 0, &pool) : 0;
+    if (joinedPointsNumber > 0) {
+        /// the query tree has the original indices of the points, so the results are
+        /// in the order of the file
+        KDTree<T> queryTree(new KDPointStorage<T>(std::move(coordinates), tree.getK(),
+                                                  KDPointsLayout::SoA),
+                            joinLeafSize, &pool);
+        results.resize(joinedPointsNumber);
+        tree.joinClosestPoints(queryTree, results.data(), &pool);
+        for (auto const & result : results) {
+            outfile << result.originalI << ", " << sqrt(result.squareDistance) << '\n';
+        }
+    }
+    while (!reader.isFinished()) {
+        coordinates.clear();
+        size_t pointsNumber = reader.read(coordinates, queriesBatchSize, &pool);
 
-    std::string line;
-    while (std::getline(infile, line))
-    {
-        std::vector<double> coords;
-        std::istringstream iss(line);
-        std::string item;
-        while (std::getline(iss, item, ',')) {
-            coords.push_back(std::stod(item));
+        results.resize(pointsNumber);
+        if (!options.rerankFilename.empty()) {
+            tree.findRerankedClosestPoints(coordinates.data(), pointsNumber, results.data(),
+                                           options.candidatesNumber, exactTree,
+                                           &pool, queryHistograms);
+        } else if (search.epsilon > 0 || search.maxLeavesNumber > 0) {
+            tree.findApproximateClosestPoints(coordinates.data(), pointsNumber, results.data(),
+                                              search, &pool, queryHistograms);
+        } else {
+            tree.findClosestPoints(coordinates.data(), pointsNumber, results.data(),
+                                   &pool, queryHistograms);
         }
-        KDPoint<double> point(coords);
 
-        size_t i = 0;
-        auto & closestPoint = tree.findClosestPoint(point, i);
+        /// output is buffered by the stream and flushed only when the file is closed
+        for (auto const & result : results) {
+            outfile << result.originalI << ", " << sqrt(result.squareDistance) << '\n';
+        }
+    }
 
-        outfile << i << ", " << sqrt(closestPoint.squareDistanceToPoint(point)) << std::endl;
+    if (!options.statsFilename.empty()) {
+        std::ofstream statsFile(options.statsFilename);
+        statsFile << "tree\n" << tree.getShape() << "\nqueries\n" << histograms;
+        if (!statsFile) {
+            throw std::runtime_error(options.statsFilename + " file can not be written");
+        }
     }
     return 0;
 }
+
+int main(int argc, char** argv) {
+    std::vector<std::string> arguments;
+    QueryOptions options;
+    /// false if a number of an option is not valid
+    bool areNumbersValid = true;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument(argv[i]);
+        if (argument == "--threads" && i + 1 < argc) {
+            areNumbersValid &= parseKDArgument(argv[++i], options.threadsNumber);
+        } else if (argument == "--epsilon" && i + 1 < argc) {
+            areNumbersValid &= parseKDArgument(argv[++i], options.search.epsilon) &&
+                    std::isfinite(options.search.epsilon) && options.search.epsilon >= 0;
+        } else if (argument == "--max-leaves" && i + 1 < argc) {
+            areNumbersValid &= parseKDArgument(argv[++i], options.search.maxLeavesNumber);
+        } else if (argument == "--stats" && i + 1 < argc) {
+            options.statsFilename = argv[++i];
+        } else if (argument == "--rerank" && i + 1 < argc) {
+            options.rerankFilename = argv[++i];
+        } else if (argument == "--candidates" && i + 1 < argc) {
+            areNumbersValid &= parseKDArgument(argv[++i], options.candidatesNumber);
+        } else if (argument == "--join") {
+            options.isJoin = true;
+        } else if (argument == "--verify") {
+            options.isVerified = true;
+        } else {
+            arguments.push_back(argument);
+        }
+    }
+
+    bool isJoinAllowed = options.search.epsilon == 0 && options.search.maxLeavesNumber == 0 &&
+            options.rerankFilename.empty();
+    if (arguments.size() != 3 || !areNumbersValid || options.candidatesNumber == 0 ||
+            (options.isJoin && !isJoinAllowed)) {
+        std::cout << "This software accepts three arguments exactly. They are: \n"
+                     "1) input file having valid built k-d tree\n"
+                     "2) input CSV file with points to search in the tree\n"
+                     "3) ouput file to save the indices and the distances of the closest "
+                     "points from the tree\n"
+                     "Options:\n"
+                     "--threads N: number of threads to search points, "
+                     "0 means all hardware threads, 1 by default\n"
+                     "--epsilon E: approximate search, the found points are not farther than "
+                     "(1 + E) * the distance to the closest ones, 0 by default\n"
+                     "--max-leaves N: approximate search, not more than N leaves are scanned "
+                     "for every point, 0 means no limit and it is the default\n"
+                     "--stats FILE: save the shape of the tree and the histograms of the query "
+                     "times and the work done by queries to the file\n"
+                     "--rerank FILE: binary file of the same points built without --quantize. "
+                     "The nearest points found in the quantized tree are reranked by their "
+                     "exact coordinates from this file, only their pages are read from the disk\n"
+                     "--candidates N: number of the nearest points to rerank, 8 by default\n"
+                     "--join: read all the points to a tree and search the closest ones by "
+                     "traversing both trees together, nearby points share the search. "
+                     "It is exact, so it can not be used with --epsilon, --max-leaves "
+                     "and --rerank. The query histograms of --stats are empty then\n"
+                     "--verify: check the nodes and the indices of the binary tree file "
+                     "before the queries, the whole file is read then. The --rerank file "
+                     "is not checked, so only the pages of the reranked points are read\n"
+                     "The coordinates type (--precision of build_kdtree) is read from "
+                     "the binary tree file." << std::endl;
+        return 1;
+    }
+
+    std::string csvFilename(arguments[1]);
+    std::string treeFilename(arguments[0]);
+    std::string outputFilename(arguments[2]);
+
+    try {
+        if (KDTreeFile::hasCoordinateType<float>(treeFilename)) {
+            return queryTree<float>(treeFilename, csvFilename, outputFilename, options);
+        }
+        return queryTree<double>(treeFilename, csvFilename, outputFilename, options);
+    } catch (std::exception const & e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <random>
+#include <vector>
+
+/// Points for the benchmarks, coordinates are one after another (row-major).
+
+/// Uniform points in the unit cube, like sample_data.csv
+inline std::vector<double> generateUniformPoints(size_t pointsNumber, size_t K, std::mt19937 & e2)
+{
+    std::uniform_real_distribution<> dist(0, 1);
+    std::vector<double> coordinates(pointsNumber * K);
+    for (auto & coordinate : coordinates) {
+        coordinate = dist(e2);
+    }
+    return coordinates;
+}
+
+/// Uniform points in a box which is much longer in the first dimension
+inline std::vector<double> generateAnisotropicPoints(size_t pointsNumber, size_t K, std::mt19937 & e2)
+{
+    std::uniform_real_distribution<> dist(0, 1);
+    std::vector<double> coordinates(pointsNumber * K);
+    for (size_t i = 0; i < coordinates.size(); ++i) {
+        double scale = i % K == 0 ? 1000 : 10;
+        coordinates[i] = dist(e2) * scale;
+    }
+    return coordinates;
+}
+
+/// Dense flat clusters of different size scattered in a big empty box
+inline std::vector<double> generateClusteredPoints(size_t pointsNumber, size_t K, std::mt19937 & e2)
+{
+    const size_t clustersNumber = 50;
+    std::uniform_real_distribution<> centerDist(0, 1000);
+    std::uniform_real_distribution<> scaleDist(0.1, 10);
+    std::vector<double> centers(clustersNumber * K);
+    std::vector<double> scales(clustersNumber * K);
+    for (size_t i = 0; i < centers.size(); ++i) {
+        centers[i] = centerDist(e2);
+        scales[i] = scaleDist(e2) * (i % K == 0 ? 10 : 1);
+    }
+
+    std::normal_distribution<> dist(0, 1);
+    std::uniform_int_distribution<size_t> clusterDist(0, clustersNumber - 1);
+    std::vector<double> coordinates(pointsNumber * K);
+    for (size_t i = 0; i < pointsNumber; ++i) {
+        size_t clusterI = clusterDist(e2);
+        for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+            coordinates[i * K + coordinateI] = centers[clusterI * K + coordinateI] +
+                    dist(e2) * scales[clusterI * K + coordinateI];
+        }
+    }
+    return coordinates;
+}
+
+/// Uniform points where every point is one of pointsNumber / 100 distinct ones
+inline std::vector<double> generateDuplicatePoints(size_t pointsNumber, size_t K, std::mt19937 & e2)
+{
+    size_t distinctPointsNumber = pointsNumber / 100 + 1;
+    auto distinctCoordinates = generateUniformPoints(distinctPointsNumber, K, e2);
+    std::uniform_int_distribution<size_t> pointDist(0, distinctPointsNumber - 1);
+    std::vector<double> coordinates(pointsNumber * K);
+    for (size_t i = 0; i < pointsNumber; ++i) {
+        size_t distinctPointI = pointDist(e2);
+        for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+            coordinates[i * K + coordinateI] = distinctCoordinates[distinctPointI * K + coordinateI];
+        }
+    }
+    return coordinates;
+}
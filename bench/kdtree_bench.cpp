@@ -0,0 +1,685 @@
+#include <kdtree.hpp>
+#include <kdmutabletree.hpp>
+#include <kdtreefile.hpp>
+#include <kdthreadpool.hpp>
+
+#include "bench_data.hpp"
+
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Performance suite: tree build, single and batched closest point queries, k nearest
+/// points queries and serialization round trips for every combination of the points number,
+/// the dimension, the leaf size and the data distribution. Closest point queries are
+/// also run on the nodes in van Emde Boas order (KDTree::setNodesLayout) and on the tree
+/// in huge pages (KDTree::adviseHugePages), and on a KDMutableTree which last 3% of
+/// the points are inserted one by one. The data TLB and the cache misses of them are
+/// counted if the hardware counters are available, and the cache lines and the pages of
+/// the visited nodes are counted anyway.
+/// Every benchmark is repeated and the median time is reported. Results are written as JSON
+/// in the format of Google Benchmark, so its tools (e.g. compare.py) can compare the results
+/// of different commits.
+
+namespace {
+
+typedef std::vector<double> (*PointsGenerator)(size_t, size_t, std::mt19937 &);
+
+const std::map<std::string, PointsGenerator> distributions = {
+    {"uniform", generateUniformPoints},
+    {"anisotropic", generateAnisotropicPoints},
+    {"clustered", generateClusteredPoints},
+    {"duplicates", generateDuplicatePoints}
+};
+
+struct Options {
+    std::vector<size_t> pointsNumbers = {1000, 100000};
+    std::vector<size_t> dimensions = {2, 3, 16, 64};
+    std::vector<size_t> leafSizes = {1, 8};
+    std::vector<std::string> distributionNames = {"uniform", "clustered", "duplicates"};
+    size_t queriesNumber = 1000;
+    size_t neighboursNumber = 10;
+    size_t repetitions = 3;
+    size_t threadsNumber = std::max(1u, std::thread::hardware_concurrency());
+    /// only the benchmarks which names contain it are run
+    std::string filter;
+    std::string outFilename;
+    std::string label;
+};
+
+/// One benchmark result, times are per iteration in timeUnit
+struct Result {
+    std::string name;
+    size_t iterations;
+    double realTime;
+    double cpuTime;
+    std::string timeUnit;
+    std::vector<std::pair<std::string, double>> counters;
+};
+
+/// wall and processor time of one run in nanoseconds
+struct Timing {
+    double realTime;
+    double cpuTime;
+};
+
+template <typename Function>
+Timing measure(Function function)
+{
+    auto realStart = std::chrono::steady_clock::now();
+    std::clock_t cpuStart = std::clock();
+    function();
+    std::clock_t cpuEnd = std::clock();
+    auto realEnd = std::chrono::steady_clock::now();
+    return Timing{std::chrono::duration<double, std::nano>(realEnd - realStart).count(),
+                  1e9 * double(cpuEnd - cpuStart) / CLOCKS_PER_SEC};
+}
+
+/// run(repetitionI) returns the timing of one repetition, the median one is returned
+template <typename Run>
+Timing measureMedian(size_t repetitions, Run run)
+{
+    std::vector<double> realTimes;
+    std::vector<double> cpuTimes;
+    for (size_t repetitionI = 0; repetitionI < repetitions; ++repetitionI) {
+        Timing timing = run(repetitionI);
+        realTimes.push_back(timing.realTime);
+        cpuTimes.push_back(timing.cpuTime);
+    }
+    std::sort(realTimes.begin(), realTimes.end());
+    std::sort(cpuTimes.begin(), cpuTimes.end());
+    return Timing{realTimes[repetitions / 2], cpuTimes[repetitions / 2]};
+}
+
+/// Hardware event counter of the calling thread (Linux perf events). It is not available
+/// if the kernel or the virtual machine does not expose the event or perf_event_paranoid
+/// does not allow it.
+class HardwareCounter {
+public:
+    HardwareCounter(std::uint32_t type, std::uint64_t config)
+    {
+#ifdef __linux__
+        perf_event_attr attributes;
+        std::memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = type;
+        attributes.config = config;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        fd = static_cast<int>(::syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#endif
+    }
+
+    ~HardwareCounter()
+    {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    HardwareCounter(HardwareCounter const &) = delete;
+    HardwareCounter & operator = (HardwareCounter const &) = delete;
+
+    bool isAvailable() const { return fd >= 0; }
+
+    void start()
+    {
+#ifdef __linux__
+        ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    /// the number of events since start
+    double stop()
+    {
+        std::uint64_t eventsNumber = 0;
+#ifdef __linux__
+        ::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (::read(fd, &eventsNumber, sizeof(eventsNumber)) != sizeof(eventsNumber)) {
+            eventsNumber = 0;
+        }
+#endif
+        return double(eventsNumber);
+    }
+
+private:
+    int fd = -1;
+};
+
+/// Run the function once and count the data TLB and the last level cache misses per item,
+/// the counters which are not available are skipped.
+template <typename Function>
+std::vector<std::pair<std::string, double>> countMisses(size_t itemsNumber, Function function)
+{
+    std::vector<std::pair<std::string, double>> counters;
+#ifdef __linux__
+    HardwareCounter tlbMisses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    HardwareCounter cacheMisses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    for (auto counter : {&tlbMisses, &cacheMisses}) {
+        if (counter->isAvailable()) {
+            counter->start();
+        }
+    }
+    function();
+    if (tlbMisses.isAvailable()) {
+        counters.push_back({"dtlb_misses_per_item", tlbMisses.stop() / itemsNumber});
+    }
+    if (cacheMisses.isAvailable()) {
+        counters.push_back({"cache_misses_per_item", cacheMisses.stop() / itemsNumber});
+    }
+#endif
+    return counters;
+}
+
+/// Query stats which count the distinct cache lines and pages of the nodes visited by every
+/// query, they are its cache and TLB misses if nothing is cached. So the effect of the nodes
+/// layout is seen without the hardware counters.
+class NodeBlocksStats {
+public:
+    void visitNode() {}
+    void visitNode(void const * node)
+    {
+        lines.push_back(reinterpret_cast<std::uintptr_t>(node) / 64);
+        pages.push_back(reinterpret_cast<std::uintptr_t>(node) / 4096);
+    }
+    void scanLeaf(size_t) {}
+    void backtrack() {}
+
+    /// count the blocks of the query, the next one starts
+    void finishQuery()
+    {
+        linesNumber += countDistinct(lines);
+        pagesNumber += countDistinct(pages);
+    }
+
+    size_t linesNumber = 0;
+    size_t pagesNumber = 0;
+
+private:
+    static size_t countDistinct(std::vector<std::uintptr_t> & blocks)
+    {
+        std::sort(blocks.begin(), blocks.end());
+        size_t distinctNumber = std::unique(blocks.begin(), blocks.end()) - blocks.begin();
+        blocks.clear();
+        return distinctNumber;
+    }
+
+    std::vector<std::uintptr_t> lines;
+    std::vector<std::uintptr_t> pages;
+};
+
+class Suite {
+public:
+    explicit Suite(Options const & aOptions)
+        : options(aOptions), pool(aOptions.threadsNumber)
+    {}
+
+    void runConfiguration(std::string const & distribution, size_t pointsNumber, size_t K,
+                          size_t leafSize)
+    {
+        std::string suffix = "/" + distribution + "/N:" + std::to_string(pointsNumber) +
+                "/K:" + std::to_string(K) + "/leaf:" + std::to_string(leafSize);
+        bool isAnySelected = false;
+        for (auto name : {"BM_Build", "BM_BuildParallel", "BM_ClosestPoint",
+                          "BM_ClosestPointBatch", "BM_KNearest", "BM_FileRoundTrip",
+                          "BM_BoostRoundTrip", "BM_ClosestPointMutable",
+                          "BM_ClosestPointVanEmdeBoas", "BM_ClosestPointHugePages"}) {
+            isAnySelected = isAnySelected || isSelected(name + suffix);
+        }
+        if (!isAnySelected) {
+            return;
+        }
+
+        /// the first pointsNumber points are put into the tree, the others are queries
+        std::mt19937 e2(1);
+        auto allCoordinates = distributions.at(distribution)(
+                    pointsNumber + options.queriesNumber, K, e2);
+        std::vector<double> coordinates(allCoordinates.begin(),
+                                        allCoordinates.begin() + pointsNumber * K);
+        std::vector<KDPoint<double>> queries;
+        for (size_t i = pointsNumber * K; i < allCoordinates.size(); i += K) {
+            queries.push_back(KDPoint<double>(&allCoordinates[i], &allCoordinates[i] + K));
+        }
+        allCoordinates.clear();
+        allCoordinates.shrink_to_fit();
+
+        std::unique_ptr<KDTree<double>> tree;
+        auto buildTree = [&](KDThreadPool * buildPool) {
+            tree.reset();
+            std::vector<double> treeCoordinates(coordinates);
+            return measure([&]() {
+                tree.reset(new KDTree<double>(
+                               new KDPointStorage<double>(std::move(treeCoordinates), K,
+                                                          KDPointsLayout::SoA),
+                               leafSize, buildPool));
+            });
+        };
+
+        if (isSelected("BM_Build" + suffix)) {
+            addResult("BM_Build" + suffix, 1, "ms",
+                      measureMedian(options.repetitions, [&](size_t) { return buildTree(nullptr); }),
+                      {{"points_per_second", 0}});
+        }
+        if (isSelected("BM_BuildParallel" + suffix)) {
+            addResult("BM_BuildParallel" + suffix, 1, "ms",
+                      measureMedian(options.repetitions, [&](size_t) { return buildTree(&pool); }),
+                      {{"points_per_second", 0}, {"threads", double(pool.size())}});
+        }
+        if (!tree) {
+            buildTree(nullptr);
+        }
+
+        /// the work done by queries and the misses are counted separately,
+        /// so they are not in the time
+        size_t closestPointI = 0;
+        auto findClosestPoints = [&]() {
+            for (auto const & query : queries) {
+                tree->findClosestPoint(query, closestPointI);
+            }
+        };
+        auto measureClosestPoints = [&](std::string const & name,
+                                        std::vector<std::pair<std::string, double>> counters) {
+            NodeBlocksStats blocksStats;
+            for (auto const & query : queries) {
+                tree->findClosestPoint(query, closestPointI, blocksStats);
+                blocksStats.finishQuery();
+            }
+            counters.push_back({"node_lines_per_query",
+                                double(blocksStats.linesNumber) / queries.size()});
+            counters.push_back({"node_pages_per_query",
+                                double(blocksStats.pagesNumber) / queries.size()});
+            auto misses = countMisses(queries.size(), findClosestPoints);
+            counters.insert(counters.end(), misses.begin(), misses.end());
+            addResult(name, queries.size(), "ns",
+                      measureMedian(options.repetitions, [&](size_t) {
+                          return measure(findClosestPoints);
+                      }),
+                      counters);
+        };
+        if (isSelected("BM_ClosestPoint" + suffix)) {
+            KDQueryStats stats;
+            for (auto const & query : queries) {
+                tree->findClosestPoint(query, closestPointI, stats);
+            }
+            measureClosestPoints("BM_ClosestPoint" + suffix,
+                                 {{"items_per_second", 0},
+                                  {"nodes_per_query",
+                                   double(stats.visitedNodesNumber) / queries.size()},
+                                  {"leaves_per_query",
+                                   double(stats.scannedLeavesNumber) / queries.size()}});
+        }
+        if (isSelected("BM_ClosestPointBatch" + suffix)) {
+            std::vector<KDQueryResult<double>> results(queries.size());
+            addResult("BM_ClosestPointBatch" + suffix, queries.size(), "ns",
+                      measureMedian(options.repetitions, [&](size_t) {
+                          return measure([&]() {
+                              tree->findClosestPoints(queries.data(), queries.size(),
+                                                      results.data(), &pool);
+                          });
+                      }),
+                      {{"items_per_second", 0}, {"threads", double(pool.size())}});
+        }
+        if (isSelected("BM_KNearest" + suffix)) {
+            std::vector<KDNeighbour<double>> nearestPoints;
+            addResult("BM_KNearest" + suffix, queries.size(), "ns",
+                      measureMedian(options.repetitions, [&](size_t) {
+                          return measure([&]() {
+                              for (auto const & query : queries) {
+                                  tree->findKNearest(query, options.neighboursNumber,
+                                                     nearestPoints);
+                              }
+                          });
+                      }),
+                      {{"items_per_second", 0}, {"k", double(options.neighboursNumber)}});
+        }
+        if (isSelected("BM_FileRoundTrip" + suffix)) {
+            std::string filename = getTemporaryFilename();
+            addResult("BM_FileRoundTrip" + suffix, 1, "ms",
+                      measureMedian(options.repetitions, [&](size_t) {
+                          return measure([&]() {
+                              KDTreeFile::save(*tree, filename);
+                              KDTree<double> mappedTree;
+                              KDTreeFile::map(filename, mappedTree);
+                          });
+                      }),
+                      {{"bytes", double(getFileSize(filename))}});
+            std::remove(filename.c_str());
+        }
+        if (isSelected("BM_BoostRoundTrip" + suffix)) {
+            size_t bytesNumber = 0;
+            addResult("BM_BoostRoundTrip" + suffix, 1, "ms",
+                      measureMedian(options.repetitions, [&](size_t) {
+                          return measure([&]() {
+                              std::stringstream stream;
+                              {
+                                  boost::archive::binary_oarchive oa{stream};
+                                  oa << *tree;
+                              }
+                              bytesNumber = stream.str().size();
+                              KDTree<double> loadedTree;
+                              boost::archive::binary_iarchive ia{stream};
+                              ia >> loadedTree;
+                          });
+                      }),
+                      {{"bytes", double(bytesNumber)}});
+        }
+        /// the same queries as BM_ClosestPoint on the same points, so their times show
+        /// how much the levels of the mutable tree cost
+        if (isSelected("BM_ClosestPointMutable" + suffix)) {
+            size_t initialPointsNumber = pointsNumber - pointsNumber * 3 / 100;
+            std::vector<KDPoint<double>> points;
+            for (size_t i = 0; i < pointsNumber * K; i += K) {
+                points.push_back(KDPoint<double>(&coordinates[i], &coordinates[i] + K));
+            }
+            KDMutableTree<double> mutableTree(
+                        std::vector<KDPoint<double>>(points.begin(),
+                                                     points.begin() + initialPointsNumber),
+                        K, leafSize, KDPointsLayout::SoA);
+            Timing insertTiming = measure([&]() {
+                for (size_t i = initialPointsNumber; i < pointsNumber; ++i) {
+                    mutableTree.insert(points[i]);
+                }
+            });
+            size_t insertedPointsNumber = std::max<size_t>(1, pointsNumber - initialPointsNumber);
+            KDSearchContext<double> context;
+            addResult("BM_ClosestPointMutable" + suffix, queries.size(), "ns",
+                      measureMedian(options.repetitions, [&](size_t) {
+                          return measure([&]() {
+                              for (auto const & query : queries) {
+                                  mutableTree.findClosestPoint(query, closestPointI, context);
+                              }
+                          });
+                      }),
+                      {{"items_per_second", 0},
+                       {"trees", double(mutableTree.getTreesNumber())},
+                       {"insert_ns", insertTiming.realTime / insertedPointsNumber}});
+        }
+        if (isSelected("BM_ClosestPointVanEmdeBoas" + suffix)) {
+            tree->setNodesLayout(KDNodesLayout::VanEmdeBoas);
+            measureClosestPoints("BM_ClosestPointVanEmdeBoas" + suffix, {{"items_per_second", 0}});
+            tree->setNodesLayout(KDNodesLayout::DepthFirst);
+        }
+        /// the last one, the memory of the tree is changed
+        if (isSelected("BM_ClosestPointHugePages" + suffix)) {
+            double hugePagesBytes = double(tree->adviseHugePages());
+            measureClosestPoints("BM_ClosestPointHugePages" + suffix,
+                                 {{"items_per_second", 0}, {"huge_pages_bytes", hugePagesBytes}});
+        }
+    }
+
+    void writeJson(std::ostream & out) const
+    {
+        out << "{\n  \"context\": {\n"
+            << "    \"date\": " << quote(getDate()) << ",\n"
+            << "    \"host_name\": " << quote(getHostName()) << ",\n"
+            << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+            << "    \"library_build_type\": " << quote(isDebugBuild() ? "debug" : "release") << ",\n"
+            << "    \"label\": " << quote(options.label) << ",\n"
+            << "    \"repetitions\": " << options.repetitions << ",\n"
+            << "    \"queries\": " << options.queriesNumber << "\n"
+            << "  },\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            auto const & result = results[i];
+            out << (i == 0 ? "\n" : ",\n")
+                << "    {\n"
+                << "      \"name\": " << quote(result.name) << ",\n"
+                << "      \"run_name\": " << quote(result.name) << ",\n"
+                << "      \"run_type\": \"iteration\",\n"
+                << "      \"repetitions\": " << options.repetitions << ",\n"
+                << "      \"iterations\": " << result.iterations << ",\n"
+                << "      \"real_time\": " << result.realTime << ",\n"
+                << "      \"cpu_time\": " << result.cpuTime << ",\n"
+                << "      \"time_unit\": " << quote(result.timeUnit);
+            for (auto const & counter : result.counters) {
+                out << ",\n      " << quote(counter.first) << ": " << counter.second;
+            }
+            out << "\n    }";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    static bool isDebugBuild()
+    {
+#ifdef NDEBUG
+        return false;
+#else
+        return true;
+#endif
+    }
+
+private:
+    bool isSelected(std::string const & name) const
+    {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    }
+
+    /// times of the timing are for all the iterations in nanoseconds, the result has them
+    /// per iteration in the time unit. Zero rate counters are filled here.
+    void addResult(std::string const & name, size_t iterations, std::string const & timeUnit,
+                   Timing timing, std::vector<std::pair<std::string, double>> counters)
+    {
+        double unitNanoseconds = timeUnit == "ms" ? 1e6 : 1;
+        for (auto & counter : counters) {
+            if (counter.first == "items_per_second") {
+                counter.second = iterations * 1e9 / timing.realTime;
+            } else if (counter.first == "points_per_second") {
+                counter.second = pointsNumberOf(name) * 1e9 / timing.realTime;
+            }
+        }
+        Result result{name, iterations, timing.realTime / iterations / unitNanoseconds,
+                      timing.cpuTime / iterations / unitNanoseconds, timeUnit, counters};
+        std::cerr << std::left << std::setw(60) << result.name << std::right
+                  << std::setw(14) << std::fixed << std::setprecision(3) << result.realTime
+                  << " " << result.timeUnit << std::endl;
+        results.push_back(result);
+    }
+
+    static size_t pointsNumberOf(std::string const & name)
+    {
+        size_t begin = name.find("/N:") + 3;
+        return std::strtoul(name.c_str() + begin, nullptr, 10);
+    }
+
+    static std::string quote(std::string const & text)
+    {
+        std::string quoted = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+            }
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
+
+    static std::string getDate()
+    {
+        std::time_t now = std::time(nullptr);
+        char date[64];
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+        return date;
+    }
+
+    static std::string getHostName()
+    {
+        char hostName[256] = {0};
+        gethostname(hostName, sizeof(hostName) - 1);
+        return hostName;
+    }
+
+    static std::string getTemporaryFilename()
+    {
+        char const * directory = std::getenv("TMPDIR");
+        return std::string(directory ? directory : "/tmp") + "/kdtree_bench_" +
+                std::to_string(getpid()) + ".tree";
+    }
+
+    static size_t getFileSize(std::string const & filename)
+    {
+        std::ifstream file(filename, std::ios::binary | std::ios::ate);
+        return file ? size_t(file.tellg()) : 0;
+    }
+
+    Options options;
+    KDThreadPool pool;
+    std::vector<Result> results;
+};
+
+/// comma separated values, numbers can be written as 1e6
+std::vector<std::string> splitList(std::string const & list)
+{
+    std::vector<std::string> values;
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ',')) {
+        values.push_back(value);
+    }
+    return values;
+}
+
+std::vector<size_t> parseNumbers(std::string const & list)
+{
+    std::vector<size_t> numbers;
+    for (auto const & value : splitList(list)) {
+        numbers.push_back(static_cast<size_t>(std::strtod(value.c_str(), nullptr)));
+    }
+    return numbers;
+}
+
+void printUsage()
+{
+    std::cout << "Options:\n"
+              << "  --points N,...          points numbers, default 1e3,1e5\n"
+              << "  --k K,...               points dimensions, default 2,3,16,64\n"
+              << "  --leaf-size N,...       leaf sizes, default 1,8\n"
+              << "  --distribution D,...    uniform, anisotropic, clustered, duplicates,\n"
+              << "                          default uniform,clustered,duplicates\n"
+              << "  --queries N             query points number, default 1e3\n"
+              << "  --neighbours N          k of k nearest points queries, default 10\n"
+              << "  --repetitions N         the median time is reported, default 3\n"
+              << "  --threads N             threads of the parallel build and batch queries\n"
+              << "  --filter TEXT           run only the benchmarks which names contain it\n"
+              << "  --label TEXT            saved into the context, e.g. the commit\n"
+              << "  --out FILE              JSON file, it is written to stdout by default"
+              << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i += 2) {
+        std::string argument(argv[i]);
+        if (i + 1 >= argc) {
+            printUsage();
+            return 1;
+        }
+        std::string value(argv[i + 1]);
+        if (argument == "--points") {
+            options.pointsNumbers = parseNumbers(value);
+        } else if (argument == "--k") {
+            options.dimensions = parseNumbers(value);
+        } else if (argument == "--leaf-size") {
+            options.leafSizes = parseNumbers(value);
+        } else if (argument == "--distribution") {
+            options.distributionNames = splitList(value);
+        } else if (argument == "--queries") {
+            options.queriesNumber = parseNumbers(value).at(0);
+        } else if (argument == "--neighbours") {
+            options.neighboursNumber = parseNumbers(value).at(0);
+        } else if (argument == "--repetitions") {
+            options.repetitions = parseNumbers(value).at(0);
+        } else if (argument == "--threads") {
+            options.threadsNumber = parseNumbers(value).at(0);
+        } else if (argument == "--filter") {
+            options.filter = value;
+        } else if (argument == "--label") {
+            options.label = value;
+        } else if (argument == "--out") {
+            options.outFilename = value;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    std::vector<size_t> allNumbers = {options.queriesNumber, options.neighboursNumber,
+                                      options.repetitions, options.threadsNumber};
+    for (auto const & numbers : {options.pointsNumbers, options.dimensions, options.leafSizes}) {
+        allNumbers.insert(allNumbers.end(), numbers.begin(), numbers.end());
+    }
+    if (std::count(allNumbers.begin(), allNumbers.end(), 0) != 0 ||
+            options.pointsNumbers.empty() || options.dimensions.empty() ||
+            options.leafSizes.empty()) {
+        std::cout << "all the numbers must be > 0" << std::endl;
+        return 1;
+    }
+    for (auto const & distribution : options.distributionNames) {
+        if (distributions.count(distribution) == 0) {
+            std::cout << "unknown distribution: " << distribution << std::endl;
+            return 1;
+        }
+    }
+    if (Suite::isDebugBuild()) {
+        std::cerr << "***WARNING*** the benchmark is built without optimizations, "
+                     "use CMAKE_BUILD_TYPE=Release" << std::endl;
+    }
+
+    try {
+        Suite suite(options);
+        for (auto const & distribution : options.distributionNames) {
+            for (size_t pointsNumber : options.pointsNumbers) {
+                for (size_t K : options.dimensions) {
+                    for (size_t leafSize : options.leafSizes) {
+                        suite.runConfiguration(distribution, pointsNumber, K, leafSize);
+                    }
+                }
+            }
+        }
+
+        if (options.outFilename.empty()) {
+            suite.writeJson(std::cout);
+        } else {
+            std::ofstream out(options.outFilename);
+            suite.writeJson(out);
+            if (!out) {
+                std::cerr << options.outFilename << " file can not be written" << std::endl;
+                return 1;
+            }
+        }
+    } catch (std::exception const & e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <kdtree.hpp>
+#include <kdsplitstorages.hpp>
+
+#include "bench_data.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/// Compare the split strategies: the shape of the built trees and the work done by
+/// the closest point queries on them, without and with node boxes.
+
+namespace {
+
+double getElapsedMilliseconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+}
+
+/// the first pointsNumber points are put into the tree, the others are queries
+void runBenchmark(std::string const & dataName,
+                  std::vector<double> const & allCoordinates,
+                  size_t pointsNumber,
+                  size_t K,
+                  size_t leafSize)
+{
+    std::vector<double> coordinates(allCoordinates.begin(),
+                                    allCoordinates.begin() + pointsNumber * K);
+    struct Strategy {
+        char const * name;
+        KDSplitStrategy strategy;
+    };
+    const Strategy strategies[] = {
+        {"median", KDSplitStrategy::Median},
+        {"max-spread", KDSplitStrategy::MaxSpread},
+        {"sliding-midpoint", KDSplitStrategy::SlidingMidpoint},
+        {"cost-model", KDSplitStrategy::CostModel}
+    };
+
+    std::vector<KDPoint<double>> queries;
+    for (size_t i = pointsNumber * K; i < allCoordinates.size(); i += K) {
+        queries.push_back(KDPoint<double>(&allCoordinates[i], &allCoordinates[i] + K));
+    }
+
+    for (auto const & strategy : strategies) {
+        auto buildStart = std::chrono::steady_clock::now();
+        KDTree<double> tree(makeKDPointStorage<double>(
+                                strategy.strategy, std::vector<double>(coordinates), K,
+                                KDPointsLayout::SoA),
+                            leafSize);
+        double buildMilliseconds = getElapsedMilliseconds(buildStart);
+
+        for (bool withBoxes : {false, true}) {
+            if (withBoxes) {
+                auto boxesStart = std::chrono::steady_clock::now();
+                tree.buildNodeBoxes();
+                buildMilliseconds += getElapsedMilliseconds(boxesStart);
+            }
+
+            KDQueryStats stats;
+            size_t closestPointI = 0;
+            auto queryStart = std::chrono::steady_clock::now();
+            for (auto const & query : queries) {
+                tree.findClosestPoint(query, closestPointI, stats);
+            }
+            double queryMicroseconds = getElapsedMilliseconds(queryStart) * 1000 / queries.size();
+
+            std::cout << std::setw(12) << dataName
+                      << std::setw(18) << strategy.name
+                      << std::setw(7) << (withBoxes ? "yes" : "no")
+                      << std::setw(8) << tree.getDepth()
+                      << std::setw(12) << std::fixed << std::setprecision(1) << buildMilliseconds
+                      << std::setw(14) << double(stats.visitedNodesNumber) / queries.size()
+                      << std::setw(14) << double(stats.scannedLeavesNumber) / queries.size()
+                      << std::setw(12) << std::setprecision(3) << queryMicroseconds << std::endl;
+        }
+    }
+}
+
+}
+
+int main(int argc, char** argv) {
+    size_t pointsNumber = 200000;
+    size_t queriesNumber = 20000;
+    size_t K = 3;
+    size_t leafSize = 8;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string argument(argv[i]);
+        size_t value = std::strtoul(argv[i + 1], nullptr, 10);
+        if (argument == "--points") {
+            pointsNumber = value;
+        } else if (argument == "--queries") {
+            queriesNumber = value;
+        } else if (argument == "--k") {
+            K = value;
+        } else if (argument == "--leaf-size") {
+            leafSize = value;
+        } else {
+            std::cout << "Options: --points N, --queries N, --k K, --leaf-size N" << std::endl;
+            return 1;
+        }
+    }
+    if (pointsNumber == 0 || queriesNumber == 0 || K == 0 || leafSize == 0) {
+        std::cout << "all the options must be > 0" << std::endl;
+        return 1;
+    }
+
+    std::cout << std::setw(12) << "data"
+              << std::setw(18) << "split"
+              << std::setw(7) << "boxes"
+              << std::setw(8) << "depth"
+              << std::setw(12) << "build, ms"
+              << std::setw(14) << "nodes/query"
+              << std::setw(14) << "leaves/query"
+              << std::setw(12) << "query, us" << std::endl;
+
+    /// queries have the same distribution as the points
+    std::mt19937 e2(1);
+    runBenchmark("uniform",
+                 generateUniformPoints(pointsNumber + queriesNumber, K, e2),
+                 pointsNumber, K, leafSize);
+    runBenchmark("anisotropic",
+                 generateAnisotropicPoints(pointsNumber + queriesNumber, K, e2),
+                 pointsNumber, K, leafSize);
+    runBenchmark("clustered",
+                 generateClusteredPoints(pointsNumber + queriesNumber, K, e2),
+                 pointsNumber, K, leafSize);
+    return 0;
+}
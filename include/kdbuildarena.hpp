@@ -0,0 +1,69 @@
+#pragma once
+
+#include <kdtreenode.hpp>
+
+#include <cstddef>
+#include <vector>
+
+/// Memory the tree uses while it is built. The tree allocates it at once before the build,
+/// so no allocations are done for nodes or partitions of points. The arena can be passed
+/// to trees built one after another (e.g. rebuilds of the same data), then its memory is
+/// allocated only when a tree is bigger than all the previous ones.
+/// Only one tree can be built with the arena at the same time.
+template <typename T>
+class KDBuildArena {
+public:
+    /// make the buffers big enough to build the tree of the points. The nodes and
+    /// the indices are needed only to build the tree in parallel, the serial build puts
+    /// the nodes right to the tree.
+    void reserve(size_t pointsNumber, bool isParallel)
+    {
+        if (!isParallel) {
+            return;
+        }
+        /// every node has at least one point and every intermediate node has two subnodes
+        size_t nodesNumber = pointsNumber > 0 ? 2 * pointsNumber - 1 : 0;
+        if (nodes.size() < nodesNumber) {
+            nodes.clear();
+            nodes.resize(nodesNumber);
+        }
+        if (indices.size() < pointsNumber) {
+            indices.clear();
+            indices.resize(pointsNumber);
+        }
+    }
+
+    /// Nodes are built here in parallel before they are copied to the tree. A subtree of
+    /// points [leftPointsI, rightPointsI) takes at most 2 * (rightPointsI - leftPointsI) - 1
+    /// nodes, so subtrees built in parallel are put at the positions known before they are
+    /// built.
+    std::vector<KDTreeNode<T>> & getNodes() { return nodes; }
+
+    /// buffer to partition points in parallel, a range of points uses the same range of it
+    size_t * getIndices() { return indices.data(); }
+
+    /// Buffer to reorder coordinates in leaf order. The storage swaps it with its coordinates
+    /// after they are reordered, so the old coordinates buffer is kept for the next trees.
+    std::vector<T> & getCoordinates() { return coordinates; }
+
+    /// the size of all the buffers in bytes
+    size_t getAllocatedSize() const
+    {
+        return nodes.capacity() * sizeof(KDTreeNode<T>) +
+                indices.capacity() * sizeof(size_t) +
+                coordinates.capacity() * sizeof(T);
+    }
+
+    /// free all the memory
+    void clear()
+    {
+        std::vector<KDTreeNode<T>>().swap(nodes);
+        std::vector<size_t>().swap(indices);
+        std::vector<T>().swap(coordinates);
+    }
+
+private:
+    std::vector<KDTreeNode<T>> nodes;
+    std::vector<size_t> indices;
+    std::vector<T> coordinates;
+};
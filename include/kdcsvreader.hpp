@@ -0,0 +1,212 @@
+#pragma once
+
+#include <kdmappedfile.hpp>
+#include <kdthreadpool.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+/// Reader of points from a CSV file: one point per row, coordinates are separated by commas.
+/// The file is mapped to memory and values are parsed in place by std::from_chars, without
+/// any temporary strings. Rows with whitespaces only are skipped.
+/// The points dimension is the number of values in the first row, other rows must have
+/// the same number of values.
+/// Big parts of the file are split into chunks on row boundaries and parsed in parallel.
+template <typename T>
+class KDCsvReader
+{
+public:
+    explicit KDCsvReader(std::string const & aFilename)
+        : filename(aFilename), file(aFilename)
+    {
+        position = file.data();
+        end = file.data() + file.size();
+        forEachRow(position, end, [&](char const * rowBegin, char const * rowEnd) {
+            K = std::count(rowBegin, rowEnd, ',') + 1;
+            return false;
+        });
+    }
+
+    /// points dimension, 0 if the file has no rows.
+    size_t getK() const { return K; }
+
+    /// true if all the rows are read.
+    bool isFinished() const
+    {
+        bool hasRows = false;
+        forEachRow(position, end, [&](char const *, char const *) {
+            hasRows = true;
+            return false;
+        });
+        return !hasRows;
+    }
+
+    /// Read the next maxPointsNumber points (all the remaining ones if it is 0) and append
+    /// their coordinates one after another to the vector. The coordinates are parsed right into
+    /// the vector, so it can be moved to KDPointStorage then.
+    /// If the pool is provided, big parts of the file are parsed in parallel.
+    /// Throws std::runtime_error if a value can not be parsed or a row has another dimension.
+    /// returns the number of read points.
+    size_t read(std::vector<T> & coordinates,
+                size_t maxPointsNumber = 0,
+                KDThreadPool * pool = nullptr)
+    {
+        char const * readEnd = end;
+        if (maxPointsNumber != 0) {
+            size_t rowsNumber = 0;
+            forEachRow(position, end, [&](char const *, char const * rowEnd) {
+                readEnd = rowEnd == end ? end : rowEnd + 1;
+                return ++rowsNumber < maxPointsNumber;
+            });
+        }
+
+        /// chunks are split on row boundaries, every one is started right after a new line
+        std::vector<char const *> chunkBegins(1, position);
+        if (pool) {
+            for (char const * chunkBegin = position;
+                 static_cast<size_t>(readEnd - chunkBegin) > 2 * chunkBytesNumber;) {
+                char const * newLine = static_cast<char const *>(
+                            std::memchr(chunkBegin + chunkBytesNumber, '\n',
+                                        readEnd - chunkBegin - chunkBytesNumber));
+                if (!newLine) {
+                    break;
+                }
+                chunkBegin = newLine + 1;
+                chunkBegins.push_back(chunkBegin);
+            }
+        }
+        chunkBegins.push_back(readEnd);
+        size_t chunksNumber = chunkBegins.size() - 1;
+
+        /// the number of rows before every chunk is counted first, so every chunk is parsed
+        /// right to its place in the vector
+        std::vector<size_t> chunkFirstRowIs(chunksNumber + 1, 0);
+        forEachChunk(chunksNumber, pool, [&](size_t chunkI) {
+            forEachRow(chunkBegins[chunkI], chunkBegins[chunkI + 1],
+                       [&](char const *, char const *) {
+                ++chunkFirstRowIs[chunkI + 1];
+                return true;
+            });
+        });
+        std::partial_sum(chunkFirstRowIs.begin(), chunkFirstRowIs.end(), chunkFirstRowIs.begin());
+        size_t pointsNumber = chunkFirstRowIs.back();
+
+        size_t firstCoordinateI = coordinates.size();
+        coordinates.resize(firstCoordinateI + pointsNumber * K);
+        forEachChunk(chunksNumber, pool, [&](size_t chunkI) {
+            size_t rowI = chunkFirstRowIs[chunkI];
+            forEachRow(chunkBegins[chunkI], chunkBegins[chunkI + 1],
+                       [&](char const * rowBegin, char const * rowEnd) {
+                parseRow(rowBegin, rowEnd, &coordinates[firstCoordinateI + rowI * K],
+                         readRowsNumber + rowI);
+                ++rowI;
+                return true;
+            });
+        });
+
+        position = readEnd;
+        readRowsNumber += pointsNumber;
+        return pointsNumber;
+    }
+
+    /// Drop the mapped pages of the rows which are already read from the resident memory,
+    /// so a file bigger than the memory can be read by batches.
+    void releaseReadRows()
+    {
+        file.release(position - file.data());
+    }
+
+private:
+    /// call function(rowBegin, rowEnd) for every not empty row in [begin, end) until
+    /// it returns false. rowEnd points to the new line or to the end.
+    template <typename Function>
+    static void forEachRow(char const * begin, char const * end, Function function)
+    {
+        while (begin < end) {
+            char const * rowEnd = static_cast<char const *>(std::memchr(begin, '\n', end - begin));
+            if (!rowEnd) {
+                rowEnd = end;
+            }
+            if (std::find_if_not(begin, rowEnd, isSpace) != rowEnd &&
+                    !function(begin, rowEnd)) {
+                return;
+            }
+            begin = rowEnd + 1;
+        }
+    }
+
+    template <typename Function>
+    static void forEachChunk(size_t chunksNumber, KDThreadPool * pool, Function function)
+    {
+        if (pool && chunksNumber > 1) {
+            pool->parallelFor(chunksNumber, 1, [&](size_t beginI, size_t endI) {
+                for (size_t chunkI = beginI; chunkI < endI; ++chunkI) {
+                    function(chunkI);
+                }
+            });
+        } else {
+            for (size_t chunkI = 0; chunkI < chunksNumber; ++chunkI) {
+                function(chunkI);
+            }
+        }
+    }
+
+    static bool isSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    /// parse K values of the row into point. rowI is used for error messages only.
+    void parseRow(char const * rowBegin, char const * rowEnd, T * point, size_t rowI) const
+    {
+        char const * current = rowBegin;
+        for (size_t coordinateI = 0; ; ++coordinateI) {
+            current = std::find_if_not(current, rowEnd, isSpace);
+            if (coordinateI == K) {
+                fail(rowI, "it has more than " + std::to_string(K) + " values");
+            }
+            /// std::from_chars does not accept the plus sign unlike std::stod
+            if (current != rowEnd && *current == '+') {
+                ++current;
+            }
+            auto result = std::from_chars(current, rowEnd, point[coordinateI]);
+            if (result.ec != std::errc()) {
+                fail(rowI, "value " + std::to_string(coordinateI + 1) + " is not a valid number");
+            }
+            current = std::find_if_not(result.ptr, rowEnd, isSpace);
+            if (current == rowEnd) {
+                if (coordinateI + 1 != K) {
+                    fail(rowI, "it has less than " + std::to_string(K) + " values");
+                }
+                return;
+            }
+            if (*current != ',') {
+                fail(rowI, "value " + std::to_string(coordinateI + 1) + " is not a valid number");
+            }
+            ++current;
+        }
+    }
+
+    void fail(size_t rowI, std::string const & reason) const
+    {
+        throw std::runtime_error("row " + std::to_string(rowI + 1) + " of " + filename +
+                                 " file can not be read: " + reason);
+    }
+
+    /// files are split into chunks of about this size to be parsed in parallel
+    static constexpr size_t chunkBytesNumber = 1 << 20;
+
+    std::string filename;
+    KDMappedFile file;
+    /// the part of the file which is not read yet
+    char const * position = nullptr;
+    char const * end = nullptr;
+    size_t K = 0;
+    size_t readRowsNumber = 0;
+};
@@ -0,0 +1,725 @@
+#pragma once
+
+#include <kdtree.hpp>
+#include <kdtreefile.hpp>
+#include <kdcsvreader.hpp>
+#include <kdsplitstorages.hpp>
+#include <kdthreadpool.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/// Builder of the binary tree file of points which do not fit in memory.
+/// The points are read from the CSV file by batches and are copied to a temporary file of
+/// records (the original index and the coordinates). A random sample of the records is
+/// split at the median cycling through dimensions, and the planes of the sample tree split
+/// the records into buckets: every bucket is a temporary file, all of them are written in
+/// one pass. Buckets small enough are loaded and built as usual trees with the split
+/// strategy, bigger ones are split into buckets again.
+/// The subtrees of the buckets are written right to the tree file under the nodes of
+/// the planes, so the file is mapped by KDTreeFile::map as a file saved by KDTreeFile::save.
+/// The memory limit caps the points of a bucket built in memory, the sample and the buffers
+/// of the files, so the resident memory does not depend on the points number.
+/// Coordinates are written in leaf order (AoS or SoA layout) and are not quantized.
+template <typename T>
+class KDExternalBuilder
+{
+public:
+    /// Throws std::domain_error if the layout is Indexed.
+    KDExternalBuilder(size_t aMemoryLimit,
+                      KDSplitStrategy aSplit = KDSplitStrategy::Median,
+                      KDPointsLayout aLayout = KDPointsLayout::SoA,
+                      size_t aMaxPointsNumberInLeafNode = 1,
+                      KDThreadPool * aPool = nullptr)
+        : memoryLimit(aMemoryLimit), split(aSplit), layout(aLayout),
+          maxPointsNumberInLeafNode(aMaxPointsNumberInLeafNode), pool(aPool)
+    {
+        if (layout == KDPointsLayout::Indexed) {
+            throw std::domain_error("trees built out of core keep points in leaf order");
+        }
+    }
+
+    /// Build the tree of the points of the CSV file and save it to the binary tree file.
+    /// Temporary files are put next to the tree file and are removed after the build.
+    /// Throws std::domain_error if the memory limit is too small for the points dimension,
+    /// std::runtime_error if a file can not be read or written or has no points.
+    void build(std::string const & csvFilename, std::string const & treeFilename)
+    {
+        temporaryFilenames.clear();
+        temporaryFilenamePrefix = treeFilename + ".tmp";
+        random.seed();
+        try {
+            buildFile(csvFilename, treeFilename);
+        } catch (...) {
+            removeTemporaryFiles();
+            throw;
+        }
+        removeTemporaryFiles();
+    }
+
+private:
+    /// Number of the points written to the tree file and the depth of its nodes.
+    /// Buckets are built one after another in depth-first order, so the points and the nodes
+    /// of every one are appended to their sections.
+    struct Output {
+        std::fstream file;
+        std::string filename;
+        KDTreeFileHeader header;
+        size_t pointsNumber = 0;
+        size_t nodesNumber = 0;
+        size_t depth = 0;
+    };
+
+    /// Plane of the sample tree or a bucket if bucketI is not npos.
+    struct SampleNode {
+        size_t planeCoordinateI = 0;
+        T planeCoordinate = 0;
+        size_t leftI = 0;
+        size_t rightI = 0;
+        size_t bucketI = npos;
+    };
+
+    /// Buffered writer of a section of a file from its offset on.
+    class SectionWriter {
+    public:
+        SectionWriter(std::ostream & aFile, std::string const & aFilename,
+                      std::uint64_t aOffset, size_t aBufferSize)
+            : file(aFile), filename(aFilename), offset(aOffset), bufferSize(aBufferSize)
+        {
+            buffer.reserve(bufferSize);
+        }
+
+        void write(void const * data, size_t size)
+        {
+            char const * bytes = static_cast<char const *>(data);
+            buffer.insert(buffer.end(), bytes, bytes + size);
+            if (buffer.size() >= bufferSize) {
+                flush();
+            }
+        }
+
+        void flush()
+        {
+            file.seekp(offset);
+            file.write(buffer.data(), buffer.size());
+            if (!file) {
+                throw std::runtime_error(filename + " file can not be written");
+            }
+            offset += buffer.size();
+            buffer.clear();
+        }
+
+    private:
+        std::ostream & file;
+        std::string filename;
+        std::uint64_t offset;
+        size_t bufferSize;
+        std::vector<char> buffer;
+    };
+
+    /// Buffered reader of a temporary file from its beginning.
+    class FileReader {
+    public:
+        FileReader(std::string const & aFilename, size_t aBufferSize)
+            : file(aFilename, std::ios::binary), filename(aFilename), bufferSize(aBufferSize)
+        {
+            if (!file) {
+                throw std::runtime_error(filename + " file can not be read");
+            }
+        }
+
+        void read(void * data, size_t size)
+        {
+            char * bytes = static_cast<char *>(data);
+            while (size > 0) {
+                if (position == buffer.size()) {
+                    buffer.resize(bufferSize);
+                    file.read(buffer.data(), buffer.size());
+                    buffer.resize(file.gcount());
+                    position = 0;
+                    if (buffer.empty()) {
+                        throw std::runtime_error(filename + " file is shorter than expected");
+                    }
+                }
+                size_t readSize = std::min(size, buffer.size() - position);
+                std::memcpy(bytes, buffer.data() + position, readSize);
+                position += readSize;
+                bytes += readSize;
+                size -= readSize;
+            }
+        }
+
+    private:
+        std::ifstream file;
+        std::string filename;
+        size_t bufferSize;
+        std::vector<char> buffer;
+        size_t position = 0;
+    };
+
+    /// Temporary file of records the points are split into.
+    struct Bucket {
+        std::string filename;
+        std::unique_ptr<std::ofstream> file;
+        std::unique_ptr<SectionWriter> writer;
+        size_t pointsNumber = 0;
+        /// positions of the bucket points in leaf order, in the order of the bucket records
+        std::string positionsFilename;
+    };
+
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+    /// the buckets a part of points is split into are numbered by bytes
+    static constexpr size_t maxBucketsNumber = 256;
+    static constexpr size_t bufferSize = 1 << 14;
+
+    void buildFile(std::string const & csvFilename, std::string const & treeFilename)
+    {
+        KDCsvReader<T> reader(csvFilename);
+        K = reader.getK();
+        if (K == 0) {
+            throw std::runtime_error(csvFilename + " file has no points");
+        }
+        if (getMaxBuiltPointsNumber() < 2 * maxPointsNumberInLeafNode ||
+                getMaxBucketsNumber() < 2) {
+            throw std::domain_error("memory limit is too small to build the tree");
+        }
+        std::string recordsFilename = makeTemporaryFilename();
+        std::vector<T> lowerBound;
+        std::vector<T> upperBound;
+        size_t pointsNumber = writeRecords(reader, recordsFilename, lowerBound, upperBound);
+
+        Output output;
+        output.filename = treeFilename;
+        output.file.open(treeFilename, std::ios::in | std::ios::out |
+                         std::ios::binary | std::ios::trunc);
+        if (!output.file) {
+            throw std::runtime_error(treeFilename + " file can not be written");
+        }
+        output.header = makeHeader(pointsNumber);
+        std::vector<T> bounds(lowerBound);
+        bounds.insert(bounds.end(), upperBound.begin(), upperBound.end());
+        writeAt(output, output.header.boundsOffset, bounds.data(), bounds.size() * sizeof(T));
+
+        SectionWriter positions(output.file, treeFilename,
+                                output.header.positionsOffset, bufferSize);
+        buildPart(recordsFilename, pointsNumber, 0, output, positions);
+        positions.flush();
+        std::remove(recordsFilename.c_str());
+
+        /// the nodes are the last section, its size is known only now
+        auto & header = output.header;
+        header.nodesNumber = output.nodesNumber;
+        header.depth = output.depth;
+        header.quantizationOffset = KDTreeFile::align(
+                    header.nodesOffset + header.nodesNumber * sizeof(KDTreeNode<T>));
+        header.fileSize = header.quantizationOffset;
+        header.checksum = KDTreeFile::getChecksum(header);
+        static const char padding[64] = {};
+        std::uint64_t nodesEnd = header.nodesOffset + header.nodesNumber * sizeof(KDTreeNode<T>);
+        writeAt(output, nodesEnd, padding, header.fileSize - nodesEnd);
+        writeAt(output, 0, &header, sizeof(header));
+        output.file.close();
+        if (!output.file) {
+            throw std::runtime_error(treeFilename + " file can not be written");
+        }
+    }
+
+    /// copy the points of the CSV file to the records file, returns the points number
+    size_t writeRecords(KDCsvReader<T> & reader,
+                        std::string const & recordsFilename,
+                        std::vector<T> & lowerBound,
+                        std::vector<T> & upperBound)
+    {
+        std::ofstream file(recordsFilename, std::ios::binary | std::ios::trunc);
+        SectionWriter writer(file, recordsFilename, 0, bufferSize);
+        lowerBound.assign(K, std::numeric_limits<T>::max());
+        upperBound.assign(K, std::numeric_limits<T>::lowest());
+        std::vector<T> coordinates;
+        size_t pointsNumber = 0;
+        while (!reader.isFinished()) {
+            coordinates.clear();
+            size_t batchPointsNumber = reader.read(coordinates, getBatchPointsNumber(), pool);
+            for (size_t i = 0; i < batchPointsNumber; ++i) {
+                T const * point = &coordinates[i * K];
+                for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                    lowerBound[coordinateI] = std::min(lowerBound[coordinateI], point[coordinateI]);
+                    upperBound[coordinateI] = std::max(upperBound[coordinateI], point[coordinateI]);
+                }
+                writeRecord(writer, pointsNumber++, point);
+            }
+            reader.releaseReadRows();
+        }
+        writer.flush();
+        return pointsNumber;
+    }
+
+    KDTreeFileHeader makeHeader(size_t pointsNumber) const
+    {
+        KDTreeFileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, KDTreeFile::getMagic(), sizeof(header.magic));
+        header.version = KDTreeFile::version;
+        header.endianTag = KDTreeFile::endianTag;
+        header.coordinateType = KDTreeFile::getCoordinateType<T>();
+        header.layout = static_cast<std::uint32_t>(layout);
+        header.quantization = static_cast<std::uint32_t>(KDQuantization::None);
+        header.K = K;
+        header.pointsNumber = pointsNumber;
+        header.nodeSize = sizeof(KDTreeNode<T>);
+        header.maxPointsNumberInLeafNode = maxPointsNumberInLeafNode;
+        header.leafOrdered = 1;
+
+        std::uint64_t offset = sizeof(KDTreeFileHeader);
+        auto addSection = [&](std::uint64_t size) {
+            std::uint64_t sectionOffset = KDTreeFile::align(offset);
+            offset = sectionOffset + size;
+            return sectionOffset;
+        };
+        header.boundsOffset = addSection(2 * K * sizeof(T));
+        header.coordinatesOffset = addSection(pointsNumber * K * sizeof(T));
+        header.indicesOffset = addSection(pointsNumber * sizeof(std::uint64_t));
+        header.positionsOffset = addSection(pointsNumber * sizeof(std::uint64_t));
+        header.nodesOffset = addSection(0);
+        return header;
+    }
+
+    /// Build the subtree of the points of the records file at the level of the tree.
+    /// The positions of the points in leaf order are written in the order of the records.
+    void buildPart(std::string const & recordsFilename,
+                   size_t pointsNumber,
+                   size_t levelI,
+                   Output & output,
+                   SectionWriter & positions)
+    {
+        if (pointsNumber <= getMaxBuiltPointsNumber()) {
+            buildInMemory(recordsFilename, pointsNumber, levelI, output, positions);
+            return;
+        }
+
+        /// split the sample into enough buckets for every one to fit in memory on average,
+        /// twice more of them leave a margin for the sample error
+        size_t levelsNumber = 0;
+        size_t bucketsNumber = 1;
+        while (bucketsNumber < std::min(maxBucketsNumber, getMaxBucketsNumber()) &&
+               bucketsNumber * getMaxBuiltPointsNumber() < 2 * pointsNumber) {
+            bucketsNumber *= 2;
+            ++levelsNumber;
+        }
+        std::vector<SampleNode> sampleNodes;
+        {
+            std::vector<T> sample = takeSample(recordsFilename, pointsNumber);
+            std::vector<size_t> sampleIs(sample.size() / K);
+            for (size_t i = 0; i < sampleIs.size(); ++i) {
+                sampleIs[i] = i;
+            }
+            bucketsNumber = 0;
+            splitSample(sample, sampleIs, 0, sampleIs.size(), levelI, levelsNumber,
+                        sampleNodes, bucketsNumber);
+        }
+
+        /// every record goes to its bucket, and the bucket index is written in the same
+        /// order to the routing file, so the positions are merged back in this order
+        std::vector<Bucket> buckets(bucketsNumber);
+        std::string routingFilename = makeTemporaryFilename();
+        {
+            std::ofstream routingFile(routingFilename, std::ios::binary | std::ios::trunc);
+            SectionWriter routing(routingFile, routingFilename, 0, bufferSize);
+            for (auto & bucket : buckets) {
+                bucket.filename = makeTemporaryFilename();
+                bucket.file.reset(new std::ofstream(bucket.filename,
+                                                    std::ios::binary | std::ios::trunc));
+                bucket.writer.reset(new SectionWriter(*bucket.file, bucket.filename,
+                                                      0, bufferSize));
+            }
+            std::vector<T> point(K);
+            forEachRecord(recordsFilename, pointsNumber,
+                          [&](size_t originalI, T const * coordinates) {
+                size_t nodeI = 0;
+                while (sampleNodes[nodeI].bucketI == npos) {
+                    auto const & node = sampleNodes[nodeI];
+                    nodeI = coordinates[node.planeCoordinateI] < node.planeCoordinate ?
+                                node.leftI : node.rightI;
+                }
+                auto & bucket = buckets[sampleNodes[nodeI].bucketI];
+                writeRecord(*bucket.writer, originalI, coordinates);
+                ++bucket.pointsNumber;
+                std::uint8_t bucketI = static_cast<std::uint8_t>(sampleNodes[nodeI].bucketI);
+                routing.write(&bucketI, sizeof(bucketI));
+            });
+            routing.flush();
+            for (auto & bucket : buckets) {
+                bucket.writer->flush();
+                bucket.writer.reset();
+                bucket.file.reset();
+            }
+        }
+
+        /// the sample has not split the points at all, e.g. all of them are the same,
+        /// so they are one leaf as in the tree built in memory
+        bool isSplit = std::none_of(buckets.begin(), buckets.end(), [&](Bucket const & bucket) {
+            return bucket.pointsNumber == pointsNumber;
+        });
+        if (!isSplit) {
+            writeLeaf(recordsFilename, pointsNumber, levelI, output, positions);
+        } else {
+            buildSampleNode(sampleNodes, 0, buckets, levelI, output);
+        }
+        for (auto const & bucket : buckets) {
+            std::remove(bucket.filename.c_str());
+        }
+        if (!isSplit) {
+            std::remove(routingFilename.c_str());
+            return;
+        }
+
+        /// merge the positions of the buckets back in the order of the records
+        {
+            FileReader routing(routingFilename, bufferSize);
+            std::vector<std::unique_ptr<FileReader>> bucketPositions(buckets.size());
+            for (size_t bucketI = 0; bucketI < buckets.size(); ++bucketI) {
+                if (buckets[bucketI].pointsNumber > 0) {
+                    bucketPositions[bucketI].reset(
+                                new FileReader(buckets[bucketI].positionsFilename, bufferSize));
+                }
+            }
+            for (size_t i = 0; i < pointsNumber; ++i) {
+                std::uint8_t bucketI = 0;
+                routing.read(&bucketI, sizeof(bucketI));
+                std::uint64_t position = 0;
+                bucketPositions[bucketI]->read(&position, sizeof(position));
+                positions.write(&position, sizeof(position));
+            }
+        }
+        std::remove(routingFilename.c_str());
+        for (auto const & bucket : buckets) {
+            if (bucket.pointsNumber > 0) {
+                std::remove(bucket.positionsFilename.c_str());
+            }
+        }
+    }
+
+    /// Write the node of the sample tree and its subnodes with the subtrees of the buckets.
+    /// The nodes which have no points on one side are skipped, so there are no empty nodes.
+    void buildSampleNode(std::vector<SampleNode> const & sampleNodes,
+                         size_t sampleNodeI,
+                         std::vector<Bucket> & buckets,
+                         size_t levelI,
+                         Output & output)
+    {
+        auto const & sampleNode = sampleNodes[sampleNodeI];
+        if (sampleNode.bucketI != npos) {
+            auto & bucket = buckets[sampleNode.bucketI];
+            bucket.positionsFilename = makeTemporaryFilename();
+            std::ofstream positionsFile(bucket.positionsFilename,
+                                        std::ios::binary | std::ios::trunc);
+            SectionWriter positions(positionsFile, bucket.positionsFilename, 0, bufferSize);
+            buildPart(bucket.filename, bucket.pointsNumber, levelI, output, positions);
+            positions.flush();
+            std::remove(bucket.filename.c_str());
+            return;
+        }
+
+        if (getPointsNumber(sampleNodes, sampleNode.leftI, buckets) == 0) {
+            buildSampleNode(sampleNodes, sampleNode.rightI, buckets, levelI, output);
+        } else if (getPointsNumber(sampleNodes, sampleNode.rightI, buckets) == 0) {
+            buildSampleNode(sampleNodes, sampleNode.leftI, buckets, levelI, output);
+        } else {
+            size_t nodeI = output.nodesNumber;
+            auto node = KDTreeNode<T>::makeIntermediate(sampleNode.planeCoordinateI,
+                                                        sampleNode.planeCoordinate);
+            writeNodes(output, &node, 1);
+            output.depth = std::max(output.depth, levelI + 1);
+            buildSampleNode(sampleNodes, sampleNode.leftI, buckets, levelI + 1, output);
+            node.setRightSubNodeOffset(output.nodesNumber - nodeI);
+            writeAt(output, output.header.nodesOffset + nodeI * sizeof(KDTreeNode<T>),
+                    &node, sizeof(node));
+            buildSampleNode(sampleNodes, sampleNode.rightI, buckets, levelI + 1, output);
+        }
+    }
+
+    size_t getPointsNumber(std::vector<SampleNode> const & sampleNodes,
+                           size_t sampleNodeI,
+                           std::vector<Bucket> const & buckets) const
+    {
+        auto const & sampleNode = sampleNodes[sampleNodeI];
+        if (sampleNode.bucketI != npos) {
+            return buckets[sampleNode.bucketI].pointsNumber;
+        }
+        return getPointsNumber(sampleNodes, sampleNode.leftI, buckets) +
+                getPointsNumber(sampleNodes, sampleNode.rightI, buckets);
+    }
+
+    /// Split the sample points [leftI, rightI) of sampleIs at the median into at most
+    /// 2^levelsNumber buckets. The dimension is cycled by the level, the next ones are tried
+    /// if all the points have the same coordinate. Returns the index of the sample node.
+    size_t splitSample(std::vector<T> const & sample,
+                       std::vector<size_t> & sampleIs,
+                       size_t leftI,
+                       size_t rightI,
+                       size_t levelI,
+                       size_t levelsNumber,
+                       std::vector<SampleNode> & sampleNodes,
+                       size_t & bucketsNumber)
+    {
+        size_t nodeI = sampleNodes.size();
+        sampleNodes.push_back(SampleNode());
+        for (size_t shiftI = 0; levelsNumber > 0 && rightI - leftI > 1 && shiftI < K; ++shiftI) {
+            size_t coordinateI = (levelI + shiftI) % K;
+            auto getCoordinate = [&](size_t i) { return sample[i * K + coordinateI]; };
+            auto middle = sampleIs.begin() + (leftI + rightI) / 2;
+            std::nth_element(sampleIs.begin() + leftI, middle, sampleIs.begin() + rightI,
+                             [&](size_t i, size_t j) { return getCoordinate(i) < getCoordinate(j); });
+            T pivot = getCoordinate(*middle);
+            size_t middleI = std::partition(sampleIs.begin() + leftI, sampleIs.begin() + rightI,
+                                            [&](size_t i) { return getCoordinate(i) < pivot; }) -
+                    sampleIs.begin();
+            if (middleI > leftI) {
+                size_t leftNodeI = splitSample(sample, sampleIs, leftI, middleI, levelI + 1,
+                                               levelsNumber - 1, sampleNodes, bucketsNumber);
+                size_t rightNodeI = splitSample(sample, sampleIs, middleI, rightI, levelI + 1,
+                                                levelsNumber - 1, sampleNodes, bucketsNumber);
+                auto & node = sampleNodes[nodeI];
+                node.planeCoordinateI = coordinateI;
+                node.planeCoordinate = pivot;
+                node.leftI = leftNodeI;
+                node.rightI = rightNodeI;
+                return nodeI;
+            }
+        }
+        sampleNodes[nodeI].bucketI = bucketsNumber++;
+        return nodeI;
+    }
+
+    /// uniform random sample of the records coordinates, K values per point
+    std::vector<T> takeSample(std::string const & recordsFilename, size_t pointsNumber)
+    {
+        size_t sampleSize = std::min(pointsNumber,
+                                     memoryLimit / 2 / (K * sizeof(T) + sizeof(size_t)));
+        std::vector<T> sample;
+        sample.reserve(sampleSize * K);
+        size_t recordI = 0;
+        forEachRecord(recordsFilename, pointsNumber, [&](size_t, T const * coordinates) {
+            if (recordI < sampleSize) {
+                sample.insert(sample.end(), coordinates, coordinates + K);
+            } else {
+                size_t sampleI = std::uniform_int_distribution<size_t>(0, recordI)(random);
+                if (sampleI < sampleSize) {
+                    std::copy(coordinates, coordinates + K, &sample[sampleI * K]);
+                }
+            }
+            ++recordI;
+        });
+        return sample;
+    }
+
+    /// load the records and build their tree in memory
+    void buildInMemory(std::string const & recordsFilename,
+                       size_t pointsNumber,
+                       size_t levelI,
+                       Output & output,
+                       SectionWriter & positions)
+    {
+        std::vector<T> coordinates;
+        coordinates.reserve(pointsNumber * K);
+        std::vector<std::uint64_t> originalIs;
+        originalIs.reserve(pointsNumber);
+        forEachRecord(recordsFilename, pointsNumber, [&](size_t originalI, T const * point) {
+            originalIs.push_back(originalI);
+            coordinates.insert(coordinates.end(), point, point + K);
+        });
+        KDTree<T> tree(makeKDPointStorage<T>(split, std::move(coordinates), K, layout),
+                       maxPointsNumberInLeafNode,
+                       pool && pool->size() > 1 ? pool : nullptr);
+        auto const & storage = *tree.storage;
+
+        /// leaves of the subtree point to the points after the already written ones
+        size_t firstPointI = output.pointsNumber;
+        std::vector<KDTreeNode<T>> nodes(tree.nodesData, tree.nodesData + tree.nodesNumber);
+        for (auto & node : nodes) {
+            if (node.isLeaf()) {
+                node = KDTreeNode<T>::makeLeaf(node.getLeftI() + firstPointI,
+                                               node.getRightI() + firstPointI);
+            }
+        }
+        writeNodes(output, nodes.data(), nodes.size());
+        output.depth = std::max(output.depth, levelI + tree.depth);
+
+        writeCoordinates(output, storage.coordinatesData, pointsNumber, firstPointI);
+        std::vector<std::uint64_t> values(pointsNumber);
+        for (size_t i = 0; i < pointsNumber; ++i) {
+            values[i] = originalIs[storage.indicesData[i]];
+        }
+        writeAt(output, output.header.indicesOffset + firstPointI * sizeof(std::uint64_t),
+                values.data(), pointsNumber * sizeof(std::uint64_t));
+        for (size_t i = 0; i < pointsNumber; ++i) {
+            values[i] = firstPointI + storage.positionsData[i];
+        }
+        positions.write(values.data(), pointsNumber * sizeof(std::uint64_t));
+        output.pointsNumber += pointsNumber;
+    }
+
+    /// write all the records as one leaf without loading them
+    void writeLeaf(std::string const & recordsFilename,
+                   size_t pointsNumber,
+                   size_t levelI,
+                   Output & output,
+                   SectionWriter & positions)
+    {
+        size_t firstPointI = output.pointsNumber;
+        auto node = KDTreeNode<T>::makeLeaf(firstPointI, firstPointI + pointsNumber);
+        writeNodes(output, &node, 1);
+        output.depth = std::max(output.depth, levelI + 1);
+
+        size_t batchPointsNumber = getBatchPointsNumber();
+        std::vector<T> coordinates(batchPointsNumber * K);
+        std::vector<std::uint64_t> originalIs;
+        auto writeBatch = [&]() {
+            size_t batchSize = originalIs.size();
+            if (layout == KDPointsLayout::SoA) {
+                /// the coordinates of the batch are written as a batch of SoA layout
+                std::vector<T> transposed(batchSize * K);
+                for (size_t i = 0; i < batchSize; ++i) {
+                    for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                        transposed[coordinateI * batchSize + i] = coordinates[i * K + coordinateI];
+                    }
+                }
+                writeCoordinates(output, transposed.data(), batchSize, output.pointsNumber);
+            } else {
+                writeCoordinates(output, coordinates.data(), batchSize, output.pointsNumber);
+            }
+            writeAt(output,
+                    output.header.indicesOffset + output.pointsNumber * sizeof(std::uint64_t),
+                    originalIs.data(), batchSize * sizeof(std::uint64_t));
+            for (size_t i = 0; i < batchSize; ++i) {
+                std::uint64_t position = output.pointsNumber + i;
+                positions.write(&position, sizeof(position));
+            }
+            output.pointsNumber += batchSize;
+            originalIs.clear();
+        };
+        forEachRecord(recordsFilename, pointsNumber, [&](size_t originalI, T const * point) {
+            std::copy(point, point + K, &coordinates[originalIs.size() * K]);
+            originalIs.push_back(originalI);
+            if (originalIs.size() == batchPointsNumber) {
+                writeBatch();
+            }
+        });
+        if (!originalIs.empty()) {
+            writeBatch();
+        }
+    }
+
+    /// write the coordinates of the points [firstPointI, firstPointI + pointsNumber)
+    /// in leaf order, they are in the layout of a storage of these points only
+    void writeCoordinates(Output & output,
+                          T const * coordinates,
+                          size_t pointsNumber,
+                          size_t firstPointI)
+    {
+        auto const & header = output.header;
+        if (layout == KDPointsLayout::AoS) {
+            writeAt(output, header.coordinatesOffset + firstPointI * K * sizeof(T),
+                    coordinates, pointsNumber * K * sizeof(T));
+        } else {
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                writeAt(output, header.coordinatesOffset +
+                        (coordinateI * header.pointsNumber + firstPointI) * sizeof(T),
+                        coordinates + coordinateI * pointsNumber, pointsNumber * sizeof(T));
+            }
+        }
+    }
+
+    void writeNodes(Output & output, KDTreeNode<T> const * nodes, size_t nodesNumber)
+    {
+        writeAt(output, output.header.nodesOffset + output.nodesNumber * sizeof(KDTreeNode<T>),
+                nodes, nodesNumber * sizeof(KDTreeNode<T>));
+        output.nodesNumber += nodesNumber;
+    }
+
+    void writeAt(Output & output, std::uint64_t offset, void const * data, size_t size)
+    {
+        output.file.seekp(offset);
+        output.file.write(static_cast<char const *>(data), size);
+        if (!output.file) {
+            throw std::runtime_error(output.filename + " file can not be written");
+        }
+    }
+
+    void writeRecord(SectionWriter & writer, std::uint64_t originalI, T const * coordinates)
+    {
+        writer.write(&originalI, sizeof(originalI));
+        writer.write(coordinates, K * sizeof(T));
+    }
+
+    /// call function(originalI, coordinates) for every record of the file
+    template <typename Function>
+    void forEachRecord(std::string const & recordsFilename, size_t pointsNumber,
+                       Function function)
+    {
+        FileReader reader(recordsFilename, bufferSize);
+        std::vector<T> coordinates(K);
+        for (size_t i = 0; i < pointsNumber; ++i) {
+            std::uint64_t originalI = 0;
+            reader.read(&originalI, sizeof(originalI));
+            reader.read(coordinates.data(), K * sizeof(T));
+            function(static_cast<size_t>(originalI), coordinates.data());
+        }
+    }
+
+    /// the biggest number of points built in memory as one bucket
+    size_t getMaxBuiltPointsNumber() const
+    {
+        /// the loaded coordinates and their copy in leaf order, the original indices,
+        /// the storage indices and positions, the partition buffer and at most 2 nodes
+        /// per point built in the arena and copied to the tree
+        size_t pointSize = 2 * K * sizeof(T) + 4 * sizeof(size_t) + 4 * sizeof(KDTreeNode<T>);
+        return memoryLimit / pointSize;
+    }
+
+    /// the points read from a file at once, a quarter of the memory limit
+    size_t getBatchPointsNumber() const
+    {
+        return std::max<size_t>(1, memoryLimit / 4 / (K * sizeof(T) + sizeof(std::uint64_t)));
+    }
+
+    /// the buckets which buffers take a quarter of the memory limit
+    size_t getMaxBucketsNumber() const
+    {
+        return memoryLimit / 4 / bufferSize;
+    }
+
+    std::string makeTemporaryFilename()
+    {
+        temporaryFilenames.push_back(temporaryFilenamePrefix +
+                                     std::to_string(temporaryFilenames.size()));
+        return temporaryFilenames.back();
+    }
+
+    void removeTemporaryFiles()
+    {
+        for (auto const & filename : temporaryFilenames) {
+            std::remove(filename.c_str());
+        }
+        temporaryFilenames.clear();
+    }
+
+    size_t memoryLimit;
+    KDSplitStrategy split;
+    KDPointsLayout layout;
+    size_t maxPointsNumberInLeafNode;
+    KDThreadPool * pool;
+    size_t K = 0;
+    /// it is seeded by every build, so the same points give the same tree
+    std::mt19937_64 random;
+    std::string temporaryFilenamePrefix;
+    std::vector<std::string> temporaryFilenames;
+};
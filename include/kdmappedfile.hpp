@@ -0,0 +1,67 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+/// Read-only memory mapping of a whole file.
+class KDMappedFile
+{
+public:
+    explicit KDMappedFile(std::string const & filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error(filename + " file can not be opened");
+        }
+        struct stat fileStat;
+        if (::fstat(fd, &fileStat) != 0) {
+            ::close(fd);
+            throw std::runtime_error(filename + " file can not be read");
+        }
+        fileSize = static_cast<size_t>(fileStat.st_size);
+        if (fileSize > 0) {
+            void * address = ::mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error(filename + " file can not be mapped");
+            }
+            fileData = static_cast<char const *>(address);
+        }
+        ::close(fd);
+    }
+
+    ~KDMappedFile()
+    {
+        if (fileData) {
+            ::munmap(const_cast<char *>(fileData), fileSize);
+        }
+    }
+
+    KDMappedFile(KDMappedFile const &) = delete;
+    KDMappedFile & operator = (KDMappedFile const &) = delete;
+
+    /// Drop the mapped pages of the first size bytes from the resident memory, e.g. when
+    /// they are already read. They are read from the file again if they are used.
+    void release(size_t size)
+    {
+        size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        size = std::min(size, fileSize) / pageSize * pageSize;
+        if (size > 0) {
+            ::madvise(const_cast<char *>(fileData), size, MADV_DONTNEED);
+        }
+    }
+
+    char const * data() const { return fileData; }
+    size_t size() const { return fileSize; }
+
+private:
+    char const * fileData = nullptr;
+    size_t fileSize = 0;
+};
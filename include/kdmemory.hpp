@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#if defined(MADV_HUGEPAGE)
+#define KDTREE_HUGE_PAGES 1
+/// synchronous collapse of the pages, Linux 6.1, it is not in older headers
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+#endif
+#endif
+
+/// Hint the CPU to load the cache line of the address, e.g. the node which is visited next
+/// while the current one is compared.
+inline void kdPrefetch(void const * address)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+}
+
+/// Size of the transparent huge page, 0 if they are not supported. It is read once.
+inline size_t kdHugePageSize()
+{
+#ifdef KDTREE_HUGE_PAGES
+    static const size_t size = []() {
+        size_t pageSize = 0;
+        std::ifstream file("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+        file >> pageSize;
+        return file ? pageSize : size_t(0);
+    }();
+    return size;
+#else
+    return 0;
+#endif
+}
+
+/// Back the memory by transparent huge pages, so random accesses to a big array, e.g. the
+/// nodes of a deep tree, need less TLB entries: a 2 MiB page replaces 512 pages of 4 KiB.
+/// The memory which is already used is moved to huge pages right away (MADV_COLLAPSE,
+/// it copies the pages), otherwise the kernel can do it later. Only the whole huge pages
+/// inside the range are changed, so the memory around it is not affected.
+/// Returns the number of bytes which are in huge pages now, 0 if it is not supported.
+inline size_t kdAdviseHugePages(void const * data, size_t size)
+{
+#ifdef KDTREE_HUGE_PAGES
+    size_t pageSize = kdHugePageSize();
+    if (pageSize == 0 || data == nullptr) {
+        return 0;
+    }
+    std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(data);
+    std::uintptr_t alignedBegin = (begin + pageSize - 1) / pageSize * pageSize;
+    std::uintptr_t alignedEnd = (begin + size) / pageSize * pageSize;
+    if (alignedEnd <= alignedBegin) {
+        return 0;
+    }
+    void * address = reinterpret_cast<void *>(alignedBegin);
+    size_t alignedSize = alignedEnd - alignedBegin;
+    ::madvise(address, alignedSize, MADV_HUGEPAGE);
+    return ::madvise(address, alignedSize, MADV_COLLAPSE) == 0 ? alignedSize : 0;
+#else
+    (void)data;
+    (void)size;
+    return 0;
+#endif
+}
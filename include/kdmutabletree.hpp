@@ -0,0 +1,370 @@
+#pragma once
+
+#include <kdtree.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+/// K-d tree which points can be inserted and erased after it is built.
+/// It uses the logarithmic method: points are kept in several static KDTree levels and
+/// in a small buffer of inserted points which is searched linearly. Level i has at most
+/// bufferCapacity * levelsGrowth^i points. When the buffer is full, its points are merged
+/// into the first level and a level which gets more points than its capacity is merged
+/// into the next one. So every point is rebuilt about levelsGrowth / 2 times per level and
+/// the biggest level, which has most of the points, is a freshly built tree.
+/// Every tree costs a query about a descent to a leaf, so the number of the small trees
+/// is kept low: levels grow by levelsGrowth instead of 2, and all the levels are merged into
+/// the biggest one when the smaller ones have more than 1/compactionRatio of its points.
+/// With 1M uniform 3D points and 3% of them inserted, queries are about 1.5 times slower
+/// than in a tree built of all the points, instead of 1.9 times with a binary counter of
+/// levels, and an insert costs about 2.3 us instead of 1.3 us (BM_ClosestPointMutable of
+/// kdtree_bench).
+/// Erased points are marked and skipped by queries, the tree of a level is rebuilt without
+/// them when more than a half of its points are erased.
+/// Points are identified by ids: the initial points have ids of their indices in the vector,
+/// inserted points get the next ids. Ids of erased points are not reused.
+template <typename T, size_t K = KDDynamicK>
+class KDMutableTree {
+public:
+    explicit KDMutableTree(size_t aK,
+                           size_t aMaxPointsNumberInLeafNode = 1,
+                           KDPointsLayout aLayout = KDPointsLayout::AoS)
+        : dynamicK(aK), maxPointsNumberInLeafNode(aMaxPointsNumberInLeafNode), layout(aLayout)
+    {
+        if (dynamicK == 0)
+            throw std::domain_error("points dimension should be > 0");
+
+        if (K != KDDynamicK && dynamicK != K)
+            throw std::domain_error("points dimension is not the same as the tree one");
+
+        bufferCoordinates.resize(bufferCapacity * getK());
+    }
+
+    KDMutableTree(std::vector<KDPoint<T, K>> const & points,
+                  size_t aK,
+                  size_t aMaxPointsNumberInLeafNode = 1,
+                  KDPointsLayout aLayout = KDPointsLayout::AoS)
+        : KDMutableTree(aK, aMaxPointsNumberInLeafNode, aLayout)
+    {
+        std::vector<T> coordinates;
+        std::vector<size_t> ids;
+        coordinates.reserve(points.size() * getK());
+        for (auto const & point : points) {
+            checkPoint(point);
+            coordinates.insert(coordinates.end(), point.data(), point.data() + getK());
+            ids.push_back(locations.size());
+            locations.push_back(Location{erasedLevelI, 0});
+        }
+        pointsNumber = points.size();
+        buildLevel(0, std::move(coordinates), std::move(ids));
+    }
+
+    size_t getK() const
+    {
+        return K != KDDynamicK ? K : dynamicK;
+    }
+
+    /// number of the points which are not erased
+    size_t size() const { return pointsNumber; }
+
+    /// number of the static trees the points are kept in (except the buffer)
+    size_t getTreesNumber() const
+    {
+        size_t treesNumber = 0;
+        for (auto const & level : levels) {
+            treesNumber += level.tree ? 1 : 0;
+        }
+        return treesNumber;
+    }
+
+    bool contains(size_t id) const
+    {
+        return id < locations.size() && locations[id].levelI != erasedLevelI;
+    }
+
+    /// returns the id of the inserted point
+    size_t insert(KDPoint<T, K> const & p)
+    {
+        checkPoint(p);
+        size_t id = locations.size();
+        locations.push_back(Location{bufferLevelI, bufferIds.size()});
+        for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+            bufferCoordinates[coordinateI * bufferCapacity + bufferIds.size()] = p[coordinateI];
+        }
+        bufferIds.push_back(id);
+        ++pointsNumber;
+        if (bufferIds.size() == bufferCapacity) {
+            carryBuffer();
+        }
+        return id;
+    }
+
+    /// returns false if there is no point with the id (or it is already erased)
+    bool erase(size_t id)
+    {
+        if (!contains(id)) {
+            return false;
+        }
+        Location location = locations[id];
+        locations[id].levelI = erasedLevelI;
+        --pointsNumber;
+
+        if (location.levelI == bufferLevelI) {
+            /// the last point of the buffer is moved to the place of the erased one
+            size_t lastI = bufferIds.size() - 1;
+            for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+                bufferCoordinates[coordinateI * bufferCapacity + location.i] =
+                        bufferCoordinates[coordinateI * bufferCapacity + lastI];
+            }
+            bufferIds[location.i] = bufferIds[lastI];
+            locations[bufferIds[location.i]].i = location.i;
+            bufferIds.pop_back();
+            return true;
+        }
+
+        auto & level = levels[location.levelI];
+        level.isErased[location.i] = true;
+        ++level.erasedNumber;
+        if (level.erasedNumber * 2 > level.ids.size()) {
+            std::vector<T> coordinates;
+            std::vector<size_t> ids;
+            takeLevelPoints(location.levelI, coordinates, ids);
+            buildLevel(location.levelI, std::move(coordinates), std::move(ids));
+        }
+        return true;
+    }
+
+    KDPoint<T, K> getPoint(size_t id) const
+    {
+        if (!contains(id)) {
+            throw std::out_of_range("there is no point with this id");
+        }
+        Location const & location = locations[id];
+        if (location.levelI == bufferLevelI) {
+            std::vector<T> coordinates(getK());
+            for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+                coordinates[coordinateI] =
+                        bufferCoordinates[coordinateI * bufferCapacity + location.i];
+            }
+            return KDPoint<T, K>(coordinates.data(), coordinates.data() + getK());
+        }
+        return levels[location.levelI].tree->getPoint(location.i);
+    }
+
+    /// returns the closest point which is not erased, closestPointId is its id.
+    KDPoint<T, K> findClosestPoint(KDPoint<T, K> const & p, size_t & closestPointId) const
+    {
+        KDSearchContext<T> context;
+        return findClosestPoint(p, closestPointId, context);
+    }
+
+    /// The same as above with the memory of the context, see KDSearchContext. The searches
+    /// of all the levels use it.
+    KDPoint<T, K> findClosestPoint(KDPoint<T, K> const & p,
+                                   size_t & closestPointId,
+                                   KDSearchContext<T> & context) const
+    {
+        checkPoint(p);
+        if (pointsNumber == 0) {
+            throw std::domain_error("tree has no points");
+        }
+        KDQueryResult<T> result;
+        result.originalI = std::numeric_limits<size_t>::max();
+        result.squareDistance = std::numeric_limits<T>::max();
+        size_t closestLevelI = levels.size();
+
+        /// the biggest levels are searched first, they most probably have the closest point,
+        /// so the search in the other ones is pruned by the distance to it
+        for (size_t levelI = levels.size(); levelI-- > 0;) {
+            auto const & level = levels[levelI];
+            if (!level.tree) {
+                continue;
+            }
+            KDQueryResult<T> levelResult = result;
+            levelResult.originalI = std::numeric_limits<size_t>::max();
+            if (level.erasedNumber == 0) {
+                level.tree->findClosestPointIf(p, KDAllPoints(), levelResult, context);
+            } else {
+                level.tree->findClosestPointIf(p, [&](size_t i) { return !level.isErased[i]; },
+                                               levelResult, context);
+            }
+            if (levelResult.originalI != std::numeric_limits<size_t>::max()) {
+                result = levelResult;
+                closestLevelI = levelI;
+            }
+        }
+
+        /// the buffer is kept dimension by dimension, so it is scanned by the leaf kernel
+        size_t bufferI = KDSimdKernels<T>::findClosestPointSoA(
+                    bufferCoordinates.data(), bufferCapacity, getK(), p.data(),
+                    bufferIds.size(), result.squareDistance);
+        if (bufferI != bufferIds.size()) {
+            closestPointId = bufferIds[bufferI];
+            return getPoint(closestPointId);
+        }
+
+        /// the point is taken from its level, so its location is not looked up
+        auto const & level = levels[closestLevelI];
+        closestPointId = level.ids[result.originalI];
+        return level.tree->getPoint(result.originalI);
+    }
+
+private:
+    struct Level {
+        std::unique_ptr<KDTree<T, K>> tree;
+        /// point ids by their indices in the tree
+        std::vector<size_t> ids;
+        /// erased flags by the point indices in the tree
+        std::vector<bool> isErased;
+        size_t erasedNumber = 0;
+    };
+
+    /// where the point is: the level and the index in its tree or in the buffer
+    struct Location {
+        std::uint32_t levelI;
+        size_t i;
+    };
+
+    static constexpr size_t bufferCapacity = 128;
+    /// the capacity of the next level is levelsGrowth times the one of the previous level
+    static constexpr size_t levelsGrowth = 8;
+    /// the smaller levels are merged into the biggest one when they have more than
+    /// 1/compactionRatio of its points
+    static constexpr size_t compactionRatio = 8;
+    static constexpr std::uint32_t bufferLevelI = std::numeric_limits<std::uint32_t>::max() - 1;
+    /// the level of erased points
+    static constexpr std::uint32_t erasedLevelI = std::numeric_limits<std::uint32_t>::max();
+
+    static size_t getLevelCapacity(size_t levelI)
+    {
+        size_t capacity = bufferCapacity;
+        for (size_t i = 0; i < levelI; ++i) {
+            capacity *= levelsGrowth;
+        }
+        return capacity;
+    }
+
+    void checkPoint(KDPoint<T, K> const & p) const
+    {
+        if (p.size() != getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+    }
+
+    /// number of the points of the level which are not erased
+    size_t getLevelPointsNumber(size_t levelI) const
+    {
+        return levels[levelI].ids.size() - levels[levelI].erasedNumber;
+    }
+
+    /// merge the points of the buffer into the levels: they are taken with the points of
+    /// the levels from the first one until the level which can have all of them, and built
+    /// into it
+    void carryBuffer()
+    {
+        std::vector<T> coordinates(bufferIds.size() * getK());
+        std::vector<size_t> ids;
+        for (size_t i = 0; i < bufferIds.size(); ++i) {
+            for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+                coordinates[i * getK() + coordinateI] =
+                        bufferCoordinates[coordinateI * bufferCapacity + i];
+            }
+        }
+        ids.swap(bufferIds);
+        size_t levelI = 0;
+        for (;; ++levelI) {
+            if (levelI < levels.size() && levels[levelI].tree) {
+                takeLevelPoints(levelI, coordinates, ids);
+            }
+            if (getLevelCapacity(levelI) >= ids.size()) {
+                break;
+            }
+        }
+        buildLevel(levelI, std::move(coordinates), std::move(ids));
+        compactLevels();
+    }
+
+    /// merge all the levels into the biggest one if the smaller ones have more than
+    /// 1/compactionRatio of its points
+    void compactLevels()
+    {
+        size_t biggestLevelI = levels.size() - 1;
+        size_t smallerPointsNumber = 0;
+        for (size_t levelI = 0; levelI < biggestLevelI; ++levelI) {
+            smallerPointsNumber += getLevelPointsNumber(levelI);
+        }
+        if (smallerPointsNumber * compactionRatio <= getLevelPointsNumber(biggestLevelI)) {
+            return;
+        }
+        std::vector<T> coordinates;
+        std::vector<size_t> ids;
+        for (size_t levelI = 0; levelI < levels.size(); ++levelI) {
+            if (levels[levelI].tree) {
+                takeLevelPoints(levelI, coordinates, ids);
+            }
+        }
+        buildLevel(biggestLevelI, std::move(coordinates), std::move(ids));
+    }
+
+    /// append not erased points of the level to the vectors and clear it
+    void takeLevelPoints(size_t levelI, std::vector<T> & coordinates, std::vector<size_t> & ids)
+    {
+        auto & level = levels[levelI];
+        coordinates.reserve(coordinates.size() + (level.ids.size() - level.erasedNumber) * getK());
+        for (size_t i = 0; i < level.ids.size(); ++i) {
+            if (!level.isErased[i]) {
+                auto point = level.tree->getPoint(i);
+                coordinates.insert(coordinates.end(), point.data(), point.data() + getK());
+                ids.push_back(level.ids[i]);
+            }
+        }
+        level = Level();
+    }
+
+    /// build the tree of the points in the first level from the given one which can have them
+    void buildLevel(size_t levelI, std::vector<T> && coordinates, std::vector<size_t> && ids)
+    {
+        if (ids.empty()) {
+            return;
+        }
+        while (getLevelCapacity(levelI) < ids.size()) {
+            ++levelI;
+        }
+        if (levels.size() <= levelI) {
+            levels.resize(levelI + 1);
+        }
+        auto & level = levels[levelI];
+        level.tree.reset(new KDTree<T, K>(
+                             new KDPointStorage<T, K>(std::move(coordinates), getK(), layout),
+                             maxPointsNumberInLeafNode, nullptr, &arena));
+        /// the arena keeps the memory of the smaller levels, which are rebuilt often, but not
+        /// the one left by the biggest level, it is as big as all the points
+        if (levelI + 1 == levels.size()) {
+            arena.clear();
+        }
+        level.ids = std::move(ids);
+        level.isErased.assign(level.ids.size(), false);
+        level.erasedNumber = 0;
+        for (size_t i = 0; i < level.ids.size(); ++i) {
+            locations[level.ids[i]] = Location{static_cast<std::uint32_t>(levelI), i};
+        }
+    }
+
+    size_t dynamicK;
+    size_t maxPointsNumberInLeafNode;
+    KDPointsLayout layout;
+    /// number of the points which are not erased
+    size_t pointsNumber = 0;
+    std::vector<Level> levels;
+    /// inserted points which are not in levels yet, coordinate c of point i is
+    /// bufferCoordinates[c * bufferCapacity + i]
+    std::vector<T> bufferCoordinates;
+    std::vector<size_t> bufferIds;
+    /// locations of the points by their ids
+    std::vector<Location> locations;
+    /// memory to build the levels, it is reused by the rebuilds of the smaller levels
+    KDBuildArena<T> arena;
+};
@@ -1,16 +1,90 @@
 #pragma once
 
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/array.hpp>
 #include <boost/serialization/export.hpp>
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <limits>
 #include <stdexcept>
 #include <vector>
+#include <utility>
 #include <ostream>
 
-/// K-dimentional point
-template <typename T>
+/// K value for points, storages and trees, which dimension is only known at runtime.
+constexpr size_t KDDynamicK = 0;
+
+/// K-dimentional point with K known at compile time. Coordinates are kept inside the point,
+/// so it takes no heap allocations, and distance loops can be unrolled by the compiler.
+template <typename T, size_t K = KDDynamicK>
 class KDPoint
 {
+public:
+    /// Empty c-tor for serialization
+    KDPoint() : coordinates() {}
+
+    KDPoint(const std::array<T, K> &aCoordinates)
+        : coordinates(aCoordinates)
+    {}
+
+    /// Copy coordinates from the range, it should have exactly K values
+    KDPoint(T const * begin, T const * end)
+    {
+        if (static_cast<size_t>(end - begin) != K) {
+            throw std::length_error("size of the point is not the same as K");
+        }
+        std::copy(begin, end, coordinates.begin());
+    }
+
+    /// Get K the point
+    constexpr size_t size() const {
+        return K;
+    }
+
+    bool operator == (KDPoint<T, K> const & other) const {
+        return squareDistanceToPoint(other) <= std::numeric_limits<T>::epsilon();
+    }
+
+    /// Get coordiante value at ith coordinate
+    T const & at(size_t i) const {
+        return coordinates.at(i);
+    }
+
+    /// Get coordiante value at ith coordinate without the range check
+    T const & operator [] (size_t i) const {
+        return coordinates[i];
+    }
+
+    /// Get all the coordinates, there are size() of them
+    T const * data() const {
+        return coordinates.data();
+    }
+
+    T squareDistanceToPoint(KDPoint<T, K> const & other) const {
+        T distance{0};
+        for (size_t i = 0; i < K; ++i) {
+            auto diff = coordinates[i] - other.coordinates[i];
+            distance += diff * diff;
+        }
+        return distance;
+    }
+private:
+    /// Boost serialization
+    friend class boost::serialization::access;
+    template <typename Archive>
+    void serialize(Archive &ar, const unsigned int version) {
+        ar & coordinates;
+    }
+
+    std::array<T, K> coordinates;
+};
+
+/// K-dimentional point with K known only at runtime
+template <typename T>
+class KDPoint<T, KDDynamicK>
+{
 public:
     /// Empty c-tor for serialization
     KDPoint() {}
@@ -19,6 +93,15 @@ public:
         : coordinates(aCoordinates)
     {}
 
+    KDPoint(std::vector<T> &&aCoordinates)
+        : coordinates(std::move(aCoordinates))
+    {}
+
+    /// Copy coordinates from the range
+    KDPoint(T const * begin, T const * end)
+        : coordinates(begin, end)
+    {}
+
     /// Get K the point
     size_t size() const {
         return coordinates.size();
@@ -33,6 +116,16 @@ public:
         return coordinates.at(i);
     }
 
+    /// Get coordiante value at ith coordinate without the range check
+    T const & operator [] (size_t i) const {
+        return coordinates[i];
+    }
+
+    /// Get all the coordinates, there are size() of them
+    T const * data() const {
+        return coordinates.data();
+    }
+
     T squareDistanceToPoint(KDPoint<T> const & other) const {
         /// If checking the size is a bottle_neck, use something instead, e.g. assert.
         if (coordinates.size() != other.coordinates.size()) {
@@ -55,3 +148,37 @@ private:
 
     std::vector<T> coordinates;
 };
+
+/// Coordinates of a point kept elsewhere, e.g. in a buffer of many points. The view does not
+/// copy them, so queries by views make no allocations. The coordinates must outlive the view.
+template <typename T>
+class KDPointView
+{
+public:
+    KDPointView(T const * aCoordinates, size_t aSize)
+        : coordinates(aCoordinates), coordinatesNumber(aSize)
+    {}
+
+    /// view of the point, so all the queries accept points too
+    template <size_t K>
+    KDPointView(KDPoint<T, K> const & p)
+        : coordinates(p.data()), coordinatesNumber(p.size())
+    {}
+
+    size_t size() const {
+        return coordinatesNumber;
+    }
+
+    /// Get coordiante value at ith coordinate without the range check
+    T const & operator [] (size_t i) const {
+        return coordinates[i];
+    }
+
+    T const * data() const {
+        return coordinates;
+    }
+
+private:
+    T const * coordinates;
+    size_t coordinatesNumber;
+};
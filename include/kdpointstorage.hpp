@@ -1,14 +1,64 @@
 #pragma once
 
 #include<kdpoint.hpp>
+#include<kdbuildarena.hpp>
+#include<kdmemory.hpp>
+#include<kdsimd.hpp>
+#include<kdthreadpool.hpp>
 
+#include <boost/serialization/split_member.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
 #include <exception>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <type_traits>
+#include <utility>
+
+/// Layout of the point coordinates in the storage after the tree is built.
+/// During the build coordinates are always kept in the original points order (row-major) and
+/// are accessed through indices. Once the tree is built, the storage can reorder them, so
+/// the points of every leaf are contiguous in memory.
+enum class KDPointsLayout {
+    /// keep the original order, leaf points are accessed through indices
+    Indexed,
+    /// leaf order, row-major: coordinates of one point are together (K-strided)
+    AoS,
+    /// leaf order, one array per dimension
+    SoA
+};
+
+/// Type of the integers the coordinates are replaced by, see KDPointStorage::quantize.
+enum class KDQuantization {
+    /// coordinates are kept as they are
+    None,
+    /// 16-bit signed integers
+    Int16,
+    /// 8-bit unsigned integers
+    UInt8
+};
+
+/// Point found by the nearest points search: the index in the original points array order
+/// and the square distance to it.
+template <typename T>
+using KDNeighbour = std::pair<size_t, T>;
+
+/// Filter of points for the queries which allows all the points,
+/// queries with it are the same as without a filter.
+struct KDAllPoints {
+    bool operator()(size_t) const { return true; }
+};
 
 /// This class encapsulates the point storage. All the manipulation with points are performed
 /// here, like partition, selecting pivot, selecting coordinate to split, etc.
 /// findPivot and findSplittingPanelCoordinateI can be overrided to use other algorithms to
 /// perform these operations.
-template <typename T>
+/// K is the points dimension if it is known at compile time, otherwise it is set at runtime.
+template <typename T, size_t K = KDDynamicK>
 class KDPointStorage {
 public:
     /// Empty c-tor for serialization
@@ -19,23 +69,79 @@ public:
     /// All the operations are performed with indices instead of the points directly,
     /// because it is faster and we need the index in the original array any way.
     /// Other implementations can be used instead.
-    KDPointStorage(std::vector<KDPoint<T>> const & aPoints, size_t aK)
-        : K(aK), points(aPoints), indices(points.size())
+    /// Coordinates are copied into one contiguous buffer.
+    KDPointStorage(std::vector<KDPoint<T, K>> const & aPoints,
+                   size_t aK,
+                   KDPointsLayout aLayout = KDPointsLayout::AoS)
+        : dynamicK(aK), layout(aLayout), indices(aPoints.size())
     {
-        if (K == 0)
-            throw std::domain_error("points dimension should be > 0");
+        checkDimension();
 
-        if (points.size() == 0)
+        if (aPoints.size() == 0)
             throw std::domain_error("point storage must have at least one point");
 
-        for (int i = 0; i < points.size(); ++i) {
-            if (points.at(i).size() != K)
+        coordinates.reserve(aPoints.size() * getK());
+        for (size_t i = 0; i < aPoints.size(); ++i) {
+            if (aPoints.at(i).size() != getK())
                 throw std::domain_error("point storage has different dimesion than some points");
 
+            coordinates.insert(coordinates.end(), aPoints[i].data(), aPoints[i].data() + getK());
             indices[i] = i;
         }
+        updateData();
     }
 
+    /// Coordinates of the points are given one after another (row-major, like AoS layout),
+    /// the vector is moved into the storage, so the points are not copied.
+    /// It is a template only to keep KDPointStorage({}, K) meaning the vector of points.
+    template <typename Coordinates, typename = typename std::enable_if<
+                  std::is_same<Coordinates, std::vector<T>>::value>::type>
+    KDPointStorage(Coordinates && aCoordinates,
+                   size_t aK,
+                   KDPointsLayout aLayout = KDPointsLayout::AoS)
+        : dynamicK(aK), layout(aLayout), coordinates(std::move(aCoordinates))
+    {
+        checkDimension();
+
+        if (coordinates.size() == 0)
+            throw std::domain_error("point storage must have at least one point");
+
+        if (coordinates.size() % getK() != 0)
+            throw std::domain_error("coordinates number is not a multiple of points dimension");
+
+        indices.resize(coordinates.size() / getK());
+        std::iota(indices.begin(), indices.end(), 0);
+        updateData();
+    }
+
+    /// Coordinates of the points are given one after another (row-major) in the buffer,
+    /// which is used without copying, so the storage takes only O(N) memory for indices.
+    /// The buffer must not be changed or freed while the storage uses it: all the time with
+    /// Indexed layout, and only until the tree is built with other layouts, because
+    /// the coordinates are copied in leaf order then.
+    /// If dataOwner is provided, the storage keeps it alive while it uses the buffer, e.g. it
+    /// is the mapped file of the buffer or the buffer itself, so the buffer is adopted.
+    KDPointStorage(T const * aCoordinates,
+                   size_t aPointsNumber,
+                   size_t aK,
+                   KDPointsLayout aLayout = KDPointsLayout::AoS,
+                   std::shared_ptr<void const> aDataOwner = nullptr)
+        : dynamicK(aK), layout(aLayout), indices(aPointsNumber),
+          borrowedCoordinates(aCoordinates), dataOwner(std::move(aDataOwner))
+    {
+        checkDimension();
+
+        if (aPointsNumber == 0 || !aCoordinates)
+            throw std::domain_error("point storage must have at least one point");
+
+        std::iota(indices.begin(), indices.end(), 0);
+        updateData();
+    }
+
+    /// The storage can refer to its data, so it is not copied.
+    KDPointStorage(KDPointStorage const &) = delete;
+    KDPointStorage & operator = (KDPointStorage const &) = delete;
+
     /// Can be overrided in derived classes to have other logic here.
     /// Now all the cordinates to for splitting plane is changed in order and depends
     /// only on the depth of the current tree level.
@@ -45,7 +151,7 @@ public:
             size_t levelI
             ) const
     {
-        return levelI % K;
+        return levelI % getK();
     }
 
     /// Can be overrided in derived classes to have other logic here.
@@ -55,6 +161,7 @@ public:
     /// If part of the array is copied, this method can be const.
     ///
     /// The current implementation finds for the right median.
+    /// If the thread pool is set, the median of big ranges is found in parallel.
     virtual T findPivot(
             size_t leftPointsI,
             size_t rightPointsI,
@@ -62,22 +169,24 @@ public:
             )
     {
         size_t middlePointsI = (rightPointsI + leftPointsI) / 2;
+        if (pool && rightPointsI - leftPointsI >= parallelMinPointsNumber) {
+            return selectInParallel(leftPointsI, rightPointsI, middlePointsI, coordinateI);
+        }
 
         std::nth_element(
                     indices.begin() + leftPointsI,
                     indices.begin() + middlePointsI,
                     indices.begin() + rightPointsI,
                     [&](size_t i, size_t j) {
-                        auto elementI = points[i].at(coordinateI);
-                        auto elementJ = points[j].at(coordinateI);
-                        return elementI < elementJ;
+                        return getCoordinate(i, coordinateI) < getCoordinate(j, coordinateI);
                     }
         );
 
-        return points.at(indices.at(middlePointsI)).at(coordinateI);
+        return getCoordinate(indices.at(middlePointsI), coordinateI);
     }
 
     /// Partition points around pivot by the given coordinate.
+    /// If the thread pool is set, big ranges are partitioned in parallel.
     size_t partition(
             size_t leftPointsI,
             size_t rightPointsI,
@@ -85,57 +194,735 @@ public:
             T pivot
             )
     {
+        if (pool && rightPointsI - leftPointsI >= parallelMinPointsNumber) {
+            return partitionInParallel(leftPointsI, rightPointsI, [&](size_t i) {
+                return getCoordinate(i, coordinateI) < pivot;
+            });
+        }
         auto middleI = std::partition(indices.begin() + leftPointsI,
                                       indices.begin() + rightPointsI,
                                       [&](size_t i)
         {
-            auto elementI = points[i].at(coordinateI);
-            bool temp = (elementI < pivot);
-            return temp;
+            return getCoordinate(i, coordinateI) < pivot;
         }
         );
 
         return middleI - indices.begin();
     }
 
+    /// The tree sets the pool while it is built and resets it after that.
+    /// Subtrees are built concurrently then, so findSplittingPlaneCoordinateI, findPivot and
+    /// partition can be called concurrently for not intersecting ranges of points.
+    void setThreadPool(KDThreadPool * aPool)
+    {
+        pool = aPool;
+    }
+
+    /// The tree sets the arena while it is built and resets it after reorderInLeafOrder.
+    /// Parallel partitions and reordering use its buffers instead of allocating their own.
+    void setBuildArena(KDBuildArena<T> * aArena)
+    {
+        arena = aArena;
+    }
+
+    /// It is called by the tree when all the points are partitioned and the tree is built.
+    /// Coordinates are reordered in leaf order according to the storage layout,
+    /// so no partition can be done after this call.
+    void reorderInLeafOrder()
+    {
+        if (layout == KDPointsLayout::Indexed || leafOrdered)
+            return;
+
+        size_t pointsNumber = size();
+        std::vector<T> reordered;
+        /// the buffer of the arena becomes the coordinates, so it is taken only if it is
+        /// not much bigger than them, otherwise the tree would keep all its capacity
+        if (arena && arena->getCoordinates().capacity() >= pointsNumber * getK() &&
+                arena->getCoordinates().capacity() <= 2 * pointsNumber * getK()) {
+            reordered.swap(arena->getCoordinates());
+        }
+        reordered.resize(pointsNumber * getK());
+        positions.resize(pointsNumber);
+        for (size_t i = 0; i < pointsNumber; ++i) {
+            T const * point = &coordinatesData[indices[i] * getK()];
+            for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+                if (layout == KDPointsLayout::AoS) {
+                    reordered[i * getK() + coordinateI] = point[coordinateI];
+                } else {
+                    reordered[coordinateI * pointsNumber + i] = point[coordinateI];
+                }
+            }
+            positions[indices[i]] = i;
+        }
+        coordinates.swap(reordered);
+        /// the arena keeps the old buffer for the next trees if it is bigger than its own one.
+        /// Borrowed coordinates are not in the buffer, so it is empty then.
+        if (arena && reordered.capacity() > arena->getCoordinates().capacity()) {
+            arena->getCoordinates().swap(reordered);
+        }
+        /// the borrowed buffer is not used any more
+        borrowedCoordinates = nullptr;
+        dataOwner.reset();
+        leafOrdered = true;
+        updateData();
+    }
+
+    /// Replace the coordinates by integers of the quantization type. Every coordinate is
+    /// offset + scale * q, the offset and the scale of every dimension map the range of
+    /// the points to the range of the integers, so a coordinate is changed by at most
+    /// scale / 2 (see getQuantizationError). Queries compute approximate distances then,
+    /// but the coordinates take 2 or 1 bytes instead of sizeof(T).
+    /// It is called after the tree is built, the storage must own its coordinates.
+    void quantize(KDQuantization aQuantization)
+    {
+        static_assert(std::is_floating_point<T>::value,
+                      "only floating point coordinates can be quantized");
+        if (quantization != KDQuantization::None || coordinates.empty() ||
+                coordinatesData != coordinates.data()) {
+            throw std::domain_error("only not quantized coordinates of the storage can be quantized");
+        }
+        if (aQuantization == KDQuantization::Int16) {
+            quantizeAs<std::int16_t>();
+        } else if (aQuantization == KDQuantization::UInt8) {
+            quantizeAs<std::uint8_t>();
+        } else {
+            return;
+        }
+        quantization = aQuantization;
+        std::vector<T>().swap(coordinates);
+        updateData();
+    }
+
+    KDQuantization getQuantization() const
+    {
+        return quantization;
+    }
+
+    /// the maximal difference between the distance computed by the quantized coordinates
+    /// and the exact one, 0 if coordinates are not quantized
+    T getQuantizationError() const
+    {
+        T squareError{0};
+        for (size_t coordinateI = 0; coordinateI < quantizationScales.size(); ++coordinateI) {
+            squareError += quantizationScales[coordinateI] * quantizationScales[coordinateI] / 4;
+        }
+        return std::sqrt(squareError);
+    }
+
+    /// square distance from p to the point by the index in the original points array order
+    T getSquareDistanceByOriginalI(KDPointView<T> p, size_t originalI) const
+    {
+        if (p.size() != getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+        if (originalI >= size()) {
+            throw std::out_of_range("point index is out of range");
+        }
+        T distance{0};
+        for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+            auto diff = getQuantizedCoordinate(originalI, coordinateI) - p[coordinateI];
+            distance += diff * diff;
+        }
+        return distance;
+    }
+
     /// Search the closest points in the range
     void findClosestPoint(
-            KDPoint<T> const & p,
+            KDPointView<T> p,
             T & minSquareDistance,
             size_t & originalPointI,
             size_t leftPointsI,
             size_t rightPointsI
         ) const
     {
-        for (size_t i = leftPointsI; i < rightPointsI; ++i) {
-            auto squareDistanceCandidate = points.at(indices[i]).squareDistanceToPoint(p);
-            if (squareDistanceCandidate < minSquareDistance) {
+        /// If checking the size is a bottle_neck, use something instead, e.g. assert.
+        if (p.size() != getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+        T const * pCoordinates = p.data();
+        if (!leafOrdered || layout == KDPointsLayout::AoS ||
+                quantization != KDQuantization::None) {
+            forEachSquareDistance(leftPointsI, rightPointsI, pCoordinates,
+                                  [&](size_t i, T squareDistanceCandidate) {
+                if (squareDistanceCandidate < minSquareDistance) {
+                    minSquareDistance = squareDistanceCandidate;
+                    originalPointI = indicesData[i];
+                }
+            });
+        } else {
+            /// SoA layout is scanned by the vectorized kernel if it is available
+            size_t pointsNumber = rightPointsI - leftPointsI;
+            size_t closestI = KDSimdKernels<T>::findClosestPointSoA(
+                        coordinatesData + leftPointsI,
+                        size(),
+                        getK(),
+                        pCoordinates,
+                        pointsNumber,
+                        minSquareDistance);
+            if (closestI != pointsNumber) {
+                originalPointI = indicesData[leftPointsI + closestI];
+            }
+        }
+    }
+
+    /// Search the closest point in the range among the points for which
+    /// isAllowed(originalI) is true.
+    template <typename Filter>
+    void findClosestPoint(
+            KDPointView<T> p,
+            T & minSquareDistance,
+            size_t & originalPointI,
+            size_t leftPointsI,
+            size_t rightPointsI,
+            Filter const & isAllowed
+        ) const
+    {
+        /// the closest point of all is searched first, it can be done by the vectorized kernel.
+        /// If it is allowed, it is also the closest allowed one, otherwise the range is scanned
+        /// again with the filter.
+        T allMinSquareDistance = minSquareDistance;
+        size_t allOriginalPointI = std::numeric_limits<size_t>::max();
+        findClosestPoint(p, allMinSquareDistance, allOriginalPointI, leftPointsI, rightPointsI);
+        if (allOriginalPointI == std::numeric_limits<size_t>::max()) {
+            return;
+        }
+        if (isAllowed(allOriginalPointI)) {
+            minSquareDistance = allMinSquareDistance;
+            originalPointI = allOriginalPointI;
+            return;
+        }
+        forEachSquareDistance(leftPointsI, rightPointsI, p.data(),
+                              [&](size_t i, T squareDistanceCandidate) {
+            if (squareDistanceCandidate < minSquareDistance && isAllowed(indicesData[i])) {
                 minSquareDistance = squareDistanceCandidate;
-                originalPointI = indices[i];
+                originalPointI = indicesData[i];
+            }
+        });
+    }
+
+    /// all the points are allowed, so the range is scanned without the filter
+    void findClosestPoint(
+            KDPointView<T> p,
+            T & minSquareDistance,
+            size_t & originalPointI,
+            size_t leftPointsI,
+            size_t rightPointsI,
+            KDAllPoints const &
+        ) const
+    {
+        findClosestPoint(p, minSquareDistance, originalPointI, leftPointsI, rightPointsI);
+    }
+
+    /// Add points in the range to the k nearest points found so far.
+    /// nearestPoints is a max-heap by the square distance (see compareNeighbours)
+    /// that keeps at most k points.
+    void findKNearest(
+            KDPointView<T> p,
+            size_t k,
+            std::vector<KDNeighbour<T>> & nearestPoints,
+            size_t leftPointsI,
+            size_t rightPointsI
+        ) const
+    {
+        if (p.size() != getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+        forEachSquareDistance(leftPointsI, rightPointsI, p.data(),
+                              [&](size_t i, T squareDistance) {
+            if (nearestPoints.size() < k) {
+                nearestPoints.push_back(KDNeighbour<T>(indicesData[i], squareDistance));
+                std::push_heap(nearestPoints.begin(), nearestPoints.end(), compareNeighbours);
+            } else if (squareDistance < nearestPoints.front().second) {
+                std::pop_heap(nearestPoints.begin(), nearestPoints.end(), compareNeighbours);
+                nearestPoints.back() = KDNeighbour<T>(indicesData[i], squareDistance);
+                std::push_heap(nearestPoints.begin(), nearestPoints.end(), compareNeighbours);
+            }
+        });
+    }
+
+    /// Call function(originalI, squareDistance) for every point in the range
+    /// which square distance to p is not bigger than squareRadius.
+    template <typename Function>
+    void findPointsInRadius(
+            KDPointView<T> p,
+            T squareRadius,
+            Function & function,
+            size_t leftPointsI,
+            size_t rightPointsI
+        ) const
+    {
+        if (p.size() != getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+        forEachSquareDistance(leftPointsI, rightPointsI, p.data(),
+                              [&](size_t i, T squareDistance) {
+            if (squareDistance <= squareRadius) {
+                function(indicesData[i], squareDistance);
+            }
+        });
+    }
+
+    /// Call function(originalI) for every point in the range which is inside the box
+    /// [lower, upper], bounds are included.
+    template <typename Function>
+    void findPointsInBox(
+            KDPoint<T, K> const & lower,
+            KDPoint<T, K> const & upper,
+            Function & function,
+            size_t leftPointsI,
+            size_t rightPointsI
+        ) const
+    {
+        for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+            bool isInside = true;
+            for (size_t coordinateI = 0; coordinateI < getK() && isInside; ++coordinateI) {
+                T coordinate = getCoordinateInLeafOrder(i, coordinateI);
+                isInside = lower[coordinateI] <= coordinate && coordinate <= upper[coordinateI];
+            }
+            if (isInside) {
+                function(indicesData[i]);
             }
         }
     }
 
+    /// Find the bounding box of the points in the range.
+    void findBoundingBox(
+            size_t leftPointsI,
+            size_t rightPointsI,
+            std::vector<T> & lower,
+            std::vector<T> & upper
+        ) const
+    {
+        lower.assign(getK(), std::numeric_limits<T>::max());
+        upper.assign(getK(), std::numeric_limits<T>::lowest());
+        for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+            for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+                T coordinate = getCoordinateInLeafOrder(i, coordinateI);
+                lower[coordinateI] = std::min(lower[coordinateI], coordinate);
+                upper[coordinateI] = std::max(upper[coordinateI], coordinate);
+            }
+        }
+    }
+
+    /// neighbours are ordered by the square distance, the closer the first
+    static bool compareNeighbours(KDNeighbour<T> const & a, KDNeighbour<T> const & b) {
+        return a.second < b.second;
+    }
+
     size_t size() const
     {
-        return points.size();
+        return pointsNumber;
+    }
+
+    /// points dimension, it is a compile time constant if K is known
+    size_t getK() const
+    {
+        return K != KDDynamicK ? K : dynamicK;
+    }
+
+    KDPointsLayout getLayout() const
+    {
+        return layout;
+    }
+
+    /// Back the data the queries read, the coordinates and the indices in leaf order,
+    /// by huge pages, see kdAdviseHugePages. Returns the number of bytes in huge pages.
+    size_t adviseHugePages()
+    {
+        size_t valuesNumber = size() * getK();
+        size_t bytesNumber = 0;
+        if (quantization == KDQuantization::None) {
+            bytesNumber += kdAdviseHugePages(coordinatesData, valuesNumber * sizeof(T));
+        } else {
+            size_t valueSize = quantization == KDQuantization::Int16 ? sizeof(std::int16_t) :
+                                                                        sizeof(std::uint8_t);
+            bytesNumber += kdAdviseHugePages(quantizedData, valuesNumber * valueSize);
+        }
+        return bytesNumber + kdAdviseHugePages(indicesData, size() * sizeof(size_t));
+    }
+
+    /// return the index in the original points array order by the index in leaf order.
+    size_t getOriginalI(size_t i) const {
+        return indicesData[i];
+    }
+
+    /// coordinate value of the point by the index in leaf order.
+    T getCoordinateInLeafOrder(size_t i, size_t coordinateI) const {
+        if (!leafOrdered) {
+            return getValue(indicesData[i] * getK() + coordinateI, coordinateI);
+        } else if (layout == KDPointsLayout::AoS) {
+            return getValue(i * getK() + coordinateI, coordinateI);
+        } else {
+            return getValue(coordinateI * size() + i, coordinateI);
+        }
     }
 
-    /// return point reference by the index in the original points array order.
-    KDPoint<T> const & getPointByOriginalI(size_t i) const {
-        return points.at(i);
+    /// return point by the index in the original points array order.
+    /// The coordinates of K known at compile time are gathered on the stack, the dynamic
+    /// ones to the vector moved into the point, so it takes at most one heap allocation.
+    KDPoint<T, K> getPointByOriginalI(size_t i) const {
+        if (i >= size()) {
+            throw std::out_of_range("point index is out of range");
+        }
+        if constexpr (K != KDDynamicK) {
+            std::array<T, K> point;
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                point[coordinateI] = getQuantizedCoordinate(i, coordinateI);
+            }
+            return KDPoint<T, K>(point);
+        } else {
+            std::vector<T> point(getK());
+            for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+                point[coordinateI] = getQuantizedCoordinate(i, coordinateI);
+            }
+            return KDPoint<T, K>(std::move(point));
+        }
     }
 
 protected:
-    size_t K = 1;
-    std::vector<KDPoint<T>> points;
+    /// Find the value of the point that would be at the kth position if the range was sorted
+    /// by the coordinate. The range is split by parallel partitions around the median of three
+    /// points until the part having the kth position is small enough to use nth_element.
+    T selectInParallel(
+            size_t leftPointsI,
+            size_t rightPointsI,
+            size_t kthPointsI,
+            size_t coordinateI
+            )
+    {
+        auto coordinateOf = [&](size_t i) { return getCoordinate(indices[i], coordinateI); };
+        while (rightPointsI - leftPointsI >= parallelMinPointsNumber) {
+            T first = coordinateOf(leftPointsI);
+            T middle = coordinateOf(leftPointsI + (rightPointsI - leftPointsI) / 2);
+            T last = coordinateOf(rightPointsI - 1);
+            T candidate = std::max(std::min(first, middle), std::min(std::max(first, middle), last));
+
+            size_t lessEndI = partitionInParallel(leftPointsI, rightPointsI, [&](size_t i) {
+                return getCoordinate(i, coordinateI) < candidate;
+            });
+            if (kthPointsI < lessEndI) {
+                rightPointsI = lessEndI;
+                continue;
+            }
+            size_t equalEndI = partitionInParallel(lessEndI, rightPointsI, [&](size_t i) {
+                return getCoordinate(i, coordinateI) <= candidate;
+            });
+            if (kthPointsI < equalEndI) {
+                return candidate;
+            }
+            leftPointsI = equalEndI;
+        }
+
+        std::nth_element(
+                    indices.begin() + leftPointsI,
+                    indices.begin() + kthPointsI,
+                    indices.begin() + rightPointsI,
+                    [&](size_t i, size_t j) {
+                        return getCoordinate(i, coordinateI) < getCoordinate(j, coordinateI);
+                    }
+        );
+        return coordinateOf(kthPointsI);
+    }
+
+    /// Stable partition of the range by the predicate of the original point index.
+    /// Every thread counts the points of its chunk that satisfy the predicate, then the points
+    /// are scattered to their places in a temporary buffer and copied back.
+    /// The buffer is the same range of the arena indices if the arena is set.
+    /// returns the index of the first point that doesn't satisfy the predicate.
+    template <typename Predicate>
+    size_t partitionInParallel(size_t leftPointsI, size_t rightPointsI, Predicate predicate)
+    {
+        size_t pointsNumber = rightPointsI - leftPointsI;
+        size_t chunkSize = std::max<size_t>(pointsNumber / (pool->size() * 4), 1);
+        size_t chunksNumber = (pointsNumber + chunkSize - 1) / chunkSize;
+        auto chunkBeginI = [&](size_t chunkI) { return leftPointsI + chunkI * chunkSize; };
+        auto chunkEndI = [&](size_t chunkI) {
+            return std::min(rightPointsI, leftPointsI + (chunkI + 1) * chunkSize);
+        };
+
+        std::vector<size_t> trueNumbers(chunksNumber);
+        pool->parallelFor(chunksNumber, 1, [&](size_t beginChunkI, size_t endChunkI) {
+            for (size_t chunkI = beginChunkI; chunkI < endChunkI; ++chunkI) {
+                trueNumbers[chunkI] = std::count_if(indices.begin() + chunkBeginI(chunkI),
+                                                    indices.begin() + chunkEndI(chunkI),
+                                                    predicate);
+            }
+        });
+
+        size_t trueTotalNumber = 0;
+        for (auto trueNumber : trueNumbers) {
+            trueTotalNumber += trueNumber;
+        }
+
+        std::vector<size_t> ownPartitioned;
+        size_t * partitioned = nullptr;
+        if (arena) {
+            partitioned = arena->getIndices() + leftPointsI;
+        } else {
+            ownPartitioned.resize(pointsNumber);
+            partitioned = ownPartitioned.data();
+        }
+        pool->parallelFor(chunksNumber, 1, [&](size_t beginChunkI, size_t endChunkI) {
+            for (size_t chunkI = beginChunkI; chunkI < endChunkI; ++chunkI) {
+                size_t trueI = 0;
+                for (size_t previousChunkI = 0; previousChunkI < chunkI; ++previousChunkI) {
+                    trueI += trueNumbers[previousChunkI];
+                }
+                size_t falseI = trueTotalNumber + (chunkBeginI(chunkI) - leftPointsI) - trueI;
+                for (size_t i = chunkBeginI(chunkI); i < chunkEndI(chunkI); ++i) {
+                    if (predicate(indices[i])) {
+                        partitioned[trueI++] = indices[i];
+                    } else {
+                        partitioned[falseI++] = indices[i];
+                    }
+                }
+            }
+        });
+
+        pool->parallelFor(pointsNumber, chunkSize, [&](size_t beginI, size_t endI) {
+            std::copy(partitioned + beginI,
+                      partitioned + endI,
+                      indices.begin() + leftPointsI + beginI);
+        });
+        return leftPointsI + trueTotalNumber;
+    }
+
+    /// call function(i, squareDistance) for every point in leaf order from leftPointsI
+    /// to rightPointsI, where i is the index of the point in leaf order.
+    template <typename Function>
+    void forEachSquareDistance(
+            size_t leftPointsI,
+            size_t rightPointsI,
+            T const * pCoordinates,
+            Function function
+        ) const
+    {
+        if (quantization != KDQuantization::None) {
+            if (quantization == KDQuantization::Int16) {
+                forEachQuantizedSquareDistance<std::int16_t>(leftPointsI, rightPointsI,
+                                                             pCoordinates, function);
+            } else {
+                forEachQuantizedSquareDistance<std::uint8_t>(leftPointsI, rightPointsI,
+                                                             pCoordinates, function);
+            }
+        } else if (!leafOrdered) {
+            for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+                function(i, squareDistance(&coordinatesData[indicesData[i] * getK()], pCoordinates));
+            }
+        } else if (layout == KDPointsLayout::AoS) {
+            T const * point = coordinatesData + leftPointsI * getK();
+            for (size_t i = leftPointsI; i < rightPointsI; ++i, point += getK()) {
+                function(i, squareDistance(point, pCoordinates));
+            }
+        } else {
+            size_t pointsNumber = size();
+            for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+                T distance{0};
+                for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+                    auto diff = coordinatesData[coordinateI * pointsNumber + i] -
+                            pCoordinates[coordinateI];
+                    distance += diff * diff;
+                }
+                function(i, distance);
+            }
+        }
+    }
+
+    /// coordinate value of the point by the index in the original points array order.
+    /// It is used to build the tree, so the coordinates can not be quantized yet.
+    T getCoordinate(size_t originalI, size_t coordinateI) const {
+        if (!leafOrdered) {
+            return coordinatesData[originalI * getK() + coordinateI];
+        } else if (layout == KDPointsLayout::AoS) {
+            return coordinatesData[positionsData[originalI] * getK() + coordinateI];
+        } else {
+            return coordinatesData[coordinateI * size() + positionsData[originalI]];
+        }
+    }
+
+    /// the same as above, but the coordinates can be quantized
+    T getQuantizedCoordinate(size_t originalI, size_t coordinateI) const {
+        if (!leafOrdered) {
+            return getValue(originalI * getK() + coordinateI, coordinateI);
+        } else if (layout == KDPointsLayout::AoS) {
+            return getValue(positionsData[originalI] * getK() + coordinateI, coordinateI);
+        } else {
+            return getValue(coordinateI * size() + positionsData[originalI], coordinateI);
+        }
+    }
+
+    /// the value of the coordinates buffer by its index, coordinateI is the dimension of it
+    T getValue(size_t valueI, size_t coordinateI) const {
+        if (quantization == KDQuantization::None) {
+            return coordinatesData[valueI];
+        } else if (quantization == KDQuantization::Int16) {
+            return dequantize(static_cast<std::int16_t const *>(quantizedData)[valueI], coordinateI);
+        } else {
+            return dequantize(static_cast<std::uint8_t const *>(quantizedData)[valueI], coordinateI);
+        }
+    }
+
+    template <typename Q>
+    T dequantize(Q value, size_t coordinateI) const {
+        return quantizationOffsets[coordinateI] + quantizationScales[coordinateI] * value;
+    }
+
+    /// quantize the coordinates into the buffer of Q values, see quantize
+    template <typename Q>
+    void quantizeAs()
+    {
+        std::vector<T> lower;
+        std::vector<T> upper;
+        findBoundingBox(0, size(), lower, upper);
+        T lowestValue = std::numeric_limits<Q>::lowest();
+        T maxValue = std::numeric_limits<Q>::max();
+        quantizationOffsets.resize(getK());
+        quantizationScales.resize(getK());
+        for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+            T scale = (upper[coordinateI] - lower[coordinateI]) / (maxValue - lowestValue);
+            /// all the points have the same coordinate, it is kept exactly
+            quantizationScales[coordinateI] = scale > 0 ? scale : T{1};
+            quantizationOffsets[coordinateI] =
+                    lower[coordinateI] - quantizationScales[coordinateI] * lowestValue;
+        }
+
+        quantizedCoordinates.resize(coordinates.size() * sizeof(Q));
+        Q * quantized = reinterpret_cast<Q *>(quantizedCoordinates.data());
+        size_t pointsNumber = size();
+        for (size_t valueI = 0; valueI < coordinates.size(); ++valueI) {
+            size_t coordinateI = layout == KDPointsLayout::SoA && leafOrdered ?
+                        valueI / pointsNumber : valueI % getK();
+            T value = std::round((coordinates[valueI] - quantizationOffsets[coordinateI]) /
+                                 quantizationScales[coordinateI]);
+            quantized[valueI] = static_cast<Q>(std::min(std::max(value, lowestValue), maxValue));
+        }
+    }
+
+    /// forEachSquareDistance of the quantized coordinates
+    template <typename Q, typename Function>
+    void forEachQuantizedSquareDistance(
+            size_t leftPointsI,
+            size_t rightPointsI,
+            T const * pCoordinates,
+            Function & function
+        ) const
+    {
+        Q const * quantized = static_cast<Q const *>(quantizedData);
+        T const * offsets = quantizationOffsets.data();
+        T const * scales = quantizationScales.data();
+        size_t pointsNumber = size();
+        for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+            /// the values of the point are strided by 1 in row-major order and by the points
+            /// number in SoA layout
+            size_t firstValueI = i * getK();
+            size_t stride = 1;
+            if (!leafOrdered) {
+                firstValueI = indicesData[i] * getK();
+            } else if (layout == KDPointsLayout::SoA) {
+                firstValueI = i;
+                stride = pointsNumber;
+            }
+            T distance{0};
+            for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+                auto diff = offsets[coordinateI] +
+                        scales[coordinateI] * quantized[firstValueI + coordinateI * stride] -
+                        pCoordinates[coordinateI];
+                distance += diff * diff;
+            }
+            function(i, distance);
+        }
+    }
+
+    void checkDimension() const
+    {
+        if (dynamicK == 0)
+            throw std::domain_error("points dimension should be > 0");
+
+        if (K != KDDynamicK && dynamicK != K)
+            throw std::domain_error("points dimension is not the same as the storage one");
+    }
+
+    /// point the data used by queries to the vectors
+    void updateData()
+    {
+        coordinatesData = coordinates.empty() ? borrowedCoordinates : coordinates.data();
+        quantizedData = quantizedCoordinates.data();
+        indicesData = indices.data();
+        positionsData = positions.data();
+        pointsNumber = indices.size();
+    }
+
+    T squareDistance(T const * point, T const * otherPoint) const {
+        T distance{0};
+        for (size_t i = 0; i < getK(); ++i) {
+            auto diff = point[i] - otherPoint[i];
+            distance += diff * diff;
+        }
+        return distance;
+    }
+
+    /// ranges with less points are partitioned serially even if the thread pool is set
+    static constexpr size_t parallelMinPointsNumber = 1 << 16;
+
+    /// thread pool to use while the tree is built
+    KDThreadPool * pool = nullptr;
+    /// memory to use while the tree is built
+    KDBuildArena<T> * arena = nullptr;
+    size_t dynamicK = 1;
+    KDPointsLayout layout = KDPointsLayout::AoS;
+    /// true if coordinates are already reordered in leaf order
+    bool leafOrdered = false;
+    /// all the coordinates in one buffer, see KDPointsLayout
+    std::vector<T> coordinates;
+    /// original point indices in the order of the tree leaves
     std::vector<size_t> indices;
+    /// position of the point in leaf order by the original point index,
+    /// it is filled only when coordinates are reordered
+    std::vector<size_t> positions;
+    /// the buffer of the coordinates if they are not copied, and the owner of its memory
+    T const * borrowedCoordinates = nullptr;
+    std::shared_ptr<void const> dataOwner;
+    /// If the coordinates are quantized, they are replaced by the integers of this type in
+    /// the same order, and the coordinates buffer is empty.
+    KDQuantization quantization = KDQuantization::None;
+    std::vector<unsigned char> quantizedCoordinates;
+    /// the coordinate of dimension i is quantizationOffsets[i] + quantizationScales[i] * q
+    std::vector<T> quantizationOffsets;
+    std::vector<T> quantizationScales;
+
+    /// All the queries use the data by these pointers. They point either to the vectors above
+    /// or to the memory that is not owned by the storage, e.g. a mapped tree file.
+    /// Vectors are only used to build the tree.
+    T const * coordinatesData = nullptr;
+    void const * quantizedData = nullptr;
+    size_t const * indicesData = nullptr;
+    size_t const * positionsData = nullptr;
+    size_t pointsNumber = 0;
 
 private:
+    friend class KDTreeFile;
+    template <typename U> friend class KDExternalBuilder;
+
     /// Boost serialization
     friend class boost::serialization::access;
+    /// The data is saved from the pointers, because it can be not in the vectors.
     template <typename Archive>
-    void serialize(Archive &ar, const unsigned int version) {
-        ar & K & points & indices;
+    void save(Archive &ar, const unsigned int version) const {
+        if (quantization != KDQuantization::None) {
+            throw std::domain_error("quantized coordinates can be saved only to tree files");
+        }
+        std::vector<T> savedCoordinates(coordinatesData, coordinatesData + pointsNumber * getK());
+        std::vector<size_t> savedIndices(indicesData, indicesData + pointsNumber);
+        std::vector<size_t> savedPositions(positionsData,
+                                           positionsData + (leafOrdered ? pointsNumber : 0));
+        ar & dynamicK & layout & leafOrdered & savedCoordinates & savedIndices & savedPositions;
     }
+
+    template <typename Archive>
+    void load(Archive &ar, const unsigned int version) {
+        ar & dynamicK & layout & leafOrdered & coordinates & indices & positions;
+        updateData();
+    }
+
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
 };
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+
+/// Counters of the work done by closest point queries, they are accumulated over queries.
+struct KDQueryStats {
+    /// intermediate and leaf nodes taken from the search
+    size_t visitedNodesNumber = 0;
+    /// leaves which points are compared with the query point
+    size_t scannedLeavesNumber = 0;
+    /// points of the scanned leaves, the distance to every one of them is computed
+    size_t computedDistancesNumber = 0;
+    /// farther subnodes which are searched because they can have closer points
+    size_t backtracksNumber = 0;
+
+    void visitNode() { ++visitedNodesNumber; }
+    /// the closest point search passes the visited node, so the stats of memory accesses
+    /// can count its cache line and page
+    void visitNode(void const *) { visitNode(); }
+    void scanLeaf(size_t pointsNumber) {
+        ++scannedLeavesNumber;
+        computedDistancesNumber += pointsNumber;
+    }
+    void backtrack() { ++backtracksNumber; }
+
+    size_t getVisitedIntermediateNodesNumber() const {
+        return visitedNodesNumber - scannedLeavesNumber;
+    }
+};
+
+/// Queries are templates of the stats type, this one counts nothing and costs nothing.
+struct KDNoQueryStats {
+    void visitNode() {}
+    void visitNode(void const *) {}
+    void scanLeaf(size_t) {}
+    void backtrack() {}
+};
+
+/// Histogram of non-negative values in power of two buckets: bucket 0 counts zeros,
+/// bucket i counts values from 2^(i - 1) to 2^i - 1.
+class KDHistogram {
+public:
+    static constexpr size_t bucketsNumber = 65;
+
+    void add(std::uint64_t value)
+    {
+        ++counts[getBucketI(value)];
+        ++number;
+        sum += value;
+        max = std::max(max, value);
+    }
+
+    void merge(KDHistogram const & other)
+    {
+        for (size_t bucketI = 0; bucketI < bucketsNumber; ++bucketI) {
+            counts[bucketI] += other.counts[bucketI];
+        }
+        number += other.number;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    /// number of the added values
+    std::uint64_t getNumber() const { return number; }
+    std::uint64_t getMax() const { return max; }
+    double getMean() const { return number == 0 ? 0 : double(sum) / number; }
+
+    /// values in the bucket, see the class description
+    std::uint64_t getCount(size_t bucketI) const { return counts.at(bucketI); }
+
+    /// the biggest value of the bucket
+    static std::uint64_t getBucketUpperBound(size_t bucketI)
+    {
+        return bucketI == 0 ? 0 : ((std::uint64_t(1) << (bucketI - 1)) - 1) * 2 + 1;
+    }
+
+    /// the upper bound of the bucket where the fraction of all the values is reached,
+    /// e.g. 0.99 for the 99th percentile. It is not bigger than the maximal value.
+    std::uint64_t getPercentile(double fraction) const
+    {
+        std::uint64_t accumulated = 0;
+        for (size_t bucketI = 0; bucketI < bucketsNumber; ++bucketI) {
+            accumulated += counts[bucketI];
+            if (accumulated > 0 && accumulated >= fraction * number) {
+                return std::min(getBucketUpperBound(bucketI), max);
+            }
+        }
+        return max;
+    }
+
+private:
+    static size_t getBucketI(std::uint64_t value)
+    {
+        size_t bucketI = 0;
+        while (value != 0) {
+            value >>= 1;
+            ++bucketI;
+        }
+        return bucketI;
+    }
+
+    std::array<std::uint64_t, bucketsNumber> counts{};
+    std::uint64_t number = 0;
+    std::uint64_t sum = 0;
+    std::uint64_t max = 0;
+};
+
+/// Histograms of the work done by every query and its time. Pass the same object to
+/// the queries of a tree to accumulate them for the tree.
+struct KDQueryHistograms {
+    KDHistogram latencyNanoseconds;
+    KDHistogram visitedNodes;
+    KDHistogram scannedLeaves;
+    KDHistogram computedDistances;
+    KDHistogram backtracks;
+
+    /// add the stats of one query
+    void addQuery(KDQueryStats const & queryStats, std::uint64_t queryLatencyNanoseconds)
+    {
+        latencyNanoseconds.add(queryLatencyNanoseconds);
+        visitedNodes.add(queryStats.visitedNodesNumber);
+        scannedLeaves.add(queryStats.scannedLeavesNumber);
+        computedDistances.add(queryStats.computedDistancesNumber);
+        backtracks.add(queryStats.backtracksNumber);
+    }
+
+    void merge(KDQueryHistograms const & other)
+    {
+        latencyNanoseconds.merge(other.latencyNanoseconds);
+        visitedNodes.merge(other.visitedNodes);
+        scannedLeaves.merge(other.scannedLeaves);
+        computedDistances.merge(other.computedDistances);
+        backtracks.merge(other.backtracks);
+    }
+};
+
+/// Shape of the built tree
+struct KDTreeShape {
+    size_t depth = 0;
+    size_t nodesNumber = 0;
+    size_t leavesNumber = 0;
+    size_t minLeafSize = 0;
+    size_t maxLeafSize = 0;
+    double meanLeafSize = 0;
+    /// number of leaves by their size
+    std::map<size_t, size_t> leafSizes;
+    /// depths of leaves, the root is at depth 1
+    size_t minLeafDepth = 0;
+    double meanLeafDepth = 0;
+    /// the depth divided by the depth of the balanced tree with the same number of leaves,
+    /// it is 1 for balanced trees
+    double imbalance = 0;
+};
+
+/// Every histogram is written as a line of its summary and a line of not empty buckets
+/// as "upper bound: count".
+inline std::ostream & operator << (std::ostream & out, KDHistogram const & histogram)
+{
+    out << "number " << histogram.getNumber()
+        << ", mean " << histogram.getMean()
+        << ", p50 " << histogram.getPercentile(0.5)
+        << ", p99 " << histogram.getPercentile(0.99)
+        << ", max " << histogram.getMax() << "\n ";
+    for (size_t bucketI = 0; bucketI < KDHistogram::bucketsNumber; ++bucketI) {
+        if (histogram.getCount(bucketI) != 0) {
+            out << " <=" << KDHistogram::getBucketUpperBound(bucketI)
+                << ": " << histogram.getCount(bucketI);
+        }
+    }
+    return out;
+}
+
+inline std::ostream & operator << (std::ostream & out, KDQueryHistograms const & histograms)
+{
+    return out << "latency, ns: " << histograms.latencyNanoseconds << "\n"
+               << "visited nodes: " << histograms.visitedNodes << "\n"
+               << "scanned leaves: " << histograms.scannedLeaves << "\n"
+               << "computed distances: " << histograms.computedDistances << "\n"
+               << "backtracks: " << histograms.backtracks << "\n";
+}
+
+inline std::ostream & operator << (std::ostream & out, KDTreeShape const & shape)
+{
+    out << "depth: " << shape.depth << "\n"
+        << "nodes: " << shape.nodesNumber << "\n"
+        << "leaves: " << shape.leavesNumber << "\n"
+        << "leaf size: min " << shape.minLeafSize
+        << ", mean " << shape.meanLeafSize
+        << ", max " << shape.maxLeafSize << "\n"
+        << "leaf depth: min " << shape.minLeafDepth
+        << ", mean " << shape.meanLeafDepth
+        << ", max " << shape.depth << "\n"
+        << "imbalance: " << shape.imbalance << "\n"
+        << "leaves by size:";
+    for (auto const & leafSize : shape.leafSizes) {
+        out << " " << leafSize.first << ": " << leafSize.second;
+    }
+    return out << "\n";
+}
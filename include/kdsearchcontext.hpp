@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/// Memory the queries use while they search a tree. The caller keeps the context and passes
+/// it to query after query, so only the first queries allocate memory: the stack of nodes
+/// to search is sized from the tree depth, and the heap of the approximate search grows
+/// to the biggest one needed so far.
+/// A context is used by one query at a time, so every thread needs its own one.
+template <typename T>
+class KDSearchContext {
+public:
+    /// nodes to search with the lower bounds of the square distance to them
+    typedef std::pair<T, size_t> BoundedNode;
+    /// the original point index with the square distance to it, the same as KDNeighbour
+    typedef std::pair<size_t, T> Neighbour;
+
+    /// make the buffers big enough to search trees not deeper than depth
+    void reserve(size_t depth)
+    {
+        /// the closest point search keeps at most the farther subnode of every node
+        /// on the path to the current one and the current one
+        if (nodesToSearch.capacity() < depth + 1) {
+            nodesToSearch.reserve(depth + 1);
+        }
+        /// the approximate search pushes at most one farther subnode per level for every
+        /// scanned leaf, so the first leaf is always reached without allocations
+        if (boundedNodes.capacity() < depth + 1) {
+            boundedNodes.reserve(depth + 1);
+        }
+    }
+
+    /// stack of the closest point search
+    std::vector<size_t> & getNodesToSearch() { return nodesToSearch; }
+
+    /// heap of the approximate closest point search
+    std::vector<BoundedNode> & getBoundedNodes() { return boundedNodes; }
+
+    /// candidates of the reranked search
+    std::vector<Neighbour> & getNeighbours() { return neighbours; }
+
+    /// the size of all the buffers in bytes
+    size_t getAllocatedSize() const
+    {
+        return nodesToSearch.capacity() * sizeof(size_t) +
+                boundedNodes.capacity() * sizeof(BoundedNode) +
+                neighbours.capacity() * sizeof(Neighbour);
+    }
+
+    /// free all the memory
+    void clear()
+    {
+        std::vector<size_t>().swap(nodesToSearch);
+        std::vector<BoundedNode>().swap(boundedNodes);
+        std::vector<Neighbour>().swap(neighbours);
+    }
+
+private:
+    std::vector<size_t> nodesToSearch;
+    std::vector<BoundedNode> boundedNodes;
+    std::vector<Neighbour> neighbours;
+};
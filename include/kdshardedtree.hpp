@@ -0,0 +1,294 @@
+#pragma once
+
+#include <kdtree.hpp>
+#include <kdsplitstorages.hpp>
+#include <kdthreadpool.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+/// K-d tree split into shards. The top levels split the points as KDTree::buildTree does,
+/// with the same split strategy, and the points of every part are an independent KDTree
+/// with its own copy of the coordinates. So a shard can be kept in the memory of one NUMA
+/// node (it is allocated by the thread that builds it) or saved by KDTreeFile and served
+/// by another process.
+/// The planes of the top levels route queries: the shard having the query point is
+/// searched first, then the other ones in the order of the planes, and a shard is skipped
+/// if its bounding box is farther than the points already found. The results are the same
+/// as the ones of one tree of all the points.
+/// The number of shards is rounded down to a power of two, every plane splits its shards
+/// in halves. It can be smaller if the points can not be split, e.g. they are the same.
+template <typename T, size_t K = KDDynamicK>
+class KDShardedTree {
+public:
+    /// The coordinates are row-major and are not used after the c-tor.
+    /// If the thread pool is provided, the shards are built in parallel, one by a thread.
+    KDShardedTree(T const * coordinates,
+                  size_t aPointsNumber,
+                  size_t aK,
+                  size_t shardsNumber,
+                  size_t aMaxPointsNumberInLeafNode = 1,
+                  KDSplitStrategy split = KDSplitStrategy::Median,
+                  KDPointsLayout layout = KDPointsLayout::AoS,
+                  KDThreadPool * pool = nullptr)
+        : dynamicK(aK), pointsNumber(aPointsNumber)
+    {
+        if (shardsNumber == 0) {
+            throw std::domain_error("tree must have at least one shard");
+        }
+        /// the storage only partitions the indices of the points, the coordinates
+        /// are not copied
+        std::unique_ptr<KDPointStorage<T, K>> storage(makeKDPointStorage<T, K>(
+                    split, coordinates, pointsNumber, dynamicK, KDPointsLayout::Indexed));
+        std::vector<std::pair<size_t, size_t>> shardRanges;
+        splitShards(*storage, 0, pointsNumber, 0, shardsNumber, shardRanges);
+
+        shards.resize(shardRanges.size());
+        auto buildShard = [&](size_t shardI) {
+            auto & shard = shards[shardI];
+            size_t leftPointsI = shardRanges[shardI].first;
+            size_t rightPointsI = shardRanges[shardI].second;
+            std::vector<T> shardCoordinates;
+            shardCoordinates.reserve((rightPointsI - leftPointsI) * getK());
+            for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+                size_t originalI = storage->getOriginalI(i);
+                T const * point = coordinates + originalI * getK();
+                shardCoordinates.insert(shardCoordinates.end(), point, point + getK());
+                shard.ids.push_back(originalI);
+            }
+            shard.tree.reset(new KDTree<T, K>(
+                                 makeKDPointStorage<T, K>(split, std::move(shardCoordinates),
+                                                          getK(), layout),
+                                 aMaxPointsNumberInLeafNode));
+            storage->findBoundingBox(leftPointsI, rightPointsI,
+                                     shard.lowerBound, shard.upperBound);
+        };
+        if (pool) {
+            pool->parallelFor(shards.size(), 1, [&](size_t beginI, size_t endI) {
+                for (size_t shardI = beginI; shardI < endI; ++shardI) {
+                    buildShard(shardI);
+                }
+            });
+        } else {
+            for (size_t shardI = 0; shardI < shards.size(); ++shardI) {
+                buildShard(shardI);
+            }
+        }
+    }
+
+    KDShardedTree(std::vector<KDPoint<T, K>> const & points,
+                  size_t aK,
+                  size_t shardsNumber,
+                  size_t aMaxPointsNumberInLeafNode = 1,
+                  KDSplitStrategy split = KDSplitStrategy::Median,
+                  KDPointsLayout layout = KDPointsLayout::AoS,
+                  KDThreadPool * pool = nullptr)
+        : KDShardedTree(getCoordinates(points, aK).data(), points.size(), aK, shardsNumber,
+                        aMaxPointsNumberInLeafNode, split, layout, pool)
+    {}
+
+    size_t getK() const
+    {
+        return K != KDDynamicK ? K : dynamicK;
+    }
+
+    size_t size() const { return pointsNumber; }
+
+    size_t getShardsNumber() const { return shards.size(); }
+
+    /// the tree of the shard, its original indices are the indices in the shard,
+    /// see getOriginalI
+    KDTree<T, K> const & getShard(size_t shardI) const
+    {
+        return *shards.at(shardI).tree;
+    }
+
+    /// the original index of the point by its index in the shard
+    size_t getOriginalI(size_t shardI, size_t shardOriginalI) const
+    {
+        return shards.at(shardI).ids.at(shardOriginalI);
+    }
+
+    /// the shard which part of the space has the point
+    size_t getHomeShardI(KDPointView<T> p) const
+    {
+        checkQueryPoint(p);
+        size_t nodeI = 0;
+        while (!nodes[nodeI].isLeaf()) {
+            nodeI += nodes[nodeI].getCloserSubNodeOffset(p);
+        }
+        return nodes[nodeI].getLeftI();
+    }
+
+    /// the square distance from the point to the bounding box of the shard points,
+    /// the shard has no points closer than it
+    T getSquareDistanceToShard(KDPointView<T> p, size_t shardI) const
+    {
+        checkQueryPoint(p);
+        auto const & shard = shards.at(shardI);
+        T squareDistance{0};
+        for (size_t coordinateI = 0; coordinateI < getK(); ++coordinateI) {
+            T diff = std::max(shard.lowerBound[coordinateI] - p[coordinateI],
+                              std::max(p[coordinateI] - shard.upperBound[coordinateI], T{0}));
+            squareDistance += diff * diff;
+        }
+        return squareDistance;
+    }
+
+    KDQueryResult<T> findClosestPoint(KDPointView<T> p) const
+    {
+        checkQueryPoint(p);
+        KDQueryResult<T> result;
+        result.originalI = std::numeric_limits<size_t>::max();
+        result.squareDistance = std::numeric_limits<T>::max();
+        searchShards(p, 0, [&]() { return result.squareDistance; }, [&](size_t shardI) {
+            auto const & shard = shards[shardI];
+            KDQueryResult<T> shardResult = result;
+            shardResult.originalI = std::numeric_limits<size_t>::max();
+            shard.tree->findClosestPointIf(p, KDAllPoints(), shardResult);
+            if (shardResult.originalI != std::numeric_limits<size_t>::max()) {
+                result.originalI = shard.ids[shardResult.originalI];
+                result.squareDistance = shardResult.squareDistance;
+            }
+        });
+        return result;
+    }
+
+    /// Find k nearest points to p, see KDTree::findKNearest.
+    void findKNearest(KDPointView<T> p,
+                      size_t k,
+                      std::vector<KDNeighbour<T>> & nearestPoints) const
+    {
+        checkQueryPoint(p);
+        nearestPoints.clear();
+        if (k == 0) {
+            return;
+        }
+        nearestPoints.reserve(std::min(k, size()));
+        auto getSquareDistance = [&]() {
+            return nearestPoints.size() < k ?
+                        std::numeric_limits<T>::max() : nearestPoints.front().second;
+        };
+        std::vector<KDNeighbour<T>> shardNearestPoints;
+        searchShards(p, 0, getSquareDistance, [&](size_t shardI) {
+            auto const & shard = shards[shardI];
+            shard.tree->findKNearest(p, k, shardNearestPoints);
+            /// nearestPoints is a max-heap of the points of all the searched shards
+            for (auto const & neighbour : shardNearestPoints) {
+                if (nearestPoints.size() < k) {
+                    nearestPoints.push_back(KDNeighbour<T>(shard.ids[neighbour.first],
+                                                           neighbour.second));
+                    std::push_heap(nearestPoints.begin(), nearestPoints.end(),
+                                   KDPointStorage<T, K>::compareNeighbours);
+                } else if (neighbour.second < nearestPoints.front().second) {
+                    std::pop_heap(nearestPoints.begin(), nearestPoints.end(),
+                                  KDPointStorage<T, K>::compareNeighbours);
+                    nearestPoints.back() = KDNeighbour<T>(shard.ids[neighbour.first],
+                                                          neighbour.second);
+                    std::push_heap(nearestPoints.begin(), nearestPoints.end(),
+                                   KDPointStorage<T, K>::compareNeighbours);
+                } else {
+                    break;
+                }
+            }
+        });
+        std::sort_heap(nearestPoints.begin(), nearestPoints.end(),
+                       KDPointStorage<T, K>::compareNeighbours);
+    }
+
+private:
+    struct Shard {
+        std::unique_ptr<KDTree<T, K>> tree;
+        /// original point indices by their indices in the shard
+        std::vector<size_t> ids;
+        /// bounding box of the shard points
+        std::vector<T> lowerBound;
+        std::vector<T> upperBound;
+    };
+
+    static std::vector<T> getCoordinates(std::vector<KDPoint<T, K>> const & points, size_t k)
+    {
+        std::vector<T> coordinates;
+        coordinates.reserve(points.size() * k);
+        for (auto const & point : points) {
+            if (point.size() != k) {
+                throw std::length_error("size of points are not the same");
+            }
+            coordinates.insert(coordinates.end(), point.data(), point.data() + k);
+        }
+        return coordinates;
+    }
+
+    void checkQueryPoint(KDPointView<T> p) const
+    {
+        if (p.size() != getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+    }
+
+    /// Split the points [leftPointsI, rightPointsI) of the storage into the shards as
+    /// the tree splits them into subtrees, the planes are added to the nodes in depth-first
+    /// order and the shards are leaves with the shard index.
+    void splitShards(KDPointStorage<T, K> & storage,
+                     size_t leftPointsI,
+                     size_t rightPointsI,
+                     size_t levelI,
+                     size_t shardsNumber,
+                     std::vector<std::pair<size_t, size_t>> & shardRanges)
+    {
+        size_t nodeI = nodes.size();
+        if (shardsNumber > 1 && rightPointsI - leftPointsI > 1) {
+            size_t coordinateI = storage.findSplittingPlaneCoordinateI(
+                        leftPointsI, rightPointsI, levelI);
+            T pivot = storage.findPivot(leftPointsI, rightPointsI, coordinateI);
+            size_t middlePointsI = storage.partition(leftPointsI, rightPointsI,
+                                                     coordinateI, pivot);
+            if (middlePointsI > leftPointsI && middlePointsI < rightPointsI) {
+                nodes.push_back(KDTreeNode<T>::makeIntermediate(coordinateI, pivot));
+                splitShards(storage, leftPointsI, middlePointsI, levelI + 1,
+                            shardsNumber / 2, shardRanges);
+                nodes[nodeI].setRightSubNodeOffset(nodes.size() - nodeI);
+                splitShards(storage, middlePointsI, rightPointsI, levelI + 1,
+                            shardsNumber / 2, shardRanges);
+                return;
+            }
+        }
+        nodes.push_back(KDTreeNode<T>::makeLeaf(shardRanges.size(), shardRanges.size() + 1));
+        shardRanges.push_back(std::make_pair(leftPointsI, rightPointsI));
+    }
+
+    /// Call search(shardI) for the shards which bounding boxes are closer to p than
+    /// getSquareDistance(), the shard of p first. The farther subnode of a plane is
+    /// searched only if the plane is closer, as in the tree search.
+    template <typename GetSquareDistance, typename Search>
+    void searchShards(KDPointView<T> p,
+                      size_t nodeI,
+                      GetSquareDistance const & getSquareDistance,
+                      Search const & search) const
+    {
+        auto const & node = nodes[nodeI];
+        if (node.isLeaf()) {
+            size_t shardI = node.getLeftI();
+            if (getSquareDistanceToShard(p, shardI) < getSquareDistance()) {
+                search(shardI);
+            }
+            return;
+        }
+        size_t closerNodeI = nodeI + node.getCloserSubNodeOffset(p);
+        size_t fartherNodeI = closerNodeI == nodeI + 1 ?
+                    nodeI + node.getRightSubNodeOffset() : nodeI + 1;
+        searchShards(p, closerNodeI, getSquareDistance, search);
+        if (node.isPlaneCloser(p, getSquareDistance())) {
+            searchShards(p, fartherNodeI, getSquareDistance, search);
+        }
+    }
+
+    size_t dynamicK;
+    size_t pointsNumber;
+    /// the planes of the top levels and the shards as leaves, in depth-first order
+    std::vector<KDTreeNode<T>> nodes;
+    std::vector<Shard> shards;
+};
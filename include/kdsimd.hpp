@@ -0,0 +1,430 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KDTREE_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/// SIMD instruction sets used by the leaf scan kernels, in the order of preference.
+enum class KDSimdLevel {
+    Scalar,
+    SSE,
+    AVX2,
+    AVX512
+};
+
+/// The best SIMD level supported by the CPU the code runs on. It is detected once.
+inline KDSimdLevel kdSupportedSimdLevel()
+{
+#ifdef KDTREE_SIMD_X86
+    static const KDSimdLevel level = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return KDSimdLevel::AVX512;
+        if (__builtin_cpu_supports("avx2"))
+            return KDSimdLevel::AVX2;
+        if (__builtin_cpu_supports("sse2"))
+            return KDSimdLevel::SSE;
+        return KDSimdLevel::Scalar;
+    }();
+    return level;
+#else
+    return KDSimdLevel::Scalar;
+#endif
+}
+
+/// Scalar leaf scan kernel, it is used for all the types and as a fallback for SIMD kernels.
+/// Points are stored dimension by dimension (SoA): coordinate c of point i
+/// is coordinates[c * stride + i].
+/// findClosestPointSoA looks for the closest point to p among the first pointsNumber points
+/// which square distance is less than minSquareDistance. If such point exists, minSquareDistance
+/// is updated and the index of the point is returned, otherwise pointsNumber is returned.
+/// If several points have the same distance, the first one is returned.
+template <typename T>
+class KDScalarKernels {
+public:
+    static size_t findClosestPointSoA(
+            T const * coordinates,
+            size_t stride,
+            size_t K,
+            T const * p,
+            size_t pointsNumber,
+            T & minSquareDistance,
+            KDSimdLevel = KDSimdLevel::Scalar)
+    {
+        return findClosestPointSoA(
+                    coordinates, stride, K, p, 0, pointsNumber, pointsNumber, minSquareDistance);
+    }
+
+protected:
+    /// scan points from firstI to pointsNumber, returns notFoundI if nothing is found
+    static size_t findClosestPointSoA(
+            T const * coordinates,
+            size_t stride,
+            size_t K,
+            T const * p,
+            size_t firstI,
+            size_t pointsNumber,
+            size_t notFoundI,
+            T & minSquareDistance)
+    {
+        size_t closestI = notFoundI;
+        for (size_t i = firstI; i < pointsNumber; ++i) {
+            T squareDistance{0};
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                auto diff = coordinates[coordinateI * stride + i] - p[coordinateI];
+                squareDistance += diff * diff;
+            }
+            if (squareDistance < minSquareDistance) {
+                minSquareDistance = squareDistance;
+                closestI = i;
+            }
+        }
+        return closestI;
+    }
+
+    /// reduce per lane best distances and indices. Lanes that found nothing have a negative
+    /// index. Returns the index of the best point or notFoundI.
+    template <typename Index>
+    static size_t reduceLanes(T const * distances,
+                              Index const * indices,
+                              size_t lanesNumber,
+                              size_t notFoundI,
+                              T & minSquareDistance)
+    {
+        size_t closestI = notFoundI;
+        for (size_t lane = 0; lane < lanesNumber; ++lane) {
+            if (indices[lane] < 0)
+                continue;
+            size_t i = static_cast<size_t>(indices[lane]);
+            if (distances[lane] < minSquareDistance ||
+                    (distances[lane] == minSquareDistance && i < closestI)) {
+                minSquareDistance = distances[lane];
+                closestI = i;
+            }
+        }
+        return closestI;
+    }
+};
+
+/// Leaf scan kernels with the same interface as KDScalarKernels. For float and double they are
+/// vectorized with SSE, AVX2 or AVX-512, the level is selected at runtime.
+/// Vectorized kernels compute distances for a block of points at once and keep the best
+/// distance and index per lane in registers, lanes are reduced only at the end of the scan,
+/// the rest of points is scanned by the scalar code.
+/// Every distance is summed in the same order as in the scalar code and FMA contraction is
+/// switched off, so all the kernels return the same points.
+/// Lane indices are 32-bit for float, so longer ranges are scanned by the scalar code.
+template <typename T>
+class KDSimdKernels : public KDScalarKernels<T> {
+};
+
+#ifdef KDTREE_SIMD_X86
+
+template <>
+class KDSimdKernels<float> : public KDScalarKernels<float> {
+public:
+    static size_t findClosestPointSoA(
+            float const * coordinates,
+            size_t stride,
+            size_t K,
+            float const * p,
+            size_t pointsNumber,
+            float & minSquareDistance,
+            KDSimdLevel level = kdSupportedSimdLevel())
+    {
+        if (pointsNumber > static_cast<size_t>(std::numeric_limits<std::int32_t>::max())) {
+            level = KDSimdLevel::Scalar;
+        }
+        switch (level) {
+        case KDSimdLevel::AVX512:
+            return findClosestPointSoAAVX512(
+                        coordinates, stride, K, p, pointsNumber, minSquareDistance);
+        case KDSimdLevel::AVX2:
+            return findClosestPointSoAAVX2(
+                        coordinates, stride, K, p, pointsNumber, minSquareDistance);
+        case KDSimdLevel::SSE:
+            return findClosestPointSoASSE(
+                        coordinates, stride, K, p, pointsNumber, minSquareDistance);
+        default:
+            return KDScalarKernels<float>::findClosestPointSoA(
+                        coordinates, stride, K, p, pointsNumber, minSquareDistance);
+        }
+    }
+
+private:
+    __attribute__((target("sse2"), optimize("fp-contract=off")))
+    static size_t findClosestPointSoASSE(
+            float const * coordinates,
+            size_t stride,
+            size_t K,
+            float const * p,
+            size_t pointsNumber,
+            float & minSquareDistance)
+    {
+        const size_t lanesNumber = 4;
+        size_t blocksEndI = pointsNumber - pointsNumber % lanesNumber;
+        __m128 bestDistances = _mm_set1_ps(minSquareDistance);
+        __m128i bestIndices = _mm_set1_epi32(-1);
+        __m128i indices = _mm_setr_epi32(0, 1, 2, 3);
+        const __m128i step = _mm_set1_epi32(lanesNumber);
+        for (size_t i = 0; i < blocksEndI; i += lanesNumber) {
+            __m128 distances = _mm_setzero_ps();
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                __m128 diff = _mm_sub_ps(_mm_loadu_ps(coordinates + coordinateI * stride + i),
+                                         _mm_set1_ps(p[coordinateI]));
+                distances = _mm_add_ps(distances, _mm_mul_ps(diff, diff));
+            }
+            __m128 less = _mm_cmplt_ps(distances, bestDistances);
+            __m128i lessI = _mm_castps_si128(less);
+            bestDistances = _mm_or_ps(_mm_and_ps(less, distances),
+                                      _mm_andnot_ps(less, bestDistances));
+            bestIndices = _mm_or_si128(_mm_and_si128(lessI, indices),
+                                       _mm_andnot_si128(lessI, bestIndices));
+            indices = _mm_add_epi32(indices, step);
+        }
+        float laneDistances[lanesNumber];
+        std::int32_t laneIndices[lanesNumber];
+        _mm_storeu_ps(laneDistances, bestDistances);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(laneIndices), bestIndices);
+        size_t closestI = reduceLanes(
+                    laneDistances, laneIndices, lanesNumber, pointsNumber, minSquareDistance);
+        return KDScalarKernels<float>::findClosestPointSoA(
+                    coordinates, stride, K, p, blocksEndI, pointsNumber, closestI,
+                    minSquareDistance);
+    }
+
+    __attribute__((target("avx2"), optimize("fp-contract=off")))
+    static size_t findClosestPointSoAAVX2(
+            float const * coordinates,
+            size_t stride,
+            size_t K,
+            float const * p,
+            size_t pointsNumber,
+            float & minSquareDistance)
+    {
+        const size_t lanesNumber = 8;
+        size_t blocksEndI = pointsNumber - pointsNumber % lanesNumber;
+        __m256 bestDistances = _mm256_set1_ps(minSquareDistance);
+        __m256i bestIndices = _mm256_set1_epi32(-1);
+        __m256i indices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i step = _mm256_set1_epi32(lanesNumber);
+        for (size_t i = 0; i < blocksEndI; i += lanesNumber) {
+            __m256 distances = _mm256_setzero_ps();
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                __m256 diff = _mm256_sub_ps(
+                            _mm256_loadu_ps(coordinates + coordinateI * stride + i),
+                            _mm256_set1_ps(p[coordinateI]));
+                distances = _mm256_add_ps(distances, _mm256_mul_ps(diff, diff));
+            }
+            __m256 less = _mm256_cmp_ps(distances, bestDistances, _CMP_LT_OQ);
+            bestDistances = _mm256_blendv_ps(bestDistances, distances, less);
+            bestIndices = _mm256_blendv_epi8(bestIndices, indices, _mm256_castps_si256(less));
+            indices = _mm256_add_epi32(indices, step);
+        }
+        float laneDistances[lanesNumber];
+        std::int32_t laneIndices[lanesNumber];
+        _mm256_storeu_ps(laneDistances, bestDistances);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(laneIndices), bestIndices);
+        size_t closestI = reduceLanes(
+                    laneDistances, laneIndices, lanesNumber, pointsNumber, minSquareDistance);
+        return KDScalarKernels<float>::findClosestPointSoA(
+                    coordinates, stride, K, p, blocksEndI, pointsNumber, closestI,
+                    minSquareDistance);
+    }
+
+    __attribute__((target("avx512f"), optimize("fp-contract=off")))
+    static size_t findClosestPointSoAAVX512(
+            float const * coordinates,
+            size_t stride,
+            size_t K,
+            float const * p,
+            size_t pointsNumber,
+            float & minSquareDistance)
+    {
+        const size_t lanesNumber = 16;
+        size_t blocksEndI = pointsNumber - pointsNumber % lanesNumber;
+        __m512 bestDistances = _mm512_set1_ps(minSquareDistance);
+        __m512i bestIndices = _mm512_set1_epi32(-1);
+        __m512i indices = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                            8, 9, 10, 11, 12, 13, 14, 15);
+        const __m512i step = _mm512_set1_epi32(lanesNumber);
+        for (size_t i = 0; i < blocksEndI; i += lanesNumber) {
+            __m512 distances = _mm512_setzero_ps();
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                __m512 diff = _mm512_sub_ps(
+                            _mm512_loadu_ps(coordinates + coordinateI * stride + i),
+                            _mm512_set1_ps(p[coordinateI]));
+                distances = _mm512_add_ps(distances, _mm512_mul_ps(diff, diff));
+            }
+            __mmask16 less = _mm512_cmp_ps_mask(distances, bestDistances, _CMP_LT_OQ);
+            bestDistances = _mm512_mask_mov_ps(bestDistances, less, distances);
+            bestIndices = _mm512_mask_mov_epi32(bestIndices, less, indices);
+            indices = _mm512_add_epi32(indices, step);
+        }
+        float laneDistances[lanesNumber];
+        std::int32_t laneIndices[lanesNumber];
+        _mm512_storeu_ps(laneDistances, bestDistances);
+        _mm512_storeu_si512(laneIndices, bestIndices);
+        size_t closestI = reduceLanes(
+                    laneDistances, laneIndices, lanesNumber, pointsNumber, minSquareDistance);
+        return KDScalarKernels<float>::findClosestPointSoA(
+                    coordinates, stride, K, p, blocksEndI, pointsNumber, closestI,
+                    minSquareDistance);
+    }
+};
+
+template <>
+class KDSimdKernels<double> : public KDScalarKernels<double> {
+public:
+    static size_t findClosestPointSoA(
+            double const * coordinates,
+            size_t stride,
+            size_t K,
+            double const * p,
+            size_t pointsNumber,
+            double & minSquareDistance,
+            KDSimdLevel level = kdSupportedSimdLevel())
+    {
+        switch (level) {
+        case KDSimdLevel::AVX512:
+            return findClosestPointSoAAVX512(
+                        coordinates, stride, K, p, pointsNumber, minSquareDistance);
+        case KDSimdLevel::AVX2:
+            return findClosestPointSoAAVX2(
+                        coordinates, stride, K, p, pointsNumber, minSquareDistance);
+        case KDSimdLevel::SSE:
+            return findClosestPointSoASSE(
+                        coordinates, stride, K, p, pointsNumber, minSquareDistance);
+        default:
+            return KDScalarKernels<double>::findClosestPointSoA(
+                        coordinates, stride, K, p, pointsNumber, minSquareDistance);
+        }
+    }
+
+private:
+    __attribute__((target("sse2"), optimize("fp-contract=off")))
+    static size_t findClosestPointSoASSE(
+            double const * coordinates,
+            size_t stride,
+            size_t K,
+            double const * p,
+            size_t pointsNumber,
+            double & minSquareDistance)
+    {
+        const size_t lanesNumber = 2;
+        size_t blocksEndI = pointsNumber - pointsNumber % lanesNumber;
+        __m128d bestDistances = _mm_set1_pd(minSquareDistance);
+        __m128i bestIndices = _mm_set1_epi64x(-1);
+        __m128i indices = _mm_set_epi64x(1, 0);
+        const __m128i step = _mm_set1_epi64x(lanesNumber);
+        for (size_t i = 0; i < blocksEndI; i += lanesNumber) {
+            __m128d distances = _mm_setzero_pd();
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                __m128d diff = _mm_sub_pd(_mm_loadu_pd(coordinates + coordinateI * stride + i),
+                                          _mm_set1_pd(p[coordinateI]));
+                distances = _mm_add_pd(distances, _mm_mul_pd(diff, diff));
+            }
+            __m128d less = _mm_cmplt_pd(distances, bestDistances);
+            __m128i lessI = _mm_castpd_si128(less);
+            bestDistances = _mm_or_pd(_mm_and_pd(less, distances),
+                                      _mm_andnot_pd(less, bestDistances));
+            bestIndices = _mm_or_si128(_mm_and_si128(lessI, indices),
+                                       _mm_andnot_si128(lessI, bestIndices));
+            indices = _mm_add_epi64(indices, step);
+        }
+        double laneDistances[lanesNumber];
+        std::int64_t laneIndices[lanesNumber];
+        _mm_storeu_pd(laneDistances, bestDistances);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(laneIndices), bestIndices);
+        size_t closestI = reduceLanes(
+                    laneDistances, laneIndices, lanesNumber, pointsNumber, minSquareDistance);
+        return KDScalarKernels<double>::findClosestPointSoA(
+                    coordinates, stride, K, p, blocksEndI, pointsNumber, closestI,
+                    minSquareDistance);
+    }
+
+    __attribute__((target("avx2"), optimize("fp-contract=off")))
+    static size_t findClosestPointSoAAVX2(
+            double const * coordinates,
+            size_t stride,
+            size_t K,
+            double const * p,
+            size_t pointsNumber,
+            double & minSquareDistance)
+    {
+        const size_t lanesNumber = 4;
+        size_t blocksEndI = pointsNumber - pointsNumber % lanesNumber;
+        __m256d bestDistances = _mm256_set1_pd(minSquareDistance);
+        __m256i bestIndices = _mm256_set1_epi64x(-1);
+        __m256i indices = _mm256_setr_epi64x(0, 1, 2, 3);
+        const __m256i step = _mm256_set1_epi64x(lanesNumber);
+        for (size_t i = 0; i < blocksEndI; i += lanesNumber) {
+            __m256d distances = _mm256_setzero_pd();
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                __m256d diff = _mm256_sub_pd(
+                            _mm256_loadu_pd(coordinates + coordinateI * stride + i),
+                            _mm256_set1_pd(p[coordinateI]));
+                distances = _mm256_add_pd(distances, _mm256_mul_pd(diff, diff));
+            }
+            __m256d less = _mm256_cmp_pd(distances, bestDistances, _CMP_LT_OQ);
+            bestDistances = _mm256_blendv_pd(bestDistances, distances, less);
+            bestIndices = _mm256_blendv_epi8(bestIndices, indices, _mm256_castpd_si256(less));
+            indices = _mm256_add_epi64(indices, step);
+        }
+        double laneDistances[lanesNumber];
+        std::int64_t laneIndices[lanesNumber];
+        _mm256_storeu_pd(laneDistances, bestDistances);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(laneIndices), bestIndices);
+        size_t closestI = reduceLanes(
+                    laneDistances, laneIndices, lanesNumber, pointsNumber, minSquareDistance);
+        return KDScalarKernels<double>::findClosestPointSoA(
+                    coordinates, stride, K, p, blocksEndI, pointsNumber, closestI,
+                    minSquareDistance);
+    }
+
+    __attribute__((target("avx512f"), optimize("fp-contract=off")))
+    static size_t findClosestPointSoAAVX512(
+            double const * coordinates,
+            size_t stride,
+            size_t K,
+            double const * p,
+            size_t pointsNumber,
+            double & minSquareDistance)
+    {
+        const size_t lanesNumber = 8;
+        size_t blocksEndI = pointsNumber - pointsNumber % lanesNumber;
+        __m512d bestDistances = _mm512_set1_pd(minSquareDistance);
+        __m512i bestIndices = _mm512_set1_epi64(-1);
+        __m512i indices = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m512i step = _mm512_set1_epi64(lanesNumber);
+        for (size_t i = 0; i < blocksEndI; i += lanesNumber) {
+            __m512d distances = _mm512_setzero_pd();
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                __m512d diff = _mm512_sub_pd(
+                            _mm512_loadu_pd(coordinates + coordinateI * stride + i),
+                            _mm512_set1_pd(p[coordinateI]));
+                distances = _mm512_add_pd(distances, _mm512_mul_pd(diff, diff));
+            }
+            __mmask8 less = _mm512_cmp_pd_mask(distances, bestDistances, _CMP_LT_OQ);
+            bestDistances = _mm512_mask_mov_pd(bestDistances, less, distances);
+            bestIndices = _mm512_mask_mov_epi64(bestIndices, less, indices);
+            indices = _mm512_add_epi64(indices, step);
+        }
+        double laneDistances[lanesNumber];
+        std::int64_t laneIndices[lanesNumber];
+        _mm512_storeu_pd(laneDistances, bestDistances);
+        _mm512_storeu_si512(laneIndices, bestIndices);
+        size_t closestI = reduceLanes(
+                    laneDistances, laneIndices, lanesNumber, pointsNumber, minSquareDistance);
+        return KDScalarKernels<double>::findClosestPointSoA(
+                    coordinates, stride, K, p, blocksEndI, pointsNumber, closestI,
+                    minSquareDistance);
+    }
+};
+
+#endif
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <kdpointstorage.hpp>
+
+#include <limits>
+#include <utility>
+#include <vector>
+
+/// Point storages with other algorithms to split points, they override
+/// findSplittingPlaneCoordinateI and findPivot of KDPointStorage.
+/// The trees built with them are queried in the same way, only their shape is different.
+
+/// Splits points in the dimension where they have the largest spread (the difference between
+/// the maximal and the minimal coordinate), the pivot is the median as in KDPointStorage.
+/// It is better than cycling through dimensions for anisotropic data, where some dimensions
+/// have much smaller spread than the others.
+template <typename T, size_t K = KDDynamicK>
+class KDMaxSpreadPointStorage : public KDPointStorage<T, K> {
+public:
+    using KDPointStorage<T, K>::KDPointStorage;
+
+    size_t findSplittingPlaneCoordinateI(
+            size_t leftPointsI,
+            size_t rightPointsI,
+            size_t /*levelI*/
+            ) const override
+    {
+        /// the buffers are reused by all the nodes built by the thread
+        thread_local std::vector<T> lower;
+        thread_local std::vector<T> upper;
+        this->findBoundingBox(leftPointsI, rightPointsI, lower, upper);
+        size_t bestCoordinateI = 0;
+        for (size_t coordinateI = 1; coordinateI < this->getK(); ++coordinateI) {
+            if (upper[coordinateI] - lower[coordinateI] >
+                    upper[bestCoordinateI] - lower[bestCoordinateI]) {
+                bestCoordinateI = coordinateI;
+            }
+        }
+        return bestCoordinateI;
+    }
+};
+
+/// Splits points in the dimension of the largest spread at the middle of their extent
+/// instead of the median, so nodes are close to cubes even if points are clustered.
+/// The tree is not balanced then: dense clusters get deeper subtrees.
+/// If all the points are on one side of the middle (it can happen only because of rounding),
+/// the plane slides to the nearest point, so both sides are never empty.
+template <typename T, size_t K = KDDynamicK>
+class KDSlidingMidpointPointStorage : public KDMaxSpreadPointStorage<T, K> {
+public:
+    using KDMaxSpreadPointStorage<T, K>::KDMaxSpreadPointStorage;
+
+    T findPivot(
+            size_t leftPointsI,
+            size_t rightPointsI,
+            size_t coordinateI
+            ) override
+    {
+        T lower = std::numeric_limits<T>::max();
+        T upper = std::numeric_limits<T>::lowest();
+        for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+            T coordinate = this->getCoordinate(this->indices[i], coordinateI);
+            lower = std::min(lower, coordinate);
+            upper = std::max(upper, coordinate);
+        }
+        T middle = lower + (upper - lower) / 2;
+        if (lower < middle) {
+            return middle;
+        }
+
+        /// points less than the pivot go to the left, so the pivot is the nearest point
+        /// above the lowest one. If all the points are the same, a leaf is created.
+        T nearest = upper;
+        for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+            T coordinate = this->getCoordinate(this->indices[i], coordinateI);
+            if (lower < coordinate && coordinate < nearest) {
+                nearest = coordinate;
+            }
+        }
+        return nearest;
+    }
+};
+
+/// Chooses the splitting plane by the cost model, like the surface area heuristic (SAH).
+/// The cost of a split is the sum over both sides of the points number multiplied by
+/// the size of the side box, the box size is its half-perimeter (the sum of its extents),
+/// so it does not depend on the dimension. Such splits cut off empty space and put clusters
+/// into their own subtrees, so queries visit less nodes.
+/// Candidate planes are the borders of binsNumber equal bins in every dimension.
+template <typename T, size_t K = KDDynamicK>
+class KDCostModelPointStorage : public KDPointStorage<T, K> {
+public:
+    using KDPointStorage<T, K>::KDPointStorage;
+
+    size_t findSplittingPlaneCoordinateI(
+            size_t leftPointsI,
+            size_t rightPointsI,
+            size_t /*levelI*/
+            ) const override
+    {
+        return findBestSplit(leftPointsI, rightPointsI, allCoordinates).first;
+    }
+
+    T findPivot(
+            size_t leftPointsI,
+            size_t rightPointsI,
+            size_t coordinateI
+            ) override
+    {
+        return findBestSplit(leftPointsI, rightPointsI, coordinateI).second;
+    }
+
+private:
+    static constexpr size_t binsNumber = 32;
+    static constexpr size_t allCoordinates = std::numeric_limits<size_t>::max();
+
+    /// returns the coordinate index and the plane coordinate of the cheapest split among
+    /// all the coordinates or only the given one. The same split is found in both cases,
+    /// if the given coordinate is the best one.
+    std::pair<size_t, T> findBestSplit(
+            size_t leftPointsI,
+            size_t rightPointsI,
+            size_t onlyCoordinateI
+            ) const
+    {
+        /// the buffers are reused by all the nodes built by the thread
+        thread_local std::vector<T> lower;
+        thread_local std::vector<T> upper;
+        thread_local std::vector<size_t> binSizes;
+        this->findBoundingBox(leftPointsI, rightPointsI, lower, upper);
+        double halfPerimeter = 0;
+        for (size_t coordinateI = 0; coordinateI < this->getK(); ++coordinateI) {
+            halfPerimeter += static_cast<double>(upper[coordinateI] - lower[coordinateI]);
+        }
+
+        /// if no plane splits the points, the points are the same and a leaf is created
+        size_t firstCoordinateI = onlyCoordinateI == allCoordinates ? 0 : onlyCoordinateI;
+        std::pair<size_t, T> bestSplit(firstCoordinateI, upper[firstCoordinateI]);
+        double bestCost = std::numeric_limits<double>::max();
+        size_t pointsNumber = rightPointsI - leftPointsI;
+        binSizes.resize(binsNumber);
+        for (size_t coordinateI = 0; coordinateI < this->getK(); ++coordinateI) {
+            double extent = static_cast<double>(upper[coordinateI] - lower[coordinateI]);
+            if ((onlyCoordinateI != allCoordinates && coordinateI != onlyCoordinateI) ||
+                    extent <= 0) {
+                continue;
+            }
+
+            std::fill(binSizes.begin(), binSizes.end(), 0);
+            for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+                double offset = static_cast<double>(
+                            this->getCoordinate(this->indices[i], coordinateI) -
+                            lower[coordinateI]);
+                ++binSizes[std::min(binsNumber - 1,
+                                    static_cast<size_t>(offset / extent * binsNumber))];
+            }
+
+            /// the box extents in the other dimensions are the same for both sides
+            double otherExtents = halfPerimeter - extent;
+            size_t leftPointsNumber = 0;
+            for (size_t binI = 1; binI < binsNumber; ++binI) {
+                leftPointsNumber += binSizes[binI - 1];
+                T plane = lower[coordinateI] + static_cast<T>(extent * binI / binsNumber);
+                if (!(lower[coordinateI] < plane && plane <= upper[coordinateI])) {
+                    continue;
+                }
+                double leftExtent = static_cast<double>(plane - lower[coordinateI]);
+                double cost = leftPointsNumber * (otherExtents + leftExtent) +
+                        (pointsNumber - leftPointsNumber) * (otherExtents + extent - leftExtent);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestSplit = std::make_pair(coordinateI, plane);
+                }
+            }
+        }
+        return bestSplit;
+    }
+};
+
+/// Algorithms to split points while the tree is built
+enum class KDSplitStrategy {
+    /// KDPointStorage: cycle through dimensions, split at the median
+    Median,
+    /// KDMaxSpreadPointStorage
+    MaxSpread,
+    /// KDSlidingMidpointPointStorage
+    SlidingMidpoint,
+    /// KDCostModelPointStorage
+    CostModel
+};
+
+/// Create the storage which splits points by the strategy, the arguments are passed to
+/// the storage c-tor.
+template <typename T, size_t K = KDDynamicK, typename... Args>
+KDPointStorage<T, K> * makeKDPointStorage(KDSplitStrategy strategy, Args &&... args)
+{
+    switch (strategy) {
+    case KDSplitStrategy::MaxSpread:
+        return new KDMaxSpreadPointStorage<T, K>(std::forward<Args>(args)...);
+    case KDSplitStrategy::SlidingMidpoint:
+        return new KDSlidingMidpointPointStorage<T, K>(std::forward<Args>(args)...);
+    case KDSplitStrategy::CostModel:
+        return new KDCostModelPointStorage<T, K>(std::forward<Args>(args)...);
+    default:
+        return new KDPointStorage<T, K>(std::forward<Args>(args)...);
+    }
+}
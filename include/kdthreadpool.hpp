@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Work-stealing pool of worker threads.
+/// Every worker has its own queue of tasks: it takes tasks from the back of its queue
+/// and, if it is empty, steals them from the front of the other queues. Threads outside
+/// the pool push tasks to a shared queue.
+/// A thread that waits for tasks (in invoke or parallelFor) runs other tasks meanwhile,
+/// so tasks can start nested tasks and wait for them without deadlocks.
+class KDThreadPool
+{
+public:
+    /// threadsNumber is the number of threads to run tasks on including the calling one.
+    /// 0 means the number of hardware threads.
+    explicit KDThreadPool(size_t threadsNumber = 0)
+    {
+        if (threadsNumber == 0) {
+            threadsNumber = std::max(1u, std::thread::hardware_concurrency());
+        }
+        /// the first queue is the shared one
+        for (size_t i = 0; i < threadsNumber; ++i) {
+            queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+        }
+        for (size_t i = 1; i < threadsNumber; ++i) {
+            workers.push_back(std::thread([this, i]() { work(i); }));
+        }
+    }
+
+    ~KDThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            isStopped = true;
+        }
+        hasTasks.notify_all();
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    KDThreadPool(KDThreadPool const &) = delete;
+    KDThreadPool & operator = (KDThreadPool const &) = delete;
+
+    /// number of threads the tasks run on including the calling one.
+    size_t size() const
+    {
+        return workers.size() + 1;
+    }
+
+    /// Run both functions, possibly in parallel, and wait for them.
+    /// The second one is offered to other threads while the first one is run here.
+    /// If any of them throws, the exception is rethrown when both are finished.
+    template <typename First, typename Second>
+    void invoke(First first, Second second)
+    {
+        std::atomic<bool> isSecondDone(false);
+        std::exception_ptr secondException;
+        push([&]() {
+            try {
+                second();
+            } catch (...) {
+                secondException = std::current_exception();
+            }
+            isSecondDone = true;
+        });
+
+        std::exception_ptr firstException;
+        try {
+            first();
+        } catch (...) {
+            firstException = std::current_exception();
+        }
+
+        waitFor([&]() { return isSecondDone.load(); });
+        if (firstException) {
+            std::rethrow_exception(firstException);
+        }
+        if (secondException) {
+            std::rethrow_exception(secondException);
+        }
+    }
+
+    /// Call function(beginI, endI) for the chunks of [0, n) with chunkSize items in each
+    /// (the last one can be smaller) and wait for all of them. Chunks are run concurrently,
+    /// the function must be safe to be called from several threads.
+    /// If the function throws, the remaining chunks are skipped and the first exception
+    /// is rethrown when all the threads are finished.
+    template <typename Function>
+    void parallelFor(size_t n, size_t chunkSize, Function function)
+    {
+        if (n == 0) {
+            return;
+        }
+        chunkSize = std::max<size_t>(chunkSize, 1);
+        size_t chunksNumber = (n + chunkSize - 1) / chunkSize;
+
+        /// every thread takes the next chunk until there are no chunks
+        std::atomic<size_t> nextChunkI(0);
+        std::exception_ptr exception;
+        std::mutex exceptionMutex;
+        auto runChunks = [&]() {
+            try {
+                size_t chunkI;
+                while ((chunkI = nextChunkI++) < chunksNumber) {
+                    size_t beginI = chunkI * chunkSize;
+                    function(beginI, std::min(n, beginI + chunkSize));
+                }
+            } catch (...) {
+                nextChunkI = chunksNumber;
+                std::lock_guard<std::mutex> lock(exceptionMutex);
+                if (!exception) {
+                    exception = std::current_exception();
+                }
+            }
+        };
+
+        /// helpers work on the chunks together with the calling thread. They keep references
+        /// to the local variables, so all of them must finish before return.
+        size_t helpersNumber = std::min(workers.size(), chunksNumber - 1);
+        std::atomic<size_t> finishedHelpersNumber(0);
+        for (size_t i = 0; i < helpersNumber; ++i) {
+            push([&]() {
+                runChunks();
+                ++finishedHelpersNumber;
+            });
+        }
+
+        runChunks();
+
+        waitFor([&]() { return finishedHelpersNumber == helpersNumber; });
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+
+private:
+    typedef std::function<void()> Task;
+
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    /// the pool and the queue of the current thread if it is a worker
+    struct Worker {
+        KDThreadPool const * pool = nullptr;
+        size_t queueI = 0;
+    };
+
+    static Worker & currentWorker()
+    {
+        static thread_local Worker worker;
+        return worker;
+    }
+
+    /// the own queue of a worker or the shared queue for other threads
+    size_t getCurrentQueueI() const
+    {
+        auto const & worker = currentWorker();
+        return worker.pool == this ? worker.queueI : 0;
+    }
+
+    void push(Task task)
+    {
+        auto & queue = *queues[getCurrentQueueI()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            ++pendingTasksNumber;
+        }
+        hasTasks.notify_one();
+    }
+
+    /// take a task from the own queue or steal it from the others and run it.
+    /// returns false if there are no tasks.
+    bool runPendingTask()
+    {
+        size_t ownQueueI = getCurrentQueueI();
+        Task task;
+        for (size_t i = 0; i < queues.size() && !task; ++i) {
+            size_t queueI = (ownQueueI + i) % queues.size();
+            auto & queue = *queues[queueI];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (queueI == ownQueueI) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        if (!task) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            --pendingTasksNumber;
+        }
+        task();
+        return true;
+    }
+
+    /// run pending tasks until the condition is true
+    template <typename Condition>
+    void waitFor(Condition condition)
+    {
+        while (!condition()) {
+            if (!runPendingTask()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void work(size_t queueI)
+    {
+        currentWorker().pool = this;
+        currentWorker().queueI = queueI;
+        while (true) {
+            if (runPendingTask()) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            hasTasks.wait(lock, [this]() { return isStopped || pendingTasksNumber > 0; });
+            if (isStopped) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::vector<std::thread> workers;
+    /// number of tasks in all the queues, workers sleep if there are none
+    size_t pendingTasksNumber = 0;
+    bool isStopped = false;
+    std::mutex sleepMutex;
+    std::condition_variable hasTasks;
+};
@@ -1,17 +1,56 @@
 #pragma once
 
-#include <kdtreeleafnode.hpp>
-#include <kdtreeintermediatenode.hpp>
+#include <kdtreenode.hpp>
+#include <kdbuildarena.hpp>
 #include <kdpointstorage.hpp>
+#include <kdthreadpool.hpp>
+#include <kdquerystats.hpp>
+#include <kdsearchcontext.hpp>
+#include <kdmemory.hpp>
 
-#include <boost/serialization/scoped_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/serialization/vector.hpp>
 
 #include <cstddef>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
 
-/// K-dimetional tree
+/// Result of the closest point search: the index of the point in the original points array
+/// order and the square distance to it.
+/// isExact is false only if the approximate search has not proved it is the closest point.
 template <typename T>
+struct KDQueryResult {
+    size_t originalI;
+    T squareDistance;
+    bool isExact = true;
+};
+
+/// Limits of the approximate closest point search. With the default values the search
+/// is exact.
+struct KDApproximateSearch {
+    /// the found point is not farther than (1 + epsilon) * the distance to the closest one
+    double epsilon = 0;
+    /// the search stops after this number of leaves is scanned, 0 means no limit
+    size_t maxLeavesNumber = 0;
+};
+
+/// Order of the nodes searched by the closest point queries, see KDTree::setNodesLayout.
+enum class KDNodesLayout {
+    /// depth-first preorder, the left subnode follows its parent
+    DepthFirst,
+    /// van Emde Boas order of the subnode pairs, the subnodes of a node are next to each other
+    VanEmdeBoas
+};
+
+/// K-dimetional tree
+/// K is the points dimension if it is known at compile time, KDDynamicK otherwise.
+template <typename T, size_t K = KDDynamicK>
 class KDTree {
 public:
     /// empty c-tor for serialization.
@@ -20,80 +59,1385 @@ public:
     /// It accepth the ownership of the storage, and delete it after using
     /// The tree is constracted here
     /// It doesn't know about K, this information is in storage.
-    KDTree(KDPointStorage<T> * aStorage, size_t aMaxPointsNumberInLeafNode = 1)
+    /// If the thread pool is provided, the tree is built in parallel. The built tree is the same
+    /// except the order of points in leaves, so queries find the same points.
+    /// If the arena is provided, its memory is used for the build and is kept for the next
+    /// trees built with it, otherwise the memory is allocated only for this build.
+    KDTree(KDPointStorage<T, K> * aStorage,
+           size_t aMaxPointsNumberInLeafNode = 1,
+           KDThreadPool * pool = nullptr,
+           KDBuildArena<T> * arena = nullptr)
         : maxPointsNumberInLeafNode(aMaxPointsNumberInLeafNode)
     {
         storage.reset(aStorage);
-        root.reset(buildTree(0, storage->size(), 0));
+        KDBuildArena<T> ownArena;
+        KDBuildArena<T> & buildArena = arena ? *arena : ownArena;
+        buildArena.reserve(storage->size(), pool != nullptr);
+        storage->setThreadPool(pool);
+        storage->setBuildArena(&buildArena);
+        if (pool) {
+            size_t builtNodesNumber = buildTree(0, storage->size(), 0, 0,
+                                                buildArena.getNodes(), depth, pool);
+            copyBuiltNodes(buildArena.getNodes().data(), builtNodesNumber);
+        } else {
+            buildTree(0, storage->size(), 0, 0, nodes, depth, pool);
+        }
+        storage->setThreadPool(nullptr);
+        updateNodesData();
+        storage->findBoundingBox(0, storage->size(), lowerBound, upperBound);
+        storage->reorderInLeafOrder();
+        storage->setBuildArena(nullptr);
     }
 
     size_t getDepth() const { return depth; }
 
-    KDPoint<T> const & findClosestPoint(KDPoint<T> const & p, size_t & closestPointOriginalI) const {
-        if (!root || !storage || storage->size() == 0) {
+    /// Find the bounding boxes of the points of every node. Then queries skip the nodes
+    /// which boxes are farther than the found points, not only the ones behind a farther
+    /// splitting plane, so less nodes are visited for clustered data, where cells
+    /// of nodes have a lot of empty space. The boxes take 2 * K coordinates per node.
+    /// They are not saved with the tree, call it again after the tree is loaded or mapped.
+    void buildNodeBoxes()
+    {
+        if (nodesNumber == 0 || !storage || storage->size() == 0) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        nodeBoxes = findNodeBoxes();
+        if (nodesLayout != KDNodesLayout::DepthFirst) {
+            setNodesLayout(nodesLayout);
+        }
+    }
+
+    bool hasNodeBoxes() const { return !nodeBoxes.empty(); }
+
+    /// Keep a copy of the nodes (and of the node boxes) in the layout for the closest point
+    /// queries, the other queries and the tree files use the depth-first nodes.
+    /// In depth-first order a node and its left subnode are together, but the right one is
+    /// after the whole left subtree, so a descent of a big tree takes a new cache line and
+    /// a new page on almost every level. The van Emde Boas order keeps the subtrees of half
+    /// the height together recursively, so a descent touches about log(depth) blocks of any
+    /// size, cache lines or pages, and both subnodes of a node are in one line.
+    /// The copy takes as much memory as the nodes and their boxes, the nodes are padded to
+    /// a size which divides the line (see KDTreeNodeSlot). It is not saved with the tree,
+    /// call it again after the tree is loaded or mapped.
+    void setNodesLayout(KDNodesLayout layout)
+    {
+        if (nodesNumber == 0 || !storage || storage->size() == 0) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        nodesLayout = layout;
+        layoutNodes.clear();
+        layoutNodeBoxes.clear();
+        if (layout == KDNodesLayout::VanEmdeBoas) {
+            buildVanEmdeBoasNodes();
+        }
+    }
+
+    KDNodesLayout getNodesLayout() const { return nodesLayout; }
+
+    /// Back the nodes, the node boxes and the points data by transparent huge pages
+    /// (Linux only, see kdAdviseHugePages). The queries of a big tree jump between
+    /// the pages of the nodes and of the leaf points, so with 4 KiB pages almost every
+    /// jump below the top levels misses the TLB. It is worth for trees bigger than the TLB
+    /// reach, hundreds of megabytes, and it is done once, e.g. after the tree is built or
+    /// loaded. Mapped trees get huge pages only if the kernel supports them for files.
+    /// Returns the number of bytes in huge pages, 0 if they are not supported.
+    size_t adviseHugePages()
+    {
+        if (nodesNumber == 0 || !storage || storage->size() == 0) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        return kdAdviseHugePages(nodesData, nodesNumber * sizeof(KDTreeNode<T>)) +
+                kdAdviseHugePages(nodeBoxes.data(), nodeBoxes.size() * sizeof(T)) +
+                kdAdviseHugePages(layoutNodes.data(),
+                                  layoutNodes.size() * sizeof(KDTreeNodeSlot<T>)) +
+                kdAdviseHugePages(layoutNodeBoxes.data(), layoutNodeBoxes.size() * sizeof(T)) +
+                storage->adviseHugePages();
+    }
+
+    /// Quantize the coordinates of the points to save memory, see KDPointStorage::quantize.
+    /// Splitting planes and node boxes are kept exact, but distances to points are computed
+    /// by the quantized coordinates, so the found points can be not the closest ones.
+    /// Use findRerankedClosestPoint to find the exact ones.
+    void quantize(KDQuantization quantization)
+    {
+        if (nodesNumber == 0 || !storage || storage->size() == 0) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        storage->quantize(quantization);
+    }
+
+    KDQuantization getQuantization() const {
+        return storage ? storage->getQuantization() : KDQuantization::None;
+    }
+
+    /// sizes and depths of leaves, see KDTreeShape
+    KDTreeShape getShape() const
+    {
+        if (nodesNumber == 0) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        KDTreeShape shape;
+        shape.nodesNumber = nodesNumber;
+        shape.minLeafSize = std::numeric_limits<size_t>::max();
+        shape.minLeafDepth = std::numeric_limits<size_t>::max();
+        /// subnodes are after their parent, so their depths are set before they are reached
+        std::vector<size_t> nodeDepths(nodesNumber, 1);
+        size_t pointsNumber = 0;
+        size_t leafDepthsSum = 0;
+        for (size_t nodeI = 0; nodeI < nodesNumber; ++nodeI) {
+            auto const & node = nodesData[nodeI];
+            if (node.isLeaf()) {
+                size_t leafSize = node.getRightI() - node.getLeftI();
+                ++shape.leavesNumber;
+                ++shape.leafSizes[leafSize];
+                pointsNumber += leafSize;
+                shape.minLeafSize = std::min(shape.minLeafSize, leafSize);
+                shape.maxLeafSize = std::max(shape.maxLeafSize, leafSize);
+                shape.minLeafDepth = std::min(shape.minLeafDepth, nodeDepths[nodeI]);
+                shape.depth = std::max(shape.depth, nodeDepths[nodeI]);
+                leafDepthsSum += nodeDepths[nodeI];
+            } else {
+                nodeDepths[nodeI + 1] = nodeDepths[nodeI] + 1;
+                nodeDepths[nodeI + node.getRightSubNodeOffset()] = nodeDepths[nodeI] + 1;
+            }
+        }
+        shape.meanLeafSize = double(pointsNumber) / shape.leavesNumber;
+        shape.meanLeafDepth = double(leafDepthsSum) / shape.leavesNumber;
+        size_t balancedDepth = 1;
+        while ((size_t(1) << (balancedDepth - 1)) < shape.leavesNumber) {
+            ++balancedDepth;
+        }
+        shape.imbalance = double(shape.depth) / balancedDepth;
+        return shape;
+    }
+
+    /// number of points in the tree
+    size_t size() const { return storage ? storage->size() : 0; }
+
+    /// dimension of the points in the tree
+    size_t getK() const { return storage ? storage->getK() : 0; }
+
+    /// point by its index in the original points array order
+    KDPoint<T, K> getPoint(size_t originalI) const {
+        if (!storage) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        return storage->getPointByOriginalI(originalI);
+    }
+
+    KDPoint<T, K> findClosestPoint(KDPoint<T, K> const & p, size_t & closestPointOriginalI) const {
+        checkQueryPoint(p);
+        T minSquareDistance = std::numeric_limits<T>::max();
+        KDNoQueryStats stats;
+        std::vector<size_t> nodesToSearch;
+        closestPointOriginalI = findClosestPointI(p, minSquareDistance, stats, nodesToSearch);
+        return storage->getPointByOriginalI(closestPointOriginalI);
+    }
+
+    /// The same as above without allocations: the search uses the memory of the context,
+    /// and the point is not copied from the storage. The context is reused for next queries,
+    /// see KDSearchContext. p can be a KDPoint or a view of coordinates kept elsewhere.
+    KDQueryResult<T> findClosestPoint(KDPointView<T> p, KDSearchContext<T> & context) const {
+        checkQueryPoint(p);
+        context.reserve(depth);
+        KDQueryResult<T> result;
+        result.squareDistance = std::numeric_limits<T>::max();
+        KDNoQueryStats stats;
+        result.originalI = findClosestPointI(p, result.squareDistance, stats,
+                                             context.getNodesToSearch());
+        return result;
+    }
+
+    /// The same as above, the work done by the query is added to stats. They are
+    /// KDQueryStats or any type with its methods, e.g. the one of kdtree_bench, which counts
+    /// the cache lines and the pages of the visited nodes.
+    template <typename Stats>
+    KDPoint<T, K> findClosestPoint(KDPoint<T, K> const & p,
+                                   size_t & closestPointOriginalI,
+                                   Stats & stats) const {
+        checkQueryPoint(p);
+        T minSquareDistance = std::numeric_limits<T>::max();
+        std::vector<size_t> nodesToSearch;
+        closestPointOriginalI = findClosestPointI(p, minSquareDistance, stats, nodesToSearch);
+        return storage->getPointByOriginalI(closestPointOriginalI);
+    }
+
+    /// The same as above, the work done by the query and its time are added to histograms.
+    KDPoint<T, K> findClosestPoint(KDPoint<T, K> const & p,
+                                   size_t & closestPointOriginalI,
+                                   KDQueryHistograms & histograms) const {
+        checkQueryPoint(p);
+        std::vector<size_t> nodesToSearch;
+        measureQuery(histograms, [&](KDQueryStats & stats) {
+            T minSquareDistance = std::numeric_limits<T>::max();
+            closestPointOriginalI = findClosestPointI(p, minSquareDistance, stats, nodesToSearch);
+        });
+        return storage->getPointByOriginalI(closestPointOriginalI);
+    }
+
+    /// Search the closest point among the points for which isAllowed(originalI) is true
+    /// and which are closer than result.squareDistance, so the search can be continued
+    /// in other trees with the same result. If such point is found, result is updated,
+    /// otherwise it is not changed.
+    /// The tree is not searched at all if its bounding box is farther than result.
+    template <typename Filter>
+    void findClosestPointIf(KDPointView<T> p,
+                            Filter const & isAllowed,
+                            KDQueryResult<T> & result) const {
+        KDSearchContext<T> context;
+        findClosestPointIf(p, isAllowed, result, context);
+    }
+
+    /// The same as above with the memory of the context, see KDSearchContext. One context
+    /// can be passed to the searches of all the trees the result is continued in.
+    template <typename Filter>
+    void findClosestPointIf(KDPointView<T> p,
+                            Filter const & isAllowed,
+                            KDQueryResult<T> & result,
+                            KDSearchContext<T> & context) const {
+        checkQueryPoint(p);
+        T boxSquareDistance{0};
+        for (size_t coordinateI = 0; coordinateI < lowerBound.size(); ++coordinateI) {
+            T diff = std::max(lowerBound[coordinateI] - p[coordinateI],
+                              std::max(p[coordinateI] - upperBound[coordinateI], T{0}));
+            boxSquareDistance += diff * diff;
+        }
+        if (boxSquareDistance >= result.squareDistance) {
+            return;
+        }
+        KDNoQueryStats stats;
+        T minSquareDistance = result.squareDistance;
+        context.reserve(depth);
+        size_t closestPointOriginalI = findClosestPointI(p, minSquareDistance, stats,
+                                                         context.getNodesToSearch(), isAllowed);
+        if (closestPointOriginalI != std::numeric_limits<size_t>::max()) {
+            result.originalI = closestPointOriginalI;
+            result.squareDistance = minSquareDistance;
+            result.isExact = true;
+        }
+    }
+
+    /// Approximate closest point search. Nodes are searched best-bin-first: in the order of
+    /// the lower bound of the distance from p to them, so the closest point is usually found
+    /// among the first leaves. The search stops when no node can have a point closer than
+    /// the found one divided by (1 + epsilon) or when maxLeavesNumber leaves are scanned.
+    /// isExact of the result is true if the found point is guaranteed to be the closest one.
+    KDQueryResult<T> findApproximateClosestPoint(KDPointView<T> p,
+                                                 KDApproximateSearch const & search) const {
+        checkQueryPoint(p);
+        KDNoQueryStats stats;
+        KDSearchContext<T> context;
+        return findApproximateClosestPointI(p, search, stats, context.getBoundedNodes());
+    }
+
+    /// The same as above, the work done by the query is added to stats.
+    KDQueryResult<T> findApproximateClosestPoint(KDPointView<T> p,
+                                                 KDApproximateSearch const & search,
+                                                 KDQueryStats & stats) const {
+        checkQueryPoint(p);
+        KDSearchContext<T> context;
+        return findApproximateClosestPointI(p, search, stats, context.getBoundedNodes());
+    }
+
+    /// The same as above with the memory of the context, see KDSearchContext.
+    KDQueryResult<T> findApproximateClosestPoint(KDPointView<T> p,
+                                                 KDApproximateSearch const & search,
+                                                 KDSearchContext<T> & context) const {
+        checkQueryPoint(p);
+        context.reserve(depth);
+        KDNoQueryStats stats;
+        return findApproximateClosestPointI(p, search, stats, context.getBoundedNodes());
+    }
+
+    /// Find the closest points for pointsNumber points, results are written in the same order.
+    /// If the pool is provided, points are split between its threads. The tree is not changed
+    /// by queries, so it is shared by all the threads without locks.
+    /// If histograms are provided, the work done by every query and its time are added to them.
+    /// Every thread reuses one search context for all its points.
+    void findClosestPoints(KDPoint<T, K> const * points,
+                           size_t pointsNumber,
+                           KDQueryResult<T> * results,
+                           KDThreadPool * pool = nullptr,
+                           KDQueryHistograms * histograms = nullptr) const
+    {
+        searchClosestPoints([&](size_t i) { return KDPointView<T>(points[i]); },
+                            pointsNumber, results, pool, histograms);
+    }
+
+    /// The same as above for the points which coordinates are one after another in the buffer,
+    /// getK() coordinates per point, so they are not copied to KDPoint objects.
+    void findClosestPoints(T const * coordinates,
+                           size_t pointsNumber,
+                           KDQueryResult<T> * results,
+                           KDThreadPool * pool = nullptr,
+                           KDQueryHistograms * histograms = nullptr) const
+    {
+        size_t k = getK();
+        searchClosestPoints([&](size_t i) { return KDPointView<T>(coordinates + i * k, k); },
+                            pointsNumber, results, pool, histograms);
+    }
+
+    /// The same as above with the approximate search, see findApproximateClosestPoint.
+    void findApproximateClosestPoints(KDPoint<T, K> const * points,
+                                      size_t pointsNumber,
+                                      KDQueryResult<T> * results,
+                                      KDApproximateSearch const & search,
+                                      KDThreadPool * pool = nullptr,
+                                      KDQueryHistograms * histograms = nullptr) const
+    {
+        searchApproximateClosestPoints([&](size_t i) { return KDPointView<T>(points[i]); },
+                                       pointsNumber, results, search, pool, histograms);
+    }
+
+    void findApproximateClosestPoints(T const * coordinates,
+                                      size_t pointsNumber,
+                                      KDQueryResult<T> * results,
+                                      KDApproximateSearch const & search,
+                                      KDThreadPool * pool = nullptr,
+                                      KDQueryHistograms * histograms = nullptr) const
+    {
+        size_t k = getK();
+        searchApproximateClosestPoints(
+                    [&](size_t i) { return KDPointView<T>(coordinates + i * k, k); },
+                    pointsNumber, results, search, pool, histograms);
+    }
+
+    /// Find the closest point of the quantized tree by the exact coordinates: candidatesNumber
+    /// nearest points are found by the quantized ones, and the closest of them by the
+    /// coordinates of exactTree is returned. exactTree must have the same points, e.g. it is
+    /// the full precision tree file mapped, so only the pages of the candidates are read from
+    /// the disk. The result is exact if no other point can be closer by the quantization error.
+    KDQueryResult<T> findRerankedClosestPoint(KDPointView<T> p,
+                                              size_t candidatesNumber,
+                                              KDTree const & exactTree,
+                                              KDSearchContext<T> & context) const
+    {
+        checkQueryPoint(p);
+        checkExactTree(exactTree, candidatesNumber);
+        KDNoQueryStats stats;
+        return findRerankedClosestPointI(p, candidatesNumber, exactTree, stats,
+                                         context.getNeighbours());
+    }
+
+    /// The same as above for many points, see findClosestPoints.
+    void findRerankedClosestPoints(T const * coordinates,
+                                   size_t pointsNumber,
+                                   KDQueryResult<T> * results,
+                                   size_t candidatesNumber,
+                                   KDTree const & exactTree,
+                                   KDThreadPool * pool = nullptr,
+                                   KDQueryHistograms * histograms = nullptr) const
+    {
+        checkExactTree(exactTree, candidatesNumber);
+        size_t k = getK();
+        forEachQueryPoint([&](size_t i) { return KDPointView<T>(coordinates + i * k, k); },
+                          pointsNumber, pool, histograms,
+                          [&](size_t i, KDPointView<T> p, auto & stats,
+                              KDSearchContext<T> & context) {
+            results[i] = findRerankedClosestPointI(p, candidatesNumber, exactTree, stats,
+                                                   context.getNeighbours());
+        });
+    }
+
+    /// All nearest neighbours join: find the closest point of this tree for every point of
+    /// queryTree, results[i] is the result of its point with the original index i, so
+    /// the array must have queryTree.size() items.
+    /// Every query point scans the leaf it falls into first. Then both trees are traversed
+    /// together, and a pair of nodes is skipped if their boxes are farther than the closest
+    /// points found so far for all the points of the query node. So nearby query points share
+    /// the traversal, most of the pairs are skipped near the root instead of every query point
+    /// walking down the tree on its own.
+    /// The node boxes are found for the join if buildNodeBoxes is not called for the trees.
+    /// If the pool is provided, subtrees of the query tree are joined in parallel.
+    void joinClosestPoints(KDTree const & queryTree,
+                           KDQueryResult<T> * results,
+                           KDThreadPool * pool = nullptr) const
+    {
+        if (nodesNumber == 0 || !storage || storage->size() == 0 ||
+                queryTree.nodesNumber == 0 || !queryTree.storage ||
+                queryTree.storage->size() == 0) {
             throw std::domain_error("tree or points storage is invalid");
         }
-        /// find the first candidate for the closest point
-        closestPointOriginalI = findAClosePoint(p, root.get());
-        T minSquareDistance = storage->getPointByOriginalI(closestPointOriginalI).
-                squareDistanceToPoint(p);
+        if (queryTree.storage->getK() != storage->getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+        std::vector<T> ownNodeBoxes;
+        std::vector<T> ownQueryNodeBoxes;
+        if (nodeBoxes.empty()) {
+            ownNodeBoxes = findNodeBoxes();
+        }
+        if (queryTree.nodeBoxes.empty()) {
+            ownQueryNodeBoxes = queryTree.findNodeBoxes();
+        }
+        Join join{queryTree,
+                  nodeBoxes.empty() ? ownNodeBoxes.data() : nodeBoxes.data(),
+                  queryTree.nodeBoxes.empty() ? ownQueryNodeBoxes.data() :
+                                                queryTree.nodeBoxes.data(),
+                  std::vector<T>(queryTree.nodesNumber, std::numeric_limits<T>::max()),
+                  std::vector<T>(queryTree.nodesNumber, std::numeric_limits<T>::max()),
+                  results};
+        for (size_t i = 0; i < queryTree.size(); ++i) {
+            results[i].originalI = std::numeric_limits<size_t>::max();
+            results[i].squareDistance = std::numeric_limits<T>::max();
+            results[i].isExact = true;
+        }
+        seedJoin(join, pool);
+        std::vector<T> point(storage->getK());
+        joinNodes(join, 0, 0, point, pool);
+    }
+
+    /// Find k nearest points to p. nearestPoints is filled with pairs of the original point
+    /// index and the square distance to the point, sorted by the distance. If the tree has
+    /// less than k points, all of them are returned.
+    /// The vector is reused: if its capacity is at least min(k, size()), no allocations
+    /// are done.
+    void findKNearest(KDPointView<T> p,
+                      size_t k,
+                      std::vector<KDNeighbour<T>> & nearestPoints) const
+    {
+        checkQueryPoint(p);
+        nearestPoints.clear();
+        if (k == 0) {
+            return;
+        }
+        /// k can be any number, not more than all the points are found
+        nearestPoints.reserve(std::min(k, size()));
+        KDNoQueryStats stats;
+        findKNearest(p, k, nearestPoints, stats, 0);
+        /// nearestPoints is a max-heap here
+        std::sort_heap(nearestPoints.begin(), nearestPoints.end(),
+                       KDPointStorage<T, K>::compareNeighbours);
+    }
+
+    /// Call function(originalI, squareDistance) for every point which distance to p
+    /// is not bigger than radius. Points are passed to the function as soon as they are found,
+    /// so the result is never kept. Use a lambda to write them to an output iterator.
+    template <typename Function>
+    void findPointsInRadius(KDPointView<T> p, T radius, Function function) const
+    {
+        checkQueryPoint(p);
+        findPointsInRadius(p, radius * radius, function, 0);
+    }
+
+    /// Call function(originalI) for every point inside the box [lower, upper],
+    /// bounds are included. Subtrees which are entirely inside the box are reported without
+    /// checking their points. Points are passed to the function as soon as they are found.
+    template <typename Function>
+    void findPointsInBox(KDPoint<T, K> const & lower,
+                         KDPoint<T, K> const & upper,
+                         Function function) const
+    {
+        if (nodesNumber == 0 || !storage || storage->size() == 0) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        if (lower.size() != storage->getK() || upper.size() != storage->getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+        /// the bounds of the current node, the root one contains all the points
+        std::vector<T> nodeLower(lowerBound);
+        std::vector<T> nodeUpper(upperBound);
+        findPointsInBox(lower, upper, function, 0, nodeLower, nodeUpper);
+    }
+
+private:
+    void checkQueryPoint(KDPointView<T> p) const {
+        if (nodesNumber == 0 || !storage || storage->size() == 0) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        if (p.size() != storage->getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+    }
+
+    void checkExactTree(KDTree const & exactTree, size_t candidatesNumber) const {
+        if (!exactTree.storage || exactTree.size() != size()) {
+            throw std::domain_error("exact tree must have the same points");
+        }
+        if (exactTree.getK() != getK()) {
+            throw std::length_error("size of points are not the same");
+        }
+        if (candidatesNumber == 0) {
+            throw std::domain_error("at least one candidate must be reranked");
+        }
+    }
+
+    /// candidates are the memory for the nearest points found by the quantized coordinates,
+    /// the work done by their search is added to stats
+    template <typename Stats>
+    KDQueryResult<T> findRerankedClosestPointI(KDPointView<T> p,
+                                               size_t candidatesNumber,
+                                               KDTree const & exactTree,
+                                               Stats & stats,
+                                               std::vector<KDNeighbour<T>> & candidates) const
+    {
+        candidates.clear();
+        candidates.reserve(std::min(candidatesNumber, size()));
+        findKNearest(p, candidatesNumber, candidates, stats, 0);
+        KDQueryResult<T> result;
+        result.originalI = std::numeric_limits<size_t>::max();
+        result.squareDistance = std::numeric_limits<T>::max();
+        for (auto const & candidate : candidates) {
+            T squareDistance = exactTree.storage->getSquareDistanceByOriginalI(p, candidate.first);
+            if (squareDistance < result.squareDistance) {
+                result.squareDistance = squareDistance;
+                result.originalI = candidate.first;
+            }
+        }
+        /// candidates is a max-heap, so the farthest one is the first. Other points are either
+        /// in skipped nodes, which are farther than it, or are not closer than it by
+        /// the quantized coordinates, so by the exact ones they are not closer than that minus
+        /// the quantization error.
+        T error = storage->getQuantizationError();
+        result.isExact = candidates.size() < candidatesNumber ||
+                std::sqrt(candidates.front().second) - error >= std::sqrt(result.squareDistance);
+        return result;
+    }
+
+    /// run the query with the stats, its stats and time are added to histograms
+    template <typename Query>
+    static void measureQuery(KDQueryHistograms & histograms, Query query)
+    {
+        KDQueryStats stats;
+        auto start = std::chrono::steady_clock::now();
+        query(stats);
+        auto latency = std::chrono::steady_clock::now() - start;
+        histograms.addQuery(
+                    stats, std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+    }
+
+    /// getPoint(i) returns the view of the i-th query point
+    template <typename GetPoint>
+    void searchClosestPoints(GetPoint getPoint,
+                             size_t pointsNumber,
+                             KDQueryResult<T> * results,
+                             KDThreadPool * pool,
+                             KDQueryHistograms * histograms) const
+    {
+        forEachQueryPoint(getPoint, pointsNumber, pool, histograms,
+                          [&](size_t i, KDPointView<T> p, auto & stats,
+                              KDSearchContext<T> & context) {
+            results[i].squareDistance = std::numeric_limits<T>::max();
+            results[i].originalI = findClosestPointI(p, results[i].squareDistance, stats,
+                                                     context.getNodesToSearch());
+            results[i].isExact = true;
+        });
+    }
+
+    template <typename GetPoint>
+    void searchApproximateClosestPoints(GetPoint getPoint,
+                                        size_t pointsNumber,
+                                        KDQueryResult<T> * results,
+                                        KDApproximateSearch const & search,
+                                        KDThreadPool * pool,
+                                        KDQueryHistograms * histograms) const
+    {
+        forEachQueryPoint(getPoint, pointsNumber, pool, histograms,
+                          [&](size_t i, KDPointView<T> p, auto & stats,
+                              KDSearchContext<T> & context) {
+            results[i] = findApproximateClosestPointI(p, search, stats,
+                                                      context.getBoundedNodes());
+        });
+    }
+
+    /// call findPoint(i, getPoint(i), stats, context) for every query point, in parallel
+    /// if the pool is provided. Every thread has its own search context for all its points.
+    /// If histograms are provided, every thread adds queries to its own ones, and they are
+    /// merged in the end, otherwise the stats count nothing.
+    template <typename GetPoint, typename Function>
+    void forEachQueryPoint(GetPoint getPoint,
+                           size_t pointsNumber,
+                           KDThreadPool * pool,
+                           KDQueryHistograms * histograms,
+                           Function findPoint) const
+    {
+        if (nodesNumber == 0 || !storage || storage->size() == 0) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        std::mutex histogramsMutex;
+        auto findPoints = [&](size_t beginI, size_t endI) {
+            KDSearchContext<T> context;
+            context.reserve(depth);
+            if (!histograms) {
+                KDNoQueryStats stats;
+                for (size_t i = beginI; i < endI; ++i) {
+                    KDPointView<T> p = getPoint(i);
+                    checkQueryPoint(p);
+                    findPoint(i, p, stats, context);
+                }
+                return;
+            }
+            KDQueryHistograms chunkHistograms;
+            for (size_t i = beginI; i < endI; ++i) {
+                KDPointView<T> p = getPoint(i);
+                checkQueryPoint(p);
+                measureQuery(chunkHistograms, [&](KDQueryStats & stats) {
+                    findPoint(i, p, stats, context);
+                });
+            }
+            std::lock_guard<std::mutex> lock(histogramsMutex);
+            histograms->merge(chunkHistograms);
+        };
+        if (pool) {
+            /// chunks are small enough to balance threads and big enough to make
+            /// the scheduling cost negligible
+            pool->parallelFor(pointsNumber, 256, findPoints);
+        } else {
+            findPoints(0, pointsNumber);
+        }
+    }
+
+    /// returns index of the closest point in the original point list,
+    /// minSquareDistance is the square distance to it. Only the points closer than
+    /// minSquareDistance and allowed by the filter are searched, if there are no such points
+    /// the maximal index is returned.
+    /// nodesToSearch is the stack of the search, it is reserved for the tree depth, so
+    /// nodes are pushed without allocations if its capacity is already enough.
+    /// The nodes of the layout are searched, see setNodesLayout.
+    template <typename Stats, typename Filter = KDAllPoints>
+    size_t findClosestPointI(KDPointView<T> p,
+                             T & minSquareDistance,
+                             Stats & stats,
+                             std::vector<size_t> & nodesToSearch,
+                             Filter const & isAllowed = Filter()) const {
+        T const * boxes = hasNodeBoxes() ? nodeBoxes.data() : nullptr;
+        if (layoutNodes.empty()) {
+            return findClosestPointI(DepthFirstNodes{nodesData, boxes}, p, minSquareDistance,
+                                     stats, nodesToSearch, isAllowed);
+        }
+        return findClosestPointI(SubNodePairs{layoutNodes.data() + layoutFirstNodeI,
+                                              boxes ? layoutNodeBoxes.data() : nullptr},
+                                 p, minSquareDistance, stats, nodesToSearch, isAllowed);
+    }
 
-        /// nodes to search in order to find the closest point
-        std::vector<IKDTreeNode *> nodesToSearch;
-        nodesToSearch.push_back(root.get());
+    /// Nodes in depth-first order, the left subnode follows its parent. boxes are the node
+    /// boxes in the same order or nullptr.
+    struct DepthFirstNodes {
+        KDTreeNode<T> const * nodes;
+        T const * boxes;
+
+        KDTreeNode<T> const & getNode(size_t nodeI) const { return nodes[nodeI]; }
+        size_t getLeftSubNodeI(size_t nodeI) const { return nodeI + 1; }
+        size_t getRightSubNodeI(size_t nodeI) const {
+            return nodeI + nodes[nodeI].getRightSubNodeOffset();
+        }
+    };
+
+    /// Nodes in which the subnodes of a node are next to each other, the offset of
+    /// an intermediate node is the offset to its left subnode, see buildVanEmdeBoasNodes.
+    struct SubNodePairs {
+        KDTreeNodeSlot<T> const * slots;
+        T const * boxes;
+
+        KDTreeNode<T> const & getNode(size_t nodeI) const { return slots[nodeI].node; }
+        size_t getLeftSubNodeI(size_t nodeI) const {
+            return nodeI + slots[nodeI].node.getRightSubNodeOffset();
+        }
+        size_t getRightSubNodeI(size_t nodeI) const { return getLeftSubNodeI(nodeI) + 1; }
+    };
+
+    template <typename Nodes, typename Stats, typename Filter>
+    size_t findClosestPointI(Nodes const & nodes,
+                             KDPointView<T> p,
+                             T & minSquareDistance,
+                             Stats & stats,
+                             std::vector<size_t> & nodesToSearch,
+                             Filter const & isAllowed) const {
+        /// find the first candidate for the closest point, unless the search is already
+        /// limited by the given distance
+        size_t closestPointOriginalI = std::numeric_limits<size_t>::max();
+        if (minSquareDistance == std::numeric_limits<T>::max()) {
+            closestPointOriginalI = findAClosePoint(nodes, p, minSquareDistance, stats,
+                                                    isAllowed);
+        }
+
+        /// indices of nodes to search in order to find the closest point
+        nodesToSearch.clear();
+        nodesToSearch.reserve(depth + 1);
+        nodesToSearch.push_back(0);
 
         while(!nodesToSearch.empty()) {
-            auto node = nodesToSearch.back();
+            auto nodeI = nodesToSearch.back();
             nodesToSearch.pop_back();
-            if (KDTreeLeafNode * leaf = dynamic_cast<KDTreeLeafNode *>(node)) {
+            /// the found point can be closer than when the node was added
+            if (!isBoxCloser(p, nodes.boxes, nodeI, minSquareDistance)) {
+                continue;
+            }
+            auto const & node = nodes.getNode(nodeI);
+            stats.visitNode(&node);
+            if (node.isLeaf()) {
+                stats.scanLeaf(node.getRightI() - node.getLeftI());
                 storage->findClosestPoint(
                             p,
                             minSquareDistance,
                             closestPointOriginalI,
-                            leaf->getLeftI(),
-                            leaf->getRightI()
+                            node.getLeftI(),
+                            node.getRightI(),
+                            isAllowed
                             );
+                continue;
+            }
+            size_t leftNodeI = nodes.getLeftSubNodeI(nodeI);
+            size_t rightNodeI = nodes.getRightSubNodeI(nodeI);
+            if (nodes.boxes) {
+                /// the boxes of subnodes are checked again when they are taken,
+                /// the found point can be closer then. The closer one is searched first.
+                size_t closerNodeI = p[node.getPlaneCoordinateI()] < node.getPlaneCoordinate() ?
+                            leftNodeI : rightNodeI;
+                size_t fartherNodeI = closerNodeI == leftNodeI ? rightNodeI : leftNodeI;
+                if (isBoxCloser(p, nodes.boxes, fartherNodeI, minSquareDistance)) {
+                    stats.backtrack();
+                    nodesToSearch.push_back(fartherNodeI);
+                }
+                nodesToSearch.push_back(closerNodeI);
             } else {
-                KDTreeIntermediateNode<T> * intermediateNode =
-                        dynamic_cast<KDTreeIntermediateNode<T> *>(node);
+                size_t nodesToSearchNumber = nodesToSearch.size();
+                node.addNodesToSearch(nodesToSearch, leftNodeI, rightNodeI, p, minSquareDistance);
+                if (nodesToSearch.size() == nodesToSearchNumber + 2) {
+                    stats.backtrack();
+                }
+            }
+        }
+        return closestPointOriginalI;
+    }
 
-                intermediateNode->addNodesToSearch(nodesToSearch, p, minSquareDistance);
+    /// Copy the nodes and their boxes in van Emde Boas order of the subnode pairs.
+    /// The root is the first unit, and the subnodes of every intermediate node are one unit
+    /// of two nodes. The units of a subtree of height h are put as the top subtree of
+    /// height h / 2 followed by all the bottom subtrees of the rest of the height, every one
+    /// laid out the same way recursively. The parent unit is always before its subnodes,
+    /// so the offset to the left subnode is kept instead of the one to the right subnode.
+    void buildVanEmdeBoasNodes()
+    {
+        /// heights of the subtrees of the nodes, leaves have 0
+        std::vector<size_t> nodeHeights(nodesNumber, 0);
+        for (size_t nodeI = nodesNumber; nodeI-- > 0;) {
+            auto const & node = nodesData[nodeI];
+            if (!node.isLeaf()) {
+                nodeHeights[nodeI] = 1 + std::max(nodeHeights[nodeI + 1],
+                                                  nodeHeights[nodeI + node.getRightSubNodeOffset()]);
+            }
+        }
+        /// a unit is the index of the parent of the subnode pair or nodesNumber for the root
+        auto addUnitNodes = [&](size_t unitI, std::vector<size_t> & nodeIs) {
+            if (unitI == nodesNumber) {
+                nodeIs.push_back(0);
+            } else {
+                nodeIs.push_back(unitI + 1);
+                nodeIs.push_back(unitI + nodesData[unitI].getRightSubNodeOffset());
+            }
+        };
+        std::vector<size_t> positions(nodesNumber);
+        size_t position = 0;
+        std::vector<size_t> unitNodeIs;
+        std::function<void(size_t, size_t)> addUnits = [&](size_t unitI, size_t height) {
+            if (height == 1) {
+                unitNodeIs.clear();
+                addUnitNodes(unitI, unitNodeIs);
+                for (size_t nodeI : unitNodeIs) {
+                    positions[nodeI] = position++;
+                }
+                /// the root is followed by an unused node, so the pairs are at even positions
+                position += unitI == nodesNumber ? 1 : 0;
+                return;
+            }
+            size_t topHeight = height / 2;
+            addUnits(unitI, topHeight);
+            /// the units right below the top subtree are the roots of the bottom ones
+            std::vector<size_t> units(1, unitI);
+            for (size_t levelI = 0; levelI < topHeight && !units.empty(); ++levelI) {
+                std::vector<size_t> nodeIs;
+                for (size_t levelUnitI : units) {
+                    addUnitNodes(levelUnitI, nodeIs);
+                }
+                units.clear();
+                for (size_t nodeI : nodeIs) {
+                    if (!nodesData[nodeI].isLeaf()) {
+                        units.push_back(nodeI);
+                    }
+                }
+            }
+            for (size_t bottomUnitI : units) {
+                addUnits(bottomUnitI, height - topHeight);
+            }
+        };
+        addUnits(nodesNumber, 1 + nodeHeights[0]);
+
+        /// the first node is at the beginning of a cache line, so no pair is split by lines
+        static_assert(64 % sizeof(KDTreeNodeSlot<T>) == 0,
+                      "node slots should divide the cache line");
+        const size_t lineNodesNumber = 64 / sizeof(KDTreeNodeSlot<T>);
+        layoutNodes.assign(position + lineNodesNumber - 1,
+                           KDTreeNodeSlot<T>{KDTreeNode<T>::makeLeaf(0, 0)});
+        layoutFirstNodeI = (lineNodesNumber - reinterpret_cast<std::uintptr_t>(
+                                 layoutNodes.data()) / sizeof(KDTreeNodeSlot<T>) %
+                            lineNodesNumber) % lineNodesNumber;
+        size_t k = storage->getK();
+        layoutNodeBoxes.resize(nodeBoxes.empty() ? 0 : position * 2 * k);
+        for (size_t nodeI = 0; nodeI < nodesNumber; ++nodeI) {
+            auto & node = layoutNodes[layoutFirstNodeI + positions[nodeI]].node;
+            node = nodesData[nodeI];
+            if (!node.isLeaf()) {
+                node.setRightSubNodeOffset(positions[nodeI + 1] - positions[nodeI]);
+            }
+            if (!nodeBoxes.empty()) {
+                std::copy(&nodeBoxes[nodeI * 2 * k], &nodeBoxes[(nodeI + 1) * 2 * k],
+                          &layoutNodeBoxes[positions[nodeI] * 2 * k]);
             }
         }
-        return storage->getPointByOriginalI(closestPointOriginalI);
     }
 
-private:
-    /// It searches the closest point in the same node as the point to search is located.
-    /// It is not optimal though, so this algorithm is only used to find a candidate to
-    /// the closest point.
-    /// returns index of a closest point in the original point list
-    size_t findAClosePoint(KDPoint<T> const & p, IKDTreeNode * node) const {
-        if (KDTreeLeafNode * leaf = dynamic_cast<KDTreeLeafNode *>(node)) {
-            size_t closestPointI = std::numeric_limits<size_t>::max();
+    /// the boxes of all the nodes, see buildNodeBoxes
+    std::vector<T> findNodeBoxes() const
+    {
+        size_t k = storage->getK();
+        std::vector<T> boxes(nodesNumber * 2 * k);
+        std::vector<T> lower;
+        std::vector<T> upper;
+        /// subnodes are after their parent, so they are done before it
+        for (size_t nodeI = nodesNumber; nodeI-- > 0;) {
+            auto const & node = nodesData[nodeI];
+            T * nodeLower = &boxes[nodeI * 2 * k];
+            T * nodeUpper = nodeLower + k;
+            if (node.isLeaf()) {
+                storage->findBoundingBox(node.getLeftI(), node.getRightI(), lower, upper);
+                std::copy(lower.begin(), lower.end(), nodeLower);
+                std::copy(upper.begin(), upper.end(), nodeUpper);
+            } else {
+                T const * leftLower = &boxes[(nodeI + 1) * 2 * k];
+                T const * rightLower = &boxes[(nodeI + node.getRightSubNodeOffset()) * 2 * k];
+                for (size_t coordinateI = 0; coordinateI < k; ++coordinateI) {
+                    nodeLower[coordinateI] = std::min(leftLower[coordinateI],
+                                                      rightLower[coordinateI]);
+                    nodeUpper[coordinateI] = std::max(leftLower[k + coordinateI],
+                                                      rightLower[k + coordinateI]);
+                }
+            }
+        }
+        return boxes;
+    }
+
+    /// State of joinClosestPoints shared by all the node pairs
+    struct Join {
+        KDTree const & queryTree;
+        T const * nodeBoxes;
+        T const * queryNodeBoxes;
+        /// no point of the query node has the closest point farther than the bound,
+        /// nodes farther than it are skipped, see setQueryNodeBound
+        std::vector<T> queryNodeBounds;
+        /// the smallest square distance to the closest point found so far among the points
+        /// of the query node
+        std::vector<T> queryNodeMinimums;
+        KDQueryResult<T> * results;
+    };
+
+    /// The bound of the query node is the largest square distance to the closest points found
+    /// so far. But it is large until all the points are searched, so the points are also
+    /// bounded by the point with the smallest distance: the closest point to it is not
+    /// farther than that distance and the diagonal of the query node box from any point.
+    void setQueryNodeBound(Join & join, size_t queryNodeI, T maxSquareDistance,
+                           T minSquareDistance) const
+    {
+        join.queryNodeMinimums[queryNodeI] = minSquareDistance;
+        join.queryNodeBounds[queryNodeI] = maxSquareDistance;
+        if (minSquareDistance == std::numeric_limits<T>::max()) {
+            return;
+        }
+        size_t k = storage->getK();
+        T const * queryLower = &join.queryNodeBoxes[queryNodeI * 2 * k];
+        T const * queryUpper = queryLower + k;
+        T squareDiagonal{0};
+        for (size_t coordinateI = 0; coordinateI < k; ++coordinateI) {
+            T side = queryUpper[coordinateI] - queryLower[coordinateI];
+            squareDiagonal += side * side;
+        }
+        T distance = std::sqrt(minSquareDistance) + std::sqrt(squareDiagonal);
+        join.queryNodeBounds[queryNodeI] = std::min(maxSquareDistance, distance * distance);
+    }
+
+    /// Every query point scans the leaf it falls into first, as the closest point search does.
+    /// So the bounds of all the query nodes are close to the final ones from the beginning,
+    /// and the traversal skips the nodes which are not closer than the seeds.
+    void seedJoin(Join & join, KDThreadPool * pool) const
+    {
+        auto const & queryTree = join.queryTree;
+        auto const & queryStorage = *queryTree.storage;
+        size_t k = storage->getK();
+        auto seedLeaves = [&](size_t beginI, size_t endI) {
+            std::vector<T> point(k);
+            KDPointView<T> p(point.data(), k);
+            for (size_t queryNodeI = beginI; queryNodeI < endI; ++queryNodeI) {
+                auto const & queryNode = queryTree.nodesData[queryNodeI];
+                if (!queryNode.isLeaf()) {
+                    continue;
+                }
+                T maxSquareDistance{0};
+                T minSquareDistance = std::numeric_limits<T>::max();
+                for (size_t i = queryNode.getLeftI(); i < queryNode.getRightI(); ++i) {
+                    for (size_t coordinateI = 0; coordinateI < k; ++coordinateI) {
+                        point[coordinateI] = queryStorage.getCoordinateInLeafOrder(i, coordinateI);
+                    }
+                    size_t nodeI = 0;
+                    while (!nodesData[nodeI].isLeaf()) {
+                        nodeI += nodesData[nodeI].getCloserSubNodeOffset(p);
+                    }
+                    auto & result = join.results[queryStorage.getOriginalI(i)];
+                    storage->findClosestPoint(p, result.squareDistance, result.originalI,
+                                              nodesData[nodeI].getLeftI(),
+                                              nodesData[nodeI].getRightI());
+                    maxSquareDistance = std::max(maxSquareDistance, result.squareDistance);
+                    minSquareDistance = std::min(minSquareDistance, result.squareDistance);
+                }
+                setQueryNodeBound(join, queryNodeI, maxSquareDistance, minSquareDistance);
+            }
+        };
+        if (pool) {
+            pool->parallelFor(queryTree.nodesNumber, parallelJoinMinPointsNumber, seedLeaves);
+        } else {
+            seedLeaves(0, queryTree.nodesNumber);
+        }
+        /// subnodes are after their parent, so they are done before it
+        for (size_t queryNodeI = queryTree.nodesNumber; queryNodeI-- > 0;) {
+            auto const & queryNode = queryTree.nodesData[queryNodeI];
+            if (queryNode.isLeaf()) {
+                continue;
+            }
+            size_t leftQueryNodeI = queryNodeI + 1;
+            size_t rightQueryNodeI = queryNodeI + queryNode.getRightSubNodeOffset();
+            setQueryNodeBound(join, queryNodeI,
+                              std::max(join.queryNodeBounds[leftQueryNodeI],
+                                       join.queryNodeBounds[rightQueryNodeI]),
+                              std::min(join.queryNodeMinimums[leftQueryNodeI],
+                                       join.queryNodeMinimums[rightQueryNodeI]));
+        }
+    }
+
+    /// square distance between the box of the query node and the box of the node
+    T getSquareDistanceBetweenNodeBoxes(Join const & join, size_t queryNodeI, size_t nodeI) const
+    {
+        size_t k = storage->getK();
+        T const * queryLower = &join.queryNodeBoxes[queryNodeI * 2 * k];
+        T const * queryUpper = queryLower + k;
+        T const * nodeLower = &join.nodeBoxes[nodeI * 2 * k];
+        T const * nodeUpper = nodeLower + k;
+        T squareDistance{0};
+        for (size_t coordinateI = 0; coordinateI < k; ++coordinateI) {
+            T diff = std::max(nodeLower[coordinateI] - queryUpper[coordinateI],
+                              std::max(queryLower[coordinateI] - nodeUpper[coordinateI], T{0}));
+            squareDistance += diff * diff;
+        }
+        return squareDistance;
+    }
+
+    /// Join the points of the query node with the points of the node. point is the buffer
+    /// for the coordinates of a query point.
+    void joinNodes(Join & join,
+                   size_t queryNodeI,
+                   size_t nodeI,
+                   std::vector<T> & point,
+                   KDThreadPool * pool) const
+    {
+        if (getSquareDistanceBetweenNodeBoxes(join, queryNodeI, nodeI) >=
+                join.queryNodeBounds[queryNodeI] + std::numeric_limits<T>::epsilon()) {
+            return;
+        }
+        auto const & queryNode = join.queryTree.nodesData[queryNodeI];
+        auto const & node = nodesData[nodeI];
+        if (queryNode.isLeaf()) {
+            /// the box of a leaf can be much bigger than the distances to the closest points
+            /// if the query points are sparse, so every point searches the subtree on its own
+            /// from here, starting with the point found so far
+            auto const & queryStorage = *join.queryTree.storage;
+            KDPointView<T> p(point.data(), point.size());
+            T maxSquareDistance{0};
             T minSquareDistance = std::numeric_limits<T>::max();
+            for (size_t i = queryNode.getLeftI(); i < queryNode.getRightI(); ++i) {
+                for (size_t coordinateI = 0; coordinateI < point.size(); ++coordinateI) {
+                    point[coordinateI] = queryStorage.getCoordinateInLeafOrder(i, coordinateI);
+                }
+                auto & result = join.results[queryStorage.getOriginalI(i)];
+                joinPoint(join, p, nodeI, result);
+                maxSquareDistance = std::max(maxSquareDistance, result.squareDistance);
+                minSquareDistance = std::min(minSquareDistance, result.squareDistance);
+            }
+            setQueryNodeBound(join, queryNodeI, maxSquareDistance, minSquareDistance);
+        } else {
+            /// the query subnodes have different points and bounds,
+            /// so they can be joined in parallel
+            size_t leftQueryNodeI = queryNodeI + 1;
+            size_t rightQueryNodeI = queryNodeI + queryNode.getRightSubNodeOffset();
+            auto joinQueryNode = [&](size_t subQueryNodeI, std::vector<T> & subPoint) {
+                if (node.isLeaf()) {
+                    joinNodes(join, subQueryNodeI, nodeI, subPoint, pool);
+                } else {
+                    joinSubNodes(join, subQueryNodeI, nodeI, subPoint, pool);
+                }
+            };
+            /// the bound of the node is also the bound of its subnodes
+            for (size_t subQueryNodeI : {leftQueryNodeI, rightQueryNodeI}) {
+                join.queryNodeBounds[subQueryNodeI] = std::min(join.queryNodeBounds[subQueryNodeI],
+                                                               join.queryNodeBounds[queryNodeI]);
+            }
+            size_t leftPointsI = 0;
+            size_t rightPointsI = 0;
+            if (pool) {
+                join.queryTree.getSubtreePointsRange(queryNodeI, leftPointsI, rightPointsI);
+            }
+            if (rightPointsI - leftPointsI >= parallelJoinMinPointsNumber) {
+                std::vector<T> rightPoint(point.size());
+                pool->invoke([&]() { joinQueryNode(leftQueryNodeI, point); },
+                             [&]() { joinQueryNode(rightQueryNodeI, rightPoint); });
+            } else {
+                joinQueryNode(leftQueryNodeI, point);
+                joinQueryNode(rightQueryNodeI, point);
+            }
+            setQueryNodeBound(join, queryNodeI,
+                              std::max(join.queryNodeBounds[leftQueryNodeI],
+                                       join.queryNodeBounds[rightQueryNodeI]),
+                              std::min(join.queryNodeMinimums[leftQueryNodeI],
+                                       join.queryNodeMinimums[rightQueryNodeI]));
+        }
+    }
+
+    /// search the closest point to p in the subtree of the node, the result has the closest
+    /// one found so far
+    void joinPoint(Join const & join,
+                   KDPointView<T> p,
+                   size_t nodeI,
+                   KDQueryResult<T> & result) const
+    {
+        size_t k = storage->getK();
+        T const * nodeLower = &join.nodeBoxes[nodeI * 2 * k];
+        T const * nodeUpper = nodeLower + k;
+        T boxSquareDistance{0};
+        for (size_t coordinateI = 0; coordinateI < k; ++coordinateI) {
+            T diff = std::max(nodeLower[coordinateI] - p[coordinateI],
+                              std::max(p[coordinateI] - nodeUpper[coordinateI], T{0}));
+            boxSquareDistance += diff * diff;
+        }
+        if (boxSquareDistance >= result.squareDistance + std::numeric_limits<T>::epsilon()) {
+            return;
+        }
+        auto const & node = nodesData[nodeI];
+        if (node.isLeaf()) {
+            storage->findClosestPoint(p, result.squareDistance, result.originalI,
+                                      node.getLeftI(), node.getRightI());
+            return;
+        }
+        size_t closerNodeI = nodeI + node.getCloserSubNodeOffset(p);
+        size_t fartherNodeI = closerNodeI == nodeI + 1 ?
+                    nodeI + node.getRightSubNodeOffset() : nodeI + 1;
+        joinPoint(join, p, closerNodeI, result);
+        joinPoint(join, p, fartherNodeI, result);
+    }
+
+    /// join the query node with the subnodes of the node, the closer one first,
+    /// so the bound is smaller when the farther one is checked
+    void joinSubNodes(Join & join,
+                      size_t queryNodeI,
+                      size_t nodeI,
+                      std::vector<T> & point,
+                      KDThreadPool * pool) const
+    {
+        size_t leftNodeI = nodeI + 1;
+        size_t rightNodeI = nodeI + nodesData[nodeI].getRightSubNodeOffset();
+        if (getSquareDistanceBetweenNodeBoxes(join, queryNodeI, rightNodeI) <
+                getSquareDistanceBetweenNodeBoxes(join, queryNodeI, leftNodeI)) {
+            std::swap(leftNodeI, rightNodeI);
+        }
+        joinNodes(join, queryNodeI, leftNodeI, point, pool);
+        joinNodes(join, queryNodeI, rightNodeI, point, pool);
+    }
+
+    /// check if the box of the node is closer to the point than the square distance,
+    /// so the node can have points closer than that. It is true if there are no boxes.
+    bool isNodeBoxCloser(KDPointView<T> p, size_t nodeI, T squareDistance) const
+    {
+        return isBoxCloser(p, hasNodeBoxes() ? nodeBoxes.data() : nullptr, nodeI,
+                           squareDistance);
+    }
 
+    /// the same as above for the boxes of the nodes in any order
+    bool isBoxCloser(KDPointView<T> p, T const * boxes, size_t nodeI, T squareDistance) const
+    {
+        return getSquareDistanceToBox(p, boxes, nodeI) <
+                squareDistance + std::numeric_limits<T>::epsilon();
+    }
+
+    /// square distance from the point to the box of the node, 0 if there are no boxes
+    T getSquareDistanceToNodeBox(KDPointView<T> p, size_t nodeI) const
+    {
+        return getSquareDistanceToBox(p, hasNodeBoxes() ? nodeBoxes.data() : nullptr, nodeI);
+    }
+
+    T getSquareDistanceToBox(KDPointView<T> p, T const * boxes, size_t nodeI) const
+    {
+        if (!boxes) {
+            return T{0};
+        }
+        size_t k = storage->getK();
+        T const * nodeLower = &boxes[nodeI * 2 * k];
+        T const * nodeUpper = nodeLower + k;
+        T boxSquareDistance{0};
+        for (size_t coordinateI = 0; coordinateI < k; ++coordinateI) {
+            T diff = std::max(nodeLower[coordinateI] - p[coordinateI],
+                              std::max(p[coordinateI] - nodeUpper[coordinateI], T{0}));
+            boxSquareDistance += diff * diff;
+        }
+        return boxSquareDistance;
+    }
+
+    template <typename Function>
+    void findPointsInRadius(KDPointView<T> p,
+                            T squareRadius,
+                            Function & function,
+                            size_t nodeI) const
+    {
+        auto const & node = nodesData[nodeI];
+        if (node.isLeaf()) {
+            storage->findPointsInRadius(p, squareRadius, function,
+                                        node.getLeftI(), node.getRightI());
+            return;
+        }
+        size_t closerNodeI = nodeI + node.getCloserSubNodeOffset(p);
+        size_t fartherNodeI = closerNodeI == nodeI + 1 ?
+                    nodeI + node.getRightSubNodeOffset() : nodeI + 1;
+        if (isNodeBoxCloser(p, closerNodeI, squareRadius)) {
+            findPointsInRadius(p, squareRadius, function, closerNodeI);
+        }
+        if (node.isPlaneCloser(p, squareRadius) && isNodeBoxCloser(p, fartherNodeI, squareRadius)) {
+            findPointsInRadius(p, squareRadius, function, fartherNodeI);
+        }
+    }
+
+    /// nodeLower and nodeUpper are the bounds of the node, they are changed while the subnodes
+    /// are searched, but restored back before return.
+    template <typename Function>
+    void findPointsInBox(KDPoint<T, K> const & lower,
+                         KDPoint<T, K> const & upper,
+                         Function & function,
+                         size_t nodeI,
+                         std::vector<T> & nodeLower,
+                         std::vector<T> & nodeUpper) const
+    {
+        bool isNodeInside = true;
+        for (size_t coordinateI = 0; coordinateI < nodeLower.size(); ++coordinateI) {
+            if (nodeUpper[coordinateI] < lower[coordinateI] ||
+                    upper[coordinateI] < nodeLower[coordinateI]) {
+                return;
+            }
+            if (nodeLower[coordinateI] < lower[coordinateI] ||
+                    upper[coordinateI] < nodeUpper[coordinateI]) {
+                isNodeInside = false;
+            }
+        }
+
+        auto const & node = nodesData[nodeI];
+        if (isNodeInside) {
+            size_t leftPointsI = 0;
+            size_t rightPointsI = 0;
+            getSubtreePointsRange(nodeI, leftPointsI, rightPointsI);
+            for (size_t i = leftPointsI; i < rightPointsI; ++i) {
+                function(storage->getOriginalI(i));
+            }
+        } else if (node.isLeaf()) {
+            storage->findPointsInBox(lower, upper, function, node.getLeftI(), node.getRightI());
+        } else {
+            size_t coordinateI = node.getPlaneCoordinateI();
+
+            T bound = nodeUpper[coordinateI];
+            nodeUpper[coordinateI] = node.getPlaneCoordinate();
+            findPointsInBox(lower, upper, function, nodeI + 1, nodeLower, nodeUpper);
+            nodeUpper[coordinateI] = bound;
+
+            bound = nodeLower[coordinateI];
+            nodeLower[coordinateI] = node.getPlaneCoordinate();
+            findPointsInBox(lower, upper, function, nodeI + node.getRightSubNodeOffset(),
+                            nodeLower, nodeUpper);
+            nodeLower[coordinateI] = bound;
+        }
+    }
+
+    /// Points of a subtree are always contiguous in the storage: they are from the left index
+    /// of the leftmost leaf to the right index of the rightmost leaf.
+    void getSubtreePointsRange(size_t nodeI, size_t & leftPointsI, size_t & rightPointsI) const
+    {
+        size_t leftmostNodeI = nodeI;
+        while (!nodesData[leftmostNodeI].isLeaf()) {
+            leftmostNodeI += 1;
+        }
+        size_t rightmostNodeI = nodeI;
+        while (!nodesData[rightmostNodeI].isLeaf()) {
+            rightmostNodeI += nodesData[rightmostNodeI].getRightSubNodeOffset();
+        }
+        leftPointsI = nodesData[leftmostNodeI].getLeftI();
+        rightPointsI = nodesData[rightmostNodeI].getRightI();
+    }
+
+    /// Search k nearest points in the subtree of the node. The subnode having the point
+    /// is searched first, and the other one only if its splitting plane is closer than
+    /// the current k-th distance. The work done is added to stats.
+    template <typename Stats>
+    void findKNearest(KDPointView<T> p,
+                      size_t k,
+                      std::vector<KDNeighbour<T>> & nearestPoints,
+                      Stats & stats,
+                      size_t nodeI) const
+    {
+        auto const & node = nodesData[nodeI];
+        stats.visitNode();
+        if (node.isLeaf()) {
+            stats.scanLeaf(node.getRightI() - node.getLeftI());
+            storage->findKNearest(p, k, nearestPoints, node.getLeftI(), node.getRightI());
+            return;
+        }
+        size_t closerNodeI = nodeI + node.getCloserSubNodeOffset(p);
+        size_t fartherNodeI = closerNodeI == nodeI + 1 ?
+                    nodeI + node.getRightSubNodeOffset() : nodeI + 1;
+        findKNearest(p, k, nearestPoints, stats, closerNodeI);
+        if (nearestPoints.size() < k ||
+                (node.isPlaneCloser(p, nearestPoints.front().second) &&
+                 isNodeBoxCloser(p, fartherNodeI, nearestPoints.front().second))) {
+            stats.backtrack();
+            findKNearest(p, k, nearestPoints, stats, fartherNodeI);
+        }
+    }
+
+    /// nodesToSearch is the memory of the heap of nodes, see KDSearchContext
+    template <typename Stats>
+    KDQueryResult<T> findApproximateClosestPointI(
+            KDPointView<T> p,
+            KDApproximateSearch const & search,
+            Stats & stats,
+            std::vector<typename KDSearchContext<T>::BoundedNode> & nodesToSearch) const
+    {
+        KDQueryResult<T> result;
+        result.originalI = std::numeric_limits<size_t>::max();
+        result.squareDistance = std::numeric_limits<T>::max();
+
+        /// nodes to search with the lower bounds of the square distance to them, it is a heap
+        /// with the smallest bound on the top. The bound of a subnode is the bigger one of
+        /// the bound of its parent, the square distance to the parent splitting plane and
+        /// the square distance to its box if the tree has node boxes.
+        typedef typename KDSearchContext<T>::BoundedNode BoundedNode;
+        nodesToSearch.clear();
+        auto compareBounds = [](BoundedNode const & a, BoundedNode const & b) {
+            return a.first > b.first;
+        };
+        double boundFactor = (1 + search.epsilon) * (1 + search.epsilon);
+        auto canBeCloser = [&](T bound) {
+            return bound * boundFactor < result.squareDistance;
+        };
+        /// the result is exact if no skipped node can have a closer point
+        T minSkippedBound = std::numeric_limits<T>::max();
+        size_t scannedLeavesNumber = 0;
+
+        nodesToSearch.push_back(BoundedNode(T{0}, 0));
+        while (!nodesToSearch.empty()) {
+            std::pop_heap(nodesToSearch.begin(), nodesToSearch.end(), compareBounds);
+            BoundedNode boundedNode = nodesToSearch.back();
+            nodesToSearch.pop_back();
+            /// other nodes have bigger bounds, so they are skipped too
+            if (!canBeCloser(boundedNode.first) ||
+                    (search.maxLeavesNumber != 0 &&
+                     scannedLeavesNumber == search.maxLeavesNumber)) {
+                minSkippedBound = std::min(minSkippedBound, boundedNode.first);
+                break;
+            }
+
+            /// go down to the leaf pushing farther subnodes to search them later
+            size_t nodeI = boundedNode.second;
+            while (!nodesData[nodeI].isLeaf()) {
+                auto const & node = nodesData[nodeI];
+                stats.visitNode();
+                size_t closerNodeI = nodeI + node.getCloserSubNodeOffset(p);
+                size_t fartherNodeI = closerNodeI == nodeI + 1 ?
+                            nodeI + node.getRightSubNodeOffset() : nodeI + 1;
+                T fartherBound = std::max(boundedNode.first, node.getSquareDistanceToPlane(p));
+                fartherBound = std::max(fartherBound, getSquareDistanceToNodeBox(p, fartherNodeI));
+                if (canBeCloser(fartherBound)) {
+                    stats.backtrack();
+                    nodesToSearch.push_back(BoundedNode(fartherBound, fartherNodeI));
+                    std::push_heap(nodesToSearch.begin(), nodesToSearch.end(), compareBounds);
+                } else {
+                    minSkippedBound = std::min(minSkippedBound, fartherBound);
+                }
+                nodeI = closerNodeI;
+            }
+            stats.visitNode();
+            stats.scanLeaf(nodesData[nodeI].getRightI() - nodesData[nodeI].getLeftI());
+            ++scannedLeavesNumber;
             storage->findClosestPoint(
                         p,
-                        minSquareDistance,
-                        closestPointI,
-                        leaf->getLeftI(),
-                        leaf->getRightI()
+                        result.squareDistance,
+                        result.originalI,
+                        nodesData[nodeI].getLeftI(),
+                        nodesData[nodeI].getRightI()
                         );
+        }
+        result.isExact = minSkippedBound >= result.squareDistance;
+        return result;
+    }
 
-            return closestPointI;
-        } else {
-            KDTreeIntermediateNode<T> * intermediateNode =
-                    dynamic_cast<KDTreeIntermediateNode<T> *>(node);
-
-            return findAClosePoint(p, intermediateNode->getCloserSubNode(p));
+    /// It searches the closest point in the same node as the point to search is located.
+    /// It is not optimal though, so this algorithm is only used to find a candidate to
+    /// the closest point.
+    /// returns index of a closest point in the original point list and the square distance to it
+    template <typename Nodes, typename Stats, typename Filter>
+    size_t findAClosePoint(Nodes const & nodes,
+                           KDPointView<T> p,
+                           T & minSquareDistance,
+                           Stats & stats,
+                           Filter const & isAllowed) const {
+        size_t nodeI = 0;
+        while (!nodes.getNode(nodeI).isLeaf()) {
+            auto const & node = nodes.getNode(nodeI);
+            stats.visitNode(&node);
+            size_t leftNodeI = nodes.getLeftSubNodeI(nodeI);
+            size_t rightNodeI = nodes.getRightSubNodeI(nodeI);
+            /// both subnodes are loaded while the plane is compared
+            kdPrefetch(&nodes.getNode(leftNodeI));
+            kdPrefetch(&nodes.getNode(rightNodeI));
+            nodeI = p[node.getPlaneCoordinateI()] < node.getPlaneCoordinate() ?
+                        leftNodeI : rightNodeI;
         }
+        auto const & leaf = nodes.getNode(nodeI);
+        stats.visitNode(&leaf);
+        stats.scanLeaf(leaf.getRightI() - leaf.getLeftI());
+
+        size_t closestPointI = std::numeric_limits<size_t>::max();
+        storage->findClosestPoint(
+                    p,
+                    minSquareDistance,
+                    closestPointI,
+                    leaf.getLeftI(),
+                    leaf.getRightI(),
+                    isAllowed
+                    );
+
+        return closestPointI;
     }
 
-    /// build one node of the tree
-    IKDTreeNode * buildTree(size_t leftPointsI, size_t rightPointsI, size_t levelI)
+    /// build one node of the tree and all its subnodes into the nodes array from nodeI
+    /// in depth-first order, returns the number of the built nodes. The depth is updated
+    /// with the depth of the subtree.
+    /// If the pool is provided, the left and the right subtrees of big nodes are built
+    /// concurrently. The right one is put after the place the left one can take at most
+    /// (see KDBuildArena), so there can be gaps between them until the nodes are copied
+    /// to the tree. Otherwise the nodes are built one after another, and treeNodes grows
+    /// as they are added.
+    size_t buildTree(size_t leftPointsI,
+                     size_t rightPointsI,
+                     size_t levelI,
+                     size_t nodeI,
+                     std::vector<KDTreeNode<T>> & treeNodes,
+                     size_t & treeDepth,
+                     KDThreadPool * pool)
     {
-        depth = std::max(depth, levelI + 1);
+        treeDepth = std::max(treeDepth, levelI + 1);
+        /// the nodes of the parallel build are always inside the arena, so it never grows
+        if (nodeI >= treeNodes.size()) {
+            treeNodes.resize(nodeI + 1);
+        }
         /// it is impossible situation, if everything is right
         if (rightPointsI <= leftPointsI) {
             throw std::length_error("left index must always be bigger than the right one");
@@ -101,7 +1445,8 @@ private:
         /// time to create a leaf node, we have too few points to split
         if (rightPointsI - leftPointsI <= maxPointsNumberInLeafNode) {
             /// create a leaf node here
-            return new KDTreeLeafNode(leftPointsI, rightPointsI);
+            treeNodes[nodeI] = KDTreeNode<T>::makeLeaf(leftPointsI, rightPointsI);
+            return 1;
         } else {
             /// create an intermediate node here
             /// find a coordinateI to build a splitting plane
@@ -130,26 +1475,135 @@ private:
             /// It can happen if we have identical points per the given coordinateI, for instance
             if (middlePointsI <= leftPointsI ||
                     middlePointsI >= rightPointsI) {
-                return new KDTreeLeafNode(leftPointsI, rightPointsI);
+                treeNodes[nodeI] = KDTreeNode<T>::makeLeaf(leftPointsI, rightPointsI);
+                return 1;
             }
 
             /// build left and right subtrees
-            auto * node = new KDTreeIntermediateNode<T>(splitingPlaneCoordinateI, pivot);
-            node->setLeftSubNode(buildTree(leftPointsI, middlePointsI, levelI + 1));
-            node->setRightSubNode(buildTree(middlePointsI, rightPointsI, levelI + 1));
-            return node;
+            treeNodes[nodeI] = KDTreeNode<T>::makeIntermediate(splitingPlaneCoordinateI, pivot);
+            if (pool && rightPointsI - leftPointsI >= parallelBuildMinPointsNumber) {
+                size_t rightOffset = 2 * (middlePointsI - leftPointsI);
+                size_t leftNodesNumber = 0;
+                size_t rightNodesNumber = 0;
+                size_t leftDepth = 0;
+                size_t rightDepth = 0;
+                pool->invoke(
+                    [&]() {
+                        leftNodesNumber = buildTree(leftPointsI, middlePointsI, levelI + 1,
+                                                    nodeI + 1, treeNodes, leftDepth, pool);
+                    },
+                    [&]() {
+                        rightNodesNumber = buildTree(middlePointsI, rightPointsI, levelI + 1,
+                                                     nodeI + rightOffset, treeNodes, rightDepth, pool);
+                    });
+                treeNodes[nodeI].setRightSubNodeOffset(rightOffset);
+                treeDepth = std::max(treeDepth, std::max(leftDepth, rightDepth));
+                return 1 + leftNodesNumber + rightNodesNumber;
+            } else {
+                size_t leftNodesNumber = buildTree(leftPointsI, middlePointsI, levelI + 1,
+                                                   nodeI + 1, treeNodes, treeDepth, pool);
+                treeNodes[nodeI].setRightSubNodeOffset(1 + leftNodesNumber);
+                size_t rightNodesNumber = buildTree(middlePointsI, rightPointsI, levelI + 1,
+                                                    nodeI + 1 + leftNodesNumber, treeNodes,
+                                                    treeDepth, pool);
+                return 1 + leftNodesNumber + rightNodesNumber;
+            }
         }
     }
 
-    /// Boost serialization
+    /// copy the built nodes without gaps into the nodes array, so it is allocated once.
+    /// Nodes are copied in depth-first order, the right subnodes which are not copied yet
+    /// are kept in the stack.
+    void copyBuiltNodes(KDTreeNode<T> const * builtNodes, size_t builtNodesNumber)
+    {
+        nodes.resize(builtNodesNumber);
+        /// pairs of the right subnode index in builtNodes and its parent index in nodes
+        std::vector<std::pair<size_t, size_t>> rightNodes;
+        rightNodes.reserve(depth);
+        size_t builtNodeI = 0;
+        for (size_t nodeI = 0; nodeI < builtNodesNumber; ++nodeI) {
+            nodes[nodeI] = builtNodes[builtNodeI];
+            if (!nodes[nodeI].isLeaf()) {
+                rightNodes.push_back(std::make_pair(
+                                         builtNodeI + nodes[nodeI].getRightSubNodeOffset(), nodeI));
+                ++builtNodeI;
+            } else if (!rightNodes.empty()) {
+                builtNodeI = rightNodes.back().first;
+                size_t parentI = rightNodes.back().second;
+                nodes[parentI].setRightSubNodeOffset(nodeI + 1 - parentI);
+                rightNodes.pop_back();
+            }
+        }
+    }
+
+    void updateNodesData()
+    {
+        nodesData = nodes.data();
+        nodesNumber = nodes.size();
+    }
+
+    /// binary tree file writes and maps the tree data directly
+    friend class KDTreeFile;
+    /// the out of core build writes the subtrees of buckets right to the tree file
+    template <typename U> friend class KDExternalBuilder;
+
+    /// Boost serialization. The nodes are saved from the pointer, because they can be
+    /// not in the vector.
     friend class boost::serialization::access;
+    /// The storage is saved as KDPointStorage object, so the tree built with any derived
+    /// storage is saved and is loaded with the base one. The split algorithms are used only
+    /// to build the tree, queries do not depend on them.
     template <typename Archive>
-    void serialize(Archive &ar, const unsigned int version) {
-        ar & maxPointsNumberInLeafNode & storage & root;
+    void save(Archive &ar, const unsigned int version) const {
+        if (!storage) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+        std::vector<KDTreeNode<T>> savedNodes(nodesData, nodesData + nodesNumber);
+        KDPointStorage<T, K> const & savedStorage = *storage;
+        ar & maxPointsNumberInLeafNode & depth & savedStorage & savedNodes & lowerBound & upperBound;
     }
 
+    template <typename Archive>
+    void load(Archive &ar, const unsigned int version) {
+        storage.reset(new KDPointStorage<T, K>());
+        ar & maxPointsNumberInLeafNode & depth & *storage & nodes & lowerBound & upperBound;
+        nodeBoxes.clear();
+        nodesLayout = KDNodesLayout::DepthFirst;
+        layoutNodes.clear();
+        layoutNodeBoxes.clear();
+        updateNodesData();
+    }
+
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+    /// subtrees with less points are built serially even if the thread pool is provided
+    static constexpr size_t parallelBuildMinPointsNumber = 1 << 14;
+    /// query subtrees with less points are joined serially even if the thread pool is provided
+    static constexpr size_t parallelJoinMinPointsNumber = 1 << 12;
+
     size_t depth = 0;
     size_t maxPointsNumberInLeafNode = 1;
-    boost::scoped_ptr<KDPointStorage<T>> storage;
-    boost::scoped_ptr<IKDTreeNode> root;
+    boost::scoped_ptr<KDPointStorage<T, K>> storage;
+    /// all the nodes of the tree in depth-first order, the root is the first one.
+    std::vector<KDTreeNode<T>> nodes;
+    /// All the queries use the nodes by this pointer. It points either to the vector above
+    /// or to the memory that is not owned by the tree, e.g. a mapped tree file.
+    KDTreeNode<T> const * nodesData = nullptr;
+    size_t nodesNumber = 0;
+    /// bounding box of all the points in the tree
+    std::vector<T> lowerBound;
+    std::vector<T> upperBound;
+    /// lower and upper bounds of the points of every node one after another,
+    /// empty if buildNodeBoxes is not called
+    std::vector<T> nodeBoxes;
+    /// the nodes and their boxes in the layout of the closest point queries,
+    /// empty for the depth-first one, see setNodesLayout
+    KDNodesLayout nodesLayout = KDNodesLayout::DepthFirst;
+    std::vector<KDTreeNodeSlot<T>> layoutNodes;
+    /// index of the first node of the layout in the vector above, it is at the beginning
+    /// of a cache line
+    size_t layoutFirstNodeI = 0;
+    std::vector<T> layoutNodeBoxes;
+    /// keeps alive the memory the tree data points to if it is not owned by the tree
+    std::shared_ptr<void const> dataOwner;
 };
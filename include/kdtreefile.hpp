@@ -0,0 +1,401 @@
+#pragma once
+
+#include <kdtree.hpp>
+#include <kdmappedfile.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+/// Header of the binary tree file. All the numbers are in the byte order of the machine
+/// that has written the file, endianTag is used to check it is the same one.
+/// Sections are aligned to 64 bytes, so they can be used right from the mapped memory.
+struct KDTreeFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t endianTag;
+    /// see KDTreeFile::getCoordinateType
+    std::uint32_t coordinateType;
+    /// KDPointsLayout
+    std::uint32_t layout;
+    /// KDQuantization
+    std::uint32_t quantization;
+    std::uint32_t reserved;
+    std::uint64_t K;
+    std::uint64_t pointsNumber;
+    std::uint64_t nodesNumber;
+    std::uint64_t nodeSize;
+    std::uint64_t depth;
+    std::uint64_t maxPointsNumberInLeafNode;
+    /// 1 if coordinates are in leaf order and positions are saved, 0 otherwise
+    std::uint64_t leafOrdered;
+    /// offsets of the sections from the beginning of the file
+    std::uint64_t nodesOffset;
+    std::uint64_t boundsOffset;
+    std::uint64_t coordinatesOffset;
+    std::uint64_t indicesOffset;
+    std::uint64_t positionsOffset;
+    std::uint64_t quantizationOffset;
+    std::uint64_t fileSize;
+    /// FNV-1a hash of the header with zero checksum
+    std::uint64_t checksum;
+};
+
+static_assert(sizeof(KDTreeFileHeader) == 152, "tree file header must have no padding");
+
+/// Binary tree file. The file has the header and these sections:
+/// - nodes: the array of KDTreeNode<T> as it is in memory,
+/// - bounds: the lower and the upper bounds of the tree points, K values each,
+/// - coordinates: K * pointsNumber values in the storage layout, they are the quantized
+///   integers if the coordinates are quantized,
+/// - indices: original point indices in leaf order, 64-bit each,
+/// - positions: leaf order positions by the original indices, only if leafOrdered,
+/// - quantization: the offsets and the scales of the dimensions, K values each, only if
+///   the coordinates are quantized.
+/// The sections can be in any order, KDExternalBuilder writes the nodes last.
+/// A mapped tree uses the sections right from the mapped memory, nothing is deserialized.
+class KDTreeFile
+{
+public:
+    /// version 2 has added quantized coordinates
+    static constexpr std::uint32_t version = 2;
+    static constexpr std::uint32_t endianTag = 0x01020304;
+
+    /// returns true if the file starts like a binary tree file.
+    static bool isTreeFile(std::string const & filename)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        char magic[sizeof(KDTreeFileHeader::magic)] = {};
+        file.read(magic, sizeof(magic));
+        return file && std::memcmp(magic, getMagic(), sizeof(magic)) == 0;
+    }
+
+    /// returns true if the file is a binary tree file of KDTree<T, K> for some K,
+    /// so the type of the tree can be chosen before the file is mapped.
+    template <typename T>
+    static bool hasCoordinateType(std::string const & filename)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        KDTreeFileHeader header;
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+        return file && std::memcmp(header.magic, getMagic(), sizeof(header.magic)) == 0 &&
+                header.coordinateType == getCoordinateType<T>();
+    }
+
+    template <typename T, size_t K>
+    static void save(KDTree<T, K> const & tree, std::string const & filename)
+    {
+        static_assert(std::is_trivially_copyable<KDTreeNode<T>>::value,
+                      "tree nodes must be trivially copyable");
+        auto const & storage = tree.storage;
+        if (tree.nodesNumber == 0 || !storage || storage->size() == 0) {
+            throw std::domain_error("tree or points storage is invalid");
+        }
+
+        KDTreeFileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, getMagic(), sizeof(header.magic));
+        header.version = version;
+        header.endianTag = endianTag;
+        header.coordinateType = getCoordinateType<T>();
+        header.layout = static_cast<std::uint32_t>(storage->layout);
+        header.quantization = static_cast<std::uint32_t>(storage->quantization);
+        header.K = storage->getK();
+        header.pointsNumber = storage->size();
+        header.nodesNumber = tree.nodesNumber;
+        header.nodeSize = sizeof(KDTreeNode<T>);
+        header.depth = tree.depth;
+        header.maxPointsNumberInLeafNode = tree.maxPointsNumberInLeafNode;
+        header.leafOrdered = storage->leafOrdered ? 1 : 0;
+
+        std::uint64_t offset = sizeof(KDTreeFileHeader);
+        auto addSection = [&](std::uint64_t size) {
+            std::uint64_t sectionOffset = align(offset);
+            offset = sectionOffset + size;
+            return sectionOffset;
+        };
+        header.nodesOffset = addSection(header.nodesNumber * sizeof(KDTreeNode<T>));
+        header.boundsOffset = addSection(2 * header.K * sizeof(T));
+        size_t coordinateSize = getCoordinateSize<T>(storage->quantization);
+        header.coordinatesOffset = addSection(header.pointsNumber * header.K * coordinateSize);
+        header.indicesOffset = addSection(header.pointsNumber * sizeof(std::uint64_t));
+        header.positionsOffset = addSection(
+                    header.leafOrdered ? header.pointsNumber * sizeof(std::uint64_t) : 0);
+        bool isQuantized = storage->quantization != KDQuantization::None;
+        header.quantizationOffset = addSection(isQuantized ? 2 * header.K * sizeof(T) : 0);
+        header.fileSize = offset;
+        header.checksum = getChecksum(header);
+
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            throw std::runtime_error(filename + " file can not be written");
+        }
+        std::uint64_t written = 0;
+        auto write = [&](std::uint64_t sectionOffset, void const * data, std::uint64_t size) {
+            static const char padding[64] = {};
+            file.write(padding, sectionOffset - written);
+            file.write(static_cast<char const *>(data), size);
+            written = sectionOffset + size;
+        };
+        write(0, &header, sizeof(header));
+        write(header.nodesOffset, tree.nodesData, header.nodesNumber * sizeof(KDTreeNode<T>));
+        std::vector<T> bounds(tree.lowerBound.begin(), tree.lowerBound.end());
+        bounds.insert(bounds.end(), tree.upperBound.begin(), tree.upperBound.end());
+        write(header.boundsOffset, bounds.data(), bounds.size() * sizeof(T));
+        write(header.coordinatesOffset,
+              isQuantized ? storage->quantizedData : storage->coordinatesData,
+              header.pointsNumber * header.K * coordinateSize);
+        writeIndices(file, header.indicesOffset - written, storage->indicesData,
+                     header.pointsNumber);
+        written = header.indicesOffset + header.pointsNumber * sizeof(std::uint64_t);
+        if (header.leafOrdered) {
+            writeIndices(file, header.positionsOffset - written, storage->positionsData,
+                         header.pointsNumber);
+            written = header.positionsOffset + header.pointsNumber * sizeof(std::uint64_t);
+        }
+        if (isQuantized) {
+            std::vector<T> quantization(storage->quantizationOffsets);
+            quantization.insert(quantization.end(), storage->quantizationScales.begin(),
+                                storage->quantizationScales.end());
+            write(header.quantizationOffset, quantization.data(), quantization.size() * sizeof(T));
+        }
+        /// the empty sections at the end are aligned too, so the file is padded to its size
+        write(header.fileSize, nullptr, 0);
+        if (!file) {
+            throw std::runtime_error(filename + " file can not be written");
+        }
+    }
+
+    /// Map the file and make the tree use it. The tree must be empty (default constructed).
+    /// The mapping is kept while the tree exists. Only the header and the sizes of
+    /// the sections are checked, so mapping takes the same time for any file size and
+    /// the queries read only the pages they need.
+    /// If verify is true, the nodes, the indices and the positions are checked too
+    /// (see checkBody), they are read once here then. Files which are not written by
+    /// KDTreeFile::save or KDExternalBuilder of a trusted source should be verified,
+    /// the queries of a corrupted body read out of the mapping.
+    template <typename T, size_t K>
+    static void map(std::string const & filename, KDTree<T, K> & tree, bool verify = false)
+    {
+        if (tree.nodesNumber != 0 || tree.storage) {
+            throw std::domain_error("only an empty tree can be mapped");
+        }
+        if (sizeof(size_t) != sizeof(std::uint64_t)) {
+            throw std::runtime_error("tree files can be mapped only if size_t is 64-bit");
+        }
+        std::shared_ptr<KDMappedFile> file = std::make_shared<KDMappedFile>(filename);
+        auto header = readHeader<T, K>(file->data(), file->size(), filename);
+        char const * data = file->data();
+        if (verify) {
+            checkBody<T>(header, data, [&](std::string const & reason) {
+                throw std::runtime_error(filename + " is not a valid tree file: " + reason);
+            });
+        }
+
+        auto storage = new KDPointStorage<T, K>();
+        tree.storage.reset(storage);
+        storage->dynamicK = header.K;
+        storage->layout = static_cast<KDPointsLayout>(header.layout);
+        storage->leafOrdered = header.leafOrdered != 0;
+        storage->pointsNumber = header.pointsNumber;
+        storage->quantization = static_cast<KDQuantization>(header.quantization);
+        if (storage->quantization == KDQuantization::None) {
+            storage->coordinatesData = reinterpret_cast<T const *>(data + header.coordinatesOffset);
+        } else {
+            storage->quantizedData = data + header.coordinatesOffset;
+            T const * quantization = reinterpret_cast<T const *>(data + header.quantizationOffset);
+            storage->quantizationOffsets.assign(quantization, quantization + header.K);
+            storage->quantizationScales.assign(quantization + header.K,
+                                               quantization + 2 * header.K);
+        }
+        storage->indicesData = reinterpret_cast<size_t const *>(data + header.indicesOffset);
+        storage->positionsData = header.leafOrdered ?
+                    reinterpret_cast<size_t const *>(data + header.positionsOffset) : nullptr;
+
+        T const * bounds = reinterpret_cast<T const *>(data + header.boundsOffset);
+        tree.lowerBound.assign(bounds, bounds + header.K);
+        tree.upperBound.assign(bounds + header.K, bounds + 2 * header.K);
+        tree.depth = header.depth;
+        tree.maxPointsNumberInLeafNode = header.maxPointsNumberInLeafNode;
+        tree.nodesData = reinterpret_cast<KDTreeNode<T> const *>(data + header.nodesOffset);
+        tree.nodesNumber = header.nodesNumber;
+        tree.dataOwner = file;
+    }
+
+    /// Check the header of the file data and return it. Throws std::runtime_error
+    /// if the file is not a valid tree file for KDTree<T, K>.
+    template <typename T, size_t K>
+    static KDTreeFileHeader readHeader(char const * data, size_t size, std::string const & filename)
+    {
+        auto fail = [&](std::string const & reason) {
+            throw std::runtime_error(filename + " is not a valid tree file: " + reason);
+        };
+        KDTreeFileHeader header;
+        if (size < sizeof(header)) {
+            fail("it is too short");
+        }
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, getMagic(), sizeof(header.magic)) != 0) {
+            fail("wrong file type");
+        }
+        if (header.endianTag != endianTag) {
+            fail("it was written on a machine with another byte order");
+        }
+        if (header.checksum != getChecksum(header)) {
+            fail("the header is corrupted");
+        }
+        if (header.version != version) {
+            fail("unsupported version");
+        }
+        if (header.coordinateType != getCoordinateType<T>() ||
+                header.nodeSize != sizeof(KDTreeNode<T>)) {
+            fail("it has another coordinate type");
+        }
+        if (header.K == 0 || (K != KDDynamicK && header.K != K)) {
+            fail("it has another points dimension");
+        }
+        if (header.pointsNumber == 0 || header.nodesNumber == 0 ||
+                header.layout > static_cast<std::uint32_t>(KDPointsLayout::SoA) ||
+                header.quantization > static_cast<std::uint32_t>(KDQuantization::UInt8)) {
+            fail("the header is corrupted");
+        }
+        auto quantization = static_cast<KDQuantization>(header.quantization);
+        if (quantization != KDQuantization::None && !std::is_floating_point<T>::value) {
+            fail("it has quantized coordinates of an integer type");
+        }
+        if (header.fileSize != size) {
+            fail("the file size is not the same as in the header");
+        }
+        checkSection(header, header.nodesOffset, header.nodesNumber, sizeof(KDTreeNode<T>), fail);
+        checkSection(header, header.boundsOffset, 2 * header.K, sizeof(T), fail);
+        checkSection(header, header.coordinatesOffset, header.pointsNumber * header.K,
+                     getCoordinateSize<T>(quantization), fail);
+        checkSection(header, header.indicesOffset, header.pointsNumber,
+                     sizeof(std::uint64_t), fail);
+        if (header.leafOrdered) {
+            checkSection(header, header.positionsOffset, header.pointsNumber,
+                         sizeof(std::uint64_t), fail);
+        }
+        if (quantization != KDQuantization::None) {
+            checkSection(header, header.quantizationOffset, 2 * header.K, sizeof(T), fail);
+        }
+        return header;
+    }
+
+private:
+    /// the out of core build writes the header and the sections itself
+    template <typename T> friend class KDExternalBuilder;
+
+    static char const * getMagic()
+    {
+        return "KDTREEB";
+    }
+
+    /// the size of the coordinate type and flags if it is integer and signed
+    template <typename T>
+    static std::uint32_t getCoordinateType()
+    {
+        return static_cast<std::uint32_t>(sizeof(T)) |
+                (std::numeric_limits<T>::is_integer ? 0x100 : 0) |
+                (std::numeric_limits<T>::is_signed ? 0x200 : 0);
+    }
+
+    /// the size of a value in the coordinates section
+    template <typename T>
+    static size_t getCoordinateSize(KDQuantization quantization)
+    {
+        if (quantization == KDQuantization::Int16) {
+            return sizeof(std::int16_t);
+        } else if (quantization == KDQuantization::UInt8) {
+            return sizeof(std::uint8_t);
+        }
+        return sizeof(T);
+    }
+
+    static std::uint64_t align(std::uint64_t offset)
+    {
+        return (offset + 63) / 64 * 64;
+    }
+
+    static std::uint64_t getChecksum(KDTreeFileHeader header)
+    {
+        header.checksum = 0;
+        unsigned char const * bytes = reinterpret_cast<unsigned char const *>(&header);
+        std::uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < sizeof(header); ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    template <typename Fail>
+    static void checkSection(KDTreeFileHeader const & header,
+                             std::uint64_t offset,
+                             std::uint64_t itemsNumber,
+                             std::uint64_t itemSize,
+                             Fail fail)
+    {
+        if (offset % 64 != 0 || offset < sizeof(KDTreeFileHeader) || offset > header.fileSize ||
+                itemsNumber > (header.fileSize - offset) / itemSize) {
+            fail("a section is out of the file");
+        }
+    }
+
+    /// Check the sections the queries index by, so a corrupted body or a file of a buggy
+    /// writer fails when it is mapped instead of reading out of the mapping: both subnodes of every
+    /// intermediate node are after it and inside the nodes, its plane is one of the K
+    /// coordinates, the points of every leaf and the indices and the positions are inside
+    /// the points.
+    template <typename T, typename Fail>
+    static void checkBody(KDTreeFileHeader const & header, char const * data, Fail fail)
+    {
+        auto nodes = reinterpret_cast<KDTreeNode<T> const *>(data + header.nodesOffset);
+        for (std::uint64_t nodeI = 0; nodeI < header.nodesNumber; ++nodeI) {
+            auto const & node = nodes[nodeI];
+            if (node.isLeaf()) {
+                if (node.getRightI() > header.pointsNumber) {
+                    fail("a leaf node has points out of the tree");
+                }
+            } else if (node.getRightSubNodeOffset() < 2 ||
+                       node.getRightSubNodeOffset() >= header.nodesNumber - nodeI ||
+                       node.getPlaneCoordinateI() >= header.K) {
+                fail("an intermediate node is corrupted");
+            }
+        }
+        auto checkIndices = [&](std::uint64_t offset) {
+            auto indices = reinterpret_cast<std::uint64_t const *>(data + offset);
+            for (std::uint64_t i = 0; i < header.pointsNumber; ++i) {
+                if (indices[i] >= header.pointsNumber) {
+                    fail("a point index is out of the tree");
+                }
+            }
+        };
+        checkIndices(header.indicesOffset);
+        if (header.leafOrdered) {
+            checkIndices(header.positionsOffset);
+        }
+    }
+
+    static void writeIndices(std::ofstream & file,
+                             std::uint64_t paddingSize,
+                             size_t const * indices,
+                             size_t indicesNumber)
+    {
+        static const char padding[64] = {};
+        file.write(padding, paddingSize);
+        std::vector<std::uint64_t> buffer;
+        const size_t bufferSize = 1 << 16;
+        for (size_t i = 0; i < indicesNumber; i += bufferSize) {
+            size_t endI = std::min(indicesNumber, i + bufferSize);
+            buffer.assign(indices + i, indices + endI);
+            file.write(reinterpret_cast<char const *>(buffer.data()),
+                       buffer.size() * sizeof(std::uint64_t));
+        }
+    }
+};
@@ -1,22 +1,158 @@
 #pragma once
 
-#include <boost/serialization/export.hpp>
+#include <kdpoint.hpp>
+
 #include <boost/serialization/access.hpp>
 
-#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
 
-/// Interface for KDTReeNode. It has two children right now: leaf node and intermediate node.
-class IKDTreeNode
+/// Node of kd-tree. All the nodes of a tree are kept in one contiguous array in depth-first
+/// order, so a node is a small POD without any pointers or virtual methods.
+/// An intermediate node keeps the splitting plane and the offset to its right subnode
+/// (the left subnode always follows the node itself).
+/// A leaf node keeps the range of its points in the points storage.
+/// The leaf flag is packed together with the splitting plane coordinate index for intermediate
+/// nodes and with the number of points for leaf nodes.
+template <typename T>
+class KDTreeNode
 {
 public:
-    virtual ~IKDTreeNode() {}
+    /// Empty c-tor for serialization
+    KDTreeNode() {}
+
+    static KDTreeNode makeLeaf(size_t leftPointsI, size_t rightPointsI) {
+        checkIndex(rightPointsI);
+        return KDTreeNode(T{0}, leftPointsI, ((rightPointsI - leftPointsI) << 1) | 1);
+    }
+
+    static KDTreeNode makeIntermediate(size_t planeCoordinateI, T planeCoordinate) {
+        checkIndex(planeCoordinateI);
+        return KDTreeNode(planeCoordinate, 0, planeCoordinateI << 1);
+    }
+
+    bool isLeaf() const { return info & 1; }
+
+    /// left and right indices of the leaf points in points storage.
+    size_t getLeftI() const { return index; }
+    size_t getRightI() const { return index + (info >> 1); }
+
+    size_t getPlaneCoordinateI() const { return info >> 1; }
+    T getPlaneCoordinate() const { return planeCoordinate; }
+
+    /// Offset from the intermediate node to its right subnode in the nodes array.
+    /// The left subnode has offset 1.
+    size_t getRightSubNodeOffset() const { return index; }
+
+    void setRightSubNodeOffset(size_t offset) {
+        checkIndex(offset);
+        index = static_cast<std::uint32_t>(offset);
+    }
+
+    /// find the offset of the subnode that has the provided point
+    template <typename Point>
+    size_t getCloserSubNodeOffset(Point const & p) const {
+        if (p[getPlaneCoordinateI()] < planeCoordinate) {
+            return 1;
+        } else {
+            return getRightSubNodeOffset();
+        }
+    }
+
+    /// square distance from the point to the splitting plane
+    template <typename Point>
+    T getSquareDistanceToPlane(Point const & p) const {
+        T distance = (p[getPlaneCoordinateI()] - planeCoordinate);
+        return distance * distance;
+    }
+
+    /// check if the splitting plane is closer to the point than the square distance,
+    /// so the farther subnode can also have points closer than that.
+    template <typename Point>
+    bool isPlaneCloser(Point const & p, T squareDistance) const {
+        T distance = (p[getPlaneCoordinateI()] - planeCoordinate);
+        return distance * distance < squareDistance + std::numeric_limits<T>::epsilon();
+    }
+
+    /// check the distance from the point to the boundary of the subnodes
+    /// and add either both nodes or only one to search further.
+    /// nodeI is the index of this node in the nodes array.
+    template <typename Point>
+    void addNodesToSearch(std::vector<size_t> & nodesToSearch,
+                          size_t nodeI,
+                          Point const & p,
+                          T minSquareDistance) const
+    {
+        addNodesToSearch(nodesToSearch, nodeI + 1, nodeI + getRightSubNodeOffset(), p,
+                         minSquareDistance);
+    }
+
+    /// The same as above for the nodes in any order, the subnodes are at leftNodeI
+    /// and rightNodeI in the nodes array.
+    template <typename Point>
+    void addNodesToSearch(std::vector<size_t> & nodesToSearch,
+                          size_t leftNodeI,
+                          size_t rightNodeI,
+                          Point const & p,
+                          T minSquareDistance) const
+    {
+        if (isPlaneCloser(p, minSquareDistance)) {
+            nodesToSearch.push_back(leftNodeI);
+            nodesToSearch.push_back(rightNodeI);
+        } else {
+            nodesToSearch.push_back(p[getPlaneCoordinateI()] < planeCoordinate ?
+                                        leftNodeI : rightNodeI);
+        }
+    }
 
 private:
+    KDTreeNode(T aPlaneCoordinate, size_t aIndex, size_t aInfo)
+        : planeCoordinate(aPlaneCoordinate),
+          index(static_cast<std::uint32_t>(aIndex)),
+          info(static_cast<std::uint32_t>(aInfo))
+    {}
+
+    /// Indices are packed into 32 bits (31 bits for the values packed with the leaf flag).
+    static void checkIndex(size_t i) {
+        if (i > (std::numeric_limits<std::uint32_t>::max() >> 1)) {
+            throw std::length_error("too many points or dimensions for kd-tree node");
+        }
+    }
+
     /// Boost serialization
     friend class boost::serialization::access;
     template <typename Archive>
     void serialize(Archive &ar, const unsigned int version) {
+        ar & planeCoordinate & index & info;
     }
+
+    /// splitting plane value for intermediate nodes, unused for leaf nodes
+    T planeCoordinate = 0;
+    /// right subnode offset for intermediate nodes, left points index for leaf nodes
+    std::uint32_t index = 0;
+    /// (planeCoordinateI << 1) for intermediate nodes, (pointsNumber << 1) | 1 for leaf nodes
+    std::uint32_t info = 1;
 };
 
-BOOST_SERIALIZATION_ASSUME_ABSTRACT(IKDTreeNode)
+/// the smallest power of two which is not less than the size of the node
+template <typename T>
+constexpr size_t kdTreeNodeSlotSize()
+{
+    size_t size = 1;
+    while (size < sizeof(KDTreeNode<T>)) {
+        size *= 2;
+    }
+    return size;
+}
+
+/// Node padded to a power of two size, so slots in an array aligned to a cache line are
+/// never split by lines, and neither are the pairs of slots at even positions. The nodes
+/// of the van Emde Boas layout are kept in slots (see KDTree::setNodesLayout), e.g. a float
+/// node takes 16 bytes there instead of 12.
+template <typename T>
+struct alignas(kdTreeNodeSlotSize<T>()) KDTreeNodeSlot {
+    KDTreeNode<T> node;
+};
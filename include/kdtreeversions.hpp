@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// Versions of a tree (KDTree, KDMutableTree or any other object) shared by readers
+/// and a writer. Readers pin the current version and query it without any locks,
+/// the writer publishes a new version atomically, readers which have pinned the old one
+/// keep using it. Old versions are deleted when all their readers have unpinned them.
+/// Only whole trees are published, a version is never patched by a delta of another one:
+/// the writer builds the next tree (e.g. inserts into its own KDMutableTree, which can not
+/// be copied) and publishes it as a new version.
+///
+/// It is epoch based: every publication increments the epoch and the replaced version is
+/// retired with it. A reader stores the epoch into its slot before it loads the current
+/// version, so the retired version can be used only by readers with smaller epochs in
+/// the slots. The writer deletes retired versions when there are no such readers.
+/// Readers take slots by compare-and-swap, so pinning takes no locks while there is a free
+/// slot. There are slotsNumber slots, one for every snapshot alive: if all of them are taken,
+/// pin waits until a snapshot is destroyed, and it waits forever if the snapshots are held
+/// by the threads waiting for it. tryPin does not wait.
+template <typename Tree>
+class KDTreeVersions
+{
+public:
+    /// The pinned version, it is unpinned in the d-tor. It must not outlive KDTreeVersions.
+    class Snapshot
+    {
+    public:
+        Snapshot(Snapshot && other)
+            : slot(other.slot), tree(other.tree), version(other.version)
+        {
+            other.slot = nullptr;
+        }
+
+        Snapshot(Snapshot const &) = delete;
+        Snapshot & operator = (Snapshot const &) = delete;
+        Snapshot & operator = (Snapshot &&) = delete;
+
+        ~Snapshot()
+        {
+            if (slot) {
+                slot->store(idleEpoch);
+            }
+        }
+
+        Tree const & operator * () const { return *tree; }
+        Tree const * operator -> () const { return tree; }
+
+        /// the first published version has number 1, every next one has the next number
+        std::uint64_t getVersion() const { return version; }
+
+    private:
+        friend class KDTreeVersions;
+
+        Snapshot(std::atomic<std::uint64_t> * aSlot, Tree const * aTree, std::uint64_t aVersion)
+            : slot(aSlot), tree(aTree), version(aVersion)
+        {}
+
+        std::atomic<std::uint64_t> * slot;
+        Tree const * tree;
+        std::uint64_t version;
+    };
+
+    /// the first version is published here, slotsNumber is the maximal number
+    /// of snapshots alive at the same time.
+    explicit KDTreeVersions(std::unique_ptr<Tree> tree, size_t slotsNumber = 128)
+        : slots(slotsNumber)
+    {
+        if (!tree) {
+            throw std::domain_error("tree version must not be empty");
+        }
+        if (slotsNumber == 0) {
+            throw std::domain_error("number of reader slots should be > 0");
+        }
+        for (auto & slot : slots) {
+            slot.store(idleEpoch);
+        }
+        current.store(new Version{std::move(tree), 1});
+    }
+
+    /// All the snapshots must be destroyed before.
+    ~KDTreeVersions()
+    {
+        delete current.load();
+        for (auto const & retiredVersion : retiredVersions) {
+            delete retiredVersion.first;
+        }
+    }
+
+    KDTreeVersions(KDTreeVersions const &) = delete;
+    KDTreeVersions & operator = (KDTreeVersions const &) = delete;
+
+    /// Pin the current version. If all the slots are taken, it yields until a snapshot
+    /// is destroyed, see tryPin.
+    Snapshot pin() const
+    {
+        while (true) {
+            if (auto snapshot = tryPin()) {
+                return std::move(*snapshot);
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    /// Pin the current version if there is a free slot, otherwise return nothing.
+    std::optional<Snapshot> tryPin() const
+    {
+        thread_local size_t firstSlotI = std::hash<std::thread::id>()(std::this_thread::get_id());
+        std::uint64_t readerEpoch = epoch.load();
+        for (size_t i = 0; i < slots.size(); ++i) {
+            size_t slotI = (firstSlotI + i) % slots.size();
+            std::uint64_t expected = idleEpoch;
+            if (slots[slotI].load() == idleEpoch &&
+                    slots[slotI].compare_exchange_strong(expected, readerEpoch)) {
+                firstSlotI = slotI;
+                /// the version is loaded after the epoch is stored, so it is retired
+                /// with a bigger epoch and is not deleted until the slot is released
+                Version const * version = current.load();
+                return Snapshot(&slots[slotI], version->tree.get(), version->number);
+            }
+        }
+        return std::nullopt;
+    }
+
+    size_t getSlotsNumber() const { return slots.size(); }
+
+    /// Publish the new version, the next pinned snapshots will use it.
+    /// The old versions which are not pinned any more are deleted.
+    void publish(std::unique_ptr<Tree> tree)
+    {
+        if (!tree) {
+            throw std::domain_error("tree version must not be empty");
+        }
+        std::lock_guard<std::mutex> lock(writerMutex);
+        Version const * oldVersion = current.load();
+        current.store(new Version{std::move(tree), oldVersion->number + 1});
+        /// only readers with smaller epochs can have the old version
+        retiredVersions.push_back(std::make_pair(oldVersion, ++epoch));
+        reclaimVersions();
+    }
+
+    /// Delete the old versions which are not pinned any more. It is called by publish,
+    /// call it if the old versions should be deleted before the next publication.
+    void reclaim()
+    {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        reclaimVersions();
+    }
+
+    /// number of old versions which are not deleted yet
+    size_t getRetiredVersionsNumber() const
+    {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        return retiredVersions.size();
+    }
+
+private:
+    static constexpr std::uint64_t idleEpoch = std::numeric_limits<std::uint64_t>::max();
+
+    struct Version {
+        std::unique_ptr<Tree const> tree;
+        std::uint64_t number;
+    };
+
+    void reclaimVersions()
+    {
+        std::uint64_t minReaderEpoch = idleEpoch;
+        for (auto const & slot : slots) {
+            minReaderEpoch = std::min(minReaderEpoch, slot.load());
+        }
+        size_t keptVersionsNumber = 0;
+        for (auto const & retiredVersion : retiredVersions) {
+            if (retiredVersion.second <= minReaderEpoch) {
+                delete retiredVersion.first;
+            } else {
+                retiredVersions[keptVersionsNumber++] = retiredVersion;
+            }
+        }
+        retiredVersions.resize(keptVersionsNumber);
+    }
+
+    std::atomic<Version const *> current;
+    /// the number of publications, it is incremented after the current version is replaced
+    std::atomic<std::uint64_t> epoch{0};
+    /// epochs of pinned snapshots or idleEpoch
+    mutable std::vector<std::atomic<std::uint64_t>> slots;
+    /// replaced versions with the epochs they were retired with
+    std::vector<std::pair<Version const *, std::uint64_t>> retiredVersions;
+    mutable std::mutex writerMutex;
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <kdpoint.hpp>
+
+#include <random>
+#include <vector>
+
+/// pointsNumber random points of K coordinates taken from the distribution
+template <typename Distribution>
+std::vector<KDPoint<double>> generateKDRandomPoints(size_t pointsNumber,
+                                                    size_t K,
+                                                    Distribution & dist,
+                                                    std::mt19937 & e2)
+{
+    std::vector<KDPoint<double>> points;
+    for (size_t i = 0; i < pointsNumber; ++i) {
+        std::vector<double> coords(K);
+        for (auto & coordinate : coords) {
+            coordinate = dist(e2);
+        }
+        points.push_back(KDPoint<double>(coords));
+    }
+    return points;
+}
@@ -0,0 +1,108 @@
+#include <kdcsvreader.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <vector>
+
+namespace {
+
+const char * csvFilename = "t_kdcsvreader_test.csv";
+
+void writeFile(std::string const & text)
+{
+    std::ofstream file(csvFilename, std::ios::binary | std::ios::trunc);
+    file << text;
+}
+
+void checkReadFails(std::string const & text)
+{
+    writeFile(text);
+    KDCsvReader<double> reader(csvFilename);
+    std::vector<double> coordinates;
+    BOOST_CHECK_EXCEPTION(
+                reader.read(coordinates),
+                std::runtime_error, [](std::runtime_error const &){return true;});
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( KDCsvReaderTest_readByBatches )
+{
+    writeFile("1, 2.5,-3\r\n"
+              "\n"
+              "+4,5e1 ,6\n"
+              "  \n"
+              "7,8,9\n"
+              "10,11,12");
+    KDCsvReader<double> reader(csvFilename);
+    BOOST_CHECK_EQUAL(reader.getK(), 3);
+
+    std::vector<double> coordinates;
+    BOOST_CHECK_EQUAL(reader.read(coordinates, 2), 2);
+    BOOST_CHECK(!reader.isFinished());
+    BOOST_CHECK_EQUAL(reader.read(coordinates, 3), 2);
+    BOOST_CHECK(reader.isFinished());
+    BOOST_CHECK_EQUAL(reader.read(coordinates, 3), 0);
+
+    std::vector<double> expected = {1, 2.5, -3, 4, 50, 6, 7, 8, 9, 10, 11, 12};
+    BOOST_CHECK_EQUAL_COLLECTIONS(coordinates.begin(), coordinates.end(),
+                                  expected.begin(), expected.end());
+
+    writeFile("\n \n");
+    KDCsvReader<float> emptyReader(csvFilename);
+    BOOST_CHECK_EQUAL(emptyReader.getK(), 0);
+    BOOST_CHECK(emptyReader.isFinished());
+    std::remove(csvFilename);
+}
+
+BOOST_AUTO_TEST_CASE( KDCsvReaderTest_parallelReadIsTheSame )
+{
+    /// the file is big enough to be split into several chunks
+    std::mt19937 e2(5);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+    std::vector<double> expected;
+    {
+        std::ofstream file(csvFilename, std::ios::trunc);
+        file.precision(17);
+        for (size_t i = 0; i < 200000; ++i) {
+            double x = dist(e2);
+            double y = dist(e2);
+            expected.push_back(x);
+            expected.push_back(y);
+            file << x << "," << y << "\n";
+        }
+    }
+
+    KDThreadPool pool(4);
+    KDCsvReader<double> reader(csvFilename);
+    std::vector<double> coordinates;
+    BOOST_CHECK_EQUAL(reader.read(coordinates, 0, &pool), expected.size() / 2);
+    BOOST_CHECK(coordinates == expected);
+
+    KDCsvReader<double> batchReader(csvFilename);
+    std::vector<double> batchCoordinates;
+    while (!batchReader.isFinished()) {
+        batchReader.read(batchCoordinates, 70000, &pool);
+        /// the next batches are read the same after the pages of the previous ones are dropped
+        batchReader.releaseReadRows();
+    }
+    BOOST_CHECK(batchCoordinates == expected);
+    std::remove(csvFilename);
+}
+
+BOOST_AUTO_TEST_CASE( KDCsvReaderTest_invalidRows )
+{
+    checkReadFails("1,2\n3,4,5\n");
+    checkReadFails("1,2\n3\n");
+    checkReadFails("1,2\n3,x\n");
+    checkReadFails("1,2\n3 4,5\n");
+    checkReadFails("1,2,\n");
+    std::remove(csvFilename);
+
+    BOOST_CHECK_EXCEPTION(
+                KDCsvReader<double>("t_kdcsvreader_no_file.csv"),
+                std::runtime_error, [](std::runtime_error const &){return true;});
+}
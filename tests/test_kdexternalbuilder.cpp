@@ -0,0 +1,135 @@
+#include <kdexternalbuilder.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+namespace {
+
+const char * csvFilename = "t_kdexternalbuilder_test.csv";
+const char * treeFilename = "t_kdexternalbuilder_test.bin";
+
+void writeCsv(std::vector<KDPoint<double>> const & points)
+{
+    std::ofstream file(csvFilename, std::ios::trunc);
+    file << std::setprecision(17);
+    for (auto const & point : points) {
+        for (size_t coordinateI = 0; coordinateI < point.size(); ++coordinateI) {
+            file << (coordinateI == 0 ? "" : ",") << point[coordinateI];
+        }
+        file << "\n";
+    }
+}
+
+/// the tree has all the points, and the closest ones are found as in the tree built in memory
+void checkTree(KDTree<double> const & tree,
+               std::vector<KDPoint<double>> const & points,
+               std::vector<KDPoint<double>> const & queries)
+{
+    BOOST_REQUIRE_EQUAL(tree.size(), points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+        BOOST_CHECK(tree.getPoint(i) == points[i]);
+    }
+    KDTree<double> memoryTree(new KDPointStorage<double>(points, points[0].size()), 2);
+    for (auto const & query : queries) {
+        size_t originalI = 0;
+        size_t memoryOriginalI = 0;
+        auto closest = tree.findClosestPoint(query, originalI);
+        auto memoryClosest = memoryTree.findClosestPoint(query, memoryOriginalI);
+        BOOST_CHECK(closest == memoryClosest);
+        BOOST_CHECK(points[originalI] == closest);
+
+        std::vector<KDNeighbour<double>> nearest;
+        std::vector<KDNeighbour<double>> memoryNearest;
+        tree.findKNearest(query, 5, nearest);
+        memoryTree.findKNearest(query, 5, memoryNearest);
+        BOOST_REQUIRE_EQUAL(nearest.size(), memoryNearest.size());
+        for (size_t i = 0; i < nearest.size(); ++i) {
+            BOOST_CHECK_EQUAL(nearest[i].second, memoryNearest[i].second);
+        }
+    }
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( KDExternalBuilderTest_buildsTreeOfBuckets )
+{
+    std::mt19937 e2(31);
+    std::uniform_real_distribution<> dist(-100, 100);
+    const size_t K = 3;
+    auto generatePoints = [&](size_t pointsNumber) {
+        std::vector<KDPoint<double>> points;
+        for (size_t i = 0; i < pointsNumber; ++i) {
+            std::vector<double> coords(K);
+            for (auto & coordinate : coords) {
+                coordinate = dist(e2);
+            }
+            points.push_back(KDPoint<double>(coords));
+        }
+        return points;
+    };
+    auto points = generatePoints(20000);
+    auto queries = generatePoints(200);
+    writeCsv(points);
+
+    /// buckets of the 256 KiB limit have less than 2000 points, so they are split twice
+    KDThreadPool pool(2);
+    for (auto layout : {KDPointsLayout::AoS, KDPointsLayout::SoA}) {
+        KDExternalBuilder<double> builder(1 << 18, KDSplitStrategy::Median, layout, 2, &pool);
+        builder.build(csvFilename, treeFilename);
+        KDTree<double> tree;
+        KDTreeFile::map(treeFilename, tree);
+        BOOST_CHECK_GT(tree.getDepth(), 10u);
+        BOOST_CHECK_EQUAL(tree.getShape().maxLeafSize, 2u);
+        checkTree(tree, points, queries);
+    }
+
+    /// the same as one bucket built in memory
+    KDExternalBuilder<double> builder(1 << 26, KDSplitStrategy::MaxSpread);
+    builder.build(csvFilename, treeFilename);
+    KDTree<double> tree;
+    KDTreeFile::map(treeFilename, tree);
+    checkTree(tree, points, queries);
+
+    std::remove(csvFilename);
+    std::remove(treeFilename);
+}
+
+BOOST_AUTO_TEST_CASE( KDExternalBuilderTest_samePoints )
+{
+    /// the sample can not split the same points, they are written as one leaf
+    std::vector<KDPoint<double>> points(10000, KDPoint<double>({1.5, -2}));
+    points.push_back(KDPoint<double>({3, 3}));
+    writeCsv(points);
+
+    KDExternalBuilder<double> builder(1 << 18);
+    builder.build(csvFilename, treeFilename);
+    KDTree<double> tree;
+    KDTreeFile::map(treeFilename, tree);
+    checkTree(tree, points, {KDPoint<double>({1, -1}), KDPoint<double>({4, 4})});
+
+    std::remove(csvFilename);
+    std::remove(treeFilename);
+}
+
+BOOST_AUTO_TEST_CASE( KDExternalBuilderTest_invalidArguments )
+{
+    BOOST_CHECK_THROW(KDExternalBuilder<double>(1 << 20, KDSplitStrategy::Median,
+                                                KDPointsLayout::Indexed),
+                      std::domain_error);
+
+    writeCsv({KDPoint<double>({1, 2}), KDPoint<double>({3, 4})});
+    KDExternalBuilder<double> builder(1 << 10);
+    BOOST_CHECK_THROW(builder.build(csvFilename, treeFilename), std::domain_error);
+
+    writeCsv({});
+    KDExternalBuilder<double> emptyBuilder(1 << 20);
+    BOOST_CHECK_THROW(emptyBuilder.build(csvFilename, treeFilename), std::runtime_error);
+
+    std::remove(csvFilename);
+    std::remove(treeFilename);
+}
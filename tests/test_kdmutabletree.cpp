@@ -0,0 +1,159 @@
+#include <kdmutabletree.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+
+KDPoint<double> generatePoint(size_t K, std::mt19937 & e2)
+{
+    std::uniform_real_distribution<> dist(-100, 100);
+    std::vector<double> coords(K);
+    for (auto & coordinate : coords) {
+        coordinate = dist(e2);
+    }
+    return KDPoint<double>(coords);
+}
+
+/// check the closest point against all the points the tree must have
+void checkClosestPoints(KDMutableTree<double> const & tree,
+                        std::map<size_t, KDPoint<double>> const & points,
+                        std::mt19937 & e2)
+{
+    BOOST_CHECK_EQUAL(tree.size(), points.size());
+    for (size_t j = 0; j < 20; ++j) {
+        auto p = generatePoint(tree.getK(), e2);
+        double minSquareDistance = std::numeric_limits<double>::max();
+        for (auto const & point : points) {
+            minSquareDistance = std::min(minSquareDistance, point.second.squareDistanceToPoint(p));
+        }
+        size_t closestPointId = 0;
+        auto closestPoint = tree.findClosestPoint(p, closestPointId);
+        BOOST_CHECK(points.count(closestPointId) == 1);
+        BOOST_CHECK(closestPoint == points.at(closestPointId));
+        BOOST_CHECK_EQUAL(closestPoint.squareDistanceToPoint(p), minSquareDistance);
+    }
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( KDMutableTreeTest_insertAndErase )
+{
+    std::mt19937 e2(31);
+    const size_t K = 3;
+    std::vector<KDPoint<double>> initialPoints;
+    std::map<size_t, KDPoint<double>> points;
+    for (size_t i = 0; i < 1000; ++i) {
+        initialPoints.push_back(generatePoint(K, e2));
+        points.insert(std::make_pair(i, initialPoints.back()));
+    }
+    KDMutableTree<double> tree(initialPoints, K, 4);
+    checkClosestPoints(tree, points, e2);
+
+    /// insert a lot of points, so they are carried through several levels
+    for (size_t i = 0; i < 3000; ++i) {
+        auto p = generatePoint(K, e2);
+        size_t id = tree.insert(p);
+        BOOST_CHECK_EQUAL(id, 1000 + i);
+        points.insert(std::make_pair(id, p));
+        if (i % 500 == 0) {
+            checkClosestPoints(tree, points, e2);
+        }
+    }
+    BOOST_CHECK(tree.getTreesNumber() > 1);
+    checkClosestPoints(tree, points, e2);
+
+    /// erase points from the buffer and from the levels, so some of them are rebuilt
+    std::uniform_int_distribution<size_t> idDist(0, 3999);
+    for (size_t i = 0; i < 3000; ++i) {
+        size_t id = idDist(e2);
+        BOOST_CHECK_EQUAL(tree.erase(id), points.erase(id) == 1);
+        BOOST_CHECK(!tree.contains(id));
+        if (i % 500 == 0) {
+            checkClosestPoints(tree, points, e2);
+        }
+    }
+    checkClosestPoints(tree, points, e2);
+    for (auto const & point : points) {
+        BOOST_CHECK(tree.getPoint(point.first) == point.second);
+    }
+
+    /// erase everything
+    for (auto const & point : points) {
+        BOOST_CHECK(tree.erase(point.first));
+    }
+    BOOST_CHECK_EQUAL(tree.size(), 0);
+    BOOST_CHECK(!tree.erase(5000));
+    size_t closestPointId = 0;
+    BOOST_CHECK_EXCEPTION(
+                tree.findClosestPoint(generatePoint(K, e2), closestPointId),
+                std::domain_error, [](std::domain_error const &){return true;});
+    BOOST_CHECK_EXCEPTION(
+                tree.getPoint(0),
+                std::out_of_range, [](std::out_of_range const &){return true;});
+
+    auto p = generatePoint(K, e2);
+    size_t id = tree.insert(p);
+    BOOST_CHECK(tree.findClosestPoint(generatePoint(K, e2), closestPointId) == p);
+    BOOST_CHECK_EQUAL(closestPointId, id);
+}
+
+BOOST_AUTO_TEST_CASE( KDMutableTreeTest_compaction )
+{
+    std::mt19937 e2(33);
+    const size_t K = 2;
+    std::vector<KDPoint<double>> initialPoints;
+    std::map<size_t, KDPoint<double>> points;
+    for (size_t i = 0; i < 20000; ++i) {
+        initialPoints.push_back(generatePoint(K, e2));
+        points.insert(std::make_pair(i, initialPoints.back()));
+    }
+    KDMutableTree<double> tree(initialPoints, K, 8);
+
+    /// the small levels grow by 8, so there are at most 3 of them below the initial tree,
+    /// and they are merged into it when they have more than 1/8 of its points
+    size_t maxTreesNumber = 0;
+    bool isCompacted = false;
+    KDSearchContext<double> context;
+    for (size_t i = 0; i < 5000; ++i) {
+        auto p = generatePoint(K, e2);
+        points.insert(std::make_pair(tree.insert(p), p));
+        maxTreesNumber = std::max(maxTreesNumber, tree.getTreesNumber());
+        isCompacted = isCompacted || (i > 1000 && tree.getTreesNumber() == 1);
+        if (i % 250 == 0) {
+            auto q = generatePoint(K, e2);
+            size_t closestPointId = 0;
+            size_t contextClosestPointId = 0;
+            auto closestPoint = tree.findClosestPoint(q, closestPointId);
+            BOOST_CHECK(tree.findClosestPoint(q, contextClosestPointId, context) == closestPoint);
+            BOOST_CHECK_EQUAL(contextClosestPointId, closestPointId);
+        }
+    }
+    BOOST_CHECK(maxTreesNumber > 1);
+    BOOST_CHECK(maxTreesNumber <= 4);
+    BOOST_CHECK(isCompacted);
+    checkClosestPoints(tree, points, e2);
+}
+
+BOOST_AUTO_TEST_CASE( KDMutableTreeTest_emptyAndInvalid )
+{
+    std::mt19937 e2(32);
+    KDMutableTree<double> tree(2);
+    std::map<size_t, KDPoint<double>> points;
+    for (size_t i = 0; i < 600; ++i) {
+        auto p = generatePoint(2, e2);
+        points.insert(std::make_pair(tree.insert(p), p));
+    }
+    checkClosestPoints(tree, points, e2);
+
+    BOOST_CHECK_EXCEPTION(
+                tree.insert(KDPoint<double>({1, 2, 3})),
+                std::length_error, [](std::length_error const &){return true;});
+    BOOST_CHECK_EXCEPTION(
+                KDMutableTree<double>(0),
+                std::domain_error, [](std::domain_error const &){return true;});
+}
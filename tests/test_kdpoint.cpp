@@ -23,3 +23,16 @@ BOOST_AUTO_TEST_CASE( KDPointTest_correctDistance )
     KDPoint<float> p2({1, -1, 5});
     BOOST_CHECK(p1.squareDistanceToPoint(p2) == 38);
 }
+
+BOOST_AUTO_TEST_CASE( KDPointTest_fixedSizePoint )
+{
+    KDPoint<float, 3> p1(std::array<float, 3>{{-4, 2, 3}});
+    std::vector<float> coords({1, -1, 5});
+    KDPoint<float, 3> p2(coords.data(), coords.data() + coords.size());
+    BOOST_CHECK_EQUAL(p1.size(), 3);
+    BOOST_CHECK(p1.squareDistanceToPoint(p2) == 38);
+    BOOST_CHECK_EXCEPTION(p1.at(3), std::out_of_range, [](std::out_of_range const &){return true;});
+    typedef KDPoint<float, 2> Point2;
+    BOOST_CHECK_EXCEPTION(Point2(coords.data(), coords.data() + 3),
+                          std::length_error, [](std::length_error const &){return true;});
+}
@@ -39,3 +39,83 @@ BOOST_AUTO_TEST_CASE( KDPointStorageTest_findPivotAndPartitionAndClosestPointSea
     BOOST_CHECK_EQUAL(i, 5);
     BOOST_CHECK(minSDistance < 5.001 );
 }
+
+BOOST_AUTO_TEST_CASE( KDPointStorageTest_reorderInLeafOrder )
+{
+    std::vector<KDPoint<float>> points({KDPoint<float>({1, -1}),
+                                        KDPoint<float>({5, 3}),
+                                        KDPoint<float>({6, -4}),
+                                        KDPoint<float>({5, 5}),
+                                        KDPoint<float>({10, -6}),
+                                        KDPoint<float>({-3, 2})
+                                       });
+
+    for (auto layout : {KDPointsLayout::Indexed, KDPointsLayout::AoS, KDPointsLayout::SoA}) {
+        KDPointStorage<float> storage(points, 2, layout);
+        storage.findPivot(0, storage.size(), 0);
+        storage.partition(0, storage.size(), 0, 5);
+        /// points indecis: (0, 5), (1, 2, 3, 4)
+        storage.reorderInLeafOrder();
+
+        for (size_t i = 0; i < points.size(); ++i) {
+            BOOST_CHECK(storage.getPointByOriginalI(i) == points[i]);
+        }
+
+        size_t i = 100;
+        float minSDistance = 1000;
+        storage.findClosestPoint(KDPoint<float>({-2, 0}), minSDistance, i, 0, 2);
+        BOOST_CHECK_EQUAL(i, 5);
+        BOOST_CHECK(minSDistance < 5.001 );
+
+        minSDistance = 1000;
+        storage.findClosestPoint(KDPoint<float>({9, -5}), minSDistance, i, 2, storage.size());
+        BOOST_CHECK_EQUAL(i, 4);
+        BOOST_CHECK(minSDistance < 2.001 );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( KDPointStorageTest_movedCoordinates )
+{
+    KDPointStorage<float> storage(std::vector<float>({1, -1, 5, 3, 6, -4}), 2);
+    BOOST_CHECK_EQUAL(storage.size(), 3);
+    BOOST_CHECK(storage.getPointByOriginalI(1) == KDPoint<float>({5, 3}));
+
+    BOOST_CHECK_EXCEPTION(
+                KDPointStorage<float>(std::vector<float>({1, -1, 5}), 2),
+                std::domain_error, [](std::domain_error const &){return true;});
+    BOOST_CHECK_EXCEPTION(
+                KDPointStorage<float>(std::vector<float>(), 2),
+                std::domain_error, [](std::domain_error const &){return true;});
+}
+
+BOOST_AUTO_TEST_CASE( KDPointStorageTest_borrowedCoordinates )
+{
+    std::vector<float> coordinates({1, -1, 5, 3, 6, -4});
+    KDPointStorage<float> storage(coordinates.data(), 3, 2, KDPointsLayout::Indexed);
+    BOOST_CHECK_EQUAL(storage.size(), 3);
+    BOOST_CHECK(storage.getPointByOriginalI(2) == KDPoint<float>({6, -4}));
+    /// the buffer is used, not copied
+    coordinates[4] = 7;
+    BOOST_CHECK(storage.getPointByOriginalI(2) == KDPoint<float>({7, -4}));
+
+    /// the owner keeps the adopted buffer alive
+    auto ownedCoordinates = std::make_shared<std::vector<float>>(coordinates);
+    KDPointStorage<float> adoptingStorage(ownedCoordinates->data(), 3, 2,
+                                          KDPointsLayout::AoS, ownedCoordinates);
+    std::weak_ptr<std::vector<float>> weakCoordinates = ownedCoordinates;
+    ownedCoordinates.reset();
+    BOOST_CHECK(!weakCoordinates.expired());
+    BOOST_CHECK(adoptingStorage.getPointByOriginalI(1) == KDPoint<float>({5, 3}));
+
+    /// the buffer is not used once coordinates are copied in leaf order
+    adoptingStorage.reorderInLeafOrder();
+    BOOST_CHECK(weakCoordinates.expired());
+    BOOST_CHECK(adoptingStorage.getPointByOriginalI(1) == KDPoint<float>({5, 3}));
+
+    BOOST_CHECK_EXCEPTION(
+                KDPointStorage<float>(coordinates.data(), 0, 2),
+                std::domain_error, [](std::domain_error const &){return true;});
+    BOOST_CHECK_EXCEPTION(
+                KDPointStorage<float>(nullptr, 3, 2),
+                std::domain_error, [](std::domain_error const &){return true;});
+}
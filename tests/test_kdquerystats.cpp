@@ -0,0 +1,149 @@
+#include <kdquerystats.hpp>
+#include <kdtree.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+#include <random>
+#include <sstream>
+#include <vector>
+
+BOOST_AUTO_TEST_CASE( KDQueryStatsTest_histogram )
+{
+    KDHistogram histogram;
+    BOOST_CHECK_EQUAL(histogram.getNumber(), 0);
+    BOOST_CHECK_EQUAL(histogram.getPercentile(0.5), 0);
+
+    for (std::uint64_t value : {0, 1, 2, 3, 4, 7, 8, 1000}) {
+        histogram.add(value);
+    }
+    BOOST_CHECK_EQUAL(histogram.getNumber(), 8);
+    BOOST_CHECK_EQUAL(histogram.getMax(), 1000);
+    BOOST_CHECK_EQUAL(histogram.getMean(), 1025.0 / 8);
+    BOOST_CHECK_EQUAL(histogram.getCount(0), 1);
+    BOOST_CHECK_EQUAL(histogram.getCount(1), 1);
+    BOOST_CHECK_EQUAL(histogram.getCount(2), 2);
+    BOOST_CHECK_EQUAL(histogram.getCount(3), 2);
+    BOOST_CHECK_EQUAL(histogram.getCount(4), 1);
+    BOOST_CHECK_EQUAL(histogram.getCount(10), 1);
+    BOOST_CHECK_EQUAL(KDHistogram::getBucketUpperBound(0), 0);
+    BOOST_CHECK_EQUAL(KDHistogram::getBucketUpperBound(3), 7);
+    BOOST_CHECK_EQUAL(KDHistogram::getBucketUpperBound(64),
+                      std::numeric_limits<std::uint64_t>::max());
+    BOOST_CHECK_EQUAL(histogram.getPercentile(0.5), 3);
+    BOOST_CHECK_EQUAL(histogram.getPercentile(1), 1000);
+
+    KDHistogram other;
+    other.add(std::numeric_limits<std::uint64_t>::max());
+    histogram.merge(other);
+    BOOST_CHECK_EQUAL(histogram.getNumber(), 9);
+    BOOST_CHECK_EQUAL(histogram.getCount(64), 1);
+    BOOST_CHECK_EQUAL(histogram.getMax(), std::numeric_limits<std::uint64_t>::max());
+}
+
+BOOST_AUTO_TEST_CASE( KDQueryStatsTest_treeQueries )
+{
+    std::mt19937 e2(23);
+    std::uniform_real_distribution<> dist(-100, 100);
+    std::vector<KDPoint<double>> points;
+    std::vector<KDPoint<double>> queries;
+    for (size_t i = 0; i < 3000; ++i) {
+        std::vector<double> coords({dist(e2), dist(e2), dist(e2)});
+        (i < 2000 ? points : queries).push_back(KDPoint<double>(coords));
+    }
+    KDTree<double> tree(new KDPointStorage<double>(points, 3), 4);
+
+    KDQueryStats totalStats;
+    KDQueryHistograms histograms;
+    for (auto const & query : queries) {
+        KDQueryStats stats;
+        size_t closestPointI = 0;
+        size_t measuredClosestPointI = 0;
+        tree.findClosestPoint(query, closestPointI, stats);
+        tree.findClosestPoint(query, measuredClosestPointI, histograms);
+        BOOST_CHECK_EQUAL(closestPointI, measuredClosestPointI);
+
+        /// the first leaf is found without backtracks, every backtrack adds a subnode
+        BOOST_CHECK(stats.scannedLeavesNumber >= 1);
+        BOOST_CHECK(stats.computedDistancesNumber >= stats.scannedLeavesNumber);
+        BOOST_CHECK(stats.computedDistancesNumber <= stats.scannedLeavesNumber * 4);
+        BOOST_CHECK(stats.getVisitedIntermediateNodesNumber() >= stats.backtracksNumber);
+        totalStats.visitedNodesNumber += stats.visitedNodesNumber;
+        totalStats.backtracksNumber += stats.backtracksNumber;
+    }
+    BOOST_CHECK_EQUAL(histograms.latencyNanoseconds.getNumber(), queries.size());
+    BOOST_CHECK_EQUAL(histograms.visitedNodes.getMean(),
+                      double(totalStats.visitedNodesNumber) / queries.size());
+    BOOST_CHECK_EQUAL(histograms.backtracks.getMean(),
+                      double(totalStats.backtracksNumber) / queries.size());
+
+    /// batch queries add the same work in parallel
+    KDThreadPool pool(3);
+    KDQueryHistograms batchHistograms;
+    std::vector<KDQueryResult<double>> results(queries.size());
+    tree.findClosestPoints(queries.data(), queries.size(), results.data(), &pool, &batchHistograms);
+    BOOST_CHECK_EQUAL(batchHistograms.visitedNodes.getNumber(), queries.size());
+    BOOST_CHECK_EQUAL(batchHistograms.visitedNodes.getMean(), histograms.visitedNodes.getMean());
+    BOOST_CHECK_EQUAL(batchHistograms.computedDistances.getMean(),
+                      histograms.computedDistances.getMean());
+
+    KDApproximateSearch search;
+    search.maxLeavesNumber = 2;
+    KDQueryHistograms approximateHistograms;
+    tree.findApproximateClosestPoints(queries.data(), queries.size(), results.data(), search,
+                                      nullptr, &approximateHistograms);
+    BOOST_CHECK_EQUAL(approximateHistograms.scannedLeaves.getMax(), 2);
+
+    /// reranked queries count the work of the search of their candidates
+    KDTree<double> quantizedTree(new KDPointStorage<double>(points, 3), 4);
+    quantizedTree.quantize(KDQuantization::Int16);
+    KDQueryHistograms rerankHistograms;
+    quantizedTree.findRerankedClosestPoints(queries.front().data(), 1, results.data(), 8, tree,
+                                            nullptr, &rerankHistograms);
+    BOOST_CHECK_EQUAL(rerankHistograms.visitedNodes.getNumber(), 1);
+    BOOST_CHECK_EQUAL(rerankHistograms.visitedNodes.getCount(0), 0);
+    BOOST_CHECK_EQUAL(rerankHistograms.scannedLeaves.getCount(0), 0);
+    BOOST_CHECK_GE(rerankHistograms.computedDistances.getMean(), 8);
+
+    std::stringstream stream;
+    stream << histograms;
+    BOOST_CHECK(stream.str().find("backtracks: number 1000") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE( KDQueryStatsTest_treeShape )
+{
+    /// 8 points in leaves of 2 points make the balanced tree of 4 leaves
+    std::vector<KDPoint<double>> points;
+    for (int i = 0; i < 8; ++i) {
+        points.push_back(KDPoint<double>({double(i), double(i)}));
+    }
+    KDTree<double> tree(new KDPointStorage<double>(points, 2), 2);
+    auto shape = tree.getShape();
+    BOOST_CHECK_EQUAL(shape.depth, tree.getDepth());
+    BOOST_CHECK_EQUAL(shape.nodesNumber, 7);
+    BOOST_CHECK_EQUAL(shape.leavesNumber, 4);
+    BOOST_CHECK_EQUAL(shape.minLeafSize, 2);
+    BOOST_CHECK_EQUAL(shape.maxLeafSize, 2);
+    BOOST_CHECK_EQUAL(shape.meanLeafSize, 2);
+    BOOST_CHECK_EQUAL(shape.leafSizes.at(2), 4);
+    BOOST_CHECK_EQUAL(shape.minLeafDepth, 3);
+    BOOST_CHECK_EQUAL(shape.meanLeafDepth, 3);
+    BOOST_CHECK_EQUAL(shape.imbalance, 1);
+
+    /// duplicates are kept in one leaf, so the tree is not balanced
+    points.clear();
+    for (int i = 0; i < 8; ++i) {
+        points.push_back(KDPoint<double>({double(i), double(i)}));
+        points.push_back(KDPoint<double>({100, 100}));
+    }
+    KDTree<double> unbalancedTree(new KDPointStorage<double>(points, 2), 1);
+    shape = unbalancedTree.getShape();
+    BOOST_CHECK_EQUAL(shape.maxLeafSize, 8);
+    BOOST_CHECK_EQUAL(shape.leafSizes.at(1), 8);
+    BOOST_CHECK(shape.minLeafDepth < shape.depth);
+    BOOST_CHECK(shape.imbalance >= 1);
+
+    KDTree<double> emptyTree;
+    BOOST_CHECK_EXCEPTION(
+                emptyTree.getShape(),
+                std::domain_error, [](std::domain_error const &){return true;});
+}
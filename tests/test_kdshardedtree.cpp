@@ -0,0 +1,281 @@
+#include <kdshardedtree.hpp>
+#include <kdtreefile.hpp>
+
+#include "kdtesthelpers.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::vector<KDPoint<double>> generatePoints(size_t pointsNumber, size_t K, std::mt19937 & e2)
+{
+    std::normal_distribution<> dist(0, 10);
+    return generateKDRandomPoints(pointsNumber, K, dist, e2);
+}
+
+void writeAll(int fd, void const * data, size_t size)
+{
+    char const * bytes = static_cast<char const *>(data);
+    while (size > 0) {
+        ssize_t written = ::write(fd, bytes, size);
+        if (written <= 0) {
+            throw std::runtime_error("pipe can not be written");
+        }
+        bytes += written;
+        size -= written;
+    }
+}
+
+bool readAll(int fd, void * data, size_t size)
+{
+    char * bytes = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t read = ::read(fd, bytes, size);
+        if (read <= 0) {
+            return false;
+        }
+        bytes += read;
+        size -= read;
+    }
+    return true;
+}
+
+/// Process which maps the tree file of one shard and answers the closest point queries
+/// sent by the pipe: the number of points and their coordinates are sent, the indices
+/// in the shard and the square distances are answered.
+struct ShardProcess {
+    /// the pipes of the other processes are closed in the child, so they see the end of
+    /// their requests when the test closes them
+    ShardProcess(std::string const & treeFilename, size_t K,
+                 std::vector<ShardProcess> const & otherProcesses)
+    {
+        int requests[2];
+        int responses[2];
+        if (::pipe(requests) != 0 || ::pipe(responses) != 0) {
+            throw std::runtime_error("pipe can not be created");
+        }
+        pid = ::fork();
+        if (pid == 0) {
+            ::close(requests[1]);
+            ::close(responses[0]);
+            for (auto const & process : otherProcesses) {
+                ::close(process.requestFd);
+                ::close(process.responseFd);
+            }
+            int exitCode = 0;
+            try {
+                serve(treeFilename, K, requests[0], responses[1]);
+            } catch (...) {
+                exitCode = 1;
+            }
+            /// the child must not run the destructors and the checks of the test process
+            ::_exit(exitCode);
+        }
+        ::close(requests[0]);
+        ::close(responses[1]);
+        requestFd = requests[1];
+        responseFd = responses[0];
+    }
+
+    static void serve(std::string const & treeFilename, size_t K, int requestFd, int responseFd)
+    {
+        KDTree<double> tree;
+        KDTreeFile::map(treeFilename, tree);
+        KDSearchContext<double> context;
+        std::uint64_t pointsNumber = 0;
+        std::vector<double> coordinates;
+        while (readAll(requestFd, &pointsNumber, sizeof(pointsNumber))) {
+            coordinates.resize(pointsNumber * K);
+            if (!readAll(requestFd, coordinates.data(), coordinates.size() * sizeof(double))) {
+                throw std::runtime_error("query points can not be read");
+            }
+            for (size_t i = 0; i < pointsNumber; ++i) {
+                auto result = tree.findClosestPoint(
+                            KDPointView<double>(&coordinates[i * K], K), context);
+                std::uint64_t originalI = result.originalI;
+                writeAll(responseFd, &originalI, sizeof(originalI));
+                writeAll(responseFd, &result.squareDistance, sizeof(result.squareDistance));
+            }
+        }
+    }
+
+    std::vector<KDQueryResult<double>> query(std::vector<double> const & coordinates, size_t K)
+    {
+        std::uint64_t pointsNumber = coordinates.size() / K;
+        writeAll(requestFd, &pointsNumber, sizeof(pointsNumber));
+        writeAll(requestFd, coordinates.data(), coordinates.size() * sizeof(double));
+        std::vector<KDQueryResult<double>> results(pointsNumber);
+        for (auto & result : results) {
+            std::uint64_t originalI = 0;
+            BOOST_REQUIRE(readAll(responseFd, &originalI, sizeof(originalI)));
+            BOOST_REQUIRE(readAll(responseFd, &result.squareDistance,
+                                  sizeof(result.squareDistance)));
+            result.originalI = originalI;
+        }
+        return results;
+    }
+
+    /// returns the exit code of the process
+    int stop()
+    {
+        ::close(requestFd);
+        ::close(responseFd);
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+
+    pid_t pid;
+    int requestFd;
+    int responseFd;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE( KDShardedTreeTest_sameAsOneTree )
+{
+    std::mt19937 e2(41);
+    const size_t K = 3;
+    auto points = generatePoints(5000, K, e2);
+    auto queries = generatePoints(300, K, e2);
+    KDTree<double> tree(new KDPointStorage<double>(points, K), 2);
+
+    KDThreadPool pool(3);
+    for (size_t shardsNumber : {1, 3, 8}) {
+        for (auto split : {KDSplitStrategy::Median, KDSplitStrategy::SlidingMidpoint}) {
+            KDShardedTree<double> shardedTree(points, K, shardsNumber, 2, split,
+                                              KDPointsLayout::SoA, &pool);
+            BOOST_CHECK_EQUAL(shardedTree.size(), points.size());
+            BOOST_CHECK_EQUAL(shardedTree.getShardsNumber(), shardsNumber == 3 ? 2 : shardsNumber);
+            size_t shardsPointsNumber = 0;
+            for (size_t shardI = 0; shardI < shardedTree.getShardsNumber(); ++shardI) {
+                auto const & shard = shardedTree.getShard(shardI);
+                shardsPointsNumber += shard.size();
+                for (size_t i = 0; i < shard.size(); ++i) {
+                    BOOST_CHECK(shard.getPoint(i) == points[shardedTree.getOriginalI(shardI, i)]);
+                }
+            }
+            BOOST_CHECK_EQUAL(shardsPointsNumber, points.size());
+
+            for (auto const & query : queries) {
+                size_t originalI = 0;
+                tree.findClosestPoint(query, originalI);
+                auto result = shardedTree.findClosestPoint(query);
+                BOOST_CHECK_EQUAL(result.originalI, originalI);
+                BOOST_CHECK_EQUAL(result.squareDistance,
+                                  points[originalI].squareDistanceToPoint(query));
+
+                std::vector<KDNeighbour<double>> nearest;
+                std::vector<KDNeighbour<double>> shardedNearest;
+                tree.findKNearest(query, 7, nearest);
+                shardedTree.findKNearest(query, 7, shardedNearest);
+                BOOST_CHECK(shardedNearest == nearest);
+            }
+
+            /// any k can be asked, all the points are found then
+            std::vector<KDNeighbour<double>> nearest;
+            std::vector<KDNeighbour<double>> shardedNearest;
+            tree.findKNearest(queries.front(), std::numeric_limits<size_t>::max(), nearest);
+            shardedTree.findKNearest(queries.front(), std::numeric_limits<size_t>::max(),
+                                     shardedNearest);
+            BOOST_CHECK_EQUAL(shardedNearest.size(), points.size());
+            BOOST_CHECK(shardedNearest == nearest);
+        }
+    }
+
+    /// the same points can not be split into shards
+    std::vector<KDPoint<double>> samePoints(100, KDPoint<double>({1, 2}));
+    KDShardedTree<double> sameTree(samePoints, 2, 4);
+    BOOST_CHECK_EQUAL(sameTree.getShardsNumber(), 1u);
+    BOOST_CHECK_EQUAL(sameTree.findClosestPoint(KDPoint<double>({1, 3})).squareDistance, 1);
+
+    BOOST_CHECK_THROW(KDShardedTree<double>(points, K, 0), std::domain_error);
+    BOOST_CHECK_THROW(KDShardedTree<double>(points, K + 1, 2), std::length_error);
+    BOOST_CHECK_THROW(KDShardedTree<double>(points, K, 2).findClosestPoint(KDPoint<double>({1, 2})),
+                      std::length_error);
+}
+
+BOOST_AUTO_TEST_CASE( KDShardedTreeTest_shardProcesses )
+{
+    std::mt19937 e2(42);
+    const size_t K = 2;
+    auto points = generatePoints(4000, K, e2);
+    auto queries = generatePoints(500, K, e2);
+    KDTree<double> tree(new KDPointStorage<double>(points, K), 2);
+    KDShardedTree<double> shardedTree(points, K, 4, 2);
+    BOOST_REQUIRE_EQUAL(shardedTree.getShardsNumber(), 4u);
+
+    /// every shard is served by its own process from its own file
+    std::vector<std::string> filenames;
+    std::vector<ShardProcess> processes;
+    for (size_t shardI = 0; shardI < shardedTree.getShardsNumber(); ++shardI) {
+        filenames.push_back("t_kdshardedtree_test" + std::to_string(shardI) + ".bin");
+        KDTreeFile::save(shardedTree.getShard(shardI), filenames.back());
+        processes.push_back(ShardProcess(filenames.back(), K, processes));
+    }
+
+    /// the router sends every query to its home shard first, then only to the shards
+    /// which bounding boxes are closer than the found point
+    std::vector<KDQueryResult<double>> results(queries.size());
+    std::vector<bool> isSent(queries.size());
+    size_t sentQueriesNumber = 0;
+    for (size_t roundI = 0; roundI < 2; ++roundI) {
+        std::vector<std::vector<size_t>> shardQueryIs(processes.size());
+        for (size_t queryI = 0; queryI < queries.size(); ++queryI) {
+            size_t homeShardI = shardedTree.getHomeShardI(queries[queryI]);
+            for (size_t shardI = 0; shardI < processes.size(); ++shardI) {
+                if (roundI == 0 ? shardI == homeShardI :
+                        shardI != homeShardI &&
+                        shardedTree.getSquareDistanceToShard(queries[queryI], shardI) <
+                        results[queryI].squareDistance) {
+                    shardQueryIs[shardI].push_back(queryI);
+                }
+            }
+        }
+        for (size_t shardI = 0; shardI < processes.size(); ++shardI) {
+            std::vector<double> coordinates;
+            for (size_t queryI : shardQueryIs[shardI]) {
+                auto const & query = queries[queryI];
+                coordinates.insert(coordinates.end(), query.data(), query.data() + K);
+            }
+            sentQueriesNumber += shardQueryIs[shardI].size();
+            auto shardResults = processes[shardI].query(coordinates, K);
+            for (size_t i = 0; i < shardResults.size(); ++i) {
+                size_t queryI = shardQueryIs[shardI][i];
+                if (!isSent[queryI] ||
+                        shardResults[i].squareDistance < results[queryI].squareDistance) {
+                    results[queryI].originalI = shardedTree.getOriginalI(
+                                shardI, shardResults[i].originalI);
+                    results[queryI].squareDistance = shardResults[i].squareDistance;
+                    isSent[queryI] = true;
+                }
+            }
+        }
+    }
+    for (auto & process : processes) {
+        BOOST_CHECK_EQUAL(process.stop(), 0);
+    }
+    for (auto const & filename : filenames) {
+        std::remove(filename.c_str());
+    }
+
+    for (size_t queryI = 0; queryI < queries.size(); ++queryI) {
+        size_t originalI = 0;
+        tree.findClosestPoint(queries[queryI], originalI);
+        BOOST_CHECK_EQUAL(results[queryI].originalI, originalI);
+        BOOST_CHECK_EQUAL(results[queryI].originalI,
+                          shardedTree.findClosestPoint(queries[queryI]).originalI);
+    }
+    /// most of the queries are answered by their home shards only
+    BOOST_CHECK_LT(sentQueriesNumber, 2 * queries.size());
+}
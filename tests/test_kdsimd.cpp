@@ -0,0 +1,66 @@
+#include <kdsimd.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+#include <random>
+#include <vector>
+
+template <typename T>
+void checkSimdKernelsAgainstScalar()
+{
+    std::mt19937 e2(7);
+    std::uniform_real_distribution<> dist(-100, 100);
+
+    for (size_t K = 1; K < 6; ++K) {
+        for (size_t pointsNumber = 1; pointsNumber < 70; pointsNumber += 3) {
+            /// the points are stored with bigger stride to check it is used correctly
+            size_t stride = pointsNumber + 5;
+            std::vector<T> coordinates(stride * K);
+            for (auto & coordinate : coordinates) {
+                coordinate = dist(e2);
+            }
+            /// put the same point twice to check that the first one is found
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                coordinates[coordinateI * stride + pointsNumber - 1] =
+                        coordinates[coordinateI * stride + pointsNumber / 2];
+            }
+            std::vector<T> p(K);
+            for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+                p[coordinateI] = coordinates[coordinateI * stride + pointsNumber / 2] + 0.01;
+            }
+
+            T scalarDistance = std::numeric_limits<T>::max();
+            size_t scalarI = KDScalarKernels<T>::findClosestPointSoA(
+                        coordinates.data(), stride, K, p.data(), pointsNumber, scalarDistance);
+            BOOST_CHECK_EQUAL(scalarI, pointsNumber / 2);
+
+            for (auto level : {KDSimdLevel::Scalar, KDSimdLevel::SSE,
+                               KDSimdLevel::AVX2, KDSimdLevel::AVX512}) {
+                if (level > kdSupportedSimdLevel())
+                    continue;
+
+                T distance = std::numeric_limits<T>::max();
+                size_t i = KDSimdKernels<T>::findClosestPointSoA(
+                            coordinates.data(), stride, K, p.data(), pointsNumber, distance, level);
+                BOOST_CHECK_EQUAL(i, scalarI);
+                BOOST_CHECK_EQUAL(distance, scalarDistance);
+
+                /// nothing is closer than the point that is already found
+                size_t notFoundI = KDSimdKernels<T>::findClosestPointSoA(
+                            coordinates.data(), stride, K, p.data(), pointsNumber, distance, level);
+                BOOST_CHECK_EQUAL(notFoundI, pointsNumber);
+                BOOST_CHECK_EQUAL(distance, scalarDistance);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( KDSimdKernels_float )
+{
+    checkSimdKernelsAgainstScalar<float>();
+}
+
+BOOST_AUTO_TEST_CASE( KDSimdKernels_double )
+{
+    checkSimdKernelsAgainstScalar<double>();
+}
@@ -0,0 +1,116 @@
+#include <kdsplitstorages.hpp>
+#include <kdtree.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+
+#include <random>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+const KDSplitStrategy splitStrategies[] = {
+    KDSplitStrategy::Median,
+    KDSplitStrategy::MaxSpread,
+    KDSplitStrategy::SlidingMidpoint,
+    KDSplitStrategy::CostModel
+};
+
+/// anisotropic points with some duplicates
+std::vector<double> generateCoordinates(size_t pointsNumber, size_t K, std::mt19937 & e2)
+{
+    std::uniform_real_distribution<> dist(0, 1);
+    std::vector<double> coordinates;
+    for (size_t i = 0; i < pointsNumber; ++i) {
+        if (i % 10 == 9) {
+            std::vector<double> previous(coordinates.end() - K, coordinates.end());
+            coordinates.insert(coordinates.end(), previous.begin(), previous.end());
+            continue;
+        }
+        for (size_t coordinateI = 0; coordinateI < K; ++coordinateI) {
+            coordinates.push_back(dist(e2) * (coordinateI == 0 ? 1000 : 1));
+        }
+    }
+    return coordinates;
+}
+
+double findMinSquareDistance(std::vector<double> const & coordinates,
+                             KDPoint<double> const & p)
+{
+    double minSquareDistance = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < coordinates.size(); i += p.size()) {
+        KDPoint<double> point(&coordinates[i], &coordinates[i] + p.size());
+        minSquareDistance = std::min(minSquareDistance, point.squareDistanceToPoint(p));
+    }
+    return minSquareDistance;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( KDSplitStoragesTest_closestPointsAreFound )
+{
+    std::mt19937 e2(21);
+    const size_t K = 3;
+    auto coordinates = generateCoordinates(2000, K, e2);
+    auto queryCoordinates = generateCoordinates(200, K, e2);
+
+    for (auto strategy : splitStrategies) {
+        for (size_t leafSize : {1, 5}) {
+            KDTree<double> tree(makeKDPointStorage<double>(
+                                    strategy, std::vector<double>(coordinates), K),
+                                leafSize);
+            KDQueryStats stats;
+            for (size_t i = 0; i < queryCoordinates.size(); i += K) {
+                KDPoint<double> query(&queryCoordinates[i], &queryCoordinates[i] + K);
+                size_t closestPointI = 0;
+                auto closestPoint = tree.findClosestPoint(query, closestPointI, stats);
+                BOOST_CHECK_EQUAL(closestPoint.squareDistanceToPoint(query),
+                                  findMinSquareDistance(coordinates, query));
+            }
+            BOOST_CHECK(stats.scannedLeavesNumber >= queryCoordinates.size() / K);
+            BOOST_CHECK(stats.visitedNodesNumber >= stats.scannedLeavesNumber);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( KDSplitStoragesTest_samePoints )
+{
+    std::vector<double> coordinates;
+    for (size_t i = 0; i < 100; ++i) {
+        coordinates.insert(coordinates.end(), {1, 2});
+    }
+    for (auto strategy : splitStrategies) {
+        KDTree<double> tree(makeKDPointStorage<double>(
+                                strategy, std::vector<double>(coordinates), 2));
+        BOOST_CHECK_EQUAL(tree.getDepth(), 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( KDSplitStoragesTest_serialization )
+{
+    std::mt19937 e2(22);
+    auto coordinates = generateCoordinates(500, 2, e2);
+    for (auto strategy : splitStrategies) {
+        KDTree<double> tree(makeKDPointStorage<double>(
+                                strategy, std::vector<double>(coordinates), 2), 3);
+        std::stringstream stream;
+        {
+            boost::archive::text_oarchive oa{stream};
+            oa << tree;
+        }
+        KDTree<double> loadedTree;
+        boost::archive::text_iarchive ia{stream};
+        ia >> loadedTree;
+
+        for (size_t i = 0; i < 50; ++i) {
+            KDPoint<double> query({coordinates[i * 2] + 0.5, coordinates[i * 2 + 1]});
+            size_t closestPointI = 0;
+            size_t loadedClosestPointI = 0;
+            tree.findClosestPoint(query, closestPointI);
+            loadedTree.findClosestPoint(query, loadedClosestPointI);
+            BOOST_CHECK_EQUAL(loadedClosestPointI, closestPointI);
+        }
+    }
+}
@@ -7,9 +7,8 @@
 
 #include <random>
 #include <chrono>
-
-BOOST_CLASS_EXPORT(KDTreeIntermediateNode<float>)
-BOOST_CLASS_EXPORT(KDTreeIntermediateNode<double>)
+#include <cstdint>
+#include <sstream>
 
 KDPoint<float> generateKDRandomPoint(size_t K,
                                      std::uniform_real_distribution<> & dist,
@@ -71,46 +70,247 @@ BOOST_AUTO_TEST_CASE( KDTreeTest_randomGeneratedTreesTest )
         }
 
         for (int pointsInFinalNode = 1; pointsInFinalNode < 5; ++pointsInFinalNode) {
-            KDTree<float> tree(new KDPointStorage<float>(points, dims), pointsInFinalNode);
+            for (auto layout : {KDPointsLayout::Indexed, KDPointsLayout::AoS,
+                                KDPointsLayout::SoA}) {
+                KDTree<float> tree(new KDPointStorage<float>(points, dims, layout),
+                                   pointsInFinalNode);
+
+                std::stringstream ss;
+                {
+                    boost::archive::text_oarchive oa{ss};
+                    oa << tree;
+                }
+
+                KDTree<float> restoredTree;
+                {
+                    boost::archive::text_iarchive ia{ss};
+                    ia >> restoredTree;
+                }
+
+                std::chrono::duration<double> totalTreeTime = std::chrono::duration<double>::zero();
+                std::chrono::duration<double> totalNaiveTime =
+                        std::chrono::duration<double>::zero();
+
+                for (int j = 0; j < 1000; ++j) {
+                    auto p = generateKDRandomPoint(dims, dist, e2);
+                    size_t bestPointI1 = 10000;
+                    auto start = std::chrono::steady_clock::now();
+                    auto closestPoint = restoredTree.findClosestPoint(p, bestPointI1);
+                    auto end = std::chrono::steady_clock::now();
+                    auto diff_tree = end - start;
+                    totalTreeTime += diff_tree;
+
+                    start = std::chrono::steady_clock::now();
+                    size_t bestPointI2 = findClosestPoint(points, p);
+                    end = std::chrono::steady_clock::now();
+                    auto diff_naive = end - start;
+                    totalNaiveTime += diff_naive;
+
+                    BOOST_CHECK_EQUAL(bestPointI1, bestPointI2);
+                    BOOST_CHECK(closestPoint == points[bestPointI2]);
+                }
+
+                /// Used for simple performance measurement
+//                std::cout << "search in tree duration: "<< totalTreeTime.count() << std::endl;
+//                std::cout << "naive search duration: " << totalNaiveTime.count() << std::endl;
 
-            std::stringstream ss;
-            {
-                boost::archive::text_oarchive oa{ss};
-                oa << tree;
             }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_fixedDimensionTree )
+{
+    /// the tree with K known at compile time should find the same points as the dynamic one
+    std::mt19937 e2(42);
+    std::uniform_real_distribution<> dist(-1000, 1000);
 
-            KDTree<float> restoredTree;
-            {
-                boost::archive::text_iarchive ia{ss};
-                ia >> restoredTree;
+    std::vector<KDPoint<float>> points;
+    std::vector<KDPoint<float, 3>> fixedPoints;
+    for (int i = 0; i < 200; ++i) {
+        points.push_back(generateKDRandomPoint(3, dist, e2));
+        fixedPoints.push_back(KDPoint<float, 3>(points.back().data(), points.back().data() + 3));
+    }
+
+    KDTree<float> tree(new KDPointStorage<float>(points, 3), 3);
+    KDTree<float, 3> fixedTree(new KDPointStorage<float, 3>(fixedPoints, 3), 3);
+    BOOST_CHECK_EQUAL(tree.getDepth(), fixedTree.getDepth());
+
+    for (int j = 0; j < 200; ++j) {
+        auto p = generateKDRandomPoint(3, dist, e2);
+        size_t i1 = 0, i2 = 0;
+        tree.findClosestPoint(p, i1);
+        auto closestPoint = fixedTree.findClosestPoint(KDPoint<float, 3>(p.data(), p.data() + 3), i2);
+        BOOST_CHECK_EQUAL(i1, i2);
+        BOOST_CHECK(closestPoint == fixedPoints[i2]);
+    }
+
+    typedef KDPointStorage<float, 3> FixedStorage;
+    BOOST_CHECK_EXCEPTION(
+                FixedStorage(fixedPoints, 2),
+                std::domain_error, [](std::domain_error const &){return true;});
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_kNearest )
+{
+    std::mt19937 e2(5);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+
+    for (int dims = 1; dims < 5; ++dims) {
+        std::vector<KDPoint<float>> points;
+        for (int i = 0; i < 100; ++i) {
+            points.push_back(generateKDRandomPoint(dims, dist, e2));
+        }
+
+        KDTree<float> tree(new KDPointStorage<float>(points, dims), 3);
+        std::vector<KDNeighbour<float>> nearestPoints;
+
+        for (int j = 0; j < 100; ++j) {
+            auto p = generateKDRandomPoint(dims, dist, e2);
+
+            std::vector<KDNeighbour<float>> allPoints;
+            for (size_t i = 0; i < points.size(); ++i) {
+                allPoints.push_back(KDNeighbour<float>(i, points[i].squareDistanceToPoint(p)));
             }
+            std::sort(allPoints.begin(), allPoints.end(),
+                      KDPointStorage<float>::compareNeighbours);
 
-            std::chrono::duration<double> totalTreeTime = std::chrono::duration<double>::zero();
-            std::chrono::duration<double> totalNaiveTime = std::chrono::duration<double>::zero();
+            for (size_t k : {size_t{1}, size_t{2}, size_t{7}, size_t{100}, size_t{150},
+                             std::numeric_limits<size_t>::max()}) {
+                tree.findKNearest(p, k, nearestPoints);
+                BOOST_CHECK_EQUAL(nearestPoints.size(), std::min(k, points.size()));
+                for (size_t i = 0; i < nearestPoints.size(); ++i) {
+                    BOOST_CHECK_EQUAL(nearestPoints[i].first, allPoints[i].first);
+                    BOOST_CHECK_EQUAL(nearestPoints[i].second, allPoints[i].second);
+                }
+            }
 
-            for (int j = 0; j < 1000; ++j) {
-                auto p = generateKDRandomPoint(dims, dist, e2);
-                size_t bestPointI1 = 10000;
-                auto start = std::chrono::steady_clock::now();
-                auto closestPoint = restoredTree.findClosestPoint(p, bestPointI1);
-                auto end = std::chrono::steady_clock::now();
-                auto diff_tree = end - start;
-                totalTreeTime += diff_tree;
-
-                start = std::chrono::steady_clock::now();
-                size_t bestPointI2 = findClosestPoint(points, p);
-                end = std::chrono::steady_clock::now();
-                auto diff_naive = end - start;
-                totalNaiveTime += diff_naive;
-
-                BOOST_CHECK_EQUAL(bestPointI1, bestPointI2);
-                BOOST_CHECK(closestPoint == points[bestPointI2]);
+            /// the closest point is the same as the one found by findClosestPoint
+            size_t closestPointI = 0;
+            tree.findClosestPoint(p, closestPointI);
+            tree.findKNearest(p, 1, nearestPoints);
+            BOOST_CHECK_EQUAL(nearestPoints[0].first, closestPointI);
+        }
+
+        tree.findKNearest(points[0], 0, nearestPoints);
+        BOOST_CHECK(nearestPoints.empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_approximateSearch )
+{
+    std::mt19937 e2(17);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+
+    for (int dims = 1; dims < 8; dims += 3) {
+        std::vector<KDPoint<float>> points;
+        for (int i = 0; i < 1000; ++i) {
+            points.push_back(generateKDRandomPoint(dims, dist, e2));
+        }
+        KDTree<float> tree(new KDPointStorage<float>(points, dims), 2);
+
+        for (int j = 0; j < 100; ++j) {
+            auto p = generateKDRandomPoint(dims, dist, e2);
+            size_t closestPointI = 0;
+            float minSquareDistance = tree.findClosestPoint(p, closestPointI)
+                    .squareDistanceToPoint(p);
+
+            /// without limits the search is exact
+            auto result = tree.findApproximateClosestPoint(p, KDApproximateSearch());
+            BOOST_CHECK(result.isExact);
+            BOOST_CHECK_EQUAL(result.squareDistance, minSquareDistance);
+
+            KDApproximateSearch search;
+            search.epsilon = 0.5;
+            result = tree.findApproximateClosestPoint(p, search);
+            BOOST_CHECK(result.squareDistance <= minSquareDistance * 1.5f * 1.5f);
+            BOOST_CHECK_EQUAL(result.squareDistance,
+                              points[result.originalI].squareDistanceToPoint(p));
+
+            search.epsilon = 0;
+            search.maxLeavesNumber = 1;
+            KDQueryStats stats;
+            result = tree.findApproximateClosestPoint(p, search, stats);
+            BOOST_CHECK_EQUAL(stats.scannedLeavesNumber, 1);
+            BOOST_CHECK(result.squareDistance >= minSquareDistance);
+            if (result.isExact) {
+                BOOST_CHECK_EQUAL(result.squareDistance, minSquareDistance);
             }
+        }
+
+        /// batch search gives the same results
+        std::vector<KDPoint<float>> queries(points.begin(), points.begin() + 300);
+        std::vector<KDQueryResult<float>> results(queries.size());
+        KDApproximateSearch search;
+        search.maxLeavesNumber = 3;
+        KDThreadPool pool(3);
+        tree.findApproximateClosestPoints(
+                    queries.data(), queries.size(), results.data(), search, &pool);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            auto result = tree.findApproximateClosestPoint(queries[i], search);
+            BOOST_CHECK_EQUAL(results[i].originalI, result.originalI);
+            BOOST_CHECK_EQUAL(results[i].isExact, result.isExact);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_radiusAndBoxSearch )
+{
+    std::mt19937 e2(11);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+
+    for (int dims = 1; dims < 5; ++dims) {
+        std::vector<KDPoint<float>> points;
+        for (int i = 0; i < 300; ++i) {
+            points.push_back(generateKDRandomPoint(dims, dist, e2));
+        }
+
+        for (auto layout : {KDPointsLayout::Indexed, KDPointsLayout::AoS, KDPointsLayout::SoA}) {
+            KDTree<float> tree(new KDPointStorage<float>(points, dims, layout), 4);
+
+            for (int j = 0; j < 50; ++j) {
+                auto p = generateKDRandomPoint(dims, dist, e2);
+                float radius = 50 + j * 10;
+                std::vector<size_t> found;
+                tree.findPointsInRadius(p, radius, [&](size_t i, float squareDistance) {
+                    BOOST_CHECK_EQUAL(squareDistance, points[i].squareDistanceToPoint(p));
+                    found.push_back(i);
+                });
+                std::sort(found.begin(), found.end());
+
+                std::vector<size_t> expected;
+                for (size_t i = 0; i < points.size(); ++i) {
+                    if (points[i].squareDistanceToPoint(p) <= radius * radius) {
+                        expected.push_back(i);
+                    }
+                }
+                BOOST_CHECK(found == expected);
 
-            /// Used for simple performance measurement
-//            std::cout << "search in tree duration: "<< totalTreeTime.count() << std::endl;
-//            std::cout << "naive search duration: " << totalNaiveTime.count() << std::endl;
+                /// the box around p, it is sometimes bigger than all the points
+                std::vector<float> lower(dims), upper(dims);
+                for (int coordinateI = 0; coordinateI < dims; ++coordinateI) {
+                    lower[coordinateI] = p.at(coordinateI) - radius * j / 10;
+                    upper[coordinateI] = p.at(coordinateI) + radius;
+                }
+                found.clear();
+                tree.findPointsInBox(KDPoint<float>(lower), KDPoint<float>(upper),
+                                     [&](size_t i) { found.push_back(i); });
+                std::sort(found.begin(), found.end());
 
+                expected.clear();
+                for (size_t i = 0; i < points.size(); ++i) {
+                    bool isInside = true;
+                    for (int coordinateI = 0; coordinateI < dims; ++coordinateI) {
+                        isInside = isInside &&
+                                lower[coordinateI] <= points[i].at(coordinateI) &&
+                                points[i].at(coordinateI) <= upper[coordinateI];
+                    }
+                    if (isInside) {
+                        expected.push_back(i);
+                    }
+                }
+                BOOST_CHECK(found == expected);
+            }
         }
     }
 }
@@ -165,3 +365,573 @@ BOOST_AUTO_TEST_CASE( KDTreeTest_differentDepths )
         BOOST_CHECK_EQUAL(tree.getDepth(), 1);
     }
 }
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_batchQueries )
+{
+    std::mt19937 e2(13);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+
+    std::vector<KDPoint<float>> points;
+    for (int i = 0; i < 500; ++i) {
+        points.push_back(generateKDRandomPoint(3, dist, e2));
+    }
+    KDTree<float> tree(new KDPointStorage<float>(points, 3, KDPointsLayout::SoA), 4);
+
+    std::vector<KDPoint<float>> queries;
+    for (int i = 0; i < 2000; ++i) {
+        queries.push_back(generateKDRandomPoint(3, dist, e2));
+    }
+
+    for (size_t threadsNumber : {1, 2, 4}) {
+        KDThreadPool pool(threadsNumber);
+        std::vector<KDQueryResult<float>> results(queries.size());
+        tree.findClosestPoints(queries.data(), queries.size(), results.data(), &pool);
+
+        for (size_t i = 0; i < queries.size(); ++i) {
+            size_t closestPointI = 0;
+            auto closestPoint = tree.findClosestPoint(queries[i], closestPointI);
+            BOOST_CHECK_EQUAL(results[i].originalI, closestPointI);
+            BOOST_CHECK_EQUAL(results[i].squareDistance,
+                              closestPoint.squareDistanceToPoint(queries[i]));
+        }
+    }
+
+    /// the wrong point is reported from any thread
+    KDThreadPool pool(4);
+    queries[1500] = KDPoint<float>({1, 2});
+    std::vector<KDQueryResult<float>> results(queries.size());
+    BOOST_CHECK_EXCEPTION(
+                tree.findClosestPoints(queries.data(), queries.size(), results.data(), &pool),
+                std::length_error, [](std::length_error const &){return true;});
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_parallelBuild )
+{
+    /// the number of points is big enough to have several levels built in parallel
+    /// and to find medians and partitions in parallel
+    std::mt19937 e2(17);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+    std::vector<KDPoint<float>> points;
+    for (int i = 0; i < 200000; ++i) {
+        points.push_back(generateKDRandomPoint(3, dist, e2));
+    }
+    /// add many equal coordinates to check partitions around duplicates
+    for (int i = 0; i < 50000; ++i) {
+        std::vector<float> coords({1, static_cast<float>(i % 7), static_cast<float>(i)});
+        points.push_back(KDPoint<float>(coords));
+    }
+
+    KDTree<float> tree(new KDPointStorage<float>(points, 3), 4);
+    for (size_t threadsNumber : {2, 5}) {
+        KDThreadPool pool(threadsNumber);
+        KDTree<float> parallelTree(new KDPointStorage<float>(points, 3), 4, &pool);
+        BOOST_CHECK_EQUAL(tree.getDepth(), parallelTree.getDepth());
+
+        std::vector<KDPoint<float>> queries;
+        for (int i = 0; i < 1000; ++i) {
+            queries.push_back(generateKDRandomPoint(3, dist, e2));
+        }
+        std::vector<KDQueryResult<float>> results(queries.size());
+        std::vector<KDQueryResult<float>> parallelResults(queries.size());
+        tree.findClosestPoints(queries.data(), queries.size(), results.data());
+        parallelTree.findClosestPoints(queries.data(), queries.size(), parallelResults.data(), &pool);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            BOOST_CHECK_EQUAL(results[i].originalI, parallelResults[i].originalI);
+            BOOST_CHECK_EQUAL(results[i].squareDistance, parallelResults[i].squareDistance);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_buildArena )
+{
+    /// trees of different sizes are built with the same arena one after another
+    std::mt19937 e2(18);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+    KDBuildArena<float> arena;
+    KDThreadPool pool(3);
+    size_t maxAllocatedSize = 0;
+    for (size_t pointsNumber : {100000, 1000, 150000, 20000}) {
+        std::vector<KDPoint<float>> points;
+        for (size_t i = 0; i < pointsNumber; ++i) {
+            points.push_back(generateKDRandomPoint(3, dist, e2));
+        }
+
+        /// the tree built with the arena is the same as the one built without it
+        KDTree<float> tree(new KDPointStorage<float>(points, 3), 4);
+        KDTree<float> arenaTree(new KDPointStorage<float>(points, 3), 4, nullptr, &arena);
+        std::stringstream stream;
+        std::stringstream arenaStream;
+        {
+            boost::archive::text_oarchive oa{stream};
+            oa << tree;
+            boost::archive::text_oarchive arenaOa{arenaStream};
+            arenaOa << arenaTree;
+        }
+        BOOST_CHECK(stream.str() == arenaStream.str());
+        /// the serial build puts the nodes right to the tree, the arena keeps only
+        /// the coordinates buffer then
+        if (maxAllocatedSize == 0) {
+            BOOST_CHECK(arena.getAllocatedSize() <
+                        pointsNumber * (3 * sizeof(float) + sizeof(KDTreeNode<float>)));
+        }
+
+        KDTree<float> parallelTree(new KDPointStorage<float>(points, 3), 4, &pool, &arena);
+        BOOST_CHECK_EQUAL(tree.getDepth(), parallelTree.getDepth());
+        for (int i = 0; i < 100; ++i) {
+            auto query = generateKDRandomPoint(3, dist, e2);
+            size_t closestPointI = 0;
+            size_t parallelClosestPointI = 0;
+            tree.findClosestPoint(query, closestPointI);
+            parallelTree.findClosestPoint(query, parallelClosestPointI);
+            BOOST_CHECK_EQUAL(closestPointI, parallelClosestPointI);
+        }
+
+        /// the memory is allocated only for the biggest tree
+        if (pointsNumber < 150000) {
+            BOOST_CHECK(arena.getAllocatedSize() >= maxAllocatedSize);
+        } else {
+            BOOST_CHECK(arena.getAllocatedSize() > maxAllocatedSize);
+        }
+        maxAllocatedSize = std::max(maxAllocatedSize, arena.getAllocatedSize());
+    }
+    size_t allocatedSize = arena.getAllocatedSize();
+    std::vector<KDPoint<float>> points(10, KDPoint<float>({1, 2, 3}));
+    KDTree<float> tree(new KDPointStorage<float>(points, 3), 1, nullptr, &arena);
+    BOOST_CHECK_EQUAL(arena.getAllocatedSize(), allocatedSize);
+    arena.clear();
+    BOOST_CHECK_EQUAL(arena.getAllocatedSize(), 0);
+
+    /// the reordered coordinates are swapped into the storage and the arena keeps the old
+    /// buffer, so the tree of borrowed coordinates takes it instead of allocating its own
+    std::vector<float> coordinates;
+    for (size_t i = 0; i < 10000; ++i) {
+        auto point = generateKDRandomPoint(3, dist, e2);
+        coordinates.insert(coordinates.end(), point.data(), point.data() + 3);
+    }
+    size_t coordinatesSize = coordinates.size() * sizeof(float);
+    KDTree<float> ownedTree(new KDPointStorage<float>(std::vector<float>(coordinates), 3,
+                                                      KDPointsLayout::SoA), 4, nullptr, &arena);
+    allocatedSize = arena.getAllocatedSize();
+    BOOST_CHECK(allocatedSize >= coordinatesSize);
+    KDTree<float> borrowedTree(new KDPointStorage<float>(coordinates.data(), coordinates.size() / 3,
+                                                         3, KDPointsLayout::SoA), 4, nullptr, &arena);
+    BOOST_CHECK(arena.getAllocatedSize() + coordinatesSize <= allocatedSize);
+    BOOST_CHECK(borrowedTree.getPoint(0) == ownedTree.getPoint(0));
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_nodeBoxes )
+{
+    /// small clusters far from each other, so the cells of nodes have a lot of empty space
+    std::mt19937 e2(19);
+    std::uniform_real_distribution<> centerDist(-1000, 1000);
+    std::uniform_real_distribution<> dist(-5, 5);
+    const size_t dims = 3;
+    std::vector<KDPoint<float>> points;
+    for (int clusterI = 0; clusterI < 30; ++clusterI) {
+        auto center = generateKDRandomPoint(dims, centerDist, e2);
+        for (int i = 0; i < 100; ++i) {
+            auto offset = generateKDRandomPoint(dims, dist, e2);
+            points.push_back(KDPoint<float>({center[0] + offset[0],
+                                             center[1] + offset[1],
+                                             center[2] + offset[2]}));
+        }
+    }
+
+    KDTree<float> tree(new KDPointStorage<float>(points, dims), 4);
+    KDTree<float> boxedTree(new KDPointStorage<float>(points, dims), 4);
+    BOOST_CHECK(!boxedTree.hasNodeBoxes());
+    boxedTree.buildNodeBoxes();
+    BOOST_CHECK(boxedTree.hasNodeBoxes());
+
+    KDQueryStats stats;
+    KDQueryStats boxedStats;
+    KDQueryStats approximateStats;
+    KDQueryStats boxedApproximateStats;
+    std::vector<KDNeighbour<float>> nearestPoints;
+    std::vector<KDNeighbour<float>> boxedNearestPoints;
+    for (int j = 0; j < 200; ++j) {
+        auto p = generateKDRandomPoint(dims, centerDist, e2);
+        size_t closestPointI = 0;
+        size_t boxedClosestPointI = 0;
+        auto closestPoint = tree.findClosestPoint(p, closestPointI, stats);
+        auto boxedClosestPoint = boxedTree.findClosestPoint(p, boxedClosestPointI, boxedStats);
+        BOOST_CHECK_EQUAL(closestPoint.squareDistanceToPoint(p),
+                          boxedClosestPoint.squareDistanceToPoint(p));
+        BOOST_CHECK_EQUAL(closestPoint.squareDistanceToPoint(p),
+                          points[findClosestPoint(points, p)].squareDistanceToPoint(p));
+
+        auto result = tree.findApproximateClosestPoint(p, KDApproximateSearch(), approximateStats);
+        auto boxedResult = boxedTree.findApproximateClosestPoint(p, KDApproximateSearch(),
+                                                                 boxedApproximateStats);
+        BOOST_CHECK(boxedResult.isExact);
+        BOOST_CHECK_EQUAL(result.squareDistance, boxedResult.squareDistance);
+
+        tree.findKNearest(p, 10, nearestPoints);
+        boxedTree.findKNearest(p, 10, boxedNearestPoints);
+        BOOST_CHECK(nearestPoints == boxedNearestPoints);
+
+        float radius = std::sqrt(nearestPoints.back().second) * 1.001f;
+        size_t foundNumber = 0;
+        boxedTree.findPointsInRadius(p, radius, [&](size_t, float) { ++foundNumber; });
+        BOOST_CHECK(foundNumber >= 10);
+        size_t expectedNumber = 0;
+        tree.findPointsInRadius(p, radius, [&](size_t, float) { ++expectedNumber; });
+        BOOST_CHECK_EQUAL(foundNumber, expectedNumber);
+    }
+    BOOST_CHECK(boxedStats.visitedNodesNumber < stats.visitedNodesNumber);
+    BOOST_CHECK(boxedStats.scannedLeavesNumber < stats.scannedLeavesNumber);
+    BOOST_CHECK(boxedApproximateStats.visitedNodesNumber < approximateStats.visitedNodesNumber);
+
+    /// the boxes are not saved
+    std::stringstream stream;
+    {
+        boost::archive::text_oarchive oa{stream};
+        oa << boxedTree;
+    }
+    boost::archive::text_iarchive ia{stream};
+    ia >> boxedTree;
+    BOOST_CHECK(!boxedTree.hasNodeBoxes());
+
+    KDTree<float> emptyTree;
+    BOOST_CHECK_EXCEPTION(
+                emptyTree.buildNodeBoxes(),
+                std::domain_error, [](std::domain_error const &){return true;});
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_searchContext )
+{
+    std::mt19937 e2(20);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+    std::vector<KDPoint<float>> points;
+    for (size_t i = 0; i < 20000; ++i) {
+        points.push_back(generateKDRandomPoint(3, dist, e2));
+    }
+    KDTree<float> tree(new KDPointStorage<float>(points, 3), 4);
+    BOOST_CHECK_EQUAL(tree.getK(), 3);
+
+    /// queries by views of one coordinates buffer find the same points as by points
+    std::vector<KDPoint<float>> queries;
+    std::vector<float> coordinates;
+    for (size_t i = 0; i < 1000; ++i) {
+        queries.push_back(generateKDRandomPoint(3, dist, e2));
+        coordinates.insert(coordinates.end(), queries.back().data(), queries.back().data() + 3);
+    }
+    KDSearchContext<float> context;
+    KDApproximateSearch search;
+    search.maxLeavesNumber = 3;
+    size_t allocatedSize = 0;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        size_t closestPointI = 0;
+        tree.findClosestPoint(queries[i], closestPointI);
+        auto result = tree.findClosestPoint(KDPointView<float>(&coordinates[i * 3], 3), context);
+        BOOST_CHECK_EQUAL(result.originalI, closestPointI);
+        BOOST_CHECK_EQUAL(result.squareDistance,
+                          queries[i].squareDistanceToPoint(tree.getPoint(closestPointI)));
+
+        auto approximateResult = tree.findApproximateClosestPoint(queries[i], search);
+        auto contextResult = tree.findApproximateClosestPoint(queries[i], search, context);
+        BOOST_CHECK_EQUAL(approximateResult.originalI, contextResult.originalI);
+        BOOST_CHECK_EQUAL(approximateResult.isExact, contextResult.isExact);
+
+        /// the stack is reserved for the depth, only the heap can grow at first
+        if (i == 0) {
+            BOOST_CHECK(context.getNodesToSearch().capacity() >= tree.getDepth() + 1);
+        } else if (i == queries.size() / 2) {
+            allocatedSize = context.getAllocatedSize();
+        }
+    }
+    BOOST_CHECK(allocatedSize > 0);
+    BOOST_CHECK(context.getAllocatedSize() >= allocatedSize);
+
+    KDThreadPool pool(3);
+    std::vector<KDQueryResult<float>> results(queries.size());
+    std::vector<KDQueryResult<float>> coordinatesResults(queries.size());
+    tree.findClosestPoints(queries.data(), queries.size(), results.data(), &pool);
+    tree.findClosestPoints(coordinates.data(), queries.size(), coordinatesResults.data(), &pool);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        BOOST_CHECK_EQUAL(results[i].originalI, coordinatesResults[i].originalI);
+    }
+    tree.findApproximateClosestPoints(queries.data(), queries.size(), results.data(), search);
+    tree.findApproximateClosestPoints(coordinates.data(), queries.size(),
+                                      coordinatesResults.data(), search);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        BOOST_CHECK_EQUAL(results[i].originalI, coordinatesResults[i].originalI);
+    }
+
+    BOOST_CHECK_EXCEPTION(
+                tree.findClosestPoint(KDPointView<float>(coordinates.data(), 2), context),
+                std::length_error, [](std::length_error const &){return true;});
+    context.clear();
+    BOOST_CHECK_EQUAL(context.getAllocatedSize(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_quantization )
+{
+    std::mt19937 e2(21);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+    std::vector<KDPoint<float>> points;
+    for (size_t i = 0; i < 20000; ++i) {
+        points.push_back(generateKDRandomPoint(3, dist, e2));
+    }
+    KDTree<float> exactTree(new KDPointStorage<float>(points, 3, KDPointsLayout::SoA), 8);
+
+    for (auto quantization : {KDQuantization::Int16, KDQuantization::UInt8}) {
+        KDTree<float> tree(new KDPointStorage<float>(points, 3, KDPointsLayout::SoA), 8);
+        tree.quantize(quantization);
+        BOOST_CHECK(tree.getQuantization() == quantization);
+        BOOST_CHECK_EXCEPTION(
+                    tree.quantize(quantization),
+                    std::domain_error, [](std::domain_error const &){return true;});
+        /// the scale of every dimension is its range divided by the number of the integers
+        float scale = 2000.0f / (quantization == KDQuantization::Int16 ? 65535 : 255);
+        float error = std::sqrt(3 * scale * scale / 4);
+
+        KDSearchContext<float> context;
+        size_t exactResultsNumber = 0;
+        for (size_t i = 0; i < 1000; ++i) {
+            auto query = generateKDRandomPoint(3, dist, e2);
+            size_t closestPointI = 0;
+            auto closestPoint = exactTree.findClosestPoint(query, closestPointI);
+            float distance = std::sqrt(query.squareDistanceToPoint(closestPoint));
+
+            /// the quantized point is not farther than the error from the exact one
+            size_t quantizedClosestPointI = 0;
+            auto quantizedClosestPoint = tree.findClosestPoint(query, quantizedClosestPointI);
+            BOOST_CHECK(std::sqrt(quantizedClosestPoint.squareDistanceToPoint(
+                                      exactTree.getPoint(quantizedClosestPointI))) <= error * 1.01f);
+            float quantizedDistance = std::sqrt(
+                        query.squareDistanceToPoint(exactTree.getPoint(quantizedClosestPointI)));
+            BOOST_CHECK(quantizedDistance <= distance + 2 * error * 1.01f);
+
+            auto result = tree.findRerankedClosestPoint(query, 4, exactTree, context);
+            BOOST_CHECK_EQUAL(result.squareDistance,
+                              query.squareDistanceToPoint(exactTree.getPoint(result.originalI)));
+            if (result.isExact) {
+                ++exactResultsNumber;
+                BOOST_CHECK_EQUAL(result.originalI, closestPointI);
+            }
+        }
+        BOOST_CHECK(exactResultsNumber > 0);
+
+        /// any number of candidates can be reranked, all the points are then
+        auto query = generateKDRandomPoint(3, dist, e2);
+        size_t closestPointI = 0;
+        exactTree.findClosestPoint(query, closestPointI);
+        auto result = tree.findRerankedClosestPoint(query, std::numeric_limits<size_t>::max(),
+                                                    exactTree, context);
+        BOOST_CHECK_EQUAL(result.originalI, closestPointI);
+
+        /// quantized coordinates are saved only to tree files
+        std::stringstream stream;
+        boost::archive::text_oarchive oa{stream};
+        BOOST_CHECK_EXCEPTION(
+                    oa << tree,
+                    std::domain_error, [](std::domain_error const &){return true;});
+    }
+
+    KDTree<float> otherTree(new KDPointStorage<float>(std::vector<KDPoint<float>>(
+                                                          points.begin(), points.begin() + 10), 3));
+    otherTree.quantize(KDQuantization::UInt8);
+    KDSearchContext<float> context;
+    BOOST_CHECK_EXCEPTION(
+                otherTree.findRerankedClosestPoint(points[0], 4, exactTree, context),
+                std::domain_error, [](std::domain_error const &){return true;});
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_borrowedCoordinates )
+{
+    std::mt19937 e2(22);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+    std::vector<KDPoint<float>> points;
+    std::vector<float> coordinates;
+    for (size_t i = 0; i < 10000; ++i) {
+        points.push_back(generateKDRandomPoint(3, dist, e2));
+        coordinates.insert(coordinates.end(), points.back().data(), points.back().data() + 3);
+    }
+    std::vector<float> copiedCoordinates(coordinates);
+    KDTree<float> tree(new KDPointStorage<float>(points, 3), 4);
+
+    /// the borrowed buffer is not changed by the build, only indices are partitioned
+    KDThreadPool pool(3);
+    KDTree<float> indexedTree(new KDPointStorage<float>(coordinates.data(), points.size(), 3,
+                                                        KDPointsLayout::Indexed), 4, &pool);
+    BOOST_CHECK(coordinates == copiedCoordinates);
+
+    /// the leaf ordered copy is used after the build, so the buffer can be freed
+    KDTree<float> soaTree(new KDPointStorage<float>(copiedCoordinates.data(), points.size(), 3,
+                                                    KDPointsLayout::SoA), 4);
+    std::vector<float>().swap(copiedCoordinates);
+
+    for (int i = 0; i < 300; ++i) {
+        auto query = generateKDRandomPoint(3, dist, e2);
+        size_t closestPointI = 0;
+        size_t indexedClosestPointI = 0;
+        size_t soaClosestPointI = 0;
+        tree.findClosestPoint(query, closestPointI);
+        indexedTree.findClosestPoint(query, indexedClosestPointI);
+        soaTree.findClosestPoint(query, soaClosestPointI);
+        BOOST_CHECK_EQUAL(indexedClosestPointI, closestPointI);
+        BOOST_CHECK_EQUAL(soaClosestPointI, closestPointI);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_join )
+{
+    std::mt19937 e2(23);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+    std::vector<KDPoint<float>> points;
+    std::vector<KDPoint<float>> queries;
+    for (size_t i = 0; i < 20000; ++i) {
+        points.push_back(generateKDRandomPoint(3, dist, e2));
+    }
+    for (size_t i = 0; i < 10000; ++i) {
+        queries.push_back(generateKDRandomPoint(3, dist, e2));
+    }
+    KDTree<float> tree(new KDPointStorage<float>(points, 3, KDPointsLayout::SoA), 4);
+    KDTree<float> queryTree(new KDPointStorage<float>(queries, 3), 2);
+
+    /// the join finds the same distances as the queries one by one, with or without
+    /// the node boxes built and the thread pool
+    KDThreadPool pool(3);
+    for (KDThreadPool * joinPool : {static_cast<KDThreadPool *>(nullptr), &pool}) {
+        std::vector<KDQueryResult<float>> results(queries.size());
+        tree.joinClosestPoints(queryTree, results.data(), joinPool);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            size_t closestPointI = 0;
+            auto closestPoint = tree.findClosestPoint(queries[i], closestPointI);
+            BOOST_CHECK_EQUAL(results[i].squareDistance,
+                              closestPoint.squareDistanceToPoint(queries[i]));
+            BOOST_CHECK_EQUAL(results[i].squareDistance,
+                              points[results[i].originalI].squareDistanceToPoint(queries[i]));
+        }
+        tree.buildNodeBoxes();
+        queryTree.buildNodeBoxes();
+    }
+
+    /// every point of the tree joined with itself is the closest to itself
+    std::vector<KDQueryResult<float>> selfResults(points.size());
+    tree.joinClosestPoints(tree, selfResults.data(), &pool);
+    for (size_t i = 0; i < points.size(); ++i) {
+        BOOST_CHECK_EQUAL(selfResults[i].squareDistance, 0);
+        BOOST_CHECK(points[selfResults[i].originalI] == points[i]);
+    }
+
+    std::vector<KDQueryResult<float>> results(points.size());
+    KDTree<float> emptyTree;
+    BOOST_CHECK_THROW(tree.joinClosestPoints(emptyTree, results.data()), std::domain_error);
+    BOOST_CHECK_THROW(emptyTree.joinClosestPoints(tree, results.data()), std::domain_error);
+    std::vector<KDPoint<float>> planePoints(10, KDPoint<float>({1, 2}));
+    KDTree<float> planeTree(new KDPointStorage<float>(planePoints, 2));
+    BOOST_CHECK_THROW(tree.joinClosestPoints(planeTree, results.data()), std::length_error);
+}
+
+/// addresses of the visited nodes
+struct NodeAddressesStats {
+    void visitNode() {}
+    void visitNode(void const * node) {
+        addresses.push_back(reinterpret_cast<std::uintptr_t>(node));
+    }
+    void scanLeaf(size_t) {}
+    void backtrack() {}
+
+    std::vector<std::uintptr_t> addresses;
+};
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_nodesLayout )
+{
+    std::mt19937 e2(25);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+    std::vector<KDPoint<float>> points;
+    for (size_t i = 0; i < 30000; ++i) {
+        points.push_back(generateKDRandomPoint(3, dist, e2));
+    }
+    /// duplicates make leaves at different depths
+    points.insert(points.end(), 500, points.front());
+    for (size_t leafSize : {1, 4}) {
+        KDTree<float> tree(new KDPointStorage<float>(points, 3), leafSize);
+        KDTree<float> layoutTree(new KDPointStorage<float>(points, 3), leafSize);
+        BOOST_CHECK(layoutTree.getNodesLayout() == KDNodesLayout::DepthFirst);
+        layoutTree.setNodesLayout(KDNodesLayout::VanEmdeBoas);
+        BOOST_CHECK(layoutTree.getNodesLayout() == KDNodesLayout::VanEmdeBoas);
+
+        /// float nodes take 12 bytes, so they are padded to 16 in the layout: the root
+        /// starts a cache line and no node, nor a pair of them, is split by lines
+        BOOST_CHECK_EQUAL(sizeof(KDTreeNodeSlot<float>), 16);
+        NodeAddressesStats addressesStats;
+        size_t addressesClosestPointI = 0;
+        layoutTree.findClosestPoint(points.back(), addressesClosestPointI, addressesStats);
+        BOOST_CHECK_EQUAL(addressesStats.addresses.front() % 64, 0);
+        for (auto address : addressesStats.addresses) {
+            BOOST_CHECK_EQUAL(address % sizeof(KDTreeNodeSlot<float>), 0);
+        }
+
+        /// the same nodes are searched in the same order, so even the stats are the same,
+        /// with the node boxes built after the layout too
+        for (int boxesI = 0; boxesI < 2; ++boxesI) {
+            for (size_t j = 0; j < 300; ++j) {
+                auto p = generateKDRandomPoint(3, dist, e2);
+                KDQueryStats stats;
+                KDQueryStats layoutStats;
+                size_t closestPointI = 0;
+                size_t layoutClosestPointI = 0;
+                tree.findClosestPoint(p, closestPointI, stats);
+                layoutTree.findClosestPoint(p, layoutClosestPointI, layoutStats);
+                BOOST_CHECK_EQUAL(layoutClosestPointI, closestPointI);
+                BOOST_CHECK_EQUAL(layoutStats.visitedNodesNumber, stats.visitedNodesNumber);
+                BOOST_CHECK_EQUAL(layoutStats.backtracksNumber, stats.backtracksNumber);
+            }
+            tree.buildNodeBoxes();
+            layoutTree.buildNodeBoxes();
+        }
+
+        /// the other queries use the depth-first nodes
+        std::vector<KDNeighbour<float>> nearestPoints;
+        std::vector<KDNeighbour<float>> layoutNearestPoints;
+        auto p = generateKDRandomPoint(3, dist, e2);
+        tree.findKNearest(p, 10, nearestPoints);
+        layoutTree.findKNearest(p, 10, layoutNearestPoints);
+        BOOST_CHECK(layoutNearestPoints == nearestPoints);
+
+        layoutTree.setNodesLayout(KDNodesLayout::DepthFirst);
+        size_t closestPointI = 0;
+        size_t layoutClosestPointI = 0;
+        tree.findClosestPoint(p, closestPointI);
+        layoutTree.findClosestPoint(p, layoutClosestPointI);
+        BOOST_CHECK_EQUAL(layoutClosestPointI, closestPointI);
+    }
+
+    KDTree<float> emptyTree;
+    BOOST_CHECK_THROW(emptyTree.setNodesLayout(KDNodesLayout::VanEmdeBoas), std::domain_error);
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeTest_hugePages )
+{
+    std::mt19937 e2(24);
+    std::uniform_real_distribution<> dist(-1000, 1000);
+    std::vector<KDPoint<float>> points;
+    for (size_t i = 0; i < 50000; ++i) {
+        points.push_back(generateKDRandomPoint(3, dist, e2));
+    }
+    KDTree<float> tree(new KDPointStorage<float>(points, 3), 2);
+    tree.buildNodeBoxes();
+    std::vector<KDPoint<float>> queries;
+    std::vector<size_t> closestPointIs;
+    for (size_t i = 0; i < 200; ++i) {
+        queries.push_back(generateKDRandomPoint(3, dist, e2));
+        closestPointIs.push_back(0);
+        tree.findClosestPoint(queries.back(), closestPointIs.back());
+    }
+
+    /// the kernel can have no huge pages, but the tree is the same anyway
+    size_t hugePagesBytes = tree.adviseHugePages();
+    BOOST_CHECK_LE(hugePagesBytes, points.size() * (3 * sizeof(float) + sizeof(size_t)) +
+                   tree.getShape().nodesNumber * (sizeof(KDTreeNode<float>) + 6 * sizeof(float)));
+    for (size_t i = 0; i < queries.size(); ++i) {
+        size_t closestPointI = 0;
+        tree.findClosestPoint(queries[i], closestPointI);
+        BOOST_CHECK_EQUAL(closestPointI, closestPointIs[i]);
+    }
+
+    KDTree<float> emptyTree;
+    BOOST_CHECK_THROW(emptyTree.adviseHugePages(), std::domain_error);
+}
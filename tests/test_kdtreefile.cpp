@@ -0,0 +1,184 @@
+#include <kdtreefile.hpp>
+
+#include "kdtesthelpers.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <vector>
+
+namespace {
+
+const char * treeFilename = "t_kdtreefile_test.bin";
+
+std::vector<KDPoint<double>> generatePoints(size_t pointsNumber, size_t K, std::mt19937 & e2)
+{
+    std::uniform_real_distribution<> dist(-100, 100);
+    return generateKDRandomPoints(pointsNumber, K, dist, e2);
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeFileTest_mappedTreeAnswersTheSame )
+{
+    std::mt19937 e2(11);
+    const size_t K = 3;
+    auto points = generatePoints(3000, K, e2);
+    auto queries = generatePoints(300, K, e2);
+
+    for (auto layout : {KDPointsLayout::Indexed, KDPointsLayout::AoS, KDPointsLayout::SoA}) {
+        KDTree<double> tree(new KDPointStorage<double>(points, K, layout), 3);
+        KDTreeFile::save(tree, treeFilename);
+        BOOST_CHECK(KDTreeFile::isTreeFile(treeFilename));
+
+        KDTree<double> mappedTree;
+        KDTreeFile::map(treeFilename, mappedTree);
+        BOOST_CHECK_EQUAL(mappedTree.getDepth(), tree.getDepth());
+
+        for (auto const & query : queries) {
+            size_t originalI = 0;
+            size_t mappedOriginalI = 0;
+            auto closest = tree.findClosestPoint(query, originalI);
+            auto mappedClosest = mappedTree.findClosestPoint(query, mappedOriginalI);
+            BOOST_CHECK_EQUAL(mappedOriginalI, originalI);
+            BOOST_CHECK(mappedClosest == closest);
+
+            std::vector<KDNeighbour<double>> nearest;
+            std::vector<KDNeighbour<double>> mappedNearest;
+            tree.findKNearest(query, 5, nearest);
+            mappedTree.findKNearest(query, 5, mappedNearest);
+            BOOST_CHECK(mappedNearest == nearest);
+        }
+    }
+    std::remove(treeFilename);
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeFileTest_invalidFiles )
+{
+    std::mt19937 e2(12);
+    auto points = generatePoints(100, 2, e2);
+    KDTree<double> tree(new KDPointStorage<double>(points, 2), 2);
+    KDTreeFile::save(tree, treeFilename);
+
+    std::vector<char> data;
+    {
+        std::ifstream file(treeFilename, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    auto writeFile = [](std::vector<char> const & fileData) {
+        std::ofstream file(treeFilename, std::ios::binary | std::ios::trunc);
+        file.write(fileData.data(), fileData.size());
+    };
+    auto checkMapFails = [](std::string const & filename) {
+        for (bool verify : {false, true}) {
+            KDTree<double> mappedTree;
+            BOOST_CHECK_EXCEPTION(
+                        KDTreeFile::map(filename, mappedTree, verify),
+                        std::runtime_error, [](std::runtime_error const &){return true;});
+        }
+    };
+
+    /// the points have another type
+    {
+        KDTree<float> mappedTree;
+        BOOST_CHECK_EXCEPTION(
+                    KDTreeFile::map(treeFilename, mappedTree),
+                    std::runtime_error, [](std::runtime_error const &){return true;});
+    }
+
+    /// the header is corrupted
+    auto corrupted = data;
+    corrupted[offsetof(KDTreeFileHeader, pointsNumber)] ^= 1;
+    writeFile(corrupted);
+    checkMapFails(treeFilename);
+
+    /// the body is corrupted: the right subnode of the root is out of the nodes,
+    /// the last node, which is a leaf, has more points and a point index is out of range.
+    /// Only the verified mapping reads the body.
+    KDTreeFileHeader header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    auto corruptNumber = [&](std::uint64_t offset, std::uint32_t value) {
+        auto corruptedBody = data;
+        std::memcpy(&corruptedBody[offset], &value, sizeof(value));
+        writeFile(corruptedBody);
+        KDTree<double> mappedTree;
+        KDTreeFile::map(treeFilename, mappedTree);
+        BOOST_CHECK_EQUAL(mappedTree.size(), points.size());
+        KDTree<double> verifiedTree;
+        BOOST_CHECK_EXCEPTION(
+                    KDTreeFile::map(treeFilename, verifiedTree, true),
+                    std::runtime_error, [](std::runtime_error const &){return true;});
+    };
+    std::uint64_t nodeIndexOffset = sizeof(double);
+    std::uint64_t nodeInfoOffset = nodeIndexOffset + sizeof(std::uint32_t);
+    corruptNumber(header.nodesOffset + nodeIndexOffset, header.nodesNumber);
+    corruptNumber(header.nodesOffset + nodeInfoOffset, 7 << 1);
+    std::uint64_t lastNodeOffset = header.nodesOffset +
+            (header.nodesNumber - 1) * sizeof(KDTreeNode<double>);
+    corruptNumber(lastNodeOffset + nodeInfoOffset, ((header.pointsNumber + 1) << 1) | 1);
+    corruptNumber(header.indicesOffset, header.pointsNumber);
+
+    /// the file is truncated
+    writeFile(std::vector<char>(data.begin(), data.end() - 8));
+    checkMapFails(treeFilename);
+    writeFile(std::vector<char>(data.begin(), data.begin() + 16));
+    checkMapFails(treeFilename);
+
+    /// the file does not exist
+    std::remove(treeFilename);
+    checkMapFails(treeFilename);
+    BOOST_CHECK(!KDTreeFile::isTreeFile(treeFilename));
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeFileTest_quantizedTree )
+{
+    std::mt19937 e2(13);
+    const size_t K = 3;
+    auto points = generatePoints(3000, K, e2);
+    auto queries = generatePoints(300, K, e2);
+    const char * exactTreeFilename = "t_kdtreefile_exact_test.bin";
+
+    for (auto layout : {KDPointsLayout::Indexed, KDPointsLayout::AoS, KDPointsLayout::SoA}) {
+        KDTree<double> exactTree(new KDPointStorage<double>(points, K, layout), 3);
+        KDTreeFile::save(exactTree, exactTreeFilename);
+        KDTree<double> mappedExactTree;
+        KDTreeFile::map(exactTreeFilename, mappedExactTree);
+        BOOST_CHECK(KDTreeFile::hasCoordinateType<double>(exactTreeFilename));
+        BOOST_CHECK(!KDTreeFile::hasCoordinateType<float>(exactTreeFilename));
+
+        for (auto quantization : {KDQuantization::Int16, KDQuantization::UInt8}) {
+            KDTree<double> tree(new KDPointStorage<double>(points, K, layout), 3);
+            tree.quantize(quantization);
+            KDTreeFile::save(tree, treeFilename);
+            KDTree<double> mappedTree;
+            KDTreeFile::map(treeFilename, mappedTree);
+            BOOST_CHECK(mappedTree.getQuantization() == quantization);
+            /// the mapped coordinates can not be quantized again
+            BOOST_CHECK_EXCEPTION(
+                        mappedTree.quantize(KDQuantization::UInt8),
+                        std::domain_error, [](std::domain_error const &){return true;});
+
+            KDSearchContext<double> context;
+            for (auto const & query : queries) {
+                std::vector<KDNeighbour<double>> nearest;
+                std::vector<KDNeighbour<double>> mappedNearest;
+                tree.findKNearest(query, 5, nearest);
+                mappedTree.findKNearest(query, 5, mappedNearest);
+                BOOST_CHECK(mappedNearest == nearest);
+
+                /// reranking with enough candidates finds the exact closest point
+                size_t closestPointI = 0;
+                exactTree.findClosestPoint(query, closestPointI);
+                auto result = mappedTree.findRerankedClosestPoint(query, 32, mappedExactTree,
+                                                                  context);
+                BOOST_CHECK_EQUAL(result.originalI, closestPointI);
+            }
+        }
+    }
+    std::remove(treeFilename);
+    std::remove(exactTreeFilename);
+}
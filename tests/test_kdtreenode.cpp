@@ -0,0 +1,46 @@
+#include <kdtreenode.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_CASE( KDTreeNode_leaf )
+{
+    auto leaf = KDTreeNode<float>::makeLeaf(3, 7);
+    BOOST_CHECK(leaf.isLeaf());
+    BOOST_CHECK_EQUAL(leaf.getLeftI(), 3);
+    BOOST_CHECK_EQUAL(leaf.getRightI(), 7);
+
+    BOOST_CHECK(!KDTreeNode<float>::makeIntermediate(0, 0.5).isLeaf());
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeNode_getCloserSubNodeOffset )
+{
+    auto node = KDTreeNode<float>::makeIntermediate(1, 0.5);
+    node.setRightSubNodeOffset(5);
+
+    BOOST_CHECK_EQUAL(node.getPlaneCoordinateI(), 1);
+    BOOST_CHECK_EQUAL(node.getCloserSubNodeOffset(KDPoint<float>({20.0, 1.1})), 5);
+    BOOST_CHECK_EQUAL(node.getCloserSubNodeOffset(KDPoint<float>({-20.0, 0.49})), 1);
+    BOOST_CHECK_EQUAL(node.getCloserSubNodeOffset(KDPoint<float>({0.0, 0.5})), 5);
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeNode_addNodesToSearch )
+{
+    auto node = KDTreeNode<float>::makeIntermediate(0, -0.5);
+    node.setRightSubNodeOffset(4);
+    /// the node is the 10th one in the nodes array, so children are 11th and 14th
+    size_t nodeI = 10;
+
+    std::vector<size_t> nodesToSearch;
+    node.addNodesToSearch(nodesToSearch, nodeI, KDPoint<float>({1, 38}), 4);
+    BOOST_CHECK_EQUAL(nodesToSearch.size(), 2);
+    BOOST_CHECK_EQUAL(nodesToSearch[0], 11);
+    BOOST_CHECK_EQUAL(nodesToSearch[1], 14);
+
+    node.addNodesToSearch(nodesToSearch, nodeI, KDPoint<float>({-1.6, 200}), 1);
+    BOOST_CHECK_EQUAL(nodesToSearch.size(), 3);
+    BOOST_CHECK_EQUAL(nodesToSearch[2], 11);
+
+    node.addNodesToSearch(nodesToSearch, nodeI, KDPoint<float>({1, -100.1}), 1);
+    BOOST_CHECK_EQUAL(nodesToSearch.size(), 4);
+    BOOST_CHECK_EQUAL(nodesToSearch[3], 14);
+}
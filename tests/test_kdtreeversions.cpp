@@ -0,0 +1,137 @@
+#include <kdtreeversions.hpp>
+#include <kdtree.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/// the tree of the version: all its points have the second coordinate equal to the version number
+struct TestVersion {
+    static std::atomic<int> aliveNumber;
+
+    explicit TestVersion(std::uint64_t aNumber)
+        : number(aNumber), tree(new KDPointStorage<double>(generateCoordinates(aNumber), 2), 4)
+    {
+        ++aliveNumber;
+    }
+
+    ~TestVersion()
+    {
+        --aliveNumber;
+    }
+
+    static std::vector<double> generateCoordinates(std::uint64_t number)
+    {
+        std::vector<double> coordinates;
+        for (size_t i = 0; i < 1000; ++i) {
+            coordinates.insert(coordinates.end(), {double(i), double(number)});
+        }
+        return coordinates;
+    }
+
+    std::uint64_t number;
+    KDTree<double> tree;
+};
+
+std::atomic<int> TestVersion::aliveNumber{0};
+
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeVersionsTest_queriesWhileSwapping )
+{
+    const size_t versionsNumber = 300;
+    const size_t readersNumber = 4;
+    {
+        KDTreeVersions<TestVersion> versions(std::unique_ptr<TestVersion>(new TestVersion(1)), 8);
+        /// the first version must stay alive while it is pinned
+        auto firstSnapshot = versions.pin();
+        BOOST_CHECK_EQUAL(firstSnapshot.getVersion(), 1);
+
+        std::atomic<bool> isPublished{false};
+        std::atomic<size_t> errorsNumber{0};
+        std::atomic<size_t> queriesNumber{0};
+        std::vector<std::thread> readers;
+        for (size_t readerI = 0; readerI < readersNumber; ++readerI) {
+            readers.emplace_back([&, readerI]() {
+                std::mt19937 e2(readerI);
+                std::uniform_real_distribution<> dist(0, 1000);
+                std::uint64_t lastVersion = 0;
+                while (!isPublished.load()) {
+                    auto snapshot = versions.pin();
+                    /// versions are published in order, so a reader never goes back
+                    if (snapshot.getVersion() < lastVersion || snapshot->number != snapshot.getVersion()) {
+                        ++errorsNumber;
+                    }
+                    lastVersion = snapshot.getVersion();
+                    for (size_t i = 0; i < 10; ++i) {
+                        size_t closestPointI = 0;
+                        auto closestPoint = snapshot->tree.findClosestPoint(
+                                    KDPoint<double>({dist(e2), 0.0}), closestPointI);
+                        if (closestPoint[1] != double(snapshot->number)) {
+                            ++errorsNumber;
+                        }
+                    }
+                    ++queriesNumber;
+                }
+            });
+        }
+
+        for (std::uint64_t number = 2; number <= versionsNumber; ++number) {
+            versions.publish(std::unique_ptr<TestVersion>(new TestVersion(number)));
+        }
+        isPublished.store(true);
+        for (auto & reader : readers) {
+            reader.join();
+        }
+
+        BOOST_CHECK_EQUAL(errorsNumber.load(), 0);
+        BOOST_CHECK(queriesNumber.load() > 0);
+        BOOST_CHECK_EQUAL(versions.pin().getVersion(), versionsNumber);
+        /// all the versions after the pinned one could be deleted, but not the pinned one
+        BOOST_CHECK(versions.getRetiredVersionsNumber() >= 1);
+        BOOST_CHECK(TestVersion::aliveNumber.load() >= 2);
+        size_t closestPointI = 0;
+        BOOST_CHECK_EQUAL(firstSnapshot->tree.findClosestPoint(
+                              KDPoint<double>({5.2, 0.0}), closestPointI)[1], 1.0);
+        BOOST_CHECK_EQUAL(closestPointI, 5);
+
+        {
+            auto movedSnapshot = std::move(firstSnapshot);
+        }
+        versions.reclaim();
+        BOOST_CHECK_EQUAL(versions.getRetiredVersionsNumber(), 0);
+        BOOST_CHECK_EQUAL(TestVersion::aliveNumber.load(), 1);
+    }
+    BOOST_CHECK_EQUAL(TestVersion::aliveNumber.load(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( KDTreeVersionsTest_invalid )
+{
+    BOOST_CHECK_EXCEPTION(
+                KDTreeVersions<TestVersion>(std::unique_ptr<TestVersion>()),
+                std::domain_error, [](std::domain_error const &){return true;});
+    BOOST_CHECK_EXCEPTION(
+                KDTreeVersions<TestVersion>(std::unique_ptr<TestVersion>(new TestVersion(1)), 0),
+                std::domain_error, [](std::domain_error const &){return true;});
+    KDTreeVersions<TestVersion> versions(std::unique_ptr<TestVersion>(new TestVersion(1)));
+    BOOST_CHECK_EXCEPTION(
+                versions.publish(std::unique_ptr<TestVersion>()),
+                std::domain_error, [](std::domain_error const &){return true;});
+    BOOST_CHECK_EQUAL(versions.pin().getVersion(), 1);
+
+    /// every alive snapshot takes a slot, tryPin fails when all of them are taken
+    KDTreeVersions<TestVersion> twoSlotsVersions(
+                std::unique_ptr<TestVersion>(new TestVersion(1)), 2);
+    BOOST_CHECK_EQUAL(twoSlotsVersions.getSlotsNumber(), 2);
+    auto firstSnapshot = twoSlotsVersions.tryPin();
+    auto secondSnapshot = twoSlotsVersions.pin();
+    BOOST_CHECK(firstSnapshot);
+    BOOST_CHECK(!twoSlotsVersions.tryPin());
+    firstSnapshot.reset();
+    BOOST_CHECK(twoSlotsVersions.tryPin());
+}